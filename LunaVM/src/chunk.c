@@ -10,7 +10,11 @@ void initChunk(Chunk* chunk)
 	chunk->capacity = 0;
 	chunk->code = NULL;
 	chunk->lines = NULL;
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = NULL;
 	initValueArray(&chunk->constants);
+	chunk->shortConstantCount = 0;
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) 
@@ -31,13 +35,61 @@ void freeChunk(Chunk* chunk)
 {
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	FREE_ARRAY(int, chunk->lines, chunk->capacity);
+	FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
 	freeValueArray(&chunk->constants);
 	initChunk(chunk);
 }
 
-int addConstant(Chunk* chunk, Value value) {
-	push(value);
+static void appendConstant(Chunk* chunk, Value value)
+{
+	pushRoot(value);
 	writeValueArray(&chunk->constants, value);
-	pop();
+	writeBarrier(NULL, value);
+	popRoot();
+}
+
+// Returns past UINT8_MAX, without adding the constant, once the byte
+// operand range is full.
+int addConstant(Chunk* chunk, Value value)
+{
+	int constant = chunk->shortConstantCount;
+	if (constant > UINT8_MAX) return constant;
+
+	if (constant < chunk->constants.count)
+	{
+		chunk->constants.values[constant] = value;
+		writeBarrier(NULL, value);
+	}
+	else
+	{
+		appendConstant(chunk, value);
+	}
+
+	chunk->shortConstantCount++;
+	return constant;
+}
+
+int addLongConstant(Chunk* chunk, Value value)
+{
+	while (chunk->constants.count < UINT8_COUNT)
+	{
+		appendConstant(chunk, NULL_VAL);
+	}
+
+	appendConstant(chunk, value);
 	return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+int addInlineCache(Chunk* chunk)
+{
+	if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+		int oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+	}
+
+	InlineCache* cache = &chunk->caches[chunk->cacheCount];
+	cache->epoch = 0;
+	cache->count = 0;
+	return chunk->cacheCount++;
+}
@@ -4,6 +4,93 @@
 #include "common.h"
 #include "value.h"
 
+#ifdef REGISTER_VM
+
+// Register format. Operands name frame slots ("registers"): R[0] is the
+// callee or receiver, then the parameters, the locals and the temporaries
+// of each expression. K names a constant, U an upvalue and IC an inline
+// cache. Jump offsets, cache indices and KK are 16 bits, big endian; offsets
+// are measured from the end of the instruction.
+typedef enum {
+	OP_MOVE, // A B: R[A] = R[B]
+	OP_CONSTANT, // A K: R[A] = K
+	OP_CONSTANT_LONG, // A KK: R[A] = KK, a 16-bit constant index
+	OP_NULL, // A
+	OP_TRUE, // A
+	OP_FALSE, // A
+	OP_EQUAL, // A B C: R[A] = R[B] == R[C]
+	OP_NOT_EQUAL, // A B C
+	OP_GREATER, // A B C
+	OP_GREATER_EQUAL, // A B C
+	OP_LESS, // A B C
+	OP_LESS_EQUAL, // A B C
+	OP_ADD, // A B C: R[A] = R[B] + R[C]
+	OP_ADD_CONSTANT, // A B K: R[A] = R[B] + K, K a number
+	OP_SUBTRACT, // A B C
+	OP_MULTIPLY, // A B C
+	OP_MOD, // A B C
+	OP_DIVIDE, // A B C
+	OP_NOT, // A B: R[A] = !R[B]
+	OP_NEGATE, // A B
+	OP_PRINT, // A
+	OP_PRINTLN, // A
+	OP_JUMP, // offset
+	OP_LOOP, // offset, backwards
+	OP_JUMP_IF_FALSE, // A offset
+	OP_LESS_JUMP_IF_FALSE, // B C offset: jump unless R[B] < R[C]
+	OP_GREATER_JUMP_IF_FALSE, // B C offset
+	OP_DEFINE_GLOBAL, // A K: globals[K] = R[A]
+	OP_GET_GLOBAL, // A K: R[A] = globals[K]
+	OP_SET_GLOBAL, // A K
+	OP_GET_UPVALUE, // A U: R[A] = U
+	OP_SET_UPVALUE, // A U: U = R[A]
+	OP_GET_PROPERTY, // A B K IC: R[A] = R[B].K
+	OP_SET_PROPERTY, // A K C IC: R[A].K = R[C]
+	OP_CLOSE_UPVALUE, // A: closes the upvalues of R[A] and above
+	OP_CALL, // A N: R[A] = R[A](R[A+1] .. R[A+N])
+	OP_TAIL_CALL, // A N: as OP_CALL, a closure reusing this frame; OP_RETURN A follows
+	OP_INVOKE, // A K N IC: R[A] = R[A].K(R[A+1] .. R[A+N])
+	OP_SUPER_INVOKE, // A K N: as OP_INVOKE, with K from the superstruct in R[A+N+1]
+	OP_TAIL_INVOKE, // A K N IC: as OP_INVOKE, reusing this frame as OP_TAIL_CALL does
+	OP_TAIL_SUPER_INVOKE, // A K N: as OP_SUPER_INVOKE, reusing this frame
+	OP_GET_SUPER, // A K: R[A] = method K of the superstruct in R[A+1], bound to R[A]
+	OP_CLOSURE, // A K, then an (isLocal, index) pair per upvalue
+	OP_STRUCT, // A K: R[A] = new struct named K
+	OP_INHERIT, // A B: copies the methods of R[A] into R[B]
+	OP_METHOD, // A B K: adds R[B] to struct R[A] as method K
+	OP_LIST, // A: R[A] = new, empty list
+	OP_ADD_LIST, // A B: appends R[B] to the list in R[A]
+	OP_INDEX_GET, // A B C: R[A] = R[B][R[C]]
+	OP_INDEX_SET, // A B C: R[A][R[B]] = R[C]
+	OP_RETURN, // A
+
+	// Long forms, for names and functions past the byte-addressed constants:
+	// each is the instruction without _LONG with KK in place of its K.
+	OP_DEFINE_GLOBAL_LONG,
+	OP_GET_GLOBAL_LONG,
+	OP_SET_GLOBAL_LONG,
+	OP_GET_PROPERTY_LONG,
+	OP_SET_PROPERTY_LONG,
+	OP_INVOKE_LONG,
+	OP_SUPER_INVOKE_LONG,
+	OP_TAIL_INVOKE_LONG,
+	OP_TAIL_SUPER_INVOKE_LONG,
+	OP_GET_SUPER_LONG,
+	OP_CLOSURE_LONG, // also with a 16-bit index in each (isLocal, index) pair
+	OP_STRUCT_LONG,
+	OP_METHOD_LONG,
+
+	// Quickened forms. run() rewrites a generic instruction in place to the
+	// form for the operand types it has just seen, and rewrites it back the
+	// first time those types change.
+	OP_ADD_NUM_NUM, // A B C: OP_ADD on two numbers
+	OP_ADD_STR_STR, // A B C: OP_ADD on two strings
+	OP_EQUAL_NUM, // A B C: OP_EQUAL on two numbers
+	OP_NOT_EQUAL_NUM, // A B C: OP_NOT_EQUAL on two numbers
+} OpCode;
+
+#else
+
 typedef enum {
 	OP_CONSTANT,
 	OP_NULL,
@@ -27,7 +114,10 @@ typedef enum {
 	OP_JUMP,
 	OP_LOOP,
 	OP_POP,
-	OP_ADD_LIST,
+	OP_LIST, // pushes a new, empty list
+	OP_ADD_LIST, // pops a value and appends it to the list below it
+	OP_INDEX_GET, // list, index -> element
+	OP_INDEX_SET, // list, index, value -> value
 	OP_DEFINE_GLOBAL,
 	OP_GET_GLOBAL,
 	OP_SET_GLOBAL,	
@@ -39,25 +129,98 @@ typedef enum {
 	OP_SET_PROPERTY,
 	OP_CLOSE_UPVALUE,
 	OP_CALL,
+	OP_TAIL_CALL, // as OP_CALL, before an OP_RETURN; a closure takes this frame over
 	OP_STRUCT,
 	OP_INHERIT,
 	OP_METHOD,
 	OP_INVOKE,
 	OP_SUPER_INVOKE,
+	OP_TAIL_INVOKE, // as OP_INVOKE, where OP_TAIL_CALL would be
+	OP_TAIL_SUPER_INVOKE, // as OP_SUPER_INVOKE, where OP_TAIL_CALL would be
 	OP_GET_SUPER,
+	OP_CONSTANT_LONG, // 16-bit constant index
+	OP_GET_LOCAL_LONG, // 16-bit slot
+	OP_SET_LOCAL_LONG, // 16-bit slot
+	// The rest take a 16-bit constant index for the name or function.
+	OP_DEFINE_GLOBAL_LONG,
+	OP_GET_GLOBAL_LONG,
+	OP_SET_GLOBAL_LONG,
+	OP_GET_PROPERTY_LONG,
+	OP_SET_PROPERTY_LONG,
+	OP_STRUCT_LONG,
+	OP_METHOD_LONG,
+	OP_INVOKE_LONG,
+	OP_SUPER_INVOKE_LONG,
+	OP_TAIL_INVOKE_LONG,
+	OP_TAIL_SUPER_INVOKE_LONG,
+	OP_GET_SUPER_LONG,
+	OP_CLOSURE_LONG, // also with a 16-bit index in each (isLocal, index) pair
+
+	// Superinstructions, emitted by the compiler in place of the common
+	// sequences noted next to each.
+	OP_NOT_EQUAL, // OP_EQUAL, OP_NOT
+	OP_GREATER_EQUAL, // OP_LESS, OP_NOT
+	OP_LESS_EQUAL, // OP_GREATER, OP_NOT
+	OP_GET_LOCAL_GET_LOCAL, // OP_GET_LOCAL a, OP_GET_LOCAL b
+	OP_SET_LOCAL_POP, // OP_SET_LOCAL, OP_POP
+	OP_ADD_CONSTANT, // OP_CONSTANT (a number), OP_ADD
+	OP_POP_JUMP_IF_FALSE, // OP_JUMP_IF_FALSE, OP_POP on both paths
+	OP_LESS_JUMP_IF_FALSE, // OP_LESS, OP_POP_JUMP_IF_FALSE
+	OP_GREATER_JUMP_IF_FALSE, // OP_GREATER, OP_POP_JUMP_IF_FALSE
+
+	// Quickened forms. run() rewrites a generic instruction in place to the
+	// form for the operand types it has just seen, and rewrites it back the
+	// first time those types change.
+	OP_ADD_NUM_NUM, // OP_ADD on two numbers
+	OP_ADD_STR_STR, // OP_ADD on two strings
+	OP_EQUAL_NUM, // OP_EQUAL on two numbers
+	OP_NOT_EQUAL_NUM, // OP_NOT_EQUAL on two numbers
 } OpCode;
 
+#endif
+
+// OP_GET_PROPERTY, OP_SET_PROPERTY, OP_INVOKE, OP_TAIL_INVOKE and their long
+// forms carry a 16-bit index into their chunk's inline caches, which
+// remember where the property was found for the last few instance shapes
+// seen at that instruction.
+#define INLINE_CACHE_ENTRIES 4
+
+typedef struct {
+	Shape* shape; // Compared by identity only, never dereferenced.
+	int field; // Slot of the field, or -1 for a method.
+	// For a store that adds the field, the shape the instance moves to.
+	Shape* transition;
+	Value method;
+} InlineCacheEntry;
+
+typedef struct {
+	// The entries are only valid while this matches vm.cacheEpoch.
+	uint32_t epoch;
+	int count;
+	InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+} InlineCache;
+
+// Only the first UINT8_COUNT constants can be named by a byte operand.
+// addConstant() places a constant among those, filling any slots that
+// addLongConstant() skipped when it placed one past them, for
+// OP_CONSTANT_LONG and the other long forms to load.
 typedef struct {
 	int count;
 	int capacity;
 	uint8_t* code;
 	int* lines;
 	ValueArray constants;
+	int shortConstantCount;
+	int cacheCount;
+	int cacheCapacity;
+	InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int addLongConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
 
 #endif
\ No newline at end of file
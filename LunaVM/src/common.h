@@ -5,11 +5,48 @@
 #include <stddef.h>
 #include <stdint.h>
 
-//#define NAN_BOXING
+// Values are NaN-boxed into 64 bits: doubles as themselves, everything else
+// in the payload of a quiet NaN, which assumes object pointers fit in 48
+// bits. Define NO_NAN_BOXING for the tagged union, twice the size.
+#if !defined(NAN_BOXING) && !defined(NO_NAN_BOXING)
+#define NAN_BOXING
+#endif
+
+// run() dispatches through a table of label addresses when the compiler
+// supports GCC's labels-as-values, and through a switch otherwise. Define
+// NO_COMPUTED_GOTO to force the switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Marks slow paths, so that the fast paths around them stay small enough
+// to be inlined into run().
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE
+#endif
+
+// Compiles to three-address instructions on frame registers instead of
+// stack instructions, and runs them with the register interpreter loop.
+//#define REGISTER_VM
+
+// Compiles hot functions to x86-64 machine code; see jit.h. Only the stack
+// VM with NaN boxing on Linux has a compiler, elsewhere this does nothing.
+//#define JIT
+
+#if defined(JIT) && (defined(REGISTER_VM) || !defined(NAN_BOXING) || \
+	!defined(__x86_64__) || !defined(__linux__))
+#undef JIT
+#endif
+
+//#define GC_PARALLEL_MARK
+//#define GC_CONCURRENT_SWEEP
 
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
-#define DEBUG_LOG_GC_START_END
 
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
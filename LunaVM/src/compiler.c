@@ -63,10 +63,39 @@ typedef struct
 
 typedef struct
 {
-    uint8_t index;
+    uint16_t index;
     bool isLocal;
 } Upvalue;
 
+#ifdef REGISTER_VM
+// Locals are registers, which instructions name with one byte.
+#define LOCALS_MAX UINT8_COUNT
+#else
+// Slots past the first UINT8_COUNT are reached with the _LONG instructions.
+#define LOCALS_MAX (UINT16_MAX + 1)
+#endif
+
+#ifdef REGISTER_VM
+
+// Where the value of an expression temporary is. Reads of locals and
+// constants stay pending until an instruction needs them, so that `a + b`
+// uses both locals in place instead of copying them first.
+typedef enum
+{
+    OPERAND_TEMP, // In the temporary's own register.
+    OPERAND_LOCAL, // Still in the register of local `index`.
+    OPERAND_CONSTANT, // Constant `index`, not loaded yet.
+    OPERAND_ABOVE, // In register `index` above it, which the next push reuses.
+} OperandKind;
+
+typedef struct
+{
+    OperandKind kind;
+    uint8_t index;
+} Operand;
+
+#endif
+
 typedef enum
 {
     TYPE_FUNCTION,
@@ -82,10 +111,19 @@ typedef struct Compiler
     struct Compiler* enclosing;
     ObjFunction* function;
     FunctionType type;
-    Local locals[UINT8_COUNT];
+    Local* locals;
     int localCount;
+    int localCapacity;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int lastInstruction; // Offset of the last instruction a superinstruction may absorb, or -1.
+    int jumpTarget; // Offset of the most recent jump target.
+#ifdef REGISTER_VM
+    int stackDepth; // Registers in use: the locals, then expression temporaries.
+    Operand operands[UINT8_COUNT]; // By register; locals are always OPERAND_TEMP.
+    int lastWrite; // Offset of the destination operand of the last register write.
+    int lastWriteEnd; // Offset just past that instruction.
+#endif
 } Compiler;
 
 typedef struct StructCompiler
@@ -199,6 +237,12 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+static void emitShort(int value)
+{
+    emitByte((value >> 8) & 0xFF);
+    emitByte(value & 0xFF);
+}
+
 static void emitLoop(int loopStart)
 {
     emitByte(OP_LOOP);
@@ -218,6 +262,339 @@ static int emitJump(uint8_t instruction)
     return currentChunk()->count - 2;
 }
 
+static int markJumpTarget()
+{
+    current->jumpTarget = currentChunk()->count;
+    return current->jumpTarget;
+}
+
+// Gives the property instruction just emitted an inline cache of its own.
+static void emitInlineCache()
+{
+    int cache = addInlineCache(currentChunk());
+    if (cache > UINT16_MAX) error("Too many property accesses in one chunk.");
+
+    emitShort(cache);
+}
+
+#ifdef REGISTER_VM
+
+// The register compiler mirrors the stack the stack compiler would build:
+// the value at stack depth d lives in register d. What each temporary
+// holds is tracked in current->operands, and instructions read their
+// operands straight from locals and constants where they can.
+
+// Past the register limit an error has been reported already; wrapping
+// the index keeps the compiler in bounds until it gives up.
+static Operand* operandAt(int reg)
+{
+    return &current->operands[reg & UINT8_MAX];
+}
+
+static int topRegister()
+{
+    return current->stackDepth - 1;
+}
+
+static void emitWrite(uint8_t instruction, uint8_t dest)
+{
+    emitByte(instruction);
+    current->lastWrite = currentChunk()->count;
+    emitByte(dest);
+}
+
+// Emits an instruction that writes register `dest`, remembering where so
+// that an assignment can point it at a local instead.
+static void emitWrite1(uint8_t instruction, uint8_t dest)
+{
+    emitWrite(instruction, dest);
+    current->lastWriteEnd = currentChunk()->count;
+}
+
+static void emitWrite2(uint8_t instruction, uint8_t dest, uint8_t b)
+{
+    emitWrite(instruction, dest);
+    emitByte(b);
+    current->lastWriteEnd = currentChunk()->count;
+}
+
+static void emitWrite3(uint8_t instruction, uint8_t dest, uint8_t b, uint8_t c)
+{
+    emitWrite(instruction, dest);
+    emitByte(b);
+    emitByte(c);
+    current->lastWriteEnd = currentChunk()->count;
+}
+
+// True if the last instruction wrote `reg` and can still be retargeted.
+static bool lastWroteRegister(int reg)
+{
+    int count = currentChunk()->count;
+
+    return current->lastWriteEnd == count && current->jumpTarget != count &&
+        currentChunk()->code[current->lastWrite] == reg;
+}
+
+// Loads a pending operand into its own register.
+static void materialize(int reg)
+{
+    Operand* operand = operandAt(reg);
+
+    switch (operand->kind)
+    {
+    case OPERAND_TEMP:
+        return;
+
+    case OPERAND_CONSTANT:
+        emitWrite2(OP_CONSTANT, (uint8_t)reg, operand->index);
+        break;
+
+    case OPERAND_LOCAL:
+    case OPERAND_ABOVE:
+        emitWrite2(OP_MOVE, (uint8_t)reg, operand->index);
+        break;
+    }
+
+    operand->kind = OPERAND_TEMP;
+}
+
+static void materializeFrom(int reg)
+{
+    for (int i = reg; i < current->stackDepth; i++)
+    {
+        materialize(i);
+    }
+}
+
+// Takes the pending reads of `local`, or of every local if it is -1, out
+// of the local before an instruction that may overwrite it.
+static void flushLocals(int local)
+{
+    for (int i = 0; i < current->stackDepth; i++)
+    {
+        Operand* operand = operandAt(i);
+
+        if (operand->kind == OPERAND_LOCAL && (local == -1 || operand->index == local))
+        {
+            materialize(i);
+        }
+    }
+}
+
+// Returns the register an instruction reads the operand from.
+static uint8_t readOperand(int reg)
+{
+    Operand* operand = operandAt(reg);
+
+    switch (operand->kind)
+    {
+    case OPERAND_LOCAL:
+    case OPERAND_ABOVE:
+        return operand->index;
+
+    case OPERAND_CONSTANT:
+        materialize(reg);
+        return (uint8_t)reg;
+
+    default:
+        return (uint8_t)reg;
+    }
+}
+
+static void pushOperand(OperandKind kind, uint8_t index)
+{
+    int depth = current->stackDepth;
+
+    if (depth > 0 && operandAt(depth - 1)->kind == OPERAND_ABOVE)
+    {
+        materialize(depth - 1);
+    }
+
+    if (depth == UINT8_COUNT)
+    {
+        error("Too many registers in use in one expression.");
+    }
+
+    operandAt(depth)->kind = kind;
+    operandAt(depth)->index = index;
+    current->stackDepth++;
+
+    if (current->stackDepth > current->function->maxSlots)
+    {
+        current->function->maxSlots = current->stackDepth;
+    }
+}
+
+// Pushes a temporary and returns its register, for the instruction that
+// is about to write it.
+static uint8_t pushTemp()
+{
+    pushOperand(OPERAND_TEMP, 0);
+    return (uint8_t)topRegister();
+}
+
+static void popOperands(int count)
+{
+    while (count-- > 0)
+    {
+        current->stackDepth--;
+        operandAt(current->stackDepth)->kind = OPERAND_TEMP;
+    }
+}
+
+// Stores the value on top in `local`. The value stays on top as a pending
+// read of the local, so `x = y + 1` as a statement is a single add.
+static void assignLocal(uint8_t local)
+{
+    int top = topRegister();
+    Operand* value = operandAt(top);
+
+    for (int i = 0; i < top; i++)
+    {
+        if (operandAt(i)->kind == OPERAND_LOCAL && operandAt(i)->index == local) materialize(i);
+    }
+
+    if (value->kind == OPERAND_TEMP && lastWroteRegister(top))
+    {
+        currentChunk()->code[current->lastWrite] = local;
+    }
+    else if (value->kind == OPERAND_CONSTANT)
+    {
+        emitWrite2(OP_CONSTANT, local, value->index);
+    }
+    else if (value->kind != OPERAND_LOCAL || value->index != local)
+    {
+        emitWrite2(OP_MOVE, local, readOperand(top));
+    }
+
+    value->kind = OPERAND_LOCAL;
+    value->index = local;
+}
+
+static int emitJumpIfFalse(uint8_t reg)
+{
+    emitBytes(OP_JUMP_IF_FALSE, reg);
+    emitByte(0xFF);
+    emitByte(0xFF);
+    return currentChunk()->count - 2;
+}
+
+// Jumps over the body of an if, while or for when the condition is false.
+// A comparison written just before is turned into a compare-and-jump.
+static int emitConditionJump()
+{
+    int top = topRegister();
+
+    for (int i = 0; i < top; i++)
+    {
+        materialize(i);
+    }
+
+    uint8_t* code = currentChunk()->code;
+    int start = current->lastWrite - 1;
+
+    if (operandAt(top)->kind == OPERAND_TEMP && lastWroteRegister(top) &&
+        (code[start] == OP_LESS || code[start] == OP_GREATER))
+    {
+        // A B C becomes B C followed by the jump offset.
+        code[start] = code[start] == OP_LESS ? OP_LESS_JUMP_IF_FALSE : OP_GREATER_JUMP_IF_FALSE;
+        code[start + 1] = code[start + 2];
+        code[start + 2] = code[start + 3];
+        currentChunk()->count--;
+        emitByte(0xFF);
+        emitByte(0xFF);
+        popOperands(1);
+        return currentChunk()->count - 2;
+    }
+
+    int jump = emitJumpIfFalse(readOperand(top));
+    popOperands(1);
+    return jump;
+}
+
+static void emitPop()
+{
+    popOperands(1);
+}
+
+static void emitReturn()
+{
+    if (current->type == TYPE_INITIALIZER)
+    {
+        emitBytes(OP_RETURN, 0);
+        return;
+    }
+
+    uint8_t reg = pushTemp();
+    emitWrite1(OP_NULL, reg);
+    emitBytes(OP_RETURN, reg);
+    popOperands(1);
+}
+
+#else
+
+// Superinstructions are formed by rewriting the instruction emitted just
+// before, so only instructions emitted through here can be absorbed.
+static void emitFusable(uint8_t instruction)
+{
+    current->lastInstruction = currentChunk()->count;
+    emitByte(instruction);
+}
+
+// Returns the offset of the previous instruction if it is `instruction`
+// (`length` bytes long) and nothing jumps in between it and the next one,
+// otherwise -1.
+static int fusableInstruction(uint8_t instruction, int length)
+{
+    int offset = current->lastInstruction;
+    int count = currentChunk()->count;
+
+    if (offset == -1 || offset + length != count || current->jumpTarget == count) return -1;
+    if (currentChunk()->code[offset] != instruction) return -1;
+
+    current->lastInstruction = -1;
+    return offset;
+}
+
+// Jumps over the body of an if, while or for when the condition is false,
+// popping the condition on both paths. A comparison right before it is
+// folded into the jump.
+static int emitConditionJump()
+{
+    int offset;
+
+    if ((offset = fusableInstruction(OP_LESS, 1)) != -1)
+    {
+        currentChunk()->code[offset] = OP_LESS_JUMP_IF_FALSE;
+    }
+    else if ((offset = fusableInstruction(OP_GREATER, 1)) != -1)
+    {
+        currentChunk()->code[offset] = OP_GREATER_JUMP_IF_FALSE;
+    }
+    else
+    {
+        emitByte(OP_POP_JUMP_IF_FALSE);
+    }
+
+    emitByte(0xFF);
+    emitByte(0xFF);
+    return currentChunk()->count - 2;
+}
+
+static void emitPop()
+{
+    int offset = fusableInstruction(OP_SET_LOCAL, 2);
+
+    if (offset != -1)
+    {
+        currentChunk()->code[offset] = OP_SET_LOCAL_POP;
+    }
+    else
+    {
+        emitByte(OP_POP);
+    }
+}
+
 static void emitReturn()
 {
     if (current->type == TYPE_INITIALIZER)
@@ -231,6 +608,8 @@ static void emitReturn()
     emitByte(OP_RETURN);
 }
 
+#endif
+
 static uint8_t makeConstant(Value value)
 {
     int constant = addConstant(currentChunk(), value);
@@ -243,9 +622,59 @@ static uint8_t makeConstant(Value value)
     return (uint8_t)constant;
 }
 
+// Names and functions take a byte-addressed constant while one is left,
+// then a long one, named by the _LONG form of their instruction.
+static int makeNameConstant(Value value)
+{
+    if (currentChunk()->shortConstantCount < UINT8_COUNT) return makeConstant(value);
+
+    int constant = addLongConstant(currentChunk(), value);
+    if (constant > UINT16_MAX) error("Too many constants in one chunk.");
+    return constant;
+}
+
+// Emits a constant from makeNameConstant(), in 16 bits past the
+// byte-addressed ones.
+static void emitNameOperand(int constant)
+{
+    if (constant > UINT8_MAX)
+    {
+        emitShort(constant);
+    }
+    else
+    {
+        emitByte((uint8_t)constant);
+    }
+}
+
+// Literals share the byte-addressed constants with names and functions
+// only until half of those are used, so that a chunk full of literals
+// still has room for the names after them.
 static void emitConstant(Value value)
 {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    if (currentChunk()->shortConstantCount < UINT8_COUNT / 2)
+    {
+        uint8_t constant = makeConstant(value);
+#ifdef REGISTER_VM
+        pushOperand(OPERAND_CONSTANT, constant);
+#else
+        emitFusable(OP_CONSTANT);
+        emitByte(constant);
+#endif
+        return;
+    }
+
+    int constant = addLongConstant(currentChunk(), value);
+    if (constant > UINT16_MAX) error("Too many constants in one chunk.");
+
+#ifdef REGISTER_VM
+    emitWrite(OP_CONSTANT_LONG, pushTemp());
+    emitShort(constant);
+    current->lastWriteEnd = currentChunk()->count;
+#else
+    emitByte(OP_CONSTANT_LONG);
+    emitShort(constant);
+#endif
 }
 
 static void patchJump(int offset)
@@ -259,14 +688,44 @@ static void patchJump(int offset)
 
     currentChunk()->code[offset] = (jump >> 8) & 0xFF;
     currentChunk()->code[offset + 1] = jump & 0xFF;
+    markJumpTarget();
+}
+
+static Local* pushLocal(Compiler* compiler)
+{
+    if (compiler->localCapacity < compiler->localCount + 1)
+    {
+        compiler->localCapacity = GROW_CAPACITY(compiler->localCapacity);
+        compiler->locals = (Local*)realloc(compiler->locals, sizeof(Local) * compiler->localCapacity);
+        if (compiler->locals == NULL) exit(1);
+    }
+
+#ifndef REGISTER_VM
+    if (compiler->localCount + 1 > compiler->function->maxSlots)
+    {
+        compiler->function->maxSlots = compiler->localCount + 1;
+    }
+#endif
+
+    return &compiler->locals[compiler->localCount++];
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type)
 {
     compiler->enclosing = current;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
+    compiler->lastInstruction = -1;
+    compiler->jumpTarget = -1;
+#ifdef REGISTER_VM
+    compiler->stackDepth = 1;
+    compiler->operands[0].kind = OPERAND_TEMP;
+    compiler->lastWrite = -1;
+    compiler->lastWriteEnd = -1;
+#endif
 
     if (type == TYPE_IMPORT)
     {
@@ -282,9 +741,10 @@ static void initCompiler(Compiler* compiler, FunctionType type)
     if (type != TYPE_SCRIPT)
     {
         current->function->name = copyString(parser.previous.start, parser.previous.length);
+        writeBarrier((Obj*)current->function, OBJ_VAL(current->function->name));
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal(current);
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION && type != TYPE_IMPORT)
@@ -311,6 +771,7 @@ static ObjFunction* endCompiler()
 	}
 #endif
 
+    free(current->locals);
     current = current->enclosing;
     return function;
 }
@@ -324,10 +785,28 @@ static void endScope()
 {
     current->scopeDepth--;
 
+#ifdef REGISTER_VM
+    // Dropping locals costs nothing, except closing the captured ones.
+    int closeFrom = -1;
+
     while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth)
     {
-        emitByte(OP_POP);
+        if (current->locals[current->localCount - 1].isCaptured)
+        {
+            closeFrom = current->localCount - 1;
+        }
 
+        current->localCount--;
+        popOperands(1);
+    }
+
+    if (closeFrom != -1)
+    {
+        emitBytes(OP_CLOSE_UPVALUE, (uint8_t)closeFrom);
+    }
+#else
+    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth)
+    {
         if (current->locals[current->localCount - 1].isCaptured)
         {
             emitByte(OP_CLOSE_UPVALUE);
@@ -339,6 +818,7 @@ static void endScope()
 
         current->localCount--;
     }
+#endif
 }
 
 static void list(bool canAssign);
@@ -347,11 +827,11 @@ static void statement(void);
 static void declaration(void);
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
-static uint8_t identifierConstant(Token* name);
+static int identifierConstant(Token* name);
 static int resolveLocal(Compiler* compiler, Token* name);
 static void declareVariable(void);
 
-static uint8_t parseVariable(const char* errorMessage)
+static int parseVariable(const char* errorMessage)
 {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
@@ -367,15 +847,26 @@ static void markInitialized()
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(int global)
 {
     if (current->scopeDepth > 0)
     {
+#ifdef REGISTER_VM
+        materialize(topRegister());
+#endif
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    uint8_t instruction = global > UINT8_MAX ? OP_DEFINE_GLOBAL_LONG : OP_DEFINE_GLOBAL;
+#ifdef REGISTER_VM
+    emitBytes(instruction, readOperand(topRegister()));
+    emitNameOperand(global);
+    popOperands(1);
+#else
+    emitByte(instruction);
+    emitNameOperand(global);
+#endif
 }
 
 static uint8_t argumentList()
@@ -402,10 +893,20 @@ static uint8_t argumentList()
 
 static void and(bool canAssign)
 {
+#ifdef REGISTER_VM
+    // Both paths leave the result in the same register.
+    materializeFrom(0);
+    int endJump = emitJumpIfFalse((uint8_t)topRegister());
+
+    popOperands(1);
+    parsePrecedence(PREC_AND);
+    materialize(topRegister());
+#else
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
     emitByte(OP_POP);
     parsePrecedence(PREC_AND);
+#endif
 
     patchJump(endJump);
 }
@@ -416,22 +917,74 @@ static void binary(bool canAssign)
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+#ifdef REGISTER_VM
+    uint8_t instruction;
+
+    switch (operatorType)
+    {
+    case TOKEN_BANG_EQUAL: instruction = OP_NOT_EQUAL; break;
+    case TOKEN_EQUAL_EQUAL: instruction = OP_EQUAL; break;
+    case TOKEN_GREATER: instruction = OP_GREATER; break;
+    case TOKEN_GREATER_EQUAL: instruction = OP_GREATER_EQUAL; break;
+    case TOKEN_LESS: instruction = OP_LESS; break;
+    case TOKEN_LESS_EQUAL: instruction = OP_LESS_EQUAL; break;
+    case TOKEN_PLUS: instruction = OP_ADD; break;
+    case TOKEN_MINUS: instruction = OP_SUBTRACT; break;
+    case TOKEN_SLASH: instruction = OP_DIVIDE; break;
+    case TOKEN_STAR: instruction = OP_MULTIPLY; break;
+    case TOKEN_MOD: instruction = OP_MOD; break;
+    default: return; // Unreachable.
+    }
+
+    int left = topRegister() - 1;
+    Operand* right = operandAt(left + 1);
+
+    // A number constant as the right operand of + is read from the
+    // constant table.
+    if (instruction == OP_ADD && right->kind == OPERAND_CONSTANT &&
+        IS_NUMBER(currentChunk()->constants.values[right->index]))
+    {
+        emitWrite3(OP_ADD_CONSTANT, (uint8_t)left, readOperand(left), right->index);
+    }
+    else
+    {
+        uint8_t b = readOperand(left);
+        uint8_t c = readOperand(left + 1);
+        emitWrite3(instruction, (uint8_t)left, b, c);
+    }
+
+    popOperands(1);
+    operandAt(left)->kind = OPERAND_TEMP;
+#else
     switch (operatorType)
     {
-    case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT);
+    case TOKEN_BANG_EQUAL: emitByte(OP_NOT_EQUAL);
         break;
     case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL);
         break;
-    case TOKEN_GREATER: emitByte(OP_GREATER);
+    case TOKEN_GREATER: emitFusable(OP_GREATER);
         break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT);
+    case TOKEN_GREATER_EQUAL: emitByte(OP_GREATER_EQUAL);
         break;
-    case TOKEN_LESS: emitByte(OP_LESS);
+    case TOKEN_LESS: emitFusable(OP_LESS);
         break;
-    case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT);
+    case TOKEN_LESS_EQUAL: emitByte(OP_LESS_EQUAL);
         break;
-    case TOKEN_PLUS: emitByte(OP_ADD);
+    case TOKEN_PLUS:
+    {
+        // A number constant as the right operand is folded into the add.
+        int offset = fusableInstruction(OP_CONSTANT, 2);
+
+        if (offset != -1 && IS_NUMBER(currentChunk()->constants.values[currentChunk()->code[offset + 1]]))
+        {
+            currentChunk()->code[offset] = OP_ADD_CONSTANT;
+        }
+        else
+        {
+            emitByte(OP_ADD);
+        }
         break;
+    }
     case TOKEN_MINUS: emitByte(OP_SUBTRACT);
         break;
     case TOKEN_SLASH: emitByte(OP_DIVIDE);
@@ -442,16 +995,50 @@ static void binary(bool canAssign)
         break;
     default: return; // Unreachable.
     }
+#endif
 }
 
+#ifdef REGISTER_VM
+// Lines the callee or receiver at `base` and the arguments above it up in
+// their own registers for a call. The callee may write any local through
+// an upvalue, so no read of a local can stay pending across it.
+static void prepareCall(int base)
+{
+    flushLocals(-1);
+    materializeFrom(base);
+}
+#endif
+
 static void call(bool canAssign)
 {
     uint8_t argCount = argumentList();
-    emitBytes(OP_CALL, argCount);
+#ifdef REGISTER_VM
+    int callee = topRegister() - argCount;
+    prepareCall(callee);
+    current->lastInstruction = currentChunk()->count;
+    emitBytes(OP_CALL, (uint8_t)callee);
+    emitByte(argCount);
+    popOperands(argCount);
+#else
+    emitFusable(OP_CALL);
+    emitByte(argCount);
+#endif
 }
 
 static void literal(bool canAssign)
 {
+#ifdef REGISTER_VM
+    switch (parser.previous.type)
+    {
+    case TOKEN_FALSE: emitWrite1(OP_FALSE, pushTemp());
+        break;
+    case TOKEN_TRUE: emitWrite1(OP_TRUE, pushTemp());
+        break;
+    case TOKEN_NULL: emitWrite1(OP_NULL, pushTemp());
+        break;
+    default: return;
+    }
+#else
     switch (parser.previous.type)
     {
     case TOKEN_FALSE: emitByte(OP_FALSE);
@@ -462,6 +1049,7 @@ static void literal(bool canAssign)
         break;
     default: return;
     }
+#endif
 }
 
 static void grouping(bool canAssign)
@@ -478,6 +1066,17 @@ static void number(bool canAssign)
 
 static void or(bool canAssign)
 {
+#ifdef REGISTER_VM
+    materializeFrom(0);
+    int elseJump = emitJumpIfFalse((uint8_t)topRegister());
+    int endJump = emitJump(OP_JUMP);
+
+    patchJump(elseJump);
+    popOperands(1);
+
+    parsePrecedence(PREC_OR);
+    materialize(topRegister());
+#else
     int elseJump = emitJump(OP_JUMP_IF_FALSE);
     int endJump = emitJump(OP_JUMP);
 
@@ -485,6 +1084,7 @@ static void or(bool canAssign)
     emitByte(OP_POP);
 
     parsePrecedence(PREC_OR);
+#endif
     patchJump(endJump);
 }
 
@@ -500,8 +1100,14 @@ static void namedVariable(Token name, bool canAssign)
 
     if (arg != -1)
     {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
+#ifdef REGISTER_VM
+        // Locals are registers, read and written with at most a move.
+        getOp = OP_MOVE;
+        setOp = OP_MOVE;
+#else
+        getOp = arg > UINT8_MAX ? OP_GET_LOCAL_LONG : OP_GET_LOCAL;
+        setOp = arg > UINT8_MAX ? OP_SET_LOCAL_LONG : OP_SET_LOCAL;
+#endif
     }
     else if ((arg = resolveUpvalue(current, &name)) != -1)
     {
@@ -511,19 +1117,76 @@ static void namedVariable(Token name, bool canAssign)
     else
     {
         arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        getOp = arg > UINT8_MAX ? OP_GET_GLOBAL_LONG : OP_GET_GLOBAL;
+        setOp = arg > UINT8_MAX ? OP_SET_GLOBAL_LONG : OP_SET_GLOBAL;
     }
 
+#ifdef REGISTER_VM
     if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+
+        if (setOp == OP_MOVE)
+        {
+            assignLocal((uint8_t)arg);
+        }
+        else
+        {
+            emitBytes(setOp, readOperand(topRegister()));
+            emitNameOperand(arg);
+        }
+    }
+    else if (getOp == OP_MOVE)
+    {
+        pushOperand(OPERAND_LOCAL, (uint8_t)arg);
+    }
+    else
+    {
+        emitWrite(getOp, pushTemp());
+        emitNameOperand(arg);
+        current->lastWriteEnd = currentChunk()->count;
+    }
+#else
+    if (arg > UINT8_MAX)
+    {
+        if (canAssign && match(TOKEN_EQUAL))
+        {
+            expression();
+            emitByte(setOp);
+        }
+        else
+        {
+            emitByte(getOp);
+        }
+
+        emitShort(arg);
+    }
+    else if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emitFusable(setOp);
+        emitByte((uint8_t)arg);
+    }
+    else if (getOp == OP_GET_LOCAL)
+    {
+        int offset = fusableInstruction(OP_GET_LOCAL, 2);
+
+        if (offset != -1)
+        {
+            currentChunk()->code[offset] = OP_GET_LOCAL_GET_LOCAL;
+            emitByte((uint8_t)arg);
+        }
+        else
+        {
+            emitFusable(OP_GET_LOCAL);
+            emitByte((uint8_t)arg);
+        }
     }
     else
     {
         emitBytes(getOp, (uint8_t)arg);
     }
+#endif
 }
 
 static void variable(bool canAssign)
@@ -552,22 +1215,49 @@ static void super_(bool canAssign)
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superstruct method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
+    bool wide = name > UINT8_MAX;
 
     namedVariable(syntheticToken("self"), false);
 
+#ifdef REGISTER_VM
+    int receiver = topRegister();
+
     if (match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        prepareCall(receiver);
+        current->lastInstruction = currentChunk()->count;
+        emitBytes(wide ? OP_SUPER_INVOKE_LONG : OP_SUPER_INVOKE, (uint8_t)receiver);
+        emitNameOperand(name);
         emitByte(argCount);
+        popOperands(argCount + 1);
     }
     else
     {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        materializeFrom(receiver);
+        emitBytes(wide ? OP_GET_SUPER_LONG : OP_GET_SUPER, (uint8_t)receiver);
+        emitNameOperand(name);
+        popOperands(1);
     }
+#else
+    if (match(TOKEN_LEFT_PAREN))
+    {
+        uint8_t argCount = argumentList();
+        namedVariable(syntheticToken("super"), false);
+        emitFusable(wide ? OP_SUPER_INVOKE_LONG : OP_SUPER_INVOKE);
+        emitNameOperand(name);
+        emitByte(argCount);
+    }
+    else
+    {
+        namedVariable(syntheticToken("super"), false);
+        emitByte(wide ? OP_GET_SUPER_LONG : OP_GET_SUPER);
+        emitNameOperand(name);
+    }
+#endif
 }
 
 static void unary(bool canAssign)
@@ -578,6 +1268,21 @@ static void unary(bool canAssign)
     parsePrecedence(PREC_UNARY);
 
     // Emit operator instruction.
+#ifdef REGISTER_VM
+    int operand = topRegister();
+    uint8_t source = readOperand(operand);
+
+    switch (operatorType)
+    {
+    case TOKEN_BANG: emitWrite2(OP_NOT, (uint8_t)operand, source);
+        break;
+    case TOKEN_MINUS: emitWrite2(OP_NEGATE, (uint8_t)operand, source);
+        break;
+    default: return; // Unreachable
+    }
+
+    operandAt(operand)->kind = OPERAND_TEMP;
+#else
     switch (operatorType)
     {
     case TOKEN_BANG: emitByte(OP_NOT);
@@ -586,28 +1291,135 @@ static void unary(bool canAssign)
         break;
     default: return; // Unreachable
     }
+#endif
 }
 
 static void dot(bool canAssign)
 {
     consume(TOKEN_IDENTIFIER, "Expect properti name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
+    bool wide = name > UINT8_MAX;
+
+#ifdef REGISTER_VM
+    int receiver = topRegister();
 
     if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        uint8_t object = readOperand(receiver);
+        uint8_t value = readOperand(receiver + 1);
+        emitBytes(wide ? OP_SET_PROPERTY_LONG : OP_SET_PROPERTY, object);
+        emitNameOperand(name);
+        emitByte(value);
+        emitInlineCache();
+
+        // The assigned value is the result, left where it already is.
+        Operand result = *operandAt(receiver + 1);
+        popOperands(1);
+
+        if (result.kind == OPERAND_TEMP)
+        {
+            result.kind = OPERAND_ABOVE;
+            result.index = value;
+        }
+
+        *operandAt(receiver) = result;
     }
     else if (match(TOKEN_LEFT_PAREN))
     {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        prepareCall(receiver);
+        current->lastInstruction = currentChunk()->count;
+        emitBytes(wide ? OP_INVOKE_LONG : OP_INVOKE, (uint8_t)receiver);
+        emitNameOperand(name);
         emitByte(argCount);
+        emitInlineCache();
+        popOperands(argCount);
+    }
+    else
+    {
+        uint8_t object = readOperand(receiver);
+        emitWrite(wide ? OP_GET_PROPERTY_LONG : OP_GET_PROPERTY, (uint8_t)receiver);
+        emitByte(object);
+        emitNameOperand(name);
+        emitInlineCache();
+        current->lastWriteEnd = currentChunk()->count;
+        operandAt(receiver)->kind = OPERAND_TEMP;
+    }
+#else
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emitByte(wide ? OP_SET_PROPERTY_LONG : OP_SET_PROPERTY);
+        emitNameOperand(name);
+        emitInlineCache();
+    }
+    else if (match(TOKEN_LEFT_PAREN))
+    {
+        uint8_t argCount = argumentList();
+        emitFusable(wide ? OP_INVOKE_LONG : OP_INVOKE);
+        emitNameOperand(name);
+        emitByte(argCount);
+        emitInlineCache();
+    }
+    else
+    {
+        emitByte(wide ? OP_GET_PROPERTY_LONG : OP_GET_PROPERTY);
+        emitNameOperand(name);
+        emitInlineCache();
+    }
+#endif
+}
+
+static void subscript(bool canAssign)
+{
+#ifdef REGISTER_VM
+    int list = topRegister();
+#endif
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+#ifdef REGISTER_VM
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        uint8_t object = readOperand(list);
+        uint8_t index = readOperand(list + 1);
+        uint8_t value = readOperand(list + 2);
+        emitBytes(OP_INDEX_SET, object);
+        emitBytes(index, value);
+
+        // As in dot(), the assigned value is the result.
+        Operand result = *operandAt(list + 2);
+        popOperands(2);
+
+        if (result.kind == OPERAND_TEMP)
+        {
+            result.kind = OPERAND_ABOVE;
+            result.index = value;
+        }
+
+        *operandAt(list) = result;
     }
     else
     {
-        emitBytes(OP_GET_PROPERTY, name);
+        uint8_t object = readOperand(list);
+        uint8_t index = readOperand(list + 1);
+        emitWrite3(OP_INDEX_GET, (uint8_t)list, object, index);
+        popOperands(1);
+        operandAt(list)->kind = OPERAND_TEMP;
     }
+#else
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emitByte(OP_INDEX_SET);
+    }
+    else
+    {
+        emitByte(OP_INDEX_GET);
+    }
+#endif
 }
 
 static void self(bool canAssign)
@@ -664,7 +1476,7 @@ ParseRule rules[] = {
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
     [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
     [TOKEN_IMPORT] = {NULL, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACKET] = {list, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
 };
 
 static void parsePrecedence(Precedence precedence)
@@ -694,9 +1506,19 @@ static void parsePrecedence(Precedence precedence)
     }
 }
 
-static uint8_t identifierConstant(Token* name)
+// Every use of a name shares one constant, since strings are interned.
+static int identifierConstant(Token* name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    ObjString* string = copyString(name->start, name->length);
+    Chunk* chunk = currentChunk();
+
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_STRING(constant) && AS_STRING(constant) == string) return i;
+    }
+
+    return makeNameConstant(OBJ_VAL(string));
 }
 
 static bool identifiersEqual(Token* a, Token* b)
@@ -723,7 +1545,7 @@ static int resolveLocal(Compiler* compiler, Token* name)
     return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal)
+static int addUpvalue(Compiler* compiler, uint16_t index, bool isLocal)
 {
     int upvalueCount = compiler->function->upvalueCount;
 
@@ -757,14 +1579,14 @@ static int resolveUpvalue(Compiler* compiler, Token* name)
     if (local != -1)
     {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t)local, true);
+        return addUpvalue(compiler, (uint16_t)local, true);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
 
     if (upvalue != -1)
     {
-        return addUpvalue(compiler, (uint8_t)upvalue, false);
+        return addUpvalue(compiler, (uint16_t)upvalue, false);
     }
 
     return -1;
@@ -772,13 +1594,13 @@ static int resolveUpvalue(Compiler* compiler, Token* name)
 
 static void addLocal(Token name)
 {
-    if (current->localCount == UINT8_COUNT)
+    if (current->localCount == LOCALS_MAX)
     {
         error("Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = pushLocal(current);
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
@@ -844,7 +1666,10 @@ static void function(FunctionType type)
             {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
+#ifdef REGISTER_VM
+            pushOperand(OPERAND_TEMP, 0); // The caller passes it in the register.
+#endif
             defineVariable(constant);
         }
         while (match(TOKEN_COMMA));
@@ -856,12 +1681,43 @@ static void function(FunctionType type)
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    // The function is only reachable once it is a constant, and emitting
+    // may collect.
+    int constant = makeNameConstant(OBJ_VAL(function));
+    bool wide = constant > UINT8_MAX;
+
+    for (int i = 0; i < function->upvalueCount; i++)
+    {
+        if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+    }
+
+#ifdef REGISTER_VM
+    emitBytes(wide ? OP_CLOSURE_LONG : OP_CLOSURE, pushTemp());
+#else
+    emitByte(wide ? OP_CLOSURE_LONG : OP_CLOSURE);
+#endif
+
+    if (wide)
+    {
+        emitShort(constant);
+    }
+    else
+    {
+        emitByte((uint8_t)constant);
+    }
 
     for (int i = 0; i < function->upvalueCount; i++)
     {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(compiler.upvalues[i].index);
+
+        if (wide)
+        {
+            emitShort(compiler.upvalues[i].index);
+        }
+        else
+        {
+            emitByte((uint8_t)compiler.upvalues[i].index);
+        }
     }
 }
 
@@ -869,7 +1725,8 @@ static void method()
 {
     consume(TOKEN_FUN, "Expect 'def' keyword to declare method.");
     consume(TOKEN_IDENTIFIER, "Expect function name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
+    uint8_t instruction = constant > UINT8_MAX ? OP_METHOD_LONG : OP_METHOD;
 
     FunctionType type = TYPE_METHOD;
 
@@ -879,12 +1736,21 @@ static void method()
     }
 
     function(type);
-    emitBytes(OP_METHOD, constant);
+#ifdef REGISTER_VM
+    int closure = topRegister();
+    emitBytes(instruction, readOperand(closure - 1));
+    emitByte(readOperand(closure));
+    emitNameOperand(constant);
+    popOperands(1);
+#else
+    emitByte(instruction);
+    emitNameOperand(constant);
+#endif
 }
 
 static void funDeclaration()
 {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -892,7 +1758,7 @@ static void funDeclaration()
 
 static void varDeclaration()
 {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL))
     {
@@ -900,7 +1766,11 @@ static void varDeclaration()
     }
     else
     {
+#ifdef REGISTER_VM
+        emitWrite1(OP_NULL, pushTemp());
+#else
         emitByte(OP_NULL);
+#endif
     }
 
     //consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
@@ -917,10 +1787,18 @@ static void structDeclaration()
 
     consume(TOKEN_IDENTIFIER, "Expect struct name.");
     Token structName = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
+    uint8_t instruction = nameConstant > UINT8_MAX ? OP_STRUCT_LONG : OP_STRUCT;
     declareVariable();
 
-    emitBytes(OP_STRUCT, nameConstant);
+#ifdef REGISTER_VM
+    emitWrite(instruction, pushTemp());
+    emitNameOperand(nameConstant);
+    current->lastWriteEnd = currentChunk()->count;
+#else
+    emitByte(instruction);
+    emitNameOperand(nameConstant);
+#endif
     defineVariable(nameConstant);
 
     StructCompiler structCompiler;
@@ -944,7 +1822,14 @@ static void structDeclaration()
 
         namedVariable(structName, false);
 
+#ifdef REGISTER_VM
+        int substruct = topRegister();
+        emitBytes(OP_INHERIT, readOperand(substruct - 1));
+        emitByte(readOperand(substruct));
+        popOperands(1);
+#else
         emitByte(OP_INHERIT);
+#endif
         structCompiler.hasSuperstruct = true;
     }
 
@@ -964,7 +1849,11 @@ static void structDeclaration()
         consume(TOKEN_SEMICOLON, "Expect ';' after empty struct declaration.");
     }
 
+#ifdef REGISTER_VM
+    popOperands(1);
+#else
     emitByte(OP_POP);
+#endif
 
     if (structCompiler.hasSuperstruct)
     {
@@ -976,29 +1865,31 @@ static void structDeclaration()
 
 static void list(bool canAssign)
 {
-    int length = 0;
-    ObjList* list = newList();
+    // Each evaluation builds a fresh list.
+#ifdef REGISTER_VM
+    uint8_t dest = pushTemp();
+    emitWrite1(OP_LIST, dest);
+#else
+    emitByte(OP_LIST);
+#endif
 
     if (!check(TOKEN_RIGHT_BRACKET))
     {
         do
         {
-            if (length < 255) 
-            {
-                expression();
-                emitByte(OP_ADD_LIST);
-                length++;
-            }
-            else
-            {
-                error("Can't have more than 255 values in one list.");
-            }
+            expression();
+#ifdef REGISTER_VM
+            uint8_t value = readOperand(topRegister());
+            emitBytes(OP_ADD_LIST, dest);
+            emitByte(value);
+            popOperands(1);
+#else
+            emitByte(OP_ADD_LIST);
+#endif
         } while (match(TOKEN_COMMA));
-
-        consume(TOKEN_RIGHT_BRACKET, "Expect ']' at list values.");
     }
 
-    emitConstant(OBJ_VAL(list));
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' at list values.");
 }
 
 static void addImportedModule(const char* moduleName)
@@ -1195,6 +2086,7 @@ static void importModule(Token line, const char* name, int length)
         declaration();
     }
 
+    free(compiler.locals);
     parser = previousParser;
     current = previousCompiler;
     scanner = previousScanner;
@@ -1216,7 +2108,7 @@ static void expressionStatement()
 {
     expression();
     //consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+    emitPop();
 }
 
 static void forStatement()
@@ -1240,7 +2132,7 @@ static void forStatement()
         consume(TOKEN_SEMICOLON, "Expect ';' after 'for' expression clause.");
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
     int exitJump = -1;
 
     if (!match(TOKEN_SEMICOLON))
@@ -1248,17 +2140,16 @@ static void forStatement()
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exitJump = emitConditionJump();
     }
 
 
     if (!match(TOKEN_RIGHT_PAREN))
     {
         int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
+        int incrementStart = markJumpTarget();
         expression();
-        emitByte(OP_POP);
+        emitPop();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'for' clauses.");
 
         emitLoop(loopStart);
@@ -1272,7 +2163,6 @@ static void forStatement()
     if (exitJump != -1)
     {
         patchJump(exitJump);
-        emitByte(OP_POP);
     }
 
     endScope();
@@ -1284,14 +2174,12 @@ static void ifStatement()
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int thenJump = emitConditionJump();
     statement();
 
     int elseJump = emitJump(OP_JUMP);
 
     patchJump(thenJump);
-    emitByte(OP_POP);
 
     if (match(TOKEN_ELSE)) statement();
     patchJump(elseJump);
@@ -1301,14 +2189,64 @@ static void printStatement()
 {
     expression();
     //consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+#ifdef REGISTER_VM
+    emitBytes(OP_PRINT, readOperand(topRegister()));
+    popOperands(1);
+#else
     emitByte(OP_PRINT);
+#endif
 }
 
 static void printlnStatement()
 {
     expression();
     //consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+#ifdef REGISTER_VM
+    emitBytes(OP_PRINTLN, readOperand(topRegister()));
+    popOperands(1);
+#else
     emitByte(OP_PRINTLN);
+#endif
+}
+
+// Turns the call or invoke just emitted for `return f(...)` or
+// `return a.m(...)` into its tail form. The OP_RETURN after it stays, as
+// callees other than closures return through it.
+static void emitTailCall()
+{
+    int offset = current->lastInstruction;
+    int count = currentChunk()->count;
+
+    if (offset == -1 || current->jumpTarget == count) return;
+
+    uint8_t* code = &currentChunk()->code[offset];
+    OpCode tail;
+    int length;
+
+    switch (code[0])
+    {
+#ifdef REGISTER_VM
+    case OP_CALL: tail = OP_TAIL_CALL; length = 3; break;
+    case OP_INVOKE: tail = OP_TAIL_INVOKE; length = 6; break;
+    case OP_INVOKE_LONG: tail = OP_TAIL_INVOKE_LONG; length = 7; break;
+    case OP_SUPER_INVOKE: tail = OP_TAIL_SUPER_INVOKE; length = 4; break;
+    case OP_SUPER_INVOKE_LONG: tail = OP_TAIL_SUPER_INVOKE_LONG; length = 5; break;
+#else
+    case OP_CALL: tail = OP_TAIL_CALL; length = 2; break;
+    case OP_INVOKE: tail = OP_TAIL_INVOKE; length = 5; break;
+    case OP_INVOKE_LONG: tail = OP_TAIL_INVOKE_LONG; length = 6; break;
+    case OP_SUPER_INVOKE: tail = OP_TAIL_SUPER_INVOKE; length = 3; break;
+    case OP_SUPER_INVOKE_LONG: tail = OP_TAIL_SUPER_INVOKE_LONG; length = 4; break;
+#endif
+    default: return;
+    }
+
+    if (offset + length != count) return;
+#ifdef REGISTER_VM
+    if (code[1] != topRegister()) return;
+#endif
+
+    code[0] = tail;
 }
 
 static void returnStatement()
@@ -1330,24 +2268,28 @@ static void returnStatement()
 
         expression();
         //consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        emitTailCall();
+#ifdef REGISTER_VM
+        emitBytes(OP_RETURN, readOperand(topRegister()));
+        popOperands(1);
+#else
         emitByte(OP_RETURN);
+#endif
     }
 }
 
 static void whileStatement()
 {
-    int loopStart = currentChunk()->count;
+    int loopStart = markJumpTarget();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    int exitJump = emitConditionJump();
     statement();
     emitLoop(loopStart);
 
     patchJump(exitJump);
-    emitByte(OP_POP);
 }
 
 static void synchronize()
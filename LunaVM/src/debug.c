@@ -13,6 +13,244 @@ void disassembleChunk(Chunk* chunk, const char* name)
 	}
 }
 
+// The 16-bit inline cache index of a property instruction.
+static uint16_t cacheIndex(Chunk* chunk, int offset)
+{
+	return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// The constant operand at `offset`, 16 bits in the _LONG forms.
+static uint16_t constantOperand(Chunk* chunk, int offset, bool wide)
+{
+	return wide ? (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]) : chunk->code[offset];
+}
+
+#ifdef REGISTER_VM
+
+// Prints the register operands of an instruction that has `count` of them.
+static int registerInstruction(const char* name, int count, Chunk* chunk, int offset)
+{
+	printf("%-16s", name);
+
+	for (int i = 1; i <= count; i++)
+	{
+		printf(" r%-3d", chunk->code[offset + i]);
+	}
+
+	printf("\n");
+	return offset + 1 + count;
+}
+
+// Prints an instruction whose operands are a register, a constant and,
+// for `third`, one more byte.
+static int registerConstantInstruction(const char* name, Chunk* chunk, int offset, const char* third, bool wide)
+{
+	uint8_t reg = chunk->code[offset + 1];
+	uint16_t constant = constantOperand(chunk, offset + 2, wide);
+	printf("%-16s r%-3d %4d '", name, reg, constant);
+	printValue(chunk->constants.values[constant]);
+	printf("'");
+
+	if (wide) offset++;
+
+	if (third != NULL)
+	{
+		printf(" %s %d", third, chunk->code[offset + 3]);
+		offset++;
+	}
+
+	printf("\n");
+	return offset + 3;
+}
+
+static int registerJumpInstruction(const char* name, int sign, int registers, Chunk* chunk, int offset)
+{
+	printf("%-16s", name);
+
+	for (int i = 1; i <= registers; i++)
+	{
+		printf(" r%-3d", chunk->code[offset + i]);
+	}
+
+	int next = offset + registers + 3;
+	uint16_t jump = (uint16_t)(chunk->code[next - 2] << 8);
+	jump |= chunk->code[next - 1];
+	printf(" %4d -> %d\n", offset, next + sign * jump);
+	return next;
+}
+
+int disassembleInstruction(Chunk* chunk, int offset)
+{
+	printf("%04d ", offset);
+
+	if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+	{
+		printf("  |  ");
+	}
+	else
+	{
+		printf("%4d ", chunk->lines[offset]);
+	}
+
+	uint8_t instruction = chunk->code[offset];
+	switch (instruction)
+	{
+	case OP_MOVE: return registerInstruction("move", 2, chunk, offset);
+	case OP_CONSTANT: return registerConstantInstruction("constant", chunk, offset, NULL, false);
+
+	case OP_CONSTANT_LONG:
+	{
+		uint16_t constant = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+		printf("%-16s r%-3d %4d '", "constant_long", chunk->code[offset + 1], constant);
+		printValue(chunk->constants.values[constant]);
+		printf("'\n");
+		return offset + 4;
+	}
+
+	case OP_NULL: return registerInstruction("null", 1, chunk, offset);
+	case OP_TRUE: return registerInstruction("true", 1, chunk, offset);
+	case OP_FALSE: return registerInstruction("false", 1, chunk, offset);
+	case OP_EQUAL: return registerInstruction("op_equal", 3, chunk, offset);
+	case OP_NOT_EQUAL: return registerInstruction("op_not_equal", 3, chunk, offset);
+	case OP_GREATER: return registerInstruction("op_greater", 3, chunk, offset);
+	case OP_GREATER_EQUAL: return registerInstruction("op_greater_equal", 3, chunk, offset);
+	case OP_LESS: return registerInstruction("op_less", 3, chunk, offset);
+	case OP_LESS_EQUAL: return registerInstruction("op_less_equal", 3, chunk, offset);
+	case OP_ADD: return registerInstruction("add", 3, chunk, offset);
+	case OP_SUBTRACT: return registerInstruction("sub", 3, chunk, offset);
+	case OP_MULTIPLY: return registerInstruction("mul", 3, chunk, offset);
+	case OP_MOD: return registerInstruction("mod", 3, chunk, offset);
+	case OP_DIVIDE: return registerInstruction("div", 3, chunk, offset);
+	case OP_NOT: return registerInstruction("not", 2, chunk, offset);
+	case OP_NEGATE: return registerInstruction("negate", 2, chunk, offset);
+	case OP_PRINT: return registerInstruction("print", 1, chunk, offset);
+	case OP_PRINTLN: return registerInstruction("println", 1, chunk, offset);
+	case OP_CLOSE_UPVALUE: return registerInstruction("close_upvalue", 1, chunk, offset);
+	case OP_INHERIT: return registerInstruction("inherit", 2, chunk, offset);
+	case OP_LIST: return registerInstruction("list", 1, chunk, offset);
+	case OP_ADD_LIST: return registerInstruction("add_list", 2, chunk, offset);
+	case OP_INDEX_GET: return registerInstruction("index_get", 3, chunk, offset);
+	case OP_INDEX_SET: return registerInstruction("index_set", 3, chunk, offset);
+	case OP_RETURN: return registerInstruction("return", 1, chunk, offset);
+	case OP_GET_UPVALUE: return registerInstruction("get_upvalue", 2, chunk, offset);
+	case OP_SET_UPVALUE: return registerInstruction("set_upvalue", 2, chunk, offset);
+	case OP_CALL: return registerInstruction("call", 2, chunk, offset);
+	case OP_TAIL_CALL: return registerInstruction("tail_call", 2, chunk, offset);
+	case OP_ADD_NUM_NUM: return registerInstruction("add_num_num", 3, chunk, offset);
+	case OP_ADD_STR_STR: return registerInstruction("add_str_str", 3, chunk, offset);
+	case OP_EQUAL_NUM: return registerInstruction("op_equal_num", 3, chunk, offset);
+	case OP_NOT_EQUAL_NUM: return registerInstruction("op_not_equal_num", 3, chunk, offset);
+
+	case OP_ADD_CONSTANT:
+	{
+		uint8_t constant = chunk->code[offset + 3];
+		printf("%-16s r%-3d r%-3d %4d '", "add_constant", chunk->code[offset + 1], chunk->code[offset + 2], constant);
+		printValue(chunk->constants.values[constant]);
+		printf("'\n");
+		return offset + 4;
+	}
+
+	case OP_GET_PROPERTY:
+	case OP_GET_PROPERTY_LONG:
+	{
+		bool wide = instruction == OP_GET_PROPERTY_LONG;
+		uint16_t constant = constantOperand(chunk, offset + 3, wide);
+		printf("%-16s r%-3d r%-3d %4d '", wide ? "get_property_long" : "get_property", chunk->code[offset + 1],
+			chunk->code[offset + 2], constant);
+		printValue(chunk->constants.values[constant]);
+		if (wide) offset++;
+		printf("' ic %d\n", cacheIndex(chunk, offset + 4));
+		return offset + 6;
+	}
+
+	case OP_SET_PROPERTY:
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+	case OP_SET_PROPERTY_LONG:
+	case OP_INVOKE_LONG:
+	case OP_TAIL_INVOKE_LONG:
+	{
+		const char* name = instruction == OP_INVOKE ? "invoke" : instruction == OP_TAIL_INVOKE ? "tail_invoke" :
+			instruction == OP_SET_PROPERTY ? "set_property" : instruction == OP_INVOKE_LONG ? "invoke_long" :
+			instruction == OP_TAIL_INVOKE_LONG ? "tail_invoke_long" : "set_property_long";
+		bool wide = instruction == OP_SET_PROPERTY_LONG || instruction == OP_INVOKE_LONG || instruction == OP_TAIL_INVOKE_LONG;
+		bool store = instruction == OP_SET_PROPERTY || instruction == OP_SET_PROPERTY_LONG;
+		uint16_t constant = constantOperand(chunk, offset + 2, wide);
+		printf("%-16s r%-3d %4d '", name, chunk->code[offset + 1], constant);
+		printValue(chunk->constants.values[constant]);
+		if (wide) offset++;
+		printf("' %s %d ic %d\n", store ? "<- r" : "args", chunk->code[offset + 3], cacheIndex(chunk, offset + 4));
+		return offset + 6;
+	}
+
+	case OP_METHOD:
+	case OP_METHOD_LONG:
+	{
+		bool wide = instruction == OP_METHOD_LONG;
+		uint16_t constant = constantOperand(chunk, offset + 3, wide);
+		printf("%-16s r%-3d r%-3d %4d '", wide ? "method_long" : "method", chunk->code[offset + 1],
+			chunk->code[offset + 2], constant);
+		printValue(chunk->constants.values[constant]);
+		printf("'\n");
+		return offset + (wide ? 5 : 4);
+	}
+
+	case OP_DEFINE_GLOBAL: return registerConstantInstruction("define_global", chunk, offset, NULL, false);
+	case OP_GET_GLOBAL: return registerConstantInstruction("get_global", chunk, offset, NULL, false);
+	case OP_SET_GLOBAL: return registerConstantInstruction("set_global", chunk, offset, NULL, false);
+	case OP_STRUCT: return registerConstantInstruction("struct", chunk, offset, NULL, false);
+	case OP_GET_SUPER: return registerConstantInstruction("get_super", chunk, offset, NULL, false);
+	case OP_SUPER_INVOKE: return registerConstantInstruction("super_invoke", chunk, offset, "args", false);
+	case OP_TAIL_SUPER_INVOKE: return registerConstantInstruction("tail_super_invoke", chunk, offset, "args", false);
+	case OP_DEFINE_GLOBAL_LONG: return registerConstantInstruction("define_global_long", chunk, offset, NULL, true);
+	case OP_GET_GLOBAL_LONG: return registerConstantInstruction("get_global_long", chunk, offset, NULL, true);
+	case OP_SET_GLOBAL_LONG: return registerConstantInstruction("set_global_long", chunk, offset, NULL, true);
+	case OP_STRUCT_LONG: return registerConstantInstruction("struct_long", chunk, offset, NULL, true);
+	case OP_GET_SUPER_LONG: return registerConstantInstruction("get_super_long", chunk, offset, NULL, true);
+	case OP_SUPER_INVOKE_LONG: return registerConstantInstruction("super_invoke_long", chunk, offset, "args", true);
+	case OP_TAIL_SUPER_INVOKE_LONG:
+		return registerConstantInstruction("tail_super_invoke_long", chunk, offset, "args", true);
+
+	case OP_JUMP: return registerJumpInstruction("jump", 1, 0, chunk, offset);
+	case OP_LOOP: return registerJumpInstruction("loop", -1, 0, chunk, offset);
+	case OP_JUMP_IF_FALSE: return registerJumpInstruction("jump_if_false", 1, 1, chunk, offset);
+	case OP_LESS_JUMP_IF_FALSE: return registerJumpInstruction("less_jump_if_false", 1, 2, chunk, offset);
+	case OP_GREATER_JUMP_IF_FALSE: return registerJumpInstruction("greater_jump_if_false", 1, 2, chunk, offset);
+
+	case OP_CLOSURE:
+	case OP_CLOSURE_LONG:
+	{
+		bool wide = instruction == OP_CLOSURE_LONG;
+		offset++;
+		uint8_t reg = chunk->code[offset++];
+		uint16_t constant = constantOperand(chunk, offset, wide);
+		offset += wide ? 2 : 1;
+		printf("%-16s r%-3d %4d ", wide ? "closure_long" : "closure", reg, constant);
+		printValue(chunk->constants.values[constant]);
+		printf("\n");
+
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+
+		for (int j = 0; j < function->upvalueCount; j++)
+		{
+			int pair = offset;
+			int isLocal = chunk->code[offset++];
+			int index = constantOperand(chunk, offset, wide);
+			offset += wide ? 2 : 1;
+			printf("%04d  |  %s %d\n", pair, isLocal ? "local" : "upvalue", index);
+		}
+
+		return offset;
+	}
+
+	default:
+		printf("Unknown opcode %d\n", instruction);
+		return offset + 1;
+	}
+}
+
+#else
+
 static int simpleInstruction(const char* name, int offset) 
 {
 	printf("%s\n", name);
@@ -26,6 +264,21 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset)
 	return offset + 2;
 }
 
+static int shortInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	printf("%-16s %4d \n", name, slot);
+	return offset + 3;
+}
+
+static int twoByteInstruction(const char* name, Chunk* chunk, int offset)
+{
+	uint8_t first = chunk->code[offset + 1];
+	uint8_t second = chunk->code[offset + 2];
+	printf("%-16s %4d %4d\n", name, first, second);
+	return offset + 3;
+}
+
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 {
 	uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
@@ -43,16 +296,44 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
 	return offset + 2;
 }
 
-static int invokeInstruction(const char* name, Chunk* chunk, int offset)
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset)
 {
-	uint8_t constant = chunk->code[offset + 1];
-	uint8_t argCount = chunk->code[offset + 2];
-	printf("%-16s (%d args) %4d '", name, argCount, constant);
+	uint16_t constant = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+	printf("%-16s %4d '", name, constant);
 	printValue(chunk->constants.values[constant]);
 	printf("'\n");
 	return offset + 3;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset, bool wide)
+{
+	uint16_t constant = constantOperand(chunk, offset + 1, wide);
+	printf("%-16s %4d '", name, constant);
+	printValue(chunk->constants.values[constant]);
+	if (wide) offset++;
+	printf("' ic %d\n", cacheIndex(chunk, offset + 2));
+	return offset + 4;
+}
+
+static int invokeInstruction(const char* name, Chunk* chunk, int offset, bool cached, bool wide)
+{
+	uint16_t constant = constantOperand(chunk, offset + 1, wide);
+	if (wide) offset++;
+	uint8_t argCount = chunk->code[offset + 2];
+	printf("%-16s (%d args) %4d '", name, argCount, constant);
+	printValue(chunk->constants.values[constant]);
+	printf("'");
+
+	if (!cached)
+	{
+		printf("\n");
+		return offset + 3;
+	}
+
+	printf(" ic %d\n", cacheIndex(chunk, offset + 3));
+	return offset + 5;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset)
 {
 	printf("%04d ", offset);
@@ -70,10 +351,16 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	switch (instruction) 
 	{
 	case OP_GET_PROPERTY:
-		return constantInstruction("get_property", chunk, offset);
+		return propertyInstruction("get_property", chunk, offset, false);
 
 	case OP_SET_PROPERTY:
-		return constantInstruction("set_property", chunk, offset);
+		return propertyInstruction("set_property", chunk, offset, false);
+
+	case OP_GET_PROPERTY_LONG:
+		return propertyInstruction("get_property_long", chunk, offset, true);
+
+	case OP_SET_PROPERTY_LONG:
+		return propertyInstruction("set_property_long", chunk, offset, true);
 
 	case OP_STRUCT:
 		return constantInstruction("struct", chunk, offset);
@@ -81,9 +368,18 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	case OP_METHOD:
 		return constantInstruction("method", chunk, offset);
 
+	case OP_STRUCT_LONG:
+		return constantLongInstruction("struct_long", chunk, offset);
+
+	case OP_METHOD_LONG:
+		return constantLongInstruction("method_long", chunk, offset);
+
 	case OP_CONSTANT:
 		return constantInstruction("push_constant", chunk, offset);
 
+	case OP_CONSTANT_LONG:
+		return constantLongInstruction("push_constant_long", chunk, offset);
+
 	case OP_NULL:
 		return simpleInstruction("push_null", offset);
 
@@ -96,12 +392,30 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	case OP_POP:
 		return simpleInstruction("pop", offset);
 
+	case OP_LIST:
+		return simpleInstruction("list", offset);
+
+	case OP_ADD_LIST:
+		return simpleInstruction("add_list", offset);
+
+	case OP_INDEX_GET:
+		return simpleInstruction("index_get", offset);
+
+	case OP_INDEX_SET:
+		return simpleInstruction("index_set", offset);
+
 	case OP_GET_LOCAL:
 		return byteInstruction("get_local", chunk, offset);
 
 	case OP_SET_LOCAL:
 		return byteInstruction("set_local", chunk, offset);
 
+	case OP_GET_LOCAL_LONG:
+		return shortInstruction("get_local_long", chunk, offset);
+
+	case OP_SET_LOCAL_LONG:
+		return shortInstruction("set_local_long", chunk, offset);
+
 	case OP_DEFINE_GLOBAL:
 		return constantInstruction("define_global", chunk, offset);
 
@@ -111,6 +425,15 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	case OP_SET_GLOBAL:
 		return constantInstruction("set_global", chunk, offset);
 
+	case OP_DEFINE_GLOBAL_LONG:
+		return constantLongInstruction("define_global_long", chunk, offset);
+
+	case OP_GET_GLOBAL_LONG:
+		return constantLongInstruction("get_global_long", chunk, offset);
+
+	case OP_SET_GLOBAL_LONG:
+		return constantLongInstruction("set_global_long", chunk, offset);
+
 	case OP_SET_UPVALUE:
 		return byteInstruction("set_upvalue", chunk, offset);
 
@@ -165,11 +488,17 @@ int disassembleInstruction(Chunk* chunk, int offset)
 	case OP_CALL:
 		return byteInstruction("call", chunk, offset);
 
+	case OP_TAIL_CALL:
+		return byteInstruction("tail_call", chunk, offset);
+
 	case OP_CLOSURE:
+	case OP_CLOSURE_LONG:
 	{
+		bool wide = instruction == OP_CLOSURE_LONG;
 		offset++;
-		uint8_t constant = chunk->code[offset++];
-		printf("%-16s %4d ", "closure", constant);
+		uint16_t constant = constantOperand(chunk, offset, wide);
+		offset += wide ? 2 : 1;
+		printf("%-16s %4d ", wide ? "closure_long" : "closure", constant);
 		printValue(chunk->constants.values[constant]);
 		printf("\n");
 
@@ -177,9 +506,11 @@ int disassembleInstruction(Chunk* chunk, int offset)
 
 		for (int j = 0; j < function->upvalueCount; j++)
 		{
+			int pair = offset;
 			int isLocal = chunk->code[offset++];
-			int index = chunk->code[offset++];
-			printf("%04d  |  %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+			int index = constantOperand(chunk, offset, wide);
+			offset += wide ? 2 : 1;
+			printf("%04d  |  %s %d\n", pair, isLocal ? "local" : "upvalue", index);
 		}
 
 		return offset;
@@ -192,12 +523,22 @@ int disassembleInstruction(Chunk* chunk, int offset)
 
 	case OP_INVOKE:
 	{
-		return invokeInstruction("invoke", chunk, offset);
+		return invokeInstruction("invoke", chunk, offset, true, false);
 	}
 
 	case OP_SUPER_INVOKE:
 	{
-		return invokeInstruction("super_invoke", chunk, offset);
+		return invokeInstruction("super_invoke", chunk, offset, false, false);
+	}
+
+	case OP_TAIL_INVOKE:
+	{
+		return invokeInstruction("tail_invoke", chunk, offset, true, false);
+	}
+
+	case OP_TAIL_SUPER_INVOKE:
+	{
+		return invokeInstruction("tail_super_invoke", chunk, offset, false, false);
 	}
 
 	case OP_GET_SUPER:
@@ -205,9 +546,63 @@ int disassembleInstruction(Chunk* chunk, int offset)
 		return constantInstruction("get_super", chunk, offset);
 	}
 
+	case OP_INVOKE_LONG:
+		return invokeInstruction("invoke_long", chunk, offset, true, true);
+
+	case OP_SUPER_INVOKE_LONG:
+		return invokeInstruction("super_invoke_long", chunk, offset, false, true);
+
+	case OP_TAIL_INVOKE_LONG:
+		return invokeInstruction("tail_invoke_long", chunk, offset, true, true);
+
+	case OP_TAIL_SUPER_INVOKE_LONG:
+		return invokeInstruction("tail_super_invoke_long", chunk, offset, false, true);
+
+	case OP_GET_SUPER_LONG:
+		return constantLongInstruction("get_super_long", chunk, offset);
+
 	case OP_RETURN:
 		return simpleInstruction("return", offset);
 
+	case OP_NOT_EQUAL:
+		return simpleInstruction("op_not_equal", offset);
+
+	case OP_GREATER_EQUAL:
+		return simpleInstruction("op_greater_equal", offset);
+
+	case OP_LESS_EQUAL:
+		return simpleInstruction("op_less_equal", offset);
+
+	case OP_GET_LOCAL_GET_LOCAL:
+		return twoByteInstruction("get_local_get_local", chunk, offset);
+
+	case OP_SET_LOCAL_POP:
+		return byteInstruction("set_local_pop", chunk, offset);
+
+	case OP_ADD_CONSTANT:
+		return constantInstruction("add_constant", chunk, offset);
+
+	case OP_POP_JUMP_IF_FALSE:
+		return jumpInstruction("pop_jump_if_false", 1, chunk, offset);
+
+	case OP_LESS_JUMP_IF_FALSE:
+		return jumpInstruction("less_jump_if_false", 1, chunk, offset);
+
+	case OP_GREATER_JUMP_IF_FALSE:
+		return jumpInstruction("greater_jump_if_false", 1, chunk, offset);
+
+	case OP_ADD_NUM_NUM:
+		return simpleInstruction("add_num_num", offset);
+
+	case OP_ADD_STR_STR:
+		return simpleInstruction("add_str_str", offset);
+
+	case OP_EQUAL_NUM:
+		return simpleInstruction("op_equal_num", offset);
+
+	case OP_NOT_EQUAL_NUM:
+		return simpleInstruction("op_not_equal_num", offset);
+
 	default:
 		printf("Unknown opcode %d\n", instruction);
 		return offset + 1;
@@ -215,3 +610,5 @@ int disassembleInstruction(Chunk* chunk, int offset)
 
 	return 0;
 }
+
+#endif
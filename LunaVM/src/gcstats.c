@@ -0,0 +1,241 @@
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcstats.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+uint64_t monotonicNanos()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ull +
+		(uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#endif
+}
+
+void initGCStats(GCStats* stats)
+{
+	memset(stats, 0, sizeof(GCStats));
+	stats->startTime = monotonicNanos();
+	stats->heapSampleEvery = 1;
+}
+
+void recordGCPause(GCStats* stats, uint64_t nanos)
+{
+	stats->pauseCount++;
+	stats->pauseTotal += nanos;
+	if (nanos > stats->pauseMax) stats->pauseMax = nanos;
+
+	int bucket = 0;
+	for (uint64_t micros = nanos / 1000; micros > 0 && bucket < GC_PAUSE_BUCKETS - 1; micros >>= 1)
+	{
+		bucket++;
+	}
+
+	stats->pauseHistogram[bucket]++;
+}
+
+void recordHeapSample(GCStats* stats, size_t heapSize)
+{
+	if (++stats->heapSampleSkipped < stats->heapSampleEvery) return;
+	stats->heapSampleSkipped = 0;
+
+	if (stats->heapSampleCount == GC_HEAP_SAMPLES_MAX)
+	{
+		for (int i = 0; i < GC_HEAP_SAMPLES_MAX / 2; i++)
+		{
+			stats->heapSamples[i] = stats->heapSamples[i * 2 + 1];
+		}
+
+		stats->heapSampleCount = GC_HEAP_SAMPLES_MAX / 2;
+		stats->heapSampleEvery *= 2;
+	}
+
+	GCHeapSample* sample = &stats->heapSamples[stats->heapSampleCount++];
+	sample->time = monotonicNanos() - stats->startTime;
+	sample->heapSize = heapSize;
+}
+
+static const char* objTypeNames[GC_OBJ_TYPES] = {
+	"string", "function", "native", "closure", "upvalue",
+	"struct", "instance", "boundMethod", "list",
+};
+
+typedef struct
+{
+	const char* name;
+	uint64_t* counter;
+} NamedCounter;
+
+bool gcStatValue(GCStats* stats, const char* name, double* value)
+{
+	NamedCounter counters[] = {
+		{ "cycles", &stats->cycles },
+		{ "minorCollections", &stats->minorCollections },
+		{ "pauseCount", &stats->pauseCount },
+		{ "pauseTotalNs", &stats->pauseTotal },
+		{ "pauseMaxNs", &stats->pauseMax },
+		{ "markTimeNs", &stats->markTime },
+		{ "sweepTimeNs", &stats->sweepTime },
+		{ "minorTimeNs", &stats->minorTime },
+		{ "compactTimeNs", &stats->compactTime },
+		{ "bytesMarked", &stats->bytesMarked },
+		{ "bytesSwept", &stats->bytesSwept },
+		{ "bytesPromoted", &stats->bytesPromoted },
+		{ "bytesFreed", &stats->bytesFreed },
+		{ "compactions", &stats->compactions },
+		{ "bytesCompacted", &stats->bytesCompacted },
+	};
+
+	for (int i = 0; i < (int)(sizeof(counters) / sizeof(counters[0])); i++)
+	{
+		if (strcmp(counters[i].name, name) == 0)
+		{
+			*value = (double)*counters[i].counter;
+			return true;
+		}
+	}
+
+	for (int i = 0; i < GC_OBJ_TYPES; i++)
+	{
+		if (strcmp(objTypeNames[i], name) == 0)
+		{
+			*value = (double)stats->freedByType[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+typedef struct
+{
+	char* chars;
+	size_t length;
+	size_t capacity;
+} JsonBuffer;
+
+static void appendJson(JsonBuffer* buffer, const char* format, ...)
+{
+	va_list args;
+
+	for (;;)
+	{
+		size_t space = buffer->capacity - buffer->length;
+
+		va_start(args, format);
+		int written = vsnprintf(buffer->chars + buffer->length, space, format, args);
+		va_end(args);
+
+		if (written < 0) exit(1);
+
+		if ((size_t)written < space)
+		{
+			buffer->length += written;
+			return;
+		}
+
+		buffer->capacity = buffer->capacity * 2 + written;
+		buffer->chars = (char*)realloc(buffer->chars, buffer->capacity);
+		if (buffer->chars == NULL) exit(1);
+	}
+}
+
+char* gcStatsToJson(GCStats* stats, size_t heapSize, size_t nextGC)
+{
+	JsonBuffer buffer;
+	buffer.capacity = 4096;
+	buffer.length = 0;
+	buffer.chars = (char*)malloc(buffer.capacity);
+	if (buffer.chars == NULL) exit(1);
+
+	appendJson(&buffer, "{\n");
+	appendJson(&buffer, "  \"elapsedNs\": %llu,\n",
+		(unsigned long long)(monotonicNanos() - stats->startTime));
+	appendJson(&buffer, "  \"cycles\": %llu,\n", (unsigned long long)stats->cycles);
+	appendJson(&buffer, "  \"minorCollections\": %llu,\n", (unsigned long long)stats->minorCollections);
+
+	appendJson(&buffer, "  \"pauses\": {\n");
+	appendJson(&buffer, "    \"count\": %llu,\n", (unsigned long long)stats->pauseCount);
+	appendJson(&buffer, "    \"totalNs\": %llu,\n", (unsigned long long)stats->pauseTotal);
+	appendJson(&buffer, "    \"maxNs\": %llu,\n", (unsigned long long)stats->pauseMax);
+	appendJson(&buffer, "    \"histogramUs\": {");
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+	{
+		if (i < GC_PAUSE_BUCKETS - 1)
+		{
+			appendJson(&buffer, "\"<%llu\": %llu, ", 1ull << i, (unsigned long long)stats->pauseHistogram[i]);
+		}
+		else
+		{
+			appendJson(&buffer, "\"more\": %llu", (unsigned long long)stats->pauseHistogram[i]);
+		}
+	}
+	appendJson(&buffer, "}\n  },\n");
+
+	appendJson(&buffer, "  \"phaseTimeNs\": { \"mark\": %llu, \"sweep\": %llu, \"minor\": %llu, \"compact\": %llu },\n",
+		(unsigned long long)stats->markTime,
+		(unsigned long long)stats->sweepTime,
+		(unsigned long long)stats->minorTime,
+		(unsigned long long)stats->compactTime);
+
+	appendJson(&buffer, "  \"bytesMarked\": %llu,\n", (unsigned long long)stats->bytesMarked);
+	appendJson(&buffer, "  \"bytesSwept\": %llu,\n", (unsigned long long)stats->bytesSwept);
+	appendJson(&buffer, "  \"bytesPromoted\": %llu,\n", (unsigned long long)stats->bytesPromoted);
+	appendJson(&buffer, "  \"bytesFreed\": %llu,\n", (unsigned long long)stats->bytesFreed);
+	appendJson(&buffer, "  \"compactions\": %llu,\n", (unsigned long long)stats->compactions);
+	appendJson(&buffer, "  \"bytesCompacted\": %llu,\n", (unsigned long long)stats->bytesCompacted);
+
+	appendJson(&buffer, "  \"freedByType\": {");
+	for (int i = 0; i < GC_OBJ_TYPES; i++)
+	{
+		appendJson(&buffer, "%s\"%s\": %llu", i == 0 ? " " : ", ",
+			objTypeNames[i], (unsigned long long)stats->freedByType[i]);
+	}
+	appendJson(&buffer, " },\n");
+
+	appendJson(&buffer, "  \"heap\": {\n");
+	appendJson(&buffer, "    \"bytesAllocated\": %zu,\n", heapSize);
+	appendJson(&buffer, "    \"nextGC\": %zu,\n", nextGC);
+	appendJson(&buffer, "    \"samples\": [");
+	for (int i = 0; i < stats->heapSampleCount; i++)
+	{
+		appendJson(&buffer, "%s[%llu, %zu]", i == 0 ? "" : ", ",
+			(unsigned long long)stats->heapSamples[i].time, stats->heapSamples[i].heapSize);
+	}
+	appendJson(&buffer, "]\n  }\n}\n");
+
+	return buffer.chars;
+}
+
+bool writeGCStats(GCStats* stats, size_t heapSize, size_t nextGC, const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL) return false;
+
+	char* json = gcStatsToJson(stats, heapSize, nextGC);
+	fputs(json, file);
+	free(json);
+
+	return fclose(file) == 0;
+}
@@ -0,0 +1,63 @@
+#ifndef luna_gcstats_h
+#define luna_gcstats_h
+
+#include "common.h"
+#include "object.h"
+
+// Pause histogram buckets are powers of two in microseconds: bucket i counts
+// pauses shorter than 2^i us, and the last one everything longer.
+#define GC_PAUSE_BUCKETS 24
+#define GC_HEAP_SAMPLES_MAX 1024
+#define GC_OBJ_TYPES (OBJ_LIST + 1)
+
+typedef struct
+{
+	uint64_t time;
+	size_t heapSize;
+} GCHeapSample;
+
+// Collector telemetry. Times are in nanoseconds from monotonicNanos().
+typedef struct
+{
+	uint64_t startTime;
+	uint64_t cycles;
+	uint64_t minorCollections;
+
+	uint64_t pauseCount;
+	uint64_t pauseTotal;
+	uint64_t pauseMax;
+	uint64_t pauseHistogram[GC_PAUSE_BUCKETS];
+
+	uint64_t markTime;
+	uint64_t sweepTime;
+	uint64_t minorTime;
+	uint64_t compactTime;
+
+	uint64_t bytesMarked;
+	uint64_t bytesSwept;
+	uint64_t bytesPromoted;
+	uint64_t bytesFreed;
+	uint64_t compactions;
+	uint64_t bytesCompacted;
+	uint64_t freedByType[GC_OBJ_TYPES];
+
+	// Heap size at the end of each cycle. Once the buffer is full every other
+	// sample is dropped and only every heapSampleEvery-th cycle is kept.
+	GCHeapSample heapSamples[GC_HEAP_SAMPLES_MAX];
+	int heapSampleCount;
+	int heapSampleEvery;
+	int heapSampleSkipped;
+} GCStats;
+
+uint64_t monotonicNanos();
+
+void initGCStats(GCStats* stats);
+void recordGCPause(GCStats* stats, uint64_t nanos);
+void recordHeapSample(GCStats* stats, size_t heapSize);
+bool gcStatValue(GCStats* stats, const char* name, double* value);
+
+// Returns the statistics as a malloc'd JSON document.
+char* gcStatsToJson(GCStats* stats, size_t heapSize, size_t nextGC);
+bool writeGCStats(GCStats* stats, size_t heapSize, size_t nextGC, const char* path);
+
+#endif
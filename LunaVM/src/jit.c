@@ -0,0 +1,1729 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+int jitThreshold = JIT_THRESHOLD;
+JitBackend jitBackend = JIT_TEMPLATES;
+
+// A baseline compiler: every instruction becomes a fixed template of x86-64
+// code that does what its handler in run() does, on the same stack and
+// frames. Locals, jumps and arithmetic on numbers are done inline and the
+// rest calls a runtime helper from vm.c, so that the interpreter and
+// compiled code can take over from each other at any instruction. Where an
+// inline template meets types it does not handle, it stores the state and
+// hands the instruction back to run(), which raises the error or does the
+// work.
+//
+// While compiled code runs it keeps the interpreter's locals in registers
+// the System V ABI has callees preserve.
+
+typedef enum
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+#define REG_SP RBX // One past the top of the stack.
+#define REG_SLOTS R12 // frame->slots
+#define REG_FRAME R13
+#define REG_CONSTANTS R14 // The function's constants.
+#define REG_VM R15 // &vm
+
+// Scratch registers for the templates: RAX, RCX and RDX for values, R10 and
+// R11 for type checks, XMM0 and XMM1 for numbers.
+#define XMM0 0
+#define XMM1 1
+
+typedef enum
+{
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_BE = 0x6,
+	CC_A = 0x7,
+	CC_P = 0xA,
+	CC_NP = 0xB,
+} Condition;
+
+typedef struct
+{
+	int at; // Offset of the 32-bit displacement to patch.
+	int target; // Bytecode offset it leads to.
+} Fixup;
+
+typedef struct
+{
+	Chunk* chunk;
+	uint8_t* code;
+	int count;
+	int capacity;
+	uint32_t* entries;
+	int epilogue;
+	// Jumps to other instructions, and to the exits that hand one back to
+	// the interpreter.
+	Fixup* jumps;
+	int jumpCount;
+	int jumpCapacity;
+	Fixup* exits;
+	int exitCount;
+	int exitCapacity;
+} Assembler;
+
+static void emitByte(Assembler* as, uint8_t byte)
+{
+	if (as->count == as->capacity)
+	{
+		as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+		as->code = (uint8_t*)realloc(as->code, as->capacity);
+		if (as->code == NULL) exit(1);
+	}
+
+	as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value)
+{
+	for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value)
+{
+	for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void addFixup(Fixup** fixups, int* count, int* capacity, int at, int target)
+{
+	if (*count == *capacity)
+	{
+		*capacity = *capacity < 16 ? 16 : *capacity * 2;
+		*fixups = (Fixup*)realloc(*fixups, sizeof(Fixup) * *capacity);
+		if (*fixups == NULL) exit(1);
+	}
+
+	(*fixups)[*count].at = at;
+	(*fixups)[*count].target = target;
+	(*count)++;
+}
+
+static void patch(Assembler* as, int at, int target)
+{
+	int32_t displacement = target - (at + 4);
+	memcpy(as->code + at, &displacement, sizeof(displacement));
+}
+
+static void patchHere(Assembler* as, int at)
+{
+	patch(as, at, as->count);
+}
+
+// REX prefix for a reg field and an r/m field, omitted when it adds nothing.
+static void emitRex(Assembler* as, bool wide, int reg, int rm)
+{
+	uint8_t rex = (uint8_t)(0x40 | wide << 3 | (reg >> 3) << 2 | rm >> 3);
+	if (rex != 0x40) emitByte(as, rex);
+}
+
+static void emitModRM(Assembler* as, int reg, int rm)
+{
+	emitByte(as, (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+// ModRM, SIB and displacement for [base + displacement].
+static void emitMemory(Assembler* as, int reg, int base, int32_t displacement)
+{
+	int mod = displacement == 0 && (base & 7) != RBP ? 0 :
+		displacement >= -128 && displacement <= 127 ? 1 : 2;
+
+	emitByte(as, (uint8_t)(mod << 6 | (reg & 7) << 3 | (base & 7)));
+	if ((base & 7) == RSP) emitByte(as, 0x24);
+
+	if (mod == 1) emitByte(as, (uint8_t)displacement);
+	else if (mod == 2) emit32(as, (uint32_t)displacement);
+}
+
+static void emitPush(Assembler* as, Register reg)
+{
+	emitRex(as, false, 0, reg);
+	emitByte(as, (uint8_t)(0x50 | (reg & 7)));
+}
+
+static void emitPop(Assembler* as, Register reg)
+{
+	emitRex(as, false, 0, reg);
+	emitByte(as, (uint8_t)(0x58 | (reg & 7)));
+}
+
+static void emitLoad(Assembler* as, Register dst, Register base, int32_t displacement)
+{
+	emitRex(as, true, dst, base);
+	emitByte(as, 0x8B);
+	emitMemory(as, dst, base, displacement);
+}
+
+static void emitStore(Assembler* as, Register base, int32_t displacement, Register src)
+{
+	emitRex(as, true, src, base);
+	emitByte(as, 0x89);
+	emitMemory(as, src, base, displacement);
+}
+
+static void emitMove(Assembler* as, Register dst, Register src)
+{
+	emitRex(as, true, src, dst);
+	emitByte(as, 0x89);
+	emitModRM(as, src, dst);
+}
+
+static void emitMoveImmediate(Assembler* as, Register dst, uint64_t value)
+{
+	if (value <= UINT32_MAX)
+	{
+		// Writing the low half clears the high one.
+		emitRex(as, false, 0, dst);
+		emitByte(as, (uint8_t)(0xB8 | (dst & 7)));
+		emit32(as, (uint32_t)value);
+		return;
+	}
+
+	emitRex(as, true, 0, dst);
+	emitByte(as, (uint8_t)(0xB8 | (dst & 7)));
+	emit64(as, value);
+}
+
+typedef enum
+{
+	ALU_ADD = 0x01,
+	ALU_OR = 0x09,
+	ALU_AND = 0x21,
+	ALU_SUB = 0x29,
+	ALU_XOR = 0x31,
+	ALU_CMP = 0x39,
+} AluOp;
+
+static void emitAlu(Assembler* as, AluOp op, Register dst, Register src)
+{
+	emitRex(as, true, src, dst);
+	emitByte(as, (uint8_t)op);
+	emitModRM(as, src, dst);
+}
+
+// The same operations on an immediate, which select them by the reg field.
+static void emitAluImmediate(Assembler* as, AluOp op, Register dst, int32_t value)
+{
+	int extension = op >> 3;
+	emitRex(as, true, 0, dst);
+
+	if (value >= -128 && value <= 127)
+	{
+		emitByte(as, 0x83);
+		emitModRM(as, extension, dst);
+		emitByte(as, (uint8_t)value);
+	}
+	else
+	{
+		emitByte(as, 0x81);
+		emitModRM(as, extension, dst);
+		emit32(as, (uint32_t)value);
+	}
+}
+
+// Byte-sized AL, CL and DL only.
+static void emitAluByte(Assembler* as, AluOp op, Register dst, Register src)
+{
+	emitByte(as, (uint8_t)(op - 1));
+	emitModRM(as, src, dst);
+}
+
+static void emitSetCondition(Assembler* as, Condition condition, Register dst)
+{
+	emitByte(as, 0x0F);
+	emitByte(as, (uint8_t)(0x90 | condition));
+	emitModRM(as, 0, dst);
+}
+
+static void emitZeroExtendByte(Assembler* as, Register dst, Register src)
+{
+	emitByte(as, 0x0F);
+	emitByte(as, 0xB6);
+	emitModRM(as, dst, src);
+}
+
+static void emitToXmm(Assembler* as, int xmm, Register src)
+{
+	emitByte(as, 0x66);
+	emitRex(as, true, xmm, src);
+	emitByte(as, 0x0F);
+	emitByte(as, 0x6E);
+	emitModRM(as, xmm, src);
+}
+
+static void emitFromXmm(Assembler* as, Register dst, int xmm)
+{
+	emitByte(as, 0x66);
+	emitRex(as, true, xmm, dst);
+	emitByte(as, 0x0F);
+	emitByte(as, 0x7E);
+	emitModRM(as, xmm, dst);
+}
+
+typedef enum
+{
+	SSE_ADD = 0x58,
+	SSE_MUL = 0x59,
+	SSE_SUB = 0x5C,
+	SSE_DIV = 0x5E,
+	SSE_SQRT = 0x51,
+	SSE_TO_INT = 0x2C, // cvttsd2si, truncating like a C cast
+	SSE_FROM_INT = 0x2A, // cvtsi2sd
+} SseOp;
+
+// A scalar double instruction; the operands are XMM registers except for
+// the integer side of the conversions.
+static void emitSse(Assembler* as, SseOp op, int dst, int src)
+{
+	emitByte(as, 0xF2);
+	emitRex(as, false, dst, src);
+	emitByte(as, 0x0F);
+	emitByte(as, (uint8_t)op);
+	emitModRM(as, dst, src);
+}
+
+// movsd between an XMM register and [base + displacement].
+static void emitLoadDouble(Assembler* as, int xmm, Register base, int32_t displacement)
+{
+	emitByte(as, 0xF2);
+	emitRex(as, false, xmm, base);
+	emitByte(as, 0x0F);
+	emitByte(as, 0x10);
+	emitMemory(as, xmm, base, displacement);
+}
+
+static void emitStoreDouble(Assembler* as, Register base, int32_t displacement, int xmm)
+{
+	emitByte(as, 0xF2);
+	emitRex(as, false, xmm, base);
+	emitByte(as, 0x0F);
+	emitByte(as, 0x11);
+	emitMemory(as, xmm, base, displacement);
+}
+
+typedef enum
+{
+	PD_MOVE = 0x28, // movapd
+	PD_COMPARE = 0x2E, // ucomisd
+	PD_XOR = 0x57, // xorpd
+} PackedOp;
+
+// The 66-prefixed instructions, on two XMM registers.
+static void emitPacked(Assembler* as, PackedOp op, int dst, int src)
+{
+	emitByte(as, 0x66);
+	emitRex(as, false, dst, src);
+	emitByte(as, 0x0F);
+	emitByte(as, (uint8_t)op);
+	emitModRM(as, dst, src);
+}
+
+// Sets the flags like an unsigned compare of a and b; unordered sets ZF,
+// PF and CF.
+static void emitCompareDoubles(Assembler* as, int a, int b)
+{
+	emitPacked(as, PD_COMPARE, a, b);
+}
+
+static int emitJump(Assembler* as)
+{
+	emitByte(as, 0xE9);
+	emit32(as, 0);
+	return as->count - 4;
+}
+
+static int emitJumpIf(Assembler* as, Condition condition)
+{
+	emitByte(as, 0x0F);
+	emitByte(as, (uint8_t)(0x80 | condition));
+	emit32(as, 0);
+	return as->count - 4;
+}
+
+static void emitJumpTo(Assembler* as, int target)
+{
+	addFixup(&as->jumps, &as->jumpCount, &as->jumpCapacity, emitJump(as), target);
+}
+
+static void emitJumpToIf(Assembler* as, Condition condition, int target)
+{
+	addFixup(&as->jumps, &as->jumpCount, &as->jumpCapacity, emitJumpIf(as, condition), target);
+}
+
+// Leaves compiled code to have run() execute the instruction at offset.
+static void emitExitIf(Assembler* as, Condition condition, int offset)
+{
+	addFixup(&as->exits, &as->exitCount, &as->exitCapacity, emitJumpIf(as, condition), offset);
+}
+
+static void emitExit(Assembler* as, int offset)
+{
+	addFixup(&as->exits, &as->exitCount, &as->exitCapacity, emitJump(as), offset);
+}
+
+// Stores the instruction pointer and the stack top where run() and the
+// helpers look for them.
+static void emitStoreState(Assembler* as, int offset)
+{
+	emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)(as->chunk->code + offset));
+	emitStore(as, REG_FRAME, offsetof(CallFrame, ip), RAX);
+	emitStore(as, REG_VM, offsetof(VM, stackTop), REG_SP);
+}
+
+// Calls a runtime helper whose instruction ends at next, after the caller
+// has put any operands in ESI, EDX and ECX. A status other than JIT_OK
+// leaves compiled code with it.
+static void emitCallHelper(Assembler* as, void* helper, int next)
+{
+	emitStoreState(as, next);
+	emitMove(as, RDI, REG_FRAME);
+	emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)helper);
+	emitByte(as, 0xFF);
+	emitModRM(as, 2, RAX);
+
+	emitByte(as, 0x85);
+	emitModRM(as, RAX, RAX);
+	patch(as, emitJumpIf(as, CC_NE), as->epilogue);
+
+	// Natives may have moved the stack.
+	emitLoad(as, REG_SP, REG_VM, offsetof(VM, stackTop));
+	emitLoad(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+}
+
+static void emitArgument(Assembler* as, Register reg, int value)
+{
+	emitMoveImmediate(as, reg, (uint32_t)value);
+}
+
+// Sets ZF unless the value in reg is a number. R11 must hold QNAN.
+static void emitTestNotNumber(Assembler* as, Register reg)
+{
+	emitMove(as, R10, reg);
+	emitAlu(as, ALU_AND, R10, R11);
+	emitAlu(as, ALU_CMP, R10, R11);
+}
+
+// Loads the two operands of a binary instruction into RAX and RCX and their
+// numbers into XMM0 and XMM1, exiting to run() unless both are numbers.
+static void emitBinaryOperands(Assembler* as, int offset)
+{
+	emitLoad(as, RAX, REG_SP, -16);
+	emitLoad(as, RCX, REG_SP, -8);
+	emitMoveImmediate(as, R11, QNAN);
+	emitTestNotNumber(as, RAX);
+	emitExitIf(as, CC_E, offset);
+	emitTestNotNumber(as, RCX);
+	emitExitIf(as, CC_E, offset);
+	emitToXmm(as, XMM0, RAX);
+	emitToXmm(as, XMM1, RCX);
+}
+
+// Replaces the two operands with the value in RAX.
+static void emitBinaryResult(Assembler* as)
+{
+	emitStore(as, REG_SP, -16, RAX);
+	emitAluImmediate(as, ALU_SUB, REG_SP, 8);
+}
+
+// Turns the byte in AL into a boolean Value in RAX.
+static void emitBoolean(Assembler* as)
+{
+	emitZeroExtendByte(as, RAX, RAX);
+	emitMoveImmediate(as, RCX, FALSE_VAL);
+	emitAlu(as, ALU_OR, RAX, RCX);
+}
+
+static void emitArithmetic(Assembler* as, SseOp op, int offset)
+{
+	emitBinaryOperands(as, offset);
+	emitSse(as, op, XMM0, XMM1);
+	emitFromXmm(as, RAX, XMM0);
+	emitBinaryResult(as);
+}
+
+// Replaces a and b with a > b or a >= b; swapped compares them the other way
+// round, for a < b and a <= b.
+static void emitComparison(Assembler* as, Condition condition, bool swapped, int offset)
+{
+	emitBinaryOperands(as, offset);
+	if (swapped) emitCompareDoubles(as, XMM1, XMM0);
+	else emitCompareDoubles(as, XMM0, XMM1);
+
+	emitSetCondition(as, condition, RAX);
+	emitBoolean(as);
+	emitBinaryResult(as);
+}
+
+// Numbers compare by value and everything else by its bits, as in
+// valueEquals().
+static void emitEquality(Assembler* as, bool negate)
+{
+	emitLoad(as, RAX, REG_SP, -16);
+	emitLoad(as, RCX, REG_SP, -8);
+	emitMoveImmediate(as, R11, QNAN);
+	emitTestNotNumber(as, RAX);
+	int first = emitJumpIf(as, CC_E);
+	emitTestNotNumber(as, RCX);
+	int second = emitJumpIf(as, CC_E);
+
+	emitToXmm(as, XMM0, RAX);
+	emitToXmm(as, XMM1, RCX);
+	emitCompareDoubles(as, XMM0, XMM1);
+	emitSetCondition(as, CC_E, RAX);
+	emitSetCondition(as, CC_NP, RDX);
+	emitAluByte(as, ALU_AND, RAX, RDX);
+	int done = emitJump(as);
+
+	patchHere(as, first);
+	patchHere(as, second);
+	emitAlu(as, ALU_CMP, RAX, RCX);
+	emitSetCondition(as, CC_E, RAX);
+
+	patchHere(as, done);
+	if (negate)
+	{
+		// xor eax, 1
+		emitByte(as, 0x83);
+		emitModRM(as, 6, RAX);
+		emitByte(as, 1);
+	}
+
+	emitBoolean(as);
+	emitBinaryResult(as);
+}
+
+// Jumps to target if the value in RAX is null or false.
+static void emitJumpIfFalsey(Assembler* as, int target)
+{
+	emitMoveImmediate(as, RCX, NULL_VAL);
+	emitAlu(as, ALU_CMP, RAX, RCX);
+	emitJumpToIf(as, CC_E, target);
+	emitMoveImmediate(as, RCX, FALSE_VAL);
+	emitAlu(as, ALU_CMP, RAX, RCX);
+	emitJumpToIf(as, CC_E, target);
+}
+
+// Pops both numbers of a fused comparison and jumps to target unless it
+// holds. Unordered operands jump, as every comparison with NaN is false.
+static void emitCompareJump(Assembler* as, bool less, int offset, int target)
+{
+	emitBinaryOperands(as, offset);
+	emitAluImmediate(as, ALU_SUB, REG_SP, 16);
+	if (less) emitCompareDoubles(as, XMM1, XMM0);
+	else emitCompareDoubles(as, XMM0, XMM1);
+
+	emitJumpToIf(as, CC_BE, target);
+}
+
+static void emitPushValue(Assembler* as, Register reg)
+{
+	emitStore(as, REG_SP, 0, reg);
+	emitAluImmediate(as, ALU_ADD, REG_SP, 8);
+}
+
+// A backward jump checks for a minor collection, as SAFEPOINT() does.
+static void emitLoop(Assembler* as, int target)
+{
+#ifndef DEBUG_STRESS_GC
+	emitLoad(as, RAX, REG_VM, offsetof(VM, nurseryTop));
+	emitRex(as, true, RAX, REG_VM);
+	emitByte(as, 0x3B);
+	emitMemory(as, RAX, REG_VM, offsetof(VM, nurseryLimit));
+	int full = emitJumpIf(as, CC_A);
+
+	// cmp byte [vm.compactionPending], 0
+	emitRex(as, false, 0, REG_VM);
+	emitByte(as, 0x80);
+	emitMemory(as, 7, REG_VM, offsetof(VM, compactionPending));
+	emitByte(as, 0);
+	int pending = emitJumpIf(as, CC_NE);
+	emitJumpTo(as, target);
+
+	patchHere(as, full);
+	patchHere(as, pending);
+#endif
+	emitCallHelper(as, (void*)jitSafepoint, target);
+	emitJumpTo(as, target);
+}
+
+static uint16_t readShort(Chunk* chunk, int offset)
+{
+	return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// Emits the template for the instruction at offset, and returns the offset
+// of the next one.
+static int compileInstruction(Assembler* as, int offset)
+{
+	Chunk* chunk = as->chunk;
+	uint8_t* code = chunk->code;
+
+	switch (code[offset])
+	{
+	case OP_CONSTANT:
+	case OP_CONSTANT_LONG:
+	{
+		bool wide = code[offset] == OP_CONSTANT_LONG;
+		int constant = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		Value value = chunk->constants.values[constant];
+
+		// Objects can move, so only their slot in the constants is fixed.
+		if (IS_OBJ(value)) emitLoad(as, RAX, REG_CONSTANTS, constant * (int)sizeof(Value));
+		else emitMoveImmediate(as, RAX, value);
+
+		emitPushValue(as, RAX);
+		return offset + (wide ? 3 : 2);
+	}
+
+	case OP_NULL:
+	case OP_TRUE:
+	case OP_FALSE:
+		emitMoveImmediate(as, RAX, code[offset] == OP_NULL ? NULL_VAL : BOOL_VAL(code[offset] == OP_TRUE));
+		emitPushValue(as, RAX);
+		return offset + 1;
+
+	case OP_POP:
+		emitAluImmediate(as, ALU_SUB, REG_SP, 8);
+		return offset + 1;
+
+	case OP_GET_LOCAL:
+	case OP_GET_LOCAL_LONG:
+	{
+		bool wide = code[offset] == OP_GET_LOCAL_LONG;
+		int slot = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		emitLoad(as, RAX, REG_SLOTS, slot * (int)sizeof(Value));
+		emitPushValue(as, RAX);
+		return offset + (wide ? 3 : 2);
+	}
+
+	case OP_SET_LOCAL:
+	case OP_SET_LOCAL_LONG:
+	{
+		bool wide = code[offset] == OP_SET_LOCAL_LONG;
+		int slot = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		emitLoad(as, RAX, REG_SP, -8);
+		emitStore(as, REG_SLOTS, slot * (int)sizeof(Value), RAX);
+		return offset + (wide ? 3 : 2);
+	}
+
+	case OP_GET_LOCAL_GET_LOCAL:
+		// The second local may be the very slot the first push writes, as
+		// in `var a = x var b = a`, so it is only read after that store.
+		emitLoad(as, RAX, REG_SLOTS, code[offset + 1] * (int)sizeof(Value));
+		emitStore(as, REG_SP, 0, RAX);
+		emitLoad(as, RCX, REG_SLOTS, code[offset + 2] * (int)sizeof(Value));
+		emitStore(as, REG_SP, 8, RCX);
+		emitAluImmediate(as, ALU_ADD, REG_SP, 16);
+		return offset + 3;
+
+	case OP_SET_LOCAL_POP:
+		emitAluImmediate(as, ALU_SUB, REG_SP, 8);
+		emitLoad(as, RAX, REG_SP, 0);
+		emitStore(as, REG_SLOTS, code[offset + 1] * (int)sizeof(Value), RAX);
+		return offset + 2;
+
+	case OP_GET_UPVALUE:
+		emitLoad(as, RAX, REG_FRAME, offsetof(CallFrame, closure));
+		emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues));
+		emitLoad(as, RAX, RAX, code[offset + 1] * (int)sizeof(ObjUpvalue*));
+		emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+		emitLoad(as, RAX, RAX, 0);
+		emitPushValue(as, RAX);
+		return offset + 2;
+
+	case OP_SET_UPVALUE:
+		emitArgument(as, RSI, code[offset + 1]);
+		emitCallHelper(as, (void*)jitSetUpvalue, offset + 2);
+		return offset + 2;
+
+	case OP_CLOSE_UPVALUE:
+		emitCallHelper(as, (void*)jitCloseUpvalue, offset + 1);
+		return offset + 1;
+
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_DEFINE_GLOBAL_LONG:
+	case OP_GET_GLOBAL_LONG:
+	case OP_SET_GLOBAL_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_DEFINE_GLOBAL_LONG || op == OP_GET_GLOBAL_LONG || op == OP_SET_GLOBAL_LONG;
+		void* helper = op == OP_DEFINE_GLOBAL || op == OP_DEFINE_GLOBAL_LONG ? (void*)jitDefineGlobal :
+			op == OP_GET_GLOBAL || op == OP_GET_GLOBAL_LONG ? (void*)jitGetGlobal : (void*)jitSetGlobal;
+		emitArgument(as, RSI, wide ? readShort(chunk, offset + 1) : code[offset + 1]);
+		emitCallHelper(as, helper, offset + (wide ? 3 : 2));
+		return offset + (wide ? 3 : 2);
+	}
+
+	case OP_EQUAL:
+	case OP_EQUAL_NUM:
+		emitEquality(as, false);
+		return offset + 1;
+
+	case OP_NOT_EQUAL:
+	case OP_NOT_EQUAL_NUM:
+		emitEquality(as, true);
+		return offset + 1;
+
+	case OP_GREATER: emitComparison(as, CC_A, false, offset); return offset + 1;
+	case OP_GREATER_EQUAL: emitComparison(as, CC_AE, false, offset); return offset + 1;
+	case OP_LESS: emitComparison(as, CC_A, true, offset); return offset + 1;
+	case OP_LESS_EQUAL: emitComparison(as, CC_AE, true, offset); return offset + 1;
+
+	case OP_ADD:
+	case OP_ADD_NUM_NUM:
+	case OP_ADD_STR_STR:
+	{
+		emitLoad(as, RAX, REG_SP, -16);
+		emitLoad(as, RCX, REG_SP, -8);
+		emitMoveImmediate(as, R11, QNAN);
+		emitTestNotNumber(as, RAX);
+		int first = emitJumpIf(as, CC_E);
+		emitTestNotNumber(as, RCX);
+		int second = emitJumpIf(as, CC_E);
+
+		emitToXmm(as, XMM0, RAX);
+		emitToXmm(as, XMM1, RCX);
+		emitSse(as, SSE_ADD, XMM0, XMM1);
+		emitFromXmm(as, RAX, XMM0);
+		emitBinaryResult(as);
+		int done = emitJump(as);
+
+		// Concatenation.
+		patchHere(as, first);
+		patchHere(as, second);
+		emitCallHelper(as, (void*)jitAdd, offset + 1);
+		patchHere(as, done);
+		return offset + 1;
+	}
+
+	case OP_ADD_CONSTANT:
+	{
+		int constant = code[offset + 1];
+		emitLoad(as, RAX, REG_SP, -8);
+		emitMoveImmediate(as, R11, QNAN);
+		emitTestNotNumber(as, RAX);
+		int string = emitJumpIf(as, CC_E);
+
+		emitToXmm(as, XMM0, RAX);
+		emitMoveImmediate(as, RCX, chunk->constants.values[constant]);
+		emitToXmm(as, XMM1, RCX);
+		emitSse(as, SSE_ADD, XMM0, XMM1);
+		emitFromXmm(as, RAX, XMM0);
+		emitStore(as, REG_SP, -8, RAX);
+		int done = emitJump(as);
+
+		patchHere(as, string);
+		emitArgument(as, RSI, constant);
+		emitCallHelper(as, (void*)jitAddConstant, offset + 2);
+		patchHere(as, done);
+		return offset + 2;
+	}
+
+	case OP_SUBTRACT: emitArithmetic(as, SSE_SUB, offset); return offset + 1;
+	case OP_MULTIPLY: emitArithmetic(as, SSE_MUL, offset); return offset + 1;
+	case OP_DIVIDE: emitArithmetic(as, SSE_DIV, offset); return offset + 1;
+
+	case OP_MOD:
+		// On the operands truncated to int, as run() does.
+		emitBinaryOperands(as, offset);
+		emitSse(as, SSE_TO_INT, RAX, XMM0);
+		emitSse(as, SSE_TO_INT, RCX, XMM1);
+		emitByte(as, 0x99); // cdq
+		emitByte(as, 0xF7); // idiv ecx
+		emitModRM(as, 7, RCX);
+		emitSse(as, SSE_FROM_INT, XMM0, RDX);
+		emitFromXmm(as, RAX, XMM0);
+		emitBinaryResult(as);
+		return offset + 1;
+
+	case OP_NEGATE:
+		emitLoad(as, RAX, REG_SP, -8);
+		emitMoveImmediate(as, R11, QNAN);
+		emitTestNotNumber(as, RAX);
+		emitExitIf(as, CC_E, offset);
+		// btc rax, 63
+		emitRex(as, true, 0, RAX);
+		emitByte(as, 0x0F);
+		emitByte(as, 0xBA);
+		emitModRM(as, 7, RAX);
+		emitByte(as, 63);
+		emitStore(as, REG_SP, -8, RAX);
+		return offset + 1;
+
+	case OP_NOT:
+		emitLoad(as, RAX, REG_SP, -8);
+		emitMoveImmediate(as, RCX, NULL_VAL);
+		emitAlu(as, ALU_CMP, RAX, RCX);
+		emitSetCondition(as, CC_E, RDX);
+		emitMoveImmediate(as, RCX, FALSE_VAL);
+		emitAlu(as, ALU_CMP, RAX, RCX);
+		emitSetCondition(as, CC_E, RAX);
+		emitAluByte(as, ALU_OR, RAX, RDX);
+		emitBoolean(as);
+		emitStore(as, REG_SP, -8, RAX);
+		return offset + 1;
+
+	case OP_PRINT:
+	case OP_PRINTLN:
+		emitArgument(as, RSI, code[offset] == OP_PRINTLN);
+		emitCallHelper(as, (void*)jitPrint, offset + 1);
+		return offset + 1;
+
+	case OP_JUMP:
+		emitJumpTo(as, offset + 3 + readShort(chunk, offset + 1));
+		return offset + 3;
+
+	case OP_LOOP:
+		emitLoop(as, offset + 3 - readShort(chunk, offset + 1));
+		return offset + 3;
+
+	case OP_JUMP_IF_FALSE:
+		emitLoad(as, RAX, REG_SP, -8);
+		emitJumpIfFalsey(as, offset + 3 + readShort(chunk, offset + 1));
+		return offset + 3;
+
+	case OP_POP_JUMP_IF_FALSE:
+		emitAluImmediate(as, ALU_SUB, REG_SP, 8);
+		emitLoad(as, RAX, REG_SP, 0);
+		emitJumpIfFalsey(as, offset + 3 + readShort(chunk, offset + 1));
+		return offset + 3;
+
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE:
+		emitCompareJump(as, code[offset] == OP_LESS_JUMP_IF_FALSE, offset,
+			offset + 3 + readShort(chunk, offset + 1));
+		return offset + 3;
+
+	case OP_CALL:
+	case OP_TAIL_CALL:
+		emitArgument(as, RSI, code[offset + 1]);
+		emitCallHelper(as, code[offset] == OP_CALL ? (void*)jitCall : (void*)jitTailCall, offset + 2);
+		return offset + 2;
+
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+	case OP_INVOKE_LONG:
+	case OP_TAIL_INVOKE_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_INVOKE_LONG || op == OP_TAIL_INVOKE_LONG;
+		int operands = offset + (wide ? 3 : 2);
+		emitArgument(as, RSI, wide ? readShort(chunk, offset + 1) : code[offset + 1]);
+		emitArgument(as, RDX, code[operands]);
+		emitArgument(as, RCX, readShort(chunk, operands + 1));
+		emitCallHelper(as, op == OP_INVOKE || op == OP_INVOKE_LONG ? (void*)jitInvoke : (void*)jitTailInvoke,
+			operands + 3);
+		return operands + 3;
+	}
+
+	case OP_SUPER_INVOKE:
+	case OP_TAIL_SUPER_INVOKE:
+	case OP_SUPER_INVOKE_LONG:
+	case OP_TAIL_SUPER_INVOKE_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_SUPER_INVOKE_LONG || op == OP_TAIL_SUPER_INVOKE_LONG;
+		int operands = offset + (wide ? 3 : 2);
+		emitArgument(as, RSI, wide ? readShort(chunk, offset + 1) : code[offset + 1]);
+		emitArgument(as, RDX, code[operands]);
+		emitCallHelper(as, op == OP_SUPER_INVOKE || op == OP_SUPER_INVOKE_LONG ? (void*)jitSuperInvoke :
+			(void*)jitTailSuperInvoke, operands + 1);
+		return operands + 1;
+	}
+
+	case OP_CLOSURE:
+	case OP_CLOSURE_LONG:
+	{
+		bool wide = code[offset] == OP_CLOSURE_LONG;
+		int constant = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+		int next = offset + (wide ? 3 + 3 * function->upvalueCount : 2 + 2 * function->upvalueCount);
+		emitArgument(as, RSI, offset);
+		emitCallHelper(as, (void*)jitClosure, next);
+		return next;
+	}
+
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_PROPERTY_LONG:
+	case OP_SET_PROPERTY_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_GET_PROPERTY_LONG || op == OP_SET_PROPERTY_LONG;
+		int cache = offset + (wide ? 3 : 2);
+		emitArgument(as, RSI, wide ? readShort(chunk, offset + 1) : code[offset + 1]);
+		emitArgument(as, RDX, readShort(chunk, cache));
+		emitCallHelper(as, op == OP_GET_PROPERTY || op == OP_GET_PROPERTY_LONG ? (void*)jitGetProperty :
+			(void*)jitSetProperty, cache + 2);
+		return cache + 2;
+	}
+
+	case OP_STRUCT:
+	case OP_METHOD:
+	case OP_GET_SUPER:
+	case OP_STRUCT_LONG:
+	case OP_METHOD_LONG:
+	case OP_GET_SUPER_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_STRUCT_LONG || op == OP_METHOD_LONG || op == OP_GET_SUPER_LONG;
+		void* helper = op == OP_STRUCT || op == OP_STRUCT_LONG ? (void*)jitStruct :
+			op == OP_METHOD || op == OP_METHOD_LONG ? (void*)jitMethod : (void*)jitGetSuper;
+		emitArgument(as, RSI, wide ? readShort(chunk, offset + 1) : code[offset + 1]);
+		emitCallHelper(as, helper, offset + (wide ? 3 : 2));
+		return offset + (wide ? 3 : 2);
+	}
+
+	case OP_INHERIT:
+	case OP_LIST:
+	case OP_ADD_LIST:
+	case OP_INDEX_GET:
+	case OP_INDEX_SET:
+	{
+		void* helper = code[offset] == OP_INHERIT ? (void*)jitInherit :
+			code[offset] == OP_LIST ? (void*)jitList :
+			code[offset] == OP_ADD_LIST ? (void*)jitAddList :
+			code[offset] == OP_INDEX_GET ? (void*)jitIndexGet : (void*)jitIndexSet;
+		emitCallHelper(as, helper, offset + 1);
+		return offset + 1;
+	}
+
+	case OP_RETURN:
+		// run() finishes the script itself. cmp dword [vm.frameCount], 1
+		emitRex(as, false, 0, REG_VM);
+		emitByte(as, 0x83);
+		emitMemory(as, 7, REG_VM, offsetof(VM, frameCount));
+		emitByte(as, 1);
+		emitExitIf(as, CC_E, offset);
+		emitCallHelper(as, (void*)jitReturn, offset + 1);
+		return offset + 1;
+
+	default:
+		// Skipped by run() as well, one byte at a time.
+		emitExit(as, offset);
+		return offset + 1;
+	}
+}
+
+static void emitPrologue(Assembler* as)
+{
+	emitPush(as, RBX);
+	emitPush(as, R12);
+	emitPush(as, R13);
+	emitPush(as, R14);
+	emitPush(as, R15);
+
+	emitMove(as, REG_FRAME, RDI);
+	emitMoveImmediate(as, REG_VM, (uint64_t)(uintptr_t)&vm);
+	emitLoad(as, REG_SP, REG_VM, offsetof(VM, stackTop));
+	emitLoad(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+	emitLoad(as, RAX, REG_FRAME, offsetof(CallFrame, closure));
+	emitLoad(as, RAX, RAX, offsetof(ObjClosure, function));
+	emitLoad(as, REG_CONSTANTS, RAX, offsetof(ObjFunction, chunk.constants.values));
+
+	// jmp rsi
+	emitByte(as, 0xFF);
+	emitModRM(as, 4, RSI);
+
+	as->epilogue = as->count;
+	emitPop(as, R15);
+	emitPop(as, R14);
+	emitPop(as, R13);
+	emitPop(as, R12);
+	emitPop(as, RBX);
+	emitByte(as, 0xC3);
+}
+
+// One exit per instruction that can hand itself back to run().
+static void emitExits(Assembler* as)
+{
+	int stub = 0;
+	int stubOffset = -1;
+
+	for (int i = 0; i < as->exitCount; i++)
+	{
+		Fixup* exit = &as->exits[i];
+
+		if (exit->target != stubOffset)
+		{
+			stubOffset = exit->target;
+			stub = as->count;
+			emitStoreState(as, exit->target);
+			emitMoveImmediate(as, RAX, JIT_INTERPRET);
+			patch(as, emitJump(as), as->epilogue);
+		}
+
+		patch(as, exit->at, stub);
+	}
+}
+
+static void freeAssembler(Assembler* as)
+{
+	free(as->code);
+	free(as->jumps);
+	free(as->exits);
+}
+
+// Copies the assembled code into pages of its own, written, then made
+// executable, never both at once. Returns NULL if there are none to be had.
+static uint8_t* installCode(Assembler* as, size_t* size)
+{
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	*size = ((size_t)as->count + pageSize - 1) / pageSize * pageSize;
+	uint8_t* code = (uint8_t*)mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) return NULL;
+
+	memcpy(code, as->code, as->count);
+	mprotect(code, *size, PROT_READ | PROT_EXEC);
+	return code;
+}
+
+bool jitCompile(ObjFunction* function)
+{
+	if (jitBackend == JIT_STENCILS && jitCompileStencils(function)) return true;
+
+	Assembler as;
+	memset(&as, 0, sizeof(as));
+	as.chunk = &function->chunk;
+	as.entries = (uint32_t*)calloc(function->chunk.count, sizeof(uint32_t));
+	if (as.entries == NULL) exit(1);
+
+	emitPrologue(&as);
+
+	for (int offset = 0; offset < function->chunk.count;)
+	{
+		as.entries[offset] = (uint32_t)as.count;
+		offset = compileInstruction(&as, offset);
+	}
+
+	// Nothing falls off the end of a chunk; ud2 in case it did.
+	emitByte(&as, 0x0F);
+	emitByte(&as, 0x0B);
+
+	for (int i = 0; i < as.jumpCount; i++)
+	{
+		patch(&as, as.jumps[i].at, (int)as.entries[as.jumps[i].target]);
+	}
+
+	emitExits(&as);
+
+	size_t size;
+	uint8_t* code = installCode(&as, &size);
+	freeAssembler(&as);
+
+	if (code == NULL)
+	{
+		free(as.entries);
+		return false;
+	}
+
+	JitCode* jitCode = (JitCode*)malloc(sizeof(JitCode));
+	if (jitCode == NULL) exit(1);
+	jitCode->code = code;
+	jitCode->size = size;
+	jitCode->entries = as.entries;
+	jitCode->enter = (JitEntry)(uintptr_t)code;
+	function->jitCode = jitCode;
+	return true;
+}
+
+void jitFree(JitCode* jitCode)
+{
+	munmap(jitCode->code, jitCode->size);
+	free(jitCode->entries);
+	free(jitCode);
+}
+
+JitStatus jitExecute(CallFrame* frame)
+{
+	ObjFunction* function = frame->closure->function;
+	JitCode* jitCode = function->jitCode;
+	return jitCode->enter(frame, jitCode->code + jitCode->entries[frame->ip - function->chunk.code]);
+}
+
+// Traces. A recorded iteration of a loop becomes straight-line code that
+// runs it on the types it was recorded with, and leaves through an exit
+// wherever a branch goes the other way. Numbers the iteration pushes live
+// in XMM0 to XMM13, one register per stack position above the loop head's
+// height, and only reach their stack slots when the trace leaves; booleans
+// and null live in their slots and natives nowhere, as the guard that let
+// them in says which they are. Locals below the loop head and globals are
+// loaded from and stored to memory at every use, with their types checked
+// once before the loop: a trace writes back into them only what the
+// interpreter would have.
+
+#define TRACE_REGISTERS 14
+#define XMM_SCRATCH 14
+
+typedef struct
+{
+	int slot; // A local of the frame, or -1 for a global.
+	Value* global;
+	TraceType entryType; // What it held when the trace started, if guarded.
+	NativeFn native;
+	TraceType type; // What it holds now.
+	bool guarded; // Read before it was written.
+	bool written;
+} TraceVariable;
+
+// Where the interpreter picks up when a guard fails: the stack depth above
+// the loop head then, and which of those positions hold numbers.
+typedef struct
+{
+	uint8_t* ip;
+	int depth;
+	uint32_t numbers;
+} TraceExit;
+
+typedef struct
+{
+	Assembler as;
+	int base;
+	TraceType types[TRACE_REGISTERS];
+	NativeFn natives[TRACE_REGISTERS];
+	int depth;
+	TraceVariable* variables;
+	int variableCount;
+	int variableCapacity;
+	TraceExit* exits;
+	int traceExitCount;
+	int traceExitCapacity;
+	bool usesGlobals;
+	bool failed; // Something the trace cannot hand back to run().
+} TraceCompiler;
+
+static int32_t entryDisplacement(TraceCompiler* tc, int position)
+{
+	return (int32_t)sizeof(Value) * (tc->base + position);
+}
+
+static TraceVariable* findVariable(TraceCompiler* tc, int slot, Value* global)
+{
+	for (int i = 0; i < tc->variableCount; i++)
+	{
+		TraceVariable* variable = &tc->variables[i];
+		if (variable->slot == slot && variable->global == global) return variable;
+	}
+
+	if (tc->variableCount == tc->variableCapacity)
+	{
+		tc->variableCapacity = tc->variableCapacity < 8 ? 8 : tc->variableCapacity * 2;
+		tc->variables = (TraceVariable*)realloc(tc->variables, sizeof(TraceVariable) * tc->variableCapacity);
+		if (tc->variables == NULL) exit(1);
+	}
+
+	TraceVariable* variable = &tc->variables[tc->variableCount++];
+	memset(variable, 0, sizeof(TraceVariable));
+	variable->slot = slot;
+	variable->global = global;
+	if (global != NULL) tc->usesGlobals = true;
+	return variable;
+}
+
+// Points base and displacement at a variable; globals go through RDX.
+static void variableAddress(TraceCompiler* tc, TraceVariable* variable, Register* base, int32_t* displacement)
+{
+	if (variable->global == NULL)
+	{
+		*base = REG_SLOTS;
+		*displacement = (int32_t)sizeof(Value) * variable->slot;
+		return;
+	}
+
+	emitMoveImmediate(&tc->as, RDX, (uint64_t)(uintptr_t)variable->global);
+	*base = RDX;
+	*displacement = 0;
+}
+
+// Adds an exit to ip with what is on the stack now.
+static int addTraceExit(TraceCompiler* tc, uint8_t* ip)
+{
+	uint32_t numbers = 0;
+
+	for (int i = 0; i < tc->depth; i++)
+	{
+		if (tc->types[i] == TRACE_NUMBER) numbers |= 1u << i;
+		if (tc->types[i] == TRACE_NATIVE) tc->failed = true;
+	}
+
+	if (tc->traceExitCount == tc->traceExitCapacity)
+	{
+		tc->traceExitCapacity = tc->traceExitCapacity < 8 ? 8 : tc->traceExitCapacity * 2;
+		tc->exits = (TraceExit*)realloc(tc->exits, sizeof(TraceExit) * tc->traceExitCapacity);
+		if (tc->exits == NULL) exit(1);
+	}
+
+	TraceExit* traceExit = &tc->exits[tc->traceExitCount];
+	traceExit->ip = ip;
+	traceExit->depth = tc->depth;
+	traceExit->numbers = numbers;
+	return tc->traceExitCount++;
+}
+
+static void emitTraceExitIf(TraceCompiler* tc, Condition condition, int target)
+{
+	Assembler* as = &tc->as;
+	addFixup(&as->exits, &as->exitCount, &as->exitCapacity, emitJumpIf(as, condition), target);
+}
+
+// Pushes the constant value of type.
+static void emitTraceConstant(TraceCompiler* tc, TraceType type, Value value)
+{
+	Assembler* as = &tc->as;
+	int position = tc->depth;
+
+	if (type == TRACE_NUMBER)
+	{
+		emitMoveImmediate(as, RAX, (uint64_t)value);
+		emitToXmm(as, position, RAX);
+	}
+	else if (type != TRACE_NATIVE)
+	{
+		emitMoveImmediate(as, RAX, (uint64_t)value);
+		emitStore(as, REG_SLOTS, entryDisplacement(tc, position), RAX);
+	}
+}
+
+// Copies the stack position from to to.
+static void emitTraceCopy(TraceCompiler* tc, int to, int from)
+{
+	Assembler* as = &tc->as;
+	tc->types[to] = tc->types[from];
+	tc->natives[to] = tc->natives[from];
+
+	if (to == from) return;
+
+	if (tc->types[from] == TRACE_NUMBER)
+	{
+		emitPacked(as, PD_MOVE, to, from);
+	}
+	else if (tc->types[from] != TRACE_NATIVE)
+	{
+		emitLoad(as, RAX, REG_SLOTS, entryDisplacement(tc, from));
+		emitStore(as, REG_SLOTS, entryDisplacement(tc, to), RAX);
+	}
+}
+
+static bool compileTraceGet(TraceCompiler* tc, TraceStep* step)
+{
+	Assembler* as = &tc->as;
+	int position = tc->depth;
+
+	if (step->op == TRACE_GET_LOCAL && step->slot >= tc->base)
+	{
+		if (step->slot - tc->base >= tc->depth) return false;
+		emitTraceCopy(tc, position, step->slot - tc->base);
+		return true;
+	}
+
+	TraceVariable* variable = findVariable(tc, step->op == TRACE_GET_LOCAL ? step->slot : -1, step->global);
+
+	if (!variable->written && !variable->guarded)
+	{
+		variable->guarded = true;
+		variable->entryType = step->type;
+		variable->native = step->native;
+		variable->type = step->type;
+	}
+
+	tc->types[position] = step->type;
+	tc->natives[position] = step->native;
+
+	Register base;
+	int32_t displacement;
+
+	if (step->type == TRACE_NUMBER)
+	{
+		variableAddress(tc, variable, &base, &displacement);
+		emitLoadDouble(as, position, base, displacement);
+	}
+	else if (step->type != TRACE_NATIVE)
+	{
+		variableAddress(tc, variable, &base, &displacement);
+		emitLoad(as, RAX, base, displacement);
+		emitStore(as, REG_SLOTS, entryDisplacement(tc, position), RAX);
+	}
+
+	return true;
+}
+
+static bool compileTraceSet(TraceCompiler* tc, TraceStep* step)
+{
+	Assembler* as = &tc->as;
+	int top = tc->depth - 1;
+
+	if (step->op == TRACE_SET_LOCAL && step->slot >= tc->base)
+	{
+		if (step->slot - tc->base >= tc->depth) return false;
+		emitTraceCopy(tc, step->slot - tc->base, top);
+		return true;
+	}
+
+	// A native would have to be boxed again.
+	if (tc->types[top] == TRACE_NATIVE) return false;
+
+	TraceVariable* variable = findVariable(tc, step->op == TRACE_SET_LOCAL ? step->slot : -1, step->global);
+	variable->written = true;
+	variable->type = tc->types[top];
+
+	Register base;
+	int32_t displacement;
+
+	if (tc->types[top] == TRACE_NUMBER)
+	{
+		variableAddress(tc, variable, &base, &displacement);
+		emitStoreDouble(as, base, displacement, top);
+	}
+	else
+	{
+		emitLoad(as, RAX, REG_SLOTS, entryDisplacement(tc, top));
+		variableAddress(tc, variable, &base, &displacement);
+		emitStore(as, base, displacement, RAX);
+	}
+
+	return true;
+}
+
+// Compares the two numbers on top and returns the condition under which
+// the comparison holds; equality needs the parity flag as well.
+static Condition emitTraceCompare(TraceCompiler* tc, TraceOp op)
+{
+	Assembler* as = &tc->as;
+	int a = tc->depth - 2;
+	int b = tc->depth - 1;
+
+	switch (op)
+	{
+	case TRACE_GREATER: emitCompareDoubles(as, a, b); return CC_A;
+	case TRACE_GREATER_EQUAL: emitCompareDoubles(as, a, b); return CC_AE;
+	case TRACE_LESS: emitCompareDoubles(as, b, a); return CC_A;
+	case TRACE_LESS_EQUAL: emitCompareDoubles(as, b, a); return CC_AE;
+	case TRACE_EQUAL: emitCompareDoubles(as, a, b); return CC_E;
+	default: emitCompareDoubles(as, a, b); return CC_NE;
+	}
+}
+
+// A comparison followed by a branch that pops it: jumps straight to the
+// exit unless it comes out as recorded.
+static void compileTraceCompareGuard(TraceCompiler* tc, TraceOp op, TraceStep* guard)
+{
+	Assembler* as = &tc->as;
+	Condition holds = emitTraceCompare(tc, op);
+	tc->depth -= 2;
+
+	if (holds == CC_A || holds == CC_AE)
+	{
+		// Unordered operands set CF, so neither holds for NaN.
+		Condition fails = holds == CC_A ? CC_BE : CC_B;
+		emitTraceExitIf(tc, guard->truthy ? fails : holds, addTraceExit(tc, guard->exit));
+		return;
+	}
+
+	// Whether the operands were equal, which they are when ZF is set and
+	// PF, set for NaN, is not.
+	bool equal = (holds == CC_E) == guard->truthy;
+
+	int target = addTraceExit(tc, guard->exit);
+
+	if (equal)
+	{
+		emitTraceExitIf(tc, CC_NE, target);
+		emitTraceExitIf(tc, CC_P, target);
+	}
+	else
+	{
+		int unordered = emitJumpIf(as, CC_P);
+		emitTraceExitIf(tc, CC_E, target);
+		patchHere(as, unordered);
+	}
+}
+
+// A comparison whose result is pushed as a boolean.
+static void compileTraceComparison(TraceCompiler* tc, TraceOp op)
+{
+	Assembler* as = &tc->as;
+	Condition holds = emitTraceCompare(tc, op);
+
+	if (holds == CC_E || holds == CC_NE)
+	{
+		emitSetCondition(as, holds, RAX);
+		emitSetCondition(as, holds == CC_E ? CC_NP : CC_P, RCX);
+		emitAluByte(as, holds == CC_E ? ALU_AND : ALU_OR, RAX, RCX);
+	}
+	else
+	{
+		emitSetCondition(as, holds, RAX);
+	}
+
+	emitBoolean(as);
+	tc->depth--;
+	tc->types[tc->depth - 1] = TRACE_BOOL;
+	emitStore(as, REG_SLOTS, entryDisplacement(tc, tc->depth - 1), RAX);
+}
+
+static void compileTraceGuard(TraceCompiler* tc, TraceStep* step)
+{
+	Assembler* as = &tc->as;
+	int top = tc->depth - 1;
+	TraceType type = tc->types[top];
+
+	if (step->pop) tc->depth--;
+
+	// Anything but a boolean is as truthy as when it was recorded.
+	if (type != TRACE_BOOL) return;
+
+	emitLoad(as, RAX, REG_SLOTS, entryDisplacement(tc, top));
+	emitMoveImmediate(as, RCX, FALSE_VAL);
+	emitAlu(as, ALU_CMP, RAX, RCX);
+	emitTraceExitIf(tc, step->truthy ? CC_E : CC_NE, addTraceExit(tc, step->exit));
+}
+
+static void compileTraceNot(TraceCompiler* tc)
+{
+	Assembler* as = &tc->as;
+	int top = tc->depth - 1;
+
+	if (tc->types[top] == TRACE_BOOL)
+	{
+		emitLoad(as, RAX, REG_SLOTS, entryDisplacement(tc, top));
+		emitAluImmediate(as, ALU_XOR, RAX, 1);
+	}
+	else
+	{
+		emitMoveImmediate(as, RAX, tc->types[top] == TRACE_NULL ? TRUE_VAL : FALSE_VAL);
+	}
+
+	tc->types[top] = TRACE_BOOL;
+	emitStore(as, REG_SLOTS, entryDisplacement(tc, top), RAX);
+}
+
+// Calls a math function on the number on top, in place of its native.
+static void compileTraceCall(TraceCompiler* tc, TraceStep* step)
+{
+	Assembler* as = &tc->as;
+	int callee = tc->depth - 2;
+	int argument = tc->depth - 1;
+
+	if (step->math == sqrt)
+	{
+		emitSse(as, SSE_SQRT, callee, argument);
+	}
+	else
+	{
+		// Every XMM register belongs to the caller.
+		for (int i = 0; i < callee; i++)
+		{
+			if (tc->types[i] == TRACE_NUMBER) emitStoreDouble(as, REG_SLOTS, entryDisplacement(tc, i), i);
+		}
+
+		emitPacked(as, PD_MOVE, XMM0, argument);
+		emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)step->math);
+		emitByte(as, 0xFF);
+		emitModRM(as, 2, RAX);
+		if (callee != XMM0) emitPacked(as, PD_MOVE, callee, XMM0);
+
+		for (int i = 0; i < callee; i++)
+		{
+			if (tc->types[i] == TRACE_NUMBER) emitLoadDouble(as, i, REG_SLOTS, entryDisplacement(tc, i));
+		}
+	}
+
+	tc->types[callee] = TRACE_NUMBER;
+	tc->depth--;
+}
+
+static bool compileTraceStep(TraceCompiler* tc, TraceStep* step, TraceStep* next, bool* fused)
+{
+	Assembler* as = &tc->as;
+	int top = tc->depth - 1;
+
+	switch (step->op)
+	{
+	case TRACE_CONSTANT:
+	case TRACE_GET_LOCAL:
+	case TRACE_GET_GLOBAL:
+		if (tc->depth == TRACE_REGISTERS) return false;
+
+		if (step->op == TRACE_CONSTANT)
+		{
+			tc->types[tc->depth] = step->type;
+			tc->natives[tc->depth] = step->native;
+			emitTraceConstant(tc, step->type, step->value);
+		}
+		else if (!compileTraceGet(tc, step))
+		{
+			return false;
+		}
+
+		tc->depth++;
+		return true;
+
+	case TRACE_SET_LOCAL:
+	case TRACE_SET_GLOBAL:
+		return compileTraceSet(tc, step);
+
+	case TRACE_POP:
+		tc->depth--;
+		return true;
+
+	case TRACE_ADD:
+	case TRACE_SUBTRACT:
+	case TRACE_MULTIPLY:
+	case TRACE_DIVIDE:
+	{
+		SseOp op = step->op == TRACE_ADD ? SSE_ADD : step->op == TRACE_SUBTRACT ? SSE_SUB :
+			step->op == TRACE_MULTIPLY ? SSE_MUL : SSE_DIV;
+		emitSse(as, op, top - 1, top);
+		tc->depth--;
+		return true;
+	}
+
+	case TRACE_MOD:
+		// On the operands truncated to int, as run() does.
+		emitSse(as, SSE_TO_INT, RAX, top - 1);
+		emitSse(as, SSE_TO_INT, RCX, top);
+		emitByte(as, 0x99); // cdq
+		emitByte(as, 0xF7); // idiv ecx
+		emitModRM(as, 7, RCX);
+		emitSse(as, SSE_FROM_INT, top - 1, RDX);
+		tc->depth--;
+		return true;
+
+	case TRACE_NEGATE:
+		emitMoveImmediate(as, RAX, SIGN_BIT);
+		emitToXmm(as, XMM_SCRATCH, RAX);
+		emitPacked(as, PD_XOR, top, XMM_SCRATCH);
+		return true;
+
+	case TRACE_NOT:
+		if (tc->types[top] == TRACE_NATIVE) return false;
+		compileTraceNot(tc);
+		return true;
+
+	case TRACE_EQUAL:
+	case TRACE_NOT_EQUAL:
+	case TRACE_GREATER:
+	case TRACE_GREATER_EQUAL:
+	case TRACE_LESS:
+	case TRACE_LESS_EQUAL:
+		// Only numbers get this far for the orderings.
+		if (tc->types[top] != TRACE_NUMBER || tc->types[top - 1] != TRACE_NUMBER) return false;
+
+		if (next != NULL && next->op == TRACE_GUARD && next->pop)
+		{
+			compileTraceCompareGuard(tc, step->op, next);
+			*fused = true;
+		}
+		else
+		{
+			compileTraceComparison(tc, step->op);
+		}
+
+		return true;
+
+	case TRACE_GUARD:
+		compileTraceGuard(tc, step);
+		return true;
+
+	case TRACE_CALL:
+		compileTraceCall(tc, step);
+		return true;
+
+	case TRACE_LOOP:
+		return tc->depth == 0;
+	}
+
+	return false;
+}
+
+// Checks the types of the variables the trace reads before writing,
+// leaving through target, the exit at the loop head, where one differs.
+static void emitTraceGuards(TraceCompiler* tc, int target)
+{
+	Assembler* as = &tc->as;
+	emitMoveImmediate(as, R11, QNAN);
+
+	for (int i = 0; i < tc->variableCount; i++)
+	{
+		TraceVariable* variable = &tc->variables[i];
+		if (!variable->guarded) continue;
+
+		Register base;
+		int32_t displacement;
+		variableAddress(tc, variable, &base, &displacement);
+		emitLoad(as, RAX, base, displacement);
+
+		switch (variable->entryType)
+		{
+		case TRACE_NUMBER:
+			emitTestNotNumber(as, RAX);
+			emitTraceExitIf(tc, CC_E, target);
+			break;
+
+		case TRACE_BOOL:
+		case TRACE_NULL:
+			if (variable->entryType == TRACE_BOOL) emitAluImmediate(as, ALU_OR, RAX, 1);
+			emitMoveImmediate(as, RCX, variable->entryType == TRACE_BOOL ? TRUE_VAL : NULL_VAL);
+			emitAlu(as, ALU_CMP, RAX, RCX);
+			emitTraceExitIf(tc, CC_NE, target);
+			break;
+
+		case TRACE_NATIVE:
+			// An object, a native, and the same one.
+			emitMove(as, R10, RAX);
+			emitMoveImmediate(as, RCX, QNAN | SIGN_BIT);
+			emitAlu(as, ALU_AND, R10, RCX);
+			emitAlu(as, ALU_CMP, R10, RCX);
+			emitTraceExitIf(tc, CC_NE, target);
+			emitMoveImmediate(as, RCX, ~(QNAN | SIGN_BIT));
+			emitAlu(as, ALU_AND, RAX, RCX);
+			emitByte(as, 0x83); // cmp dword [rax + type], OBJ_NATIVE
+			emitMemory(as, 7, RAX, offsetof(Obj, type));
+			emitByte(as, OBJ_NATIVE);
+			emitTraceExitIf(tc, CC_NE, target);
+			emitLoad(as, RAX, RAX, offsetof(ObjNative, function));
+			emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)variable->native);
+			emitAlu(as, ALU_CMP, RAX, RCX);
+			emitTraceExitIf(tc, CC_NE, target);
+			break;
+		}
+	}
+}
+
+// Spills the numbers an exit has on the stack and hands run() the state.
+static void emitTraceExits(TraceCompiler* tc, int epilogue)
+{
+	Assembler* as = &tc->as;
+	int* stubs = (int*)malloc(sizeof(int) * tc->traceExitCount);
+	if (stubs == NULL) exit(1);
+
+	for (int i = 0; i < tc->traceExitCount; i++)
+	{
+		TraceExit* traceExit = &tc->exits[i];
+		stubs[i] = as->count;
+
+		for (int position = 0; position < traceExit->depth; position++)
+		{
+			if (traceExit->numbers & (1u << position))
+			{
+				emitStoreDouble(as, REG_SLOTS, entryDisplacement(tc, position), position);
+			}
+		}
+
+		emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)traceExit->ip);
+		emitStore(as, REG_FRAME, offsetof(CallFrame, ip), RAX);
+		emitMove(as, RAX, REG_SLOTS);
+		emitAluImmediate(as, ALU_ADD, RAX, entryDisplacement(tc, traceExit->depth));
+		emitStore(as, REG_VM, offsetof(VM, stackTop), RAX);
+		emitMoveImmediate(as, RAX, JIT_INTERPRET);
+		patch(as, emitJump(as), epilogue);
+	}
+
+	for (int i = 0; i < as->exitCount; i++) patch(as, as->exits[i].at, stubs[as->exits[i].target]);
+	free(stubs);
+}
+
+bool jitCompileTrace(TraceRecording* recording, Trace* trace)
+{
+	TraceCompiler tc;
+	memset(&tc, 0, sizeof(tc));
+	tc.base = recording->base;
+	Assembler* as = &tc.as;
+
+	int headExit = addTraceExit(&tc, recording->start);
+
+	emitPush(as, R12);
+	emitPush(as, R13);
+	emitPush(as, R15);
+	emitMove(as, REG_FRAME, RDI);
+	emitMoveImmediate(as, REG_VM, (uint64_t)(uintptr_t)&vm);
+	emitLoad(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+	int toGuards = emitJump(as);
+
+	int epilogue = as->count;
+	emitPop(as, R15);
+	emitPop(as, R13);
+	emitPop(as, R12);
+	emitByte(as, 0xC3);
+
+	int body = as->count;
+	bool compiled = true;
+	int toLoop = -1;
+
+	for (int i = 0; compiled && i < recording->count; i++)
+	{
+		TraceStep* step = &recording->steps[i];
+		TraceStep* next = i + 1 < recording->count ? &recording->steps[i + 1] : NULL;
+		bool fused = false;
+
+		compiled = compileTraceStep(&tc, step, next, &fused);
+		if (fused) i++;
+
+		if (compiled && step->op == TRACE_LOOP)
+		{
+			// Straight back into the body while every variable still has the
+			// type it was checked for.
+			bool stable = true;
+
+			for (int j = 0; j < tc.variableCount; j++)
+			{
+				TraceVariable* variable = &tc.variables[j];
+				if (variable->guarded && variable->type != variable->entryType) stable = false;
+			}
+
+			if (stable) patch(as, emitJump(as), body);
+			else toLoop = emitJump(as);
+		}
+	}
+
+	compiled = compiled && !tc.failed;
+
+	if (compiled)
+	{
+		patchHere(as, toGuards);
+		if (toLoop != -1) patchHere(as, toLoop);
+		emitTraceGuards(&tc, headExit);
+		patch(as, emitJump(as), body);
+		emitTraceExits(&tc, epilogue);
+
+		size_t size;
+		trace->code = installCode(as, &size);
+		trace->size = size;
+		trace->globals = tc.usesGlobals ? recording->globals : NULL;
+		compiled = trace->code != NULL;
+	}
+
+	freeAssembler(as);
+	free(tc.variables);
+	free(tc.exits);
+	return compiled;
+}
+
+void jitFreeTraces(Trace* trace)
+{
+	while (trace != NULL)
+	{
+		Trace* next = trace->next;
+		if (trace->code != NULL) munmap(trace->code, trace->size);
+		free(trace);
+		trace = next;
+	}
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef luna_jit_h
+#define luna_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+
+// Calls and loop iterations a function runs in the interpreter before it is
+// compiled. --jit-threshold overrides it; 0 never compiles.
+#define JIT_THRESHOLD 1000
+
+// How compiled code hands control back to run(), and how the runtime
+// helpers it calls tell it whether to go on.
+typedef enum
+{
+	JIT_OK, // Only from helpers: carry on in compiled code.
+	JIT_FRAME, // A call changed the frame on top.
+	JIT_RETURN, // The frame on top returned.
+	JIT_INTERPRET, // The interpreter runs the instruction at frame->ip.
+	JIT_ERROR, // A runtime error has been reported.
+} JitStatus;
+
+// How a function is compiled: from hand-written templates in jit.c, or by
+// copying and patching stencils, the code of C functions, in stencil.c.
+// With traces no function is compiled; hot loops are, one recorded
+// iteration at a time (see trace.c).
+typedef enum
+{
+	JIT_TEMPLATES,
+	JIT_STENCILS,
+	JIT_TRACES,
+} JitBackend;
+
+// Runs compiled code from target, the code of the instruction at frame->ip.
+typedef JitStatus (*JitEntry)(CallFrame* frame, uint8_t* target);
+
+// Machine code for one function. entries maps each bytecode offset that
+// starts an instruction to the offset of its code, so that compiled code
+// can be entered wherever the interpreter stands; 0 means no entry.
+struct JitCode
+{
+	uint8_t* code;
+	size_t size;
+	uint32_t* entries;
+	JitEntry enter;
+};
+
+extern int jitThreshold;
+extern JitBackend jitBackend;
+
+bool jitCompile(ObjFunction* function);
+
+// Returns false, leaving the function to the templates, where the stencils
+// were compiled in a way that keeps them from being copied.
+bool jitCompileStencils(ObjFunction* function);
+void jitFree(JitCode* jitCode);
+
+// Runs the compiled code of the frame on top from frame->ip, which must have
+// an entry. On return ip, the stack top and the frames are all the
+// interpreter needs.
+JitStatus jitExecute(CallFrame* frame);
+
+static inline bool jitHasEntry(ObjFunction* function, uint8_t* ip)
+{
+	return function->jitCode != NULL && function->jitCode->entries[ip - function->chunk.code] != 0;
+}
+
+// Counts a call or loop iteration, compiling the function once it is hot. A
+// function that failed to compile starts counting again.
+static inline void jitWarmUp(ObjFunction* function)
+{
+	if (jitBackend == JIT_TRACES) return;
+	if (function->hotness < jitThreshold && ++function->hotness == jitThreshold &&
+		!jitCompile(function))
+	{
+		function->hotness = 0;
+	}
+}
+
+// The types a trace knows its values by. Natives are told apart by their C
+// function, as they may move.
+typedef enum
+{
+	TRACE_NUMBER,
+	TRACE_BOOL,
+	TRACE_NULL,
+	TRACE_NATIVE,
+} TraceType;
+
+// What a recorded iteration did, instruction by instruction, on the types
+// the recorder saw. Operands below the loop head's stack height are locals,
+// those above it live on the stack.
+typedef enum
+{
+	TRACE_CONSTANT,
+	TRACE_GET_LOCAL,
+	TRACE_SET_LOCAL,
+	TRACE_GET_GLOBAL,
+	TRACE_SET_GLOBAL,
+	TRACE_POP,
+	TRACE_ADD,
+	TRACE_SUBTRACT,
+	TRACE_MULTIPLY,
+	TRACE_DIVIDE,
+	TRACE_MOD,
+	TRACE_NEGATE,
+	TRACE_NOT,
+	TRACE_EQUAL,
+	TRACE_NOT_EQUAL,
+	TRACE_GREATER,
+	TRACE_GREATER_EQUAL,
+	TRACE_LESS,
+	TRACE_LESS_EQUAL,
+	TRACE_GUARD, // A branch: leaves the trace unless it goes the same way.
+	TRACE_CALL, // A math native on one number.
+	TRACE_LOOP,
+} TraceOp;
+
+typedef struct
+{
+	TraceOp op;
+	TraceType type; // Of what a constant or get pushed.
+	NativeFn native; // For TRACE_NATIVE values.
+	Value value; // TRACE_CONSTANT
+	int slot; // TRACE_GET_LOCAL, TRACE_SET_LOCAL
+	Value* global; // The value in vm.globals' entry.
+	double (*math)(double); // TRACE_CALL
+	// TRACE_GUARD: whether the value was truthy, whether the branch pops it,
+	// and where the interpreter carries on when it is not.
+	bool truthy;
+	bool pop;
+	uint8_t* exit;
+} TraceStep;
+
+typedef struct
+{
+	uint8_t* start; // The loop head, where the backward jump lands.
+	int base; // Stack height there, from frame->slots.
+	Entry* globals; // vm.globals' entries, which the steps point into.
+	TraceStep* steps;
+	int count;
+	int capacity;
+} TraceRecording;
+
+// Machine code for a loop of some function, or none if it cannot be
+// traced. It runs until a guard fails, and returns JIT_INTERPRET with
+// frame->ip and vm.stackTop where the interpreter picks up.
+struct Trace
+{
+	uint8_t* start;
+	uint8_t* code;
+	size_t size;
+	Entry* globals; // The entries it points into, if it uses globals.
+	struct Trace* next;
+};
+
+typedef JitStatus (*TraceEntry)(CallFrame* frame);
+
+bool jitCompileTrace(TraceRecording* recording, Trace* trace);
+void jitFreeTraces(Trace* trace);
+
+// At a backward jump in run(), once frame->ip is the loop head: runs the
+// loop's trace, or counts towards recording one. Either may move frame->ip
+// and vm.stackTop on.
+void jitTraceLoop(CallFrame* frame);
+
+// Runtime helpers, in vm.c. Compiled code stores frame->ip, pointing past
+// the instruction, and vm.stackTop before calling one, and reloads the stack
+// top, which may have moved, after. Operands come decoded.
+JitStatus jitAdd(CallFrame* frame);
+JitStatus jitAddConstant(CallFrame* frame, int constant);
+JitStatus jitDefineGlobal(CallFrame* frame, int constant);
+JitStatus jitGetGlobal(CallFrame* frame, int constant);
+JitStatus jitSetGlobal(CallFrame* frame, int constant);
+JitStatus jitSetUpvalue(CallFrame* frame, int slot);
+JitStatus jitCloseUpvalue(CallFrame* frame);
+JitStatus jitClosure(CallFrame* frame, int offset);
+JitStatus jitGetProperty(CallFrame* frame, int constant, int cache);
+JitStatus jitSetProperty(CallFrame* frame, int constant, int cache);
+JitStatus jitPrint(CallFrame* frame, bool newline);
+JitStatus jitStruct(CallFrame* frame, int constant);
+JitStatus jitInherit(CallFrame* frame);
+JitStatus jitMethod(CallFrame* frame, int constant);
+JitStatus jitGetSuper(CallFrame* frame, int constant);
+JitStatus jitList(CallFrame* frame);
+JitStatus jitAddList(CallFrame* frame);
+JitStatus jitIndexGet(CallFrame* frame);
+JitStatus jitIndexSet(CallFrame* frame);
+JitStatus jitCall(CallFrame* frame, int argCount);
+JitStatus jitTailCall(CallFrame* frame, int argCount);
+JitStatus jitInvoke(CallFrame* frame, int constant, int argCount, int cache);
+JitStatus jitSuperInvoke(CallFrame* frame, int constant, int argCount);
+JitStatus jitTailInvoke(CallFrame* frame, int constant, int argCount, int cache);
+JitStatus jitTailSuperInvoke(CallFrame* frame, int constant, int argCount);
+JitStatus jitReturn(CallFrame* frame);
+JitStatus jitSafepoint(CallFrame* frame);
+
+#endif
+
+#endif
@@ -3,134 +3,1445 @@
 #include "vm.h"
 #include <stdlib.h>
 
-#include <time.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include "debug.h"
+#include "lthread.h"
+#include "jit.h"
 
-typedef enum {
-    GC_MARK_PHASE,
-    GC_SWEEP_PHASE,
-    GC_IDLE_PHASE
-} GCPhase;
+// Heap sizing. When a cycle ends the policy sets the next trigger from the
+// live heap: GC_POLICY_FIXED multiplies it by growFactor, GC_POLICY_ADAPTIVE
+// leaves as much headroom as the measured allocation rate and cycle cost
+// allow for collection to take targetOverhead of the run time. The trigger
+// never drops below minHeap, and grows by GC_MIN_GROW to GC_MAX_GROW.
+#define GC_HEAP_GROW_FACTOR 1.5
+#define GC_TARGET_OVERHEAD 0.05
+#define GC_MIN_HEAP (1024 * 1024)
+#define GC_MIN_GROW 1.1
+#define GC_MAX_GROW 8.0
+#define GC_RATE_SMOOTHING 0.5
+
+// While a cycle is running the mutator may allocate GC_STEP_SIZE bytes between
+// two incremental steps, and each step scans or sweeps GC_STEP_MULTIPLIER times
+// that much heap, so the collector stays ahead of allocation.
+#define GC_STEP_SIZE (8 * 1024)
+#define GC_STEP_MULTIPLIER 4
+#define GC_STEP_BUDGET (GC_STEP_SIZE * GC_STEP_MULTIPLIER)
+
+// With a pause goal the step budget is instead what the measured mark rate
+// gets through in maxPauseMs, within these bounds.
+#define GC_STEP_BUDGET_MIN (4 * 1024)
+#define GC_STEP_BUDGET_MAX (64 * 1024 * 1024)
+
+// Young objects are bump-allocated in a fixed nursery. A minor collection
+// runs at the next interpreter safepoint once NURSERY_MINOR_GC_AT of it is in
+// use; if it fills up before that, allocation falls back to the old heap.
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MINOR_GC_AT 0.75
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+// Old objects are never malloc'd one by one. Every object type has a fixed
+// header size, so each is carved out of HEAP_PAGE_SIZE pages that hold slots
+// of a single size class, SIZE_CLASS_GRANULE bytes apart.
+#define HEAP_PAGE_SIZE (16 * 1024)
+#define SIZE_CLASS_GRANULE 16
+#define SIZE_CLASS_COUNT 16
+#define SIZE_CLASS_INDEX(size) (((size) + SIZE_CLASS_GRANULE - 1) / SIZE_CLASS_GRANULE - 1)
+#define HEAP_PAGE_MAX_SLOTS (HEAP_PAGE_SIZE / SIZE_CLASS_GRANULE)
+
+typedef struct HeapPage
+{
+    struct HeapPage* next;
+    // Pages of the same size class that still have free slots.
+    struct HeapPage* nextAvailable;
+    bool isAvailable;
+    int sizeClass;
+    int slotSize;
+    int slotCount;
+    int liveCount;
+    // Free slots are threaded through Obj.next.
+    Obj* freeList;
+    uint8_t used[HEAP_PAGE_MAX_SLOTS / 8];
+} HeapPage;
+
+#define HEAP_PAGE_HEADER \
+    ((sizeof(HeapPage) + SIZE_CLASS_GRANULE - 1) & ~(size_t)(SIZE_CLASS_GRANULE - 1))
+#define PAGE_SLOT(page, index) \
+    ((Obj*)((uint8_t*)(page) + HEAP_PAGE_HEADER + (size_t)(index) * (page)->slotSize))
+#define SLOT_USED(page, index) ((page)->used[(index) >> 3] & (1 << ((index) & 7)))
+
+// Sweeping is lazy: when a size class runs out of free slots during the
+// sweep phase, the allocator sweeps up to LAZY_SWEEP_PAGES of that class's
+// own unswept pages before it asks the system for a new page.
+#define LAZY_SWEEP_PAGES 8
+
+// With compaction on, a finished cycle schedules an evacuation of every page
+// less than COMPACT_MAX_OCCUPANCY full, in size classes that have at least
+// COMPACT_MIN_CLASS_PAGES such pages to merge, once there are
+// COMPACT_MIN_PAGES of them overall.
+#define COMPACT_MAX_OCCUPANCY 0.25
+#define COMPACT_MIN_CLASS_PAGES 2
+#define COMPACT_MIN_PAGES 4
+
+typedef struct
+{
+    HeapPage* pages;
+    HeapPage* available;
+    // Pages detached at the end of marking, waiting to be swept.
+    HeapPage* unswept;
+} SizeClass;
+
+static GCConfig gcConfig = {
+    GC_POLICY_ADAPTIVE, GC_HEAP_GROW_FACTOR, GC_TARGET_OVERHEAD, 0, GC_MIN_HEAP, false
+};
+
+// What the heap policy measured up to the end of the previous cycle.
+typedef struct
+{
+    uint64_t cycleEnd;
+    uint64_t gcTime;
+    uint64_t markTime;
+    uint64_t bytesMarked;
+    uint64_t bytesFreed;
+    size_t liveBytes;
+
+    // Smoothed over the last few cycles.
+    double allocationRate;
+    double cycleCost;
+    double markRate;
+
+    size_t stepBudget;
+} HeapPolicy;
+
+static HeapPolicy heapPolicy;
+
+static SizeClass sizeClasses[SIZE_CLASS_COUNT];
+static int unsweptPageCount = 0;
+
+// Promoted objects whose fields still have to be scanned by the running
+// minor collection.
+static Obj** promotedStack = NULL;
+static int promotedCount = 0;
+static int promotedCapacity = 0;
+
+#ifdef GC_PARALLEL_MARK
+// Once the gray stack holds PARALLEL_MARK_MIN_GRAY objects, tracing is split
+// across GC_MARK_THREADS markers, the calling thread being the first one.
+#define GC_MARK_THREADS 4
+#define PARALLEL_MARK_MIN_GRAY 256
+#define MARK_STEAL_MAX 64
+
+// Every marker owns a deque of gray objects. The owner pushes and pops at
+// the tail; a marker that runs dry steals half of another one's deque from
+// the head.
+typedef struct
+{
+    LunaMutex lock;
+    Obj** items;
+    int head;
+    int tail;
+    int capacity;
+    LunaThread thread;
+} MarkWorker;
+
+static MarkWorker markWorkers[GC_MARK_THREADS];
+static THREAD_LOCAL MarkWorker* currentMarker = NULL;
+
+static bool markersStarted = false;
+static bool markersQuit = false;
+static LunaMutex markerLock;
+static LunaCond markerWake;
+static LunaCond markerDone;
+static int markGeneration = 0;
+static int markersRunning = 0;
+
+static volatile long activeMarkers = 0;
+static volatile long long markedWork = 0;
+static long long markBudget = 0;
+#endif
+
+#ifdef GC_CONCURRENT_SWEEP
+// Pages detached by finishMark() are swept by a background thread while the
+// script keeps allocating into fresh pages. Finished pages are handed back
+// through sweptPages, under sweeperLock, together with the bytes they freed.
+static LunaThread sweeperThread;
+static LunaMutex sweeperLock;
+static LunaCond sweeperWake;
+static bool sweeperStarted = false;
+static bool sweeperQuit = false;
+static bool sweepRequested = false;
+static bool sweepFinished = true;
+static HeapPage* sweptPages[SIZE_CLASS_COUNT];
+static size_t sweptBytes = 0;
+
+// Frees made on the sweeper thread are counted here instead of in
+// vm.bytesAllocated, which belongs to the mutator.
+static THREAD_LOCAL bool onSweeperThread = false;
+static size_t sweeperFreedBytes = 0;
+static uint64_t sweeperFreedByType[GC_OBJ_TYPES];
+
+// Statistics of the handed-off pages, also under sweeperLock.
+static uint64_t sweptPageBytes = 0;
+static uint64_t sweptFreedByType[GC_OBJ_TYPES];
+#endif
+
+static void freeObject(Obj* object);
+static void compactHeap();
+
+#ifdef GC_CONCURRENT_SWEEP
+static void startSweeper();
+#endif
+
+static void collectIfNeeded()
+{
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#else
+    if (vm.bytesAllocated > vm.nextGC) {
+        collectGarbage();
+    }
+#endif
+}
+
+static void releaseBytes(size_t size)
+{
+#ifdef GC_CONCURRENT_SWEEP
+    if (onSweeperThread)
+    {
+        sweeperFreedBytes += size;
+        return;
+    }
+#endif
+
+    vm.bytesAllocated -= size;
+    vm.gcStats.bytesFreed += size;
+}
+
+static void countFreedObject(ObjType type)
+{
+#ifdef GC_CONCURRENT_SWEEP
+    if (onSweeperThread)
+    {
+        sweeperFreedByType[type]++;
+        return;
+    }
+#endif
+
+    vm.gcStats.freedByType[type]++;
+}
+
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize == 0) {
+        releaseBytes(oldSize);
+        free(pointer);
+        return NULL;
+    }
+
+    vm.bytesAllocated += newSize - oldSize;
+
+    if (newSize > oldSize) {
+#ifdef DEBUG_LOG_GC
+        printf("Allocating %zu bytes of memory.\n", newSize);
+#endif
+
+        collectIfNeeded();
+    }
+
+    void* result = realloc(pointer, newSize);
+    if (result == NULL) exit(1);
+
+    return result;
+}
+
+static size_t objectSize(Obj* object)
+{
+    switch (object->type)
+    {
+    case OBJ_STRING: return sizeof(ObjString);
+    case OBJ_FUNCTION: return sizeof(ObjFunction);
+    case OBJ_NATIVE: return sizeof(ObjNative);
+    case OBJ_CLOSURE: return sizeof(ObjClosure);
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    case OBJ_STRUCT: return sizeof(ObjStruct);
+    case OBJ_INSTANCE: return sizeof(ObjInstance) + sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_LIST: return sizeof(ObjList);
+    }
+
+    return sizeof(Obj);
+}
+
+// Stack, call frames and open upvalues change on every instruction without
+// going through the write barrier, so they are scanned both when a cycle
+// starts and again when marking ends.
+static void markMutatorRoots()
+{
+    for (Value* slot = vm.stack; slot < stackRootsEnd(); slot++)
+    {
+        markValue(*slot);
+    }
+
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        markObject((Obj*)vm.frames[i].closure);
+    }
+
+    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        markObject((Obj*)upvalue);
+    }
+
+    markCompilerRoots();
+}
+
+// Objects the previous cycle marked may still be sitting in the nursery;
+// they have to start the new cycle white like everything else.
+static void clearNurseryMarks()
+{
+    uint8_t* cursor = vm.nurseryStart;
+
+    while (cursor < vm.nurseryTop)
+    {
+        Obj* object = (Obj*)cursor;
+        object->isMarked = false;
+        cursor += NURSERY_ALIGN(objectSize(object));
+    }
+}
+
+static void markRoots()
+{
+    clearNurseryMarks();
+    markMutatorRoots();
+    markTable(&vm.globals);
+    markObject((Obj*)vm.initString);
+}
+
+static void markArray(ValueArray* array)
+{
+    for (int i = 0; i < array->count; i++)
+    {
+        markValue(array->values[i]);
+    }
+}
+
+// The keys of a struct's shapes belong to the struct.
+static size_t markShapeTree(Shape* shape)
+{
+    size_t work = sizeof(Shape) + sizeof(Shape*) * shape->transitionCapacity;
+    markObject((Obj*)shape->key);
+
+    for (int i = 0; i < shape->transitionCount; i++)
+    {
+        work += markShapeTree(shape->transitions[i]);
+    }
+
+    return work;
+}
+
+// Greys everything the object references and returns how many bytes were
+// scanned, which is what the incremental step budget is measured in.
+static size_t blanckenObject(Obj* object)
+{
+#ifdef DEBUG_LOG_GC
+	printf("%p blacken ", (void*)object);
+	printValue(OBJ_VAL(object));
+	printf("\n");
+#endif
+
+    size_t work = objectSize(object);
+
+    switch (object->type)
+    {
+    case OBJ_BOUND_METHOD:
+        {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            markValue(bound->receiver);
+            markObject((Obj*)bound->method);
+            break;
+        }
+    case OBJ_STRUCT:
+        {
+            ObjStruct* klass = (ObjStruct*)object;
+            markObject((Obj*)klass->name);
+            markTable(&klass->methods);
+            work += sizeof(Entry) * klass->methods.capacity;
+            work += markShapeTree(klass->shapes);
+            break;
+        }
+
+    case OBJ_INSTANCE:
+        {
+            ObjInstance* instance = (ObjInstance*)object;
+            markObject((Obj*)instance->klass);
+
+            if (instance->shape == NULL)
+            {
+                markTable(instance->dictionary);
+                work += sizeof(Entry) * instance->dictionary->capacity;
+                break;
+            }
+
+            for (int i = 0; i < instance->shape->slotCount; i++)
+            {
+                markValue(*instanceSlot(instance, i));
+            }
+            work += sizeof(Value) * instance->overflowCapacity;
+            break;
+        }
+
+    case OBJ_CLOSURE:
+        {
+            ObjClosure* closure = (ObjClosure*)object;
+            markObject((Obj*)closure->function);
+
+            for (int i = 0; i < closure->upvalueCount; i++)
+            {
+                markObject((Obj*)closure->upvalues[i]);
+            }
+            work += sizeof(ObjUpvalue*) * closure->upvalueCount;
+            break;
+        }
+
+    case OBJ_FUNCTION:
+        {
+            ObjFunction* function = (ObjFunction*)object;
+            markObject((Obj*)function->name);
+            markArray(&function->chunk.constants);
+            work += sizeof(Value) * function->chunk.constants.count;
+            break;
+        }
+
+    case OBJ_UPVALUE:
+        {
+            markValue(((ObjUpvalue*)object)->closed);
+            break;
+        }
+
+    case OBJ_STRING:
+        work += ((ObjString*)object)->length + 1;
+        break;
+
+    case OBJ_LIST:
+        {
+            ObjList* list = (ObjList*)object;
+
+            for (uint32_t i = 0; i < list->length; i++)
+            {
+                markValue(list->elements[i]);
+            }
+            work += sizeof(Value) * list->capacity;
+            break;
+        }
+
+    case OBJ_NATIVE:
+        break;
+    }
+
+    return work;
+}
+
+static void pushGray(Obj* object)
+{
+    if (vm.grayCapacity < vm.grayCount + 1)
+    {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+
+        if (vm.grayStack == NULL) exit(1);
+    }
+
+    vm.grayStack[vm.grayCount++] = object;
+}
+
+#ifdef GC_PARALLEL_MARK
+static void pushMarkWork(MarkWorker* worker, Obj* object)
+{
+    lockMutex(&worker->lock);
+
+    if (worker->tail == worker->capacity)
+    {
+        if (worker->head > 0)
+        {
+            memmove(worker->items, worker->items + worker->head,
+                sizeof(Obj*) * (worker->tail - worker->head));
+            worker->tail -= worker->head;
+            worker->head = 0;
+        }
+        else
+        {
+            worker->capacity = GROW_CAPACITY(worker->capacity);
+            worker->items = (Obj**)realloc(worker->items, sizeof(Obj*) * worker->capacity);
+
+            if (worker->items == NULL) exit(1);
+        }
+    }
+
+    worker->items[worker->tail++] = object;
+    unlockMutex(&worker->lock);
+}
+
+static Obj* popMarkWork(MarkWorker* worker)
+{
+    Obj* object = NULL;
+    lockMutex(&worker->lock);
+
+    if (worker->tail > worker->head) object = worker->items[--worker->tail];
+    if (worker->tail == worker->head) worker->head = worker->tail = 0;
+
+    unlockMutex(&worker->lock);
+    return object;
+}
+
+static bool stealMarkWork(MarkWorker* thief)
+{
+    int self = (int)(thief - markWorkers);
+
+    for (int i = 1; i < GC_MARK_THREADS; i++)
+    {
+        MarkWorker* victim = &markWorkers[(self + i) % GC_MARK_THREADS];
+        Obj* stolen[MARK_STEAL_MAX];
+
+        lockMutex(&victim->lock);
+        int count = (victim->tail - victim->head + 1) / 2;
+        if (count > MARK_STEAL_MAX) count = MARK_STEAL_MAX;
+
+        memcpy(stolen, victim->items + victim->head, sizeof(Obj*) * count);
+        victim->head += count;
+        unlockMutex(&victim->lock);
+
+        if (count == 0) continue;
+
+        for (int j = 0; j < count; j++)
+        {
+            pushMarkWork(thief, stolen[j]);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Traces until every deque is empty or the markers together have spent the
+// budget. A marker only leaves once no marker is busy, since a busy one may
+// still produce work to steal. Objects a marker has just stolen are briefly
+// not counted as busy, but the thief scans those itself before it leaves.
+static void runMarker(MarkWorker* worker)
+{
+    currentMarker = worker;
+
+    for (;;)
+    {
+        Obj* object;
+        while (atomicLoad(&markedWork) < markBudget && (object = popMarkWork(worker)) != NULL)
+        {
+            atomicAdd64(&markedWork, (long long)blanckenObject(object));
+        }
+
+        atomicDecrement(&activeMarkers);
+
+        for (;;)
+        {
+            if (atomicLoad(&activeMarkers) == 0 || atomicLoad(&markedWork) >= markBudget)
+            {
+                currentMarker = NULL;
+                return;
+            }
+
+            if (stealMarkWork(worker))
+            {
+                atomicIncrement(&activeMarkers);
+                break;
+            }
+
+            yieldThread();
+        }
+    }
+}
+
+static void markerThread(void* argument)
+{
+    MarkWorker* worker = (MarkWorker*)argument;
+    int generation = 0;
+
+    lockMutex(&markerLock);
+
+    for (;;)
+    {
+        while (markGeneration == generation && !markersQuit)
+        {
+            waitCond(&markerWake, &markerLock);
+        }
+
+        if (markersQuit) break;
+        generation = markGeneration;
+
+        unlockMutex(&markerLock);
+        runMarker(worker);
+        lockMutex(&markerLock);
+
+        if (--markersRunning == 0) broadcastCond(&markerDone);
+    }
+
+    unlockMutex(&markerLock);
+}
+
+static void startMarkers()
+{
+    initMutex(&markerLock);
+    initCond(&markerWake);
+    initCond(&markerDone);
+
+    for (int i = 0; i < GC_MARK_THREADS; i++)
+    {
+        MarkWorker* worker = &markWorkers[i];
+        initMutex(&worker->lock);
+        worker->items = NULL;
+        worker->head = worker->tail = worker->capacity = 0;
+
+        if (i > 0) startThread(&worker->thread, markerThread, worker);
+    }
+
+    markersStarted = true;
+}
+
+static void stopMarkers()
+{
+    if (!markersStarted) return;
+
+    lockMutex(&markerLock);
+    markersQuit = true;
+    broadcastCond(&markerWake);
+    unlockMutex(&markerLock);
+
+    for (int i = 0; i < GC_MARK_THREADS; i++)
+    {
+        MarkWorker* worker = &markWorkers[i];
+        if (i > 0) joinThread(worker->thread);
+
+        free(worker->items);
+        freeMutex(&worker->lock);
+    }
+
+    freeCond(&markerDone);
+    freeCond(&markerWake);
+    freeMutex(&markerLock);
+
+    markersStarted = false;
+    markersQuit = false;
+    markGeneration = 0;
+}
+
+// Deals the gray stack out to the markers and traces in parallel. Whatever
+// the budget leaves unscanned goes back on the gray stack for the next step.
+static bool traceParallel(size_t budget)
+{
+    if (!markersStarted) startMarkers();
+
+    for (int i = 0; i < vm.grayCount; i++)
+    {
+        pushMarkWork(&markWorkers[i % GC_MARK_THREADS], vm.grayStack[i]);
+    }
+    vm.grayCount = 0;
+
+    markedWork = 0;
+    markBudget = budget > (size_t)LLONG_MAX ? LLONG_MAX : (long long)budget;
+    activeMarkers = GC_MARK_THREADS;
+
+    lockMutex(&markerLock);
+    markersRunning = GC_MARK_THREADS - 1;
+    markGeneration++;
+    broadcastCond(&markerWake);
+    unlockMutex(&markerLock);
+
+    runMarker(&markWorkers[0]);
+
+    lockMutex(&markerLock);
+    while (markersRunning > 0)
+    {
+        waitCond(&markerDone, &markerLock);
+    }
+    unlockMutex(&markerLock);
+
+    vm.gcStats.bytesMarked += (uint64_t)markedWork;
+
+    for (int i = 0; i < GC_MARK_THREADS; i++)
+    {
+        MarkWorker* worker = &markWorkers[i];
+
+        for (int j = worker->head; j < worker->tail; j++)
+        {
+            pushGray(worker->items[j]);
+        }
+        worker->head = worker->tail = 0;
+    }
+
+    return vm.grayCount == 0;
+}
+#endif
+
+// Drains the gray stack until it is empty or the budget is spent. Returns
+// true once there is nothing gray left.
+static bool traceReferences(size_t budget)
+{
+    size_t work = 0;
+
+    while (vm.grayCount > 0)
+    {
+        if (work >= budget) break;
+
+#ifdef GC_PARALLEL_MARK
+        if (vm.grayCount >= PARALLEL_MARK_MIN_GRAY)
+        {
+            vm.gcStats.bytesMarked += work;
+            return traceParallel(budget - work);
+        }
+#endif
+
+        Obj* object = vm.grayStack[--vm.grayCount];
+        work += blanckenObject(object);
+    }
+
+    vm.gcStats.bytesMarked += work;
+    return vm.grayCount == 0;
+}
+
+// The atomic end of the mark phase. Heap stores are covered by writeBarrier(),
+// so only the mutator roots have to be scanned again before anything white is
+// treated as garbage.
+static void finishMark()
+{
+    markMutatorRoots();
+    traceReferences(SIZE_MAX);
+    tableRemoveWhite(&vm.strings);
+
+    // Remembered objects that turned out to be garbage are about to be freed
+    // by the sweeper, so the next minor collection must not visit them.
+    int kept = 0;
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        Obj* object = vm.rememberedSet[i];
+
+        if (object->isMarked)
+        {
+            vm.rememberedSet[kept++] = object;
+        }
+        else
+        {
+            object->isRemembered = false;
+        }
+    }
+    vm.rememberedCount = kept;
+
+    // Inline caches may hold methods the sweeper is about to free. Entries
+    // made from here on only see objects that survived marking.
+    invalidateInlineCaches();
+
+    // Every page goes to the sweeper and the free lists start over. Until a
+    // page is swept again, objects allocated from here on land in swept or
+    // fresh pages, so the sweeper never sees an object born after marking
+    // ended.
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        SizeClass* sizeClass = &sizeClasses[i];
+
+        while (sizeClass->pages != NULL)
+        {
+            HeapPage* page = sizeClass->pages;
+            sizeClass->pages = page->next;
+            page->next = sizeClass->unswept;
+            sizeClass->unswept = page;
+            unsweptPageCount++;
+        }
+
+        sizeClass->available = NULL;
+    }
+
+#ifdef GC_CONCURRENT_SWEEP
+    startSweeper();
+#endif
+}
+
+static void makeAvailable(SizeClass* sizeClass, HeapPage* page)
+{
+    if (page->isAvailable) return;
+
+    page->isAvailable = true;
+    page->nextAvailable = sizeClass->available;
+    sizeClass->available = page;
+}
+
+static void adoptPage(SizeClass* sizeClass, HeapPage* page)
+{
+    page->next = sizeClass->pages;
+    sizeClass->pages = page;
+    page->isAvailable = false;
+
+    if (page->freeList != NULL) makeAvailable(sizeClass, page);
+}
+
+// Frees the unmarked objects of a page and rebuilds its free list from the
+// slots they leave behind. Returns false if nothing on the page survived.
+static bool sweepSlots(HeapPage* page)
+{
+    page->freeList = NULL;
+    page->liveCount = 0;
+
+    for (int i = page->slotCount - 1; i >= 0; i--)
+    {
+        Obj* object = PAGE_SLOT(page, i);
+
+        if (SLOT_USED(page, i))
+        {
+            if (object->isMarked)
+            {
+                object->isMarked = false;
+                page->liveCount++;
+                continue;
+            }
+
+            freeObject(object);
+            page->used[i >> 3] &= ~(1 << (i & 7));
+        }
+
+        object->next = page->freeList;
+        page->freeList = object;
+    }
+
+    return page->liveCount > 0;
+}
+
+#ifndef GC_CONCURRENT_SWEEP
+// Sweeps the next unswept page of a size class. Empty pages go back to the
+// system; the rest return to their size class.
+static void sweepPage(SizeClass* sizeClass)
+{
+    HeapPage* page = sizeClass->unswept;
+    sizeClass->unswept = page->next;
+    unsweptPageCount--;
+    vm.gcStats.bytesSwept += HEAP_PAGE_SIZE;
+
+    if (sweepSlots(page))
+    {
+        adoptPage(sizeClass, page);
+    }
+    else
+    {
+        free(page);
+    }
+}
+#endif
+
+#ifdef GC_CONCURRENT_SWEEP
+// While a sweep is running, the unswept lists belong to this thread.
+static void sweeperMain(void* argument)
+{
+    onSweeperThread = true;
+    lockMutex(&sweeperLock);
+
+    for (;;)
+    {
+        while (!sweepRequested && !sweeperQuit)
+        {
+            waitCond(&sweeperWake, &sweeperLock);
+        }
+
+        if (!sweepRequested) break;
+        sweepRequested = false;
+        unlockMutex(&sweeperLock);
+
+        for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+        {
+            SizeClass* sizeClass = &sizeClasses[i];
+
+            while (sizeClass->unswept != NULL)
+            {
+                HeapPage* page = sizeClass->unswept;
+                sizeClass->unswept = page->next;
+
+                bool live = sweepSlots(page);
+                if (!live) free(page);
+
+                lockMutex(&sweeperLock);
+                if (live)
+                {
+                    page->next = sweptPages[i];
+                    sweptPages[i] = page;
+                }
+                sweptBytes += sweeperFreedBytes;
+                sweeperFreedBytes = 0;
+                sweptPageBytes += HEAP_PAGE_SIZE;
+                for (int type = 0; type < GC_OBJ_TYPES; type++)
+                {
+                    sweptFreedByType[type] += sweeperFreedByType[type];
+                    sweeperFreedByType[type] = 0;
+                }
+                unsweptPageCount--;
+                unlockMutex(&sweeperLock);
+            }
+        }
+
+        lockMutex(&sweeperLock);
+        sweepFinished = true;
+    }
+
+    unlockMutex(&sweeperLock);
+}
+
+static void startSweeper()
+{
+    if (!sweeperStarted)
+    {
+        initMutex(&sweeperLock);
+        initCond(&sweeperWake);
+        startThread(&sweeperThread, sweeperMain, NULL);
+        sweeperStarted = true;
+    }
+
+    lockMutex(&sweeperLock);
+    sweepRequested = true;
+    sweepFinished = false;
+    broadcastCond(&sweeperWake);
+    unlockMutex(&sweeperLock);
+}
+
+// Moves the pages the sweeper has finished into their size classes and
+// settles the bytes it freed. Returns true once the whole heap is swept.
+static bool adoptSweptPages()
+{
+    if (!sweeperStarted) return true;
+
+    lockMutex(&sweeperLock);
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        while (sweptPages[i] != NULL)
+        {
+            HeapPage* page = sweptPages[i];
+            sweptPages[i] = page->next;
+            adoptPage(&sizeClasses[i], page);
+        }
+    }
+
+    vm.bytesAllocated -= sweptBytes;
+    vm.gcStats.bytesFreed += sweptBytes;
+    sweptBytes = 0;
+
+    vm.gcStats.bytesSwept += sweptPageBytes;
+    sweptPageBytes = 0;
+
+    for (int i = 0; i < GC_OBJ_TYPES; i++)
+    {
+        vm.gcStats.freedByType[i] += sweptFreedByType[i];
+        sweptFreedByType[i] = 0;
+    }
+
+    bool finished = sweepFinished;
+    unlockMutex(&sweeperLock);
+
+    return finished;
+}
+
+// Lets a pending sweep run to completion before the thread exits.
+static void stopSweeper()
+{
+    if (!sweeperStarted) return;
+
+    lockMutex(&sweeperLock);
+    sweeperQuit = true;
+    broadcastCond(&sweeperWake);
+    unlockMutex(&sweeperLock);
+
+    joinThread(sweeperThread);
+    adoptSweptPages();
+
+    freeCond(&sweeperWake);
+    freeMutex(&sweeperLock);
+    sweeperStarted = false;
+    sweeperQuit = false;
+}
+
+// The sweeper thread does the actual work, so a sweep step only takes over
+// the pages it has finished so far.
+static bool sweep(size_t budget)
+{
+    (void)budget;
+    return adoptSweptPages();
+}
+
+size_t unsweptHeapSize()
+{
+    if (!sweeperStarted) return 0;
+
+    lockMutex(&sweeperLock);
+    size_t size = (size_t)unsweptPageCount * HEAP_PAGE_SIZE;
+    unlockMutex(&sweeperLock);
+
+    return size;
+}
+#else
+// Sweeps whatever pages the allocator has not swept on demand yet, until
+// the budget is spent. Returns true once every page has been swept.
+static bool sweep(size_t budget)
+{
+    size_t work = 0;
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        SizeClass* sizeClass = &sizeClasses[i];
+
+        while (sizeClass->unswept != NULL)
+        {
+            if (work >= budget) return false;
+
+            sweepPage(sizeClass);
+            work += HEAP_PAGE_SIZE;
+        }
+    }
+
+    return true;
+}
+
+size_t unsweptHeapSize()
+{
+    return (size_t)unsweptPageCount * HEAP_PAGE_SIZE;
+}
+#endif
+
+static bool isSparsePage(HeapPage* page)
+{
+    return page->liveCount < page->slotCount * COMPACT_MAX_OCCUPANCY;
+}
+
+static int countSparsePages()
+{
+    int total = 0;
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        int sparse = 0;
+
+        for (HeapPage* page = sizeClasses[i].pages; page != NULL; page = page->next)
+        {
+            if (isSparsePage(page)) sparse++;
+        }
+
+        if (sparse >= COMPACT_MIN_CLASS_PAGES) total += sparse;
+    }
+
+    return total;
+}
+
+void configureGC(const GCConfig* config)
+{
+    gcConfig = *config;
+}
+
+void defaultGCConfig(GCConfig* config)
+{
+    config->policy = GC_POLICY_ADAPTIVE;
+    config->growFactor = GC_HEAP_GROW_FACTOR;
+    config->targetOverhead = GC_TARGET_OVERHEAD;
+    config->maxPauseMs = 0;
+    config->minHeap = GC_MIN_HEAP;
+    config->compact = false;
+}
+
+void initHeapPolicy()
+{
+    memset(&heapPolicy, 0, sizeof(HeapPolicy));
+    heapPolicy.cycleEnd = monotonicNanos();
+    heapPolicy.stepBudget = GC_STEP_BUDGET;
+
+    vm.nextGC = gcConfig.minHeap;
+}
+
+static double smoothRate(double average, double sample)
+{
+    if (average == 0) return sample;
+    return average + (sample - average) * GC_RATE_SMOOTHING;
+}
+
+// Runs when a cycle ends, with only live objects left on the heap.
+static void updateHeapPolicy()
+{
+    HeapPolicy* policy = &heapPolicy;
+    GCStats* stats = &vm.gcStats;
+
+    uint64_t now = monotonicNanos();
+    uint64_t gcTime = stats->markTime + stats->sweepTime + stats->compactTime;
+    uint64_t cycleGCTime = gcTime - policy->gcTime;
+    uint64_t wallTime = now - policy->cycleEnd;
+    uint64_t mutatorTime = wallTime > cycleGCTime ? wallTime - cycleGCTime : 1;
+
+    // Whatever the heap grew by, plus whatever was freed on the way.
+    double allocated = (double)vm.bytesAllocated - (double)policy->liveBytes +
+        (double)(stats->bytesFreed - policy->bytesFreed);
+    if (allocated < 0) allocated = 0;
+
+    policy->allocationRate = smoothRate(policy->allocationRate, allocated / (double)mutatorTime);
+    policy->cycleCost = smoothRate(policy->cycleCost, (double)cycleGCTime);
+
+    uint64_t markTime = stats->markTime - policy->markTime;
+    if (markTime > 0)
+    {
+        double marked = (double)(stats->bytesMarked - policy->bytesMarked);
+        policy->markRate = smoothRate(policy->markRate, marked / (double)markTime);
+    }
+
+    policy->cycleEnd = now;
+    policy->gcTime = gcTime;
+    policy->markTime = stats->markTime;
+    policy->bytesMarked = stats->bytesMarked;
+    policy->bytesFreed = stats->bytesFreed;
+    policy->liveBytes = vm.bytesAllocated;
+
+    double live = (double)vm.bytesAllocated;
+    double next = live * gcConfig.growFactor;
+
+    if (gcConfig.policy == GC_POLICY_ADAPTIVE && policy->cycleCost > 0)
+    {
+        // Headroom is allocated in mutator time headroom / allocationRate,
+        // then collected in cycleCost.
+        double overhead = gcConfig.targetOverhead;
+        double headroom = policy->allocationRate * policy->cycleCost * (1 - overhead) / overhead;
+
+        next = live + headroom;
+        if (next < live * GC_MIN_GROW) next = live * GC_MIN_GROW;
+        if (next > live * GC_MAX_GROW) next = live * GC_MAX_GROW;
+    }
+
+    if (next < (double)gcConfig.minHeap) next = (double)gcConfig.minHeap;
+    vm.nextGC = (size_t)next;
+
+    if (gcConfig.maxPauseMs > 0 && policy->markRate > 0)
+    {
+        double budget = policy->markRate * gcConfig.maxPauseMs * 1000000.0;
+
+        if (budget < GC_STEP_BUDGET_MIN) budget = GC_STEP_BUDGET_MIN;
+        if (budget > GC_STEP_BUDGET_MAX) budget = GC_STEP_BUDGET_MAX;
+        policy->stepBudget = (size_t)budget;
+    }
+}
+
+void collectGarbage()
+{
+#ifdef DEBUG_STRESS_GC
+    size_t budget = SIZE_MAX;
+#else
+    size_t budget = heapPolicy.stepBudget;
+#endif
+
+    uint64_t startTime = monotonicNanos();
+    GCPhase phase = vm.gcPhase;
+
+    switch (vm.gcPhase)
+    {
+    case GC_IDLE_PHASE:
+        vm.gcPhase = GC_MARK_PHASE;
+        markRoots();
+        break;
+
+    case GC_MARK_PHASE:
+        if (traceReferences(budget))
+        {
+            finishMark();
+            vm.gcPhase = GC_SWEEP_PHASE;
+        }
+        break;
+
+    case GC_SWEEP_PHASE:
+        if (sweep(budget))
+        {
+            vm.gcPhase = GC_IDLE_PHASE;
+        }
+        break;
+    }
+
+    uint64_t elapsed = monotonicNanos() - startTime;
+    recordGCPause(&vm.gcStats, elapsed);
+
+    if (phase == GC_SWEEP_PHASE)
+    {
+        vm.gcStats.sweepTime += elapsed;
+    }
+    else
+    {
+        vm.gcStats.markTime += elapsed;
+    }
+
+    if (vm.gcPhase == GC_IDLE_PHASE)
+    {
+        updateHeapPolicy();
+
+        vm.gcStats.cycles++;
+        recordHeapSample(&vm.gcStats, vm.bytesAllocated);
+
+        if (gcConfig.compact && countSparsePages() >= COMPACT_MIN_PAGES)
+        {
+            vm.compactionPending = true;
+        }
+    }
+    else
+    {
+        vm.nextGC = vm.bytesAllocated + heapPolicy.stepBudget / GC_STEP_MULTIPLIER;
+    }
+}
+
+
+void markValue(Value value)
+{
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+void markObject(Obj* object)
+{
+    if (object == NULL) return;
+    if (object->isMarked) return;
+
+#ifdef GC_PARALLEL_MARK
+    if (currentMarker != NULL)
+    {
+        // Markers race for the same objects; the one that sets the bit owns
+        // the scan.
+        if (atomicExchangeBool(&object->isMarked, true)) return;
+
+        pushMarkWork(currentMarker, object);
+        return;
+    }
+#endif
 
-static GCPhase gcPhase = GC_IDLE_PHASE;
+#ifdef DEBUG_LOG_GC
+	printf("%p mark ", (void*)object);
+	printValue(OBJ_VAL(object));
+	printf("\n");
+#endif
 
+    object->isMarked = true;
+    pushGray(object);
+}
 
-#define GC_HEAP_GROW_FACTOR 1.5
+static HeapPage* newPage(int index)
+{
+    HeapPage* page = (HeapPage*)malloc(HEAP_PAGE_SIZE);
+    if (page == NULL) exit(1);
 
-static void freeObject(Obj* object);
+    page->sizeClass = index;
+    page->slotSize = (index + 1) * SIZE_CLASS_GRANULE;
+    page->slotCount = (int)((HEAP_PAGE_SIZE - HEAP_PAGE_HEADER) / page->slotSize);
+    page->liveCount = 0;
+    page->freeList = NULL;
+    page->isAvailable = false;
+    memset(page->used, 0, sizeof(page->used));
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+    for (int i = page->slotCount - 1; i >= 0; i--)
+    {
+        Obj* slot = PAGE_SLOT(page, i);
+        slot->next = page->freeList;
+        page->freeList = slot;
+    }
 
-    if (newSize > oldSize) {
-#ifdef DEBUG_LOG_GC
-        printf("Allocating %d bytes of memory.\n", newSize);
-#endif
+    SizeClass* sizeClass = &sizeClasses[index];
+    page->next = sizeClass->pages;
+    sizeClass->pages = page;
+    makeAvailable(sizeClass, page);
+    return page;
+}
 
-#ifdef DEBUG_STRESS_GC
-        collectGarbage();
+// Hands out a slot from the first page of the size class that has one,
+// adding a page when none does. The caller settles vm.bytesAllocated.
+static Obj* allocateSlot(size_t size)
+{
+    int index = SIZE_CLASS_INDEX(size);
+    if (index >= SIZE_CLASS_COUNT) exit(1);
+
+    SizeClass* sizeClass = &sizeClasses[index];
+
+#ifdef GC_CONCURRENT_SWEEP
+    if (sizeClass->available == NULL && vm.gcPhase == GC_SWEEP_PHASE) adoptSweptPages();
+#else
+    for (int swept = 0; sizeClass->available == NULL && sizeClass->unswept != NULL &&
+        swept < LAZY_SWEEP_PAGES; swept++)
+    {
+        sweepPage(sizeClass);
+    }
 #endif
-        if (vm.bytesAllocated > vm.nextGC || gcPhase != GC_IDLE_PHASE) {
-            collectGarbage();
+
+    HeapPage* page = sizeClass->available;
+    if (page == NULL) page = newPage(index);
+
+    Obj* slot = page->freeList;
+    page->freeList = slot->next;
+    page->liveCount++;
+
+    int slotIndex = (int)(((uint8_t*)slot - ((uint8_t*)page + HEAP_PAGE_HEADER)) / page->slotSize);
+    page->used[slotIndex >> 3] |= 1 << (slotIndex & 7);
+
+    if (page->freeList == NULL)
+    {
+        sizeClass->available = page->nextAvailable;
+        page->isAvailable = false;
     }
+
+    return slot;
 }
 
-    if (newSize == 0) {
-        if (pointer != NULL) {
-            free(pointer);
-            return NULL;
-        }
-    }
+Obj* allocateOld(size_t size)
+{
+    vm.bytesAllocated += size;
+    collectIfNeeded();
+    return allocateSlot(size);
+}
 
-    void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
+void initNursery()
+{
+    vm.nurseryStart = (uint8_t*)malloc(NURSERY_SIZE);
+    if (vm.nurseryStart == NULL) exit(1);
 
-    return result;
+    vm.nurseryTop = vm.nurseryStart;
+    vm.nurseryLimit = vm.nurseryStart + (size_t)(NURSERY_SIZE * NURSERY_MINOR_GC_AT);
+    vm.nurseryEnd = vm.nurseryStart + NURSERY_SIZE;
 }
 
-static int currentMarkIndex = 0;
+Obj* allocateYoung(size_t size)
+{
+    size = NURSERY_ALIGN(size);
+    if (size > (size_t)(vm.nurseryEnd - vm.nurseryTop)) return NULL;
 
-void markRoots() {
-    while (currentMarkIndex < (vm.stackTop - vm.stack)) {
-        markValue(vm.stack[currentMarkIndex]);
-        currentMarkIndex++;
-        if (currentMarkIndex % 8 == 0) return;
-    }
+    Obj* object = (Obj*)vm.nurseryTop;
+    vm.nurseryTop += size;
+    return object;
+}
+
+void rememberObject(Obj* object)
+{
+    if (vm.rememberedCapacity < vm.rememberedCount + 1)
+    {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.rememberedSet = (Obj**)realloc(vm.rememberedSet, sizeof(Obj*) * vm.rememberedCapacity);
 
-    currentMarkIndex = 0;
-    while (currentMarkIndex < vm.frameCount) {
-        markObject((Obj*)vm.frames[currentMarkIndex].closure);
-        currentMarkIndex++;
-        if (currentMarkIndex % 8 == 0) return;
+        if (vm.rememberedSet == NULL) exit(1);
     }
 
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    while (upvalue != NULL) {
-        markObject((Obj*)upvalue);
-        upvalue = upvalue->next;
-        currentMarkIndex++;
-        if (currentMarkIndex % 8 == 0) return;
+    object->isRemembered = true;
+    vm.rememberedSet[vm.rememberedCount++] = object;
+}
+
+// Copies a live young object into the old heap and leaves its new address
+// behind in next. The copy keeps its mark bit only while a major cycle is
+// marking; otherwise it has to enter the old heap white.
+static Obj* promoteObject(Obj* object)
+{
+    size_t size = objectSize(object);
+
+    // Not allocateOld(): a major step must not run halfway through a minor
+    // collection. collectNursery() catches up on the trigger afterwards.
+    vm.bytesAllocated += size;
+    vm.gcStats.bytesPromoted += size;
+    Obj* promoted = allocateSlot(size);
+
+    memcpy(promoted, object, size);
+    promoted->isYoung = false;
+    promoted->isRemembered = false;
+    if (vm.gcPhase != GC_MARK_PHASE) promoted->isMarked = false;
+    promoted->next = NULL;
+
+    object->next = promoted;
+
+    if (promotedCapacity < promotedCount + 1)
+    {
+        promotedCapacity = GROW_CAPACITY(promotedCapacity);
+        promotedStack = (Obj**)realloc(promotedStack, sizeof(Obj*) * promotedCapacity);
+
+        if (promotedStack == NULL) exit(1);
     }
 
-    markTable(&vm.globals);
-    markCompilerRoots();
-    markObject((Obj*)vm.initString);
+    promotedStack[promotedCount++] = promoted;
+    return promoted;
+}
 
-    gcPhase = GC_SWEEP_PHASE;
-    currentMarkIndex = 0;
+static Obj* forwardObject(Obj* object)
+{
+    if (object == NULL) return NULL;
+    if (object->next != NULL) return object->next;
+    if (!object->isYoung) return object;
+    return promoteObject(object);
 }
 
+static void forwardValue(Value* slot)
+{
+    if (IS_OBJ(*slot)) *slot = OBJ_VAL(forwardObject(AS_OBJ(*slot)));
+}
 
-static void markArray(ValueArray* array)
+static void forwardTable(Table* table)
 {
-    for (int i = 0; i < array->count; i++)
+    for (int i = 0; i < table->capacity; i++)
     {
-        markValue(array->values[i]);
+        Entry* entry = &table->entries[i];
+        entry->key = (ObjString*)forwardObject((Obj*)entry->key);
+        forwardValue(&entry->value);
     }
 }
 
-static void blanckenObject(Obj* object)
+static void forwardShapeTree(Shape* shape)
 {
-#ifdef DEBUG_LOG_GC
-	printf("%p blacken ", (void*)object);
-	printValue(OBJ_VAL(object));
-	printf("\n");
-#endif
+    shape->key = (ObjString*)forwardObject((Obj*)shape->key);
+
+    for (int i = 0; i < shape->transitionCount; i++)
+    {
+        forwardShapeTree(shape->transitions[i]);
+    }
+}
 
+// Rewrites every reference the object holds to a copied object, promoted
+// or evacuated, with the address of the copy.
+static void forwardReferences(Obj* object)
+{
     switch (object->type)
     {
     case OBJ_BOUND_METHOD:
         {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            markValue(bound->receiver);
-            markObject((Obj*)bound->method);
+            forwardValue(&bound->receiver);
+            bound->method = (ObjClosure*)forwardObject((Obj*)bound->method);
             break;
         }
+
     case OBJ_STRUCT:
         {
             ObjStruct* klass = (ObjStruct*)object;
-            markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            klass->name = (ObjString*)forwardObject((Obj*)klass->name);
+            forwardTable(&klass->methods);
+            forwardShapeTree(klass->shapes);
             break;
         }
 
     case OBJ_INSTANCE:
         {
             ObjInstance* instance = (ObjInstance*)object;
-            markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            instance->klass = (ObjStruct*)forwardObject((Obj*)instance->klass);
+
+            if (instance->shape == NULL)
+            {
+                forwardTable(instance->dictionary);
+                break;
+            }
+
+            for (int i = 0; i < instance->shape->slotCount; i++)
+            {
+                forwardValue(instanceSlot(instance, i));
+            }
             break;
         }
 
     case OBJ_CLOSURE:
         {
             ObjClosure* closure = (ObjClosure*)object;
-            markObject((Obj*)closure->function);
+            closure->function = (ObjFunction*)forwardObject((Obj*)closure->function);
 
             for (int i = 0; i < closure->upvalueCount; i++)
             {
-                markObject((Obj*)closure->upvalues[i]);
+                closure->upvalues[i] = (ObjUpvalue*)forwardObject((Obj*)closure->upvalues[i]);
             }
             break;
         }
@@ -138,14 +1449,36 @@ static void blanckenObject(Obj* object)
     case OBJ_FUNCTION:
         {
             ObjFunction* function = (ObjFunction*)object;
-            markObject((Obj*)function->name);
-            markArray(&function->chunk.constants);
+            function->name = (ObjString*)forwardObject((Obj*)function->name);
+
+            for (int i = 0; i < function->chunk.constants.count; i++)
+            {
+                forwardValue(&function->chunk.constants.values[i]);
+            }
             break;
         }
 
     case OBJ_UPVALUE:
         {
-            markValue(((ObjUpvalue*)object)->closed);
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            forwardValue(&upvalue->closed);
+
+            // Closed upvalues keep a stale link to their old neighbour.
+            if (upvalue->location != &upvalue->closed)
+            {
+                upvalue->next = (ObjUpvalue*)forwardObject((Obj*)upvalue->next);
+            }
+            break;
+        }
+
+    case OBJ_LIST:
+        {
+            ObjList* list = (ObjList*)object;
+
+            for (uint32_t i = 0; i < list->length; i++)
+            {
+                forwardValue(&list->elements[i]);
+            }
             break;
         }
 
@@ -155,129 +1488,245 @@ static void blanckenObject(Obj* object)
     }
 }
 
-static void traceReferences()
+static void freeInstanceFields(ObjInstance* instance)
 {
-    while (vm.grayCount > 0)
+    FREE_ARRAY(Value, instance->overflow, instance->overflowCapacity);
+
+    if (instance->dictionary != NULL)
     {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blanckenObject(object);
+        freeTable(instance->dictionary);
+        FREE(Table, instance->dictionary);
     }
 }
 
-static void sweep()
+// Frees what a dead young object owns outside the nursery. Only the types
+// isNurseryType() lets in can show up here.
+static void releaseYoungObject(Obj* object)
 {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
+    countFreedObject(object->type);
 
-    while (object != NULL)
+    switch (object->type)
     {
-        if (object->isMarked)
+    case OBJ_STRING:
+        {
+            ObjString* string = (ObjString*)object;
+            tableDelete(&vm.strings, string);
+            FREE_ARRAY(char, string->characters, string->length + 1);
+            break;
+        }
+
+    case OBJ_INSTANCE:
+        {
+            freeInstanceFields((ObjInstance*)object);
+            break;
+        }
+
+    case OBJ_LIST:
+        {
+            ObjList* list = (ObjList*)object;
+            FREE_ARRAY(Value, list->elements, list->capacity);
+            break;
+        }
+
+    default:
+        break;
+    }
+}
+
+static void evacuateObject(Obj* object)
+{
+    size_t size = objectSize(object);
+    Obj* copy = allocateSlot(size);
+
+    memcpy(copy, object, size);
+    copy->next = NULL;
+    object->next = copy;
+
+    if (object->type == OBJ_UPVALUE)
+    {
+        ObjUpvalue* upvalue = (ObjUpvalue*)object;
+        if (upvalue->location == &upvalue->closed)
+        {
+            ((ObjUpvalue*)copy)->location = &((ObjUpvalue*)copy)->closed;
+        }
+    }
+
+    vm.gcStats.bytesCompacted += size;
+}
+
+// Copies the objects of sparse pages into the free slots of denser ones,
+// then points every reference at the copies and frees the emptied pages.
+// Only runs between a finished cycle and the next one, from a safepoint
+// with the nursery empty, so no C code holds an old object it could move.
+static void compactHeap()
+{
+    uint64_t startTime = monotonicNanos();
+    HeapPage* evacuated = NULL;
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        SizeClass* sizeClass = &sizeClasses[i];
+        int sparse = 0;
+
+        for (HeapPage* page = sizeClass->pages; page != NULL; page = page->next)
         {
-            object->isMarked = false;
-            object->isOnCurrentGC = false;
-            previous = object;
-            object = object->next;
+            if (isSparsePage(page)) sparse++;
         }
-        else if (object->isOnCurrentGC)
+
+        if (sparse < COMPACT_MIN_CLASS_PAGES) continue;
+
+        HeapPage** link = &sizeClass->pages;
+        while (*link != NULL)
         {
-            Obj* unreached = object;
-            object = object->next;
+            HeapPage* page = *link;
 
-            if (previous != NULL)
+            if (isSparsePage(page))
             {
-                previous->next = object;
+                *link = page->next;
+                page->next = evacuated;
+                evacuated = page;
             }
             else
             {
-                vm.objects = object;
+                link = &page->next;
             }
+        }
 
-            freeObject(unreached);
+        sizeClass->available = NULL;
+        for (HeapPage* page = sizeClass->pages; page != NULL; page = page->next)
+        {
+            page->isAvailable = false;
+            if (page->freeList != NULL) makeAvailable(sizeClass, page);
         }
-        else
+    }
+
+    if (evacuated == NULL) return;
+
+    for (HeapPage* page = evacuated; page != NULL; page = page->next)
+    {
+        for (int i = 0; i < page->slotCount; i++)
         {
-            previous = object;
-            object = object->next;
+            if (SLOT_USED(page, i)) evacuateObject(PAGE_SLOT(page, i));
         }
     }
-}
 
+    for (Value* slot = vm.stack; slot < stackRootsEnd(); slot++)
+    {
+        forwardValue(slot);
+    }
 
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC_START_END
-    printf("--gc begin \n");
-    size_t before = vm.bytesAllocated;
-    clock_t start_time = clock();
-#endif
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        vm.frames[i].closure = (ObjClosure*)forwardObject((Obj*)vm.frames[i].closure);
+    }
 
-    vm.nextGC = (size_t)(((double)vm.bytesAllocated) * GC_HEAP_GROW_FACTOR);
+    vm.openUpvalues = (ObjUpvalue*)forwardObject((Obj*)vm.openUpvalues);
+    vm.initString = (ObjString*)forwardObject((Obj*)vm.initString);
+    forwardTable(&vm.globals);
+    forwardTable(&vm.strings);
 
-    switch (gcPhase) {
-    case GC_IDLE_PHASE:
-        gcPhase = GC_MARK_PHASE;
-        currentMarkIndex = 0;
-        printf("Idle phase. Next phase at %zu\n", vm.nextGC);
-        break;
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        vm.rememberedSet[i] = forwardObject(vm.rememberedSet[i]);
+    }
 
-    case GC_MARK_PHASE:
-        markRoots();
-        if (gcPhase != GC_MARK_PHASE) {
-            gcPhase = GC_SWEEP_PHASE;
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
+    {
+        for (HeapPage* page = sizeClasses[i].pages; page != NULL; page = page->next)
+        {
+            for (int slot = 0; slot < page->slotCount; slot++)
+            {
+                if (SLOT_USED(page, slot)) forwardReferences(PAGE_SLOT(page, slot));
+            }
         }
-        printf("Mark phase. Next phase at %zu\n", vm.nextGC);
-        break;
+    }
 
-    case GC_SWEEP_PHASE:
-        printf("Sweep phase. Next phase at %zu\n", vm.nextGC);
-        sweep();
-        gcPhase = GC_IDLE_PHASE;
-
-#ifdef DEBUG_LOG_GC_START_END
-        clock_t end_time = clock();
-        double time_spent = (double)(end_time - start_time) / CLOCKS_PER_SEC;
-
-        printf("--gc end \n");
-        printf("    now with %zu Bytes. Collected %zu bytes (from %zu to %zu) next at %zu\n",
-            vm.bytesAllocated,
-            before - vm.bytesAllocated,
-            before,
-            vm.bytesAllocated,
-            vm.nextGC);
-        printf("    GC took %.6f seconds\n", time_spent);
-#endif
-        break;
+    // The evacuated objects now live on as their copies, so the pages go
+    // without freeing anything they own.
+    while (evacuated != NULL)
+    {
+        HeapPage* next = evacuated->next;
+        free(evacuated);
+        evacuated = next;
     }
-}
 
+    invalidateInlineCaches();
 
-void markValue(Value value)
-{
-    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+    uint64_t elapsed = monotonicNanos() - startTime;
+    vm.gcStats.compactions++;
+    vm.gcStats.compactTime += elapsed;
+    recordGCPause(&vm.gcStats, elapsed);
 }
 
-void markObject(Obj* object)
+// Minor collection. Copies everything in the nursery that is reachable from
+// the roots or the remembered set into the old heap, then resets the
+// nursery. Objects move, so this may only run at interpreter safepoints,
+// where no C code holds a raw pointer to a young object.
+void collectNursery()
 {
-    if (object == NULL) return;
-    if (object->isMarked) return;
+    uint64_t startTime = monotonicNanos();
 
-#ifdef DEBUG_LOG_GC
-	printf("%p mark ", (void*)object);
-	printValue(OBJ_VAL(object));
-	printf("\n");
-#endif
+    for (Value* slot = vm.stack; slot < stackRootsEnd(); slot++)
+    {
+        forwardValue(slot);
+    }
 
-    object->isMarked = true;
-    object->isOnCurrentGC = true;
+    forwardTable(&vm.globals);
 
-    if (vm.grayCapacity < vm.grayCount + 1)
+    for (int i = 0; i < vm.grayCount; i++)
     {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        vm.grayStack[i] = forwardObject(vm.grayStack[i]);
+    }
 
-        if (vm.grayStack == NULL) exit(1);
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        Obj* object = vm.rememberedSet[i];
+        object->isRemembered = false;
+        forwardReferences(object);
     }
+    vm.rememberedCount = 0;
 
-    vm.grayStack[vm.grayCount++] = object;
+    while (promotedCount > 0)
+    {
+        forwardReferences(promotedStack[--promotedCount]);
+    }
+
+    uint8_t* cursor = vm.nurseryStart;
+
+    while (cursor < vm.nurseryTop)
+    {
+        Obj* object = (Obj*)cursor;
+        cursor += NURSERY_ALIGN(objectSize(object));
+
+        if (object->next == NULL)
+        {
+            releaseYoungObject(object);
+        }
+        else if (object->type == OBJ_STRING)
+        {
+            tableMoveKey(&vm.strings, (ObjString*)object, (ObjString*)object->next);
+        }
+    }
+
+    vm.nurseryTop = vm.nurseryStart;
+    invalidateInlineCaches();
+
+    uint64_t elapsed = monotonicNanos() - startTime;
+    vm.gcStats.minorCollections++;
+    vm.gcStats.minorTime += elapsed;
+    recordGCPause(&vm.gcStats, elapsed);
+
+    // With the nursery empty, only old objects are left to move.
+    if (vm.compactionPending)
+    {
+        vm.compactionPending = false;
+        if (vm.gcPhase == GC_IDLE_PHASE) compactHeap();
+    }
+
+    if (vm.bytesAllocated > vm.nextGC)
+    {
+        collectGarbage();
+    }
 }
 
 static void freeObject(Obj* object)
@@ -288,17 +1737,11 @@ static void freeObject(Obj* object)
 
     switch (object->type)
     {
-    case OBJ_BOUND_METHOD:
-        {
-            FREE(ObjBoundMethod, object);
-            break;
-        }
-
     case OBJ_STRUCT:
         {
             ObjStruct* klass = (ObjStruct*)object;
             freeTable(&klass->methods);
-            FREE(ObjStruct, object);
+            freeShapeTree(klass->shapes);
             break;
         }
 
@@ -306,13 +1749,6 @@ static void freeObject(Obj* object)
         {
             ObjString* string = (ObjString*)object;
             FREE_ARRAY(char, string->characters, string->length + 1);
-            FREE(ObjString, object);
-            break;
-        }
-
-    case OBJ_UPVALUE:
-        {
-            FREE(ObjUpvalue, object);
             break;
         }
 
@@ -320,7 +1756,6 @@ static void freeObject(Obj* object)
         {
             ObjClosure* closure = (ObjClosure*)object;
             FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(ObjClosure, object);
             break;
         }
 
@@ -328,36 +1763,85 @@ static void freeObject(Obj* object)
         {
             ObjFunction* function = (ObjFunction*)object;
             freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+#ifdef JIT
+            if (function->jitCode != NULL) jitFree(function->jitCode);
+            jitFreeTraces(function->traces);
+#endif
             break;
         }
 
     case OBJ_INSTANCE:
         {
-            ObjInstance* instance = (ObjInstance*)object;
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
+            freeInstanceFields((ObjInstance*)object);
             break;
         }
 
-    case OBJ_NATIVE:
+    case OBJ_LIST:
         {
-            FREE(ObjNative, object);
+            ObjList* list = (ObjList*)object;
+            FREE_ARRAY(Value, list->elements, list->capacity);
             break;
         }
+
+    case OBJ_BOUND_METHOD:
+    case OBJ_UPVALUE:
+    case OBJ_NATIVE:
+        break;
+    }
+
+    // The slot itself goes back to its page in sweepSlots().
+    countFreedObject(object->type);
+    releaseBytes(objectSize(object));
+}
+
+static void freePageList(HeapPage* page)
+{
+    while (page != NULL)
+    {
+        HeapPage* next = page->next;
+
+        for (int i = 0; i < page->slotCount; i++)
+        {
+            if (SLOT_USED(page, i)) freeObject(PAGE_SLOT(page, i));
+        }
+
+        free(page);
+        page = next;
     }
 }
 
 void freeObjects()
 {
-    Obj* object = vm.objects;
+#ifdef GC_CONCURRENT_SWEEP
+    stopSweeper();
+#endif
+
+    for (uint8_t* cursor = vm.nurseryStart; cursor < vm.nurseryTop;)
+    {
+        Obj* object = (Obj*)cursor;
+        cursor += NURSERY_ALIGN(objectSize(object));
+        releaseYoungObject(object);
+    }
 
-    while (object != NULL)
+    free(vm.nurseryStart);
+    vm.nurseryStart = vm.nurseryTop = vm.nurseryLimit = vm.nurseryEnd = NULL;
+
+    for (int i = 0; i < SIZE_CLASS_COUNT; i++)
     {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+        freePageList(sizeClasses[i].pages);
+        freePageList(sizeClasses[i].unswept);
+        sizeClasses[i].pages = NULL;
+        sizeClasses[i].available = NULL;
+        sizeClasses[i].unswept = NULL;
     }
+    unsweptPageCount = 0;
+
+#ifdef GC_PARALLEL_MARK
+    stopMarkers();
+#endif
+
+    free(vm.rememberedSet);
+    free(promotedStack);
 
     free(vm.grayStack);
 }
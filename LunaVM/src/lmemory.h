@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
 	(type*)reallocate(NULL, 0, sizeof(type) * (count))
@@ -19,10 +20,62 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
 	reallocate(pointer, sizeof(type) * oldCount, 0)
 
+typedef enum
+{
+	GC_POLICY_FIXED,
+	GC_POLICY_ADAPTIVE,
+} GCPolicy;
+
+typedef struct
+{
+	GCPolicy policy;
+	// Trigger growth over the live heap under GC_POLICY_FIXED.
+	double growFactor;
+	// Share of run time GC_POLICY_ADAPTIVE aims to spend collecting.
+	double targetOverhead;
+	// Longest incremental step to aim for; 0 keeps the fixed step budget.
+	double maxPauseMs;
+	size_t minHeap;
+	// Evacuate sparse old-generation pages after a cycle.
+	bool compact;
+} GCConfig;
+
+// Call before initVM().
+void configureGC(const GCConfig* config);
+void defaultGCConfig(GCConfig* config);
+void initHeapPolicy();
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void collectGarbage();
 void markValue(Value value);
 void markObject(Obj* object);
 void freeObjects();
 
+Obj* allocateOld(size_t size);
+size_t unsweptHeapSize();
+void initNursery();
+Obj* allocateYoung(size_t size);
+void collectNursery();
+void rememberObject(Obj* object);
+
+// Write barrier, run on every store of a value into a heap object. Old
+// objects that receive a pointer into the nursery are added to the
+// remembered set for the next minor collection. While the collector is
+// marking it also acts as a Dijkstra insertion barrier: the stored value is
+// greyed if its new owner has already been marked, so a black object never
+// points at a white one. Pass a NULL owner for root tables like vm.globals,
+// which both collectors scan themselves.
+static inline void writeBarrier(Obj* owner, Value value)
+{
+	if (!IS_OBJ(value)) return;
+
+	if (owner != NULL && !owner->isYoung && !owner->isRemembered && AS_OBJ(value)->isYoung)
+	{
+		rememberObject(owner);
+	}
+
+	if (vm.gcPhase != GC_MARK_PHASE) return;
+	if (owner == NULL || owner->isMarked) markObject(AS_OBJ(value));
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+
+#include "lthread.h"
+
+typedef struct
+{
+	ThreadFn function;
+	void* argument;
+} ThreadStart;
+
+#ifdef _WIN32
+
+static DWORD WINAPI threadMain(LPVOID parameter)
+{
+	ThreadStart start = *(ThreadStart*)parameter;
+	free(parameter);
+
+	start.function(start.argument);
+	return 0;
+}
+
+void startThread(LunaThread* thread, ThreadFn function, void* argument)
+{
+	ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+	if (start == NULL) exit(1);
+
+	start->function = function;
+	start->argument = argument;
+
+	*thread = CreateThread(NULL, 0, threadMain, start, 0, NULL);
+	if (*thread == NULL) exit(1);
+}
+
+void joinThread(LunaThread thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+void yieldThread()
+{
+	SwitchToThread();
+}
+
+void initMutex(LunaMutex* mutex) { InitializeCriticalSection(mutex); }
+void freeMutex(LunaMutex* mutex) { DeleteCriticalSection(mutex); }
+void lockMutex(LunaMutex* mutex) { EnterCriticalSection(mutex); }
+void unlockMutex(LunaMutex* mutex) { LeaveCriticalSection(mutex); }
+
+void initCond(LunaCond* cond) { InitializeConditionVariable(cond); }
+void freeCond(LunaCond* cond) { (void)cond; }
+void waitCond(LunaCond* cond, LunaMutex* mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+void broadcastCond(LunaCond* cond) { WakeAllConditionVariable(cond); }
+
+#else
+
+#include <sched.h>
+
+static void* threadMain(void* parameter)
+{
+	ThreadStart start = *(ThreadStart*)parameter;
+	free(parameter);
+
+	start.function(start.argument);
+	return NULL;
+}
+
+void startThread(LunaThread* thread, ThreadFn function, void* argument)
+{
+	ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+	if (start == NULL) exit(1);
+
+	start->function = function;
+	start->argument = argument;
+
+	if (pthread_create(thread, NULL, threadMain, start) != 0) exit(1);
+}
+
+void joinThread(LunaThread thread)
+{
+	pthread_join(thread, NULL);
+}
+
+void yieldThread()
+{
+	sched_yield();
+}
+
+void initMutex(LunaMutex* mutex) { pthread_mutex_init(mutex, NULL); }
+void freeMutex(LunaMutex* mutex) { pthread_mutex_destroy(mutex); }
+void lockMutex(LunaMutex* mutex) { pthread_mutex_lock(mutex); }
+void unlockMutex(LunaMutex* mutex) { pthread_mutex_unlock(mutex); }
+
+void initCond(LunaCond* cond) { pthread_cond_init(cond, NULL); }
+void freeCond(LunaCond* cond) { pthread_cond_destroy(cond); }
+void waitCond(LunaCond* cond, LunaMutex* mutex) { pthread_cond_wait(cond, mutex); }
+void broadcastCond(LunaCond* cond) { pthread_cond_broadcast(cond); }
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef luna_thread_h
+#define luna_thread_h
+
+#include "common.h"
+
+// The handful of threading primitives the collector needs, on top of Win32
+// or pthreads.
+
+#ifdef _WIN32
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <intrin.h>
+
+typedef HANDLE LunaThread;
+typedef CRITICAL_SECTION LunaMutex;
+typedef CONDITION_VARIABLE LunaCond;
+
+#define THREAD_LOCAL __declspec(thread)
+
+#define atomicExchangeBool(pointer, value) \
+	(_InterlockedExchange8((volatile char*)(pointer), (char)(value)) != 0)
+#define atomicIncrement(pointer) _InterlockedIncrement(pointer)
+#define atomicDecrement(pointer) _InterlockedDecrement(pointer)
+#define atomicAdd64(pointer, value) _InterlockedExchangeAdd64((pointer), (value))
+#define atomicLoad(pointer) (*(pointer))
+
+#else
+
+#include <pthread.h>
+
+typedef pthread_t LunaThread;
+typedef pthread_mutex_t LunaMutex;
+typedef pthread_cond_t LunaCond;
+
+#define THREAD_LOCAL __thread
+
+#define atomicExchangeBool(pointer, value) __atomic_exchange_n((pointer), (value), __ATOMIC_ACQ_REL)
+#define atomicIncrement(pointer) __atomic_add_fetch((pointer), 1, __ATOMIC_ACQ_REL)
+#define atomicDecrement(pointer) __atomic_sub_fetch((pointer), 1, __ATOMIC_ACQ_REL)
+#define atomicAdd64(pointer, value) __atomic_fetch_add((pointer), (value), __ATOMIC_ACQ_REL)
+#define atomicLoad(pointer) __atomic_load_n((pointer), __ATOMIC_ACQUIRE)
+
+#endif
+
+typedef void (*ThreadFn)(void* argument);
+
+void startThread(LunaThread* thread, ThreadFn function, void* argument);
+void joinThread(LunaThread thread);
+void yieldThread();
+
+void initMutex(LunaMutex* mutex);
+void freeMutex(LunaMutex* mutex);
+void lockMutex(LunaMutex* mutex);
+void unlockMutex(LunaMutex* mutex);
+
+void initCond(LunaCond* cond);
+void freeCond(LunaCond* cond);
+void waitCond(LunaCond* cond, LunaMutex* mutex);
+void broadcastCond(LunaCond* cond);
+
+#endif
@@ -5,7 +5,9 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "lmemory.h"
 #include "vm.h"
+#include "jit.h"
 
 static void repl(void)
 {
@@ -67,43 +69,145 @@ static char* readFile(const char* path)
 	return buffer;
 }
 
-static void runFile(const char* path)
+static InterpretResult runFile(const char* path)
 {
 	char* source = readFile(path);
 
 	InterpretResult result = interpret(path, source);
 	free(source);
 
-	if (result == INTERPRET_COMPILE_ERROR) exit(65);
-	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+	return result;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage: CLuna [options] [path]\n");
+	fprintf(stderr, "  --gc-stats=<file>       write GC statistics as JSON on exit\n");
+	fprintf(stderr, "  --gc-policy=<policy>    'adaptive' (default) or 'fixed' heap growth\n");
+	fprintf(stderr, "  --gc-grow=<factor>      heap growth per cycle under the fixed policy\n");
+	fprintf(stderr, "  --gc-overhead=<percent> share of run time the adaptive policy spends in GC\n");
+	fprintf(stderr, "  --gc-max-pause=<ms>     longest incremental GC step to aim for\n");
+	fprintf(stderr, "  --gc-min-heap=<KB>      heap size below which no collection starts\n");
+	fprintf(stderr, "  --gc-compact            evacuate sparse heap pages after collections\n");
+#ifdef JIT
+	fprintf(stderr, "  --jit-threshold=<count> calls and loop iterations before a function is compiled; 0 never compiles\n");
+	fprintf(stderr, "  --jit-backend=<name>    'templates' (default), 'stencils', copied from C, or 'traces' of hot loops\n");
+#endif
+	exit(64);
+}
+
+// Returns the value of "--name=value" if argument is that option.
+static const char* optionValue(const char* argument, const char* name)
+{
+	size_t length = strlen(name);
+	if (strncmp(argument, name, length) != 0 || argument[length] != '=') return NULL;
+
+	return argument + length + 1;
+}
+
+static double numberOption(const char* value, double min)
+{
+	char* end;
+	double number = strtod(value, &end);
+
+	if (end == value || *end != '\0' || number < min) usage();
+	return number;
 }
 
 int main(int argc, const char* argv[]) {
 
-	initVM();
+	const char* path = NULL;
+	const char* gcStatsPath = NULL;
+	const char* value;
 
-	if (argc == 1)
-	{
-		repl();
-	}
-	else if (argc == 2)
+	GCConfig gcConfig;
+	defaultGCConfig(&gcConfig);
+
+	for (int i = 1; i < argc; i++)
 	{
 		// Internal commands if aplicable.
-		if (strcmp(argv[1], "--version") == 0)
+		if (strcmp(argv[i], "--version") == 0)
 		{
 			printf("Luna Version - 0.0.1 Debug\n");
 			return 0;
 		}
+		else if (strcmp(argv[i], "--gc-compact") == 0)
+		{
+			gcConfig.compact = true;
+		}
+		else if ((value = optionValue(argv[i], "--gc-stats")) != NULL)
+		{
+			gcStatsPath = value;
+		}
+		else if ((value = optionValue(argv[i], "--gc-policy")) != NULL)
+		{
+			if (strcmp(value, "fixed") == 0) gcConfig.policy = GC_POLICY_FIXED;
+			else if (strcmp(value, "adaptive") == 0) gcConfig.policy = GC_POLICY_ADAPTIVE;
+			else usage();
+		}
+		else if ((value = optionValue(argv[i], "--gc-grow")) != NULL)
+		{
+			gcConfig.growFactor = numberOption(value, 1);
+		}
+		else if ((value = optionValue(argv[i], "--gc-overhead")) != NULL)
+		{
+			gcConfig.targetOverhead = numberOption(value, 0.1) / 100;
+			if (gcConfig.targetOverhead >= 1) usage();
+		}
+		else if ((value = optionValue(argv[i], "--gc-max-pause")) != NULL)
+		{
+			gcConfig.maxPauseMs = numberOption(value, 0);
+		}
+		else if ((value = optionValue(argv[i], "--gc-min-heap")) != NULL)
+		{
+			gcConfig.minHeap = (size_t)(numberOption(value, 0) * 1024);
+		}
+#ifdef JIT
+		else if ((value = optionValue(argv[i], "--jit-threshold")) != NULL)
+		{
+			jitThreshold = (int)numberOption(value, 0);
+		}
+		else if ((value = optionValue(argv[i], "--jit-backend")) != NULL)
+		{
+			if (strcmp(value, "templates") == 0) jitBackend = JIT_TEMPLATES;
+			else if (strcmp(value, "stencils") == 0) jitBackend = JIT_STENCILS;
+			else if (strcmp(value, "traces") == 0) jitBackend = JIT_TRACES;
+			else usage();
+		}
+#endif
+		else if (path == NULL && strncmp(argv[i], "--", 2) != 0)
+		{
+			path = argv[i];
+		}
+		else
+		{
+			usage();
+		}
+	}
+
+	configureGC(&gcConfig);
+	initVM();
+
+	InterpretResult result = INTERPRET_OK;
 
-		runFile(argv[1]);
+	if (path == NULL)
+	{
+		repl();
 	}
 	else
 	{
-		fprintf(stderr, "Usage: CLuna [path]\n");
-		exit(64);
+		result = runFile(path);
 	}
 
+	if (gcStatsPath != NULL && !writeGCStats(&vm.gcStats, vm.bytesAllocated, vm.nextGC, gcStatsPath))
+	{
+		fprintf(stderr, "Could not write GC statistics to \"%s\".\n", gcStatsPath);
+	}
+
+	if (result == INTERPRET_COMPILE_ERROR) exit(65);
+	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+
 	freeVM();
 
 	return 0;
-}
\ No newline at end of file
+}
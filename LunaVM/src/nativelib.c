@@ -6,6 +6,7 @@
 
 #include "nativelib.h"
 #include "object.h"
+#include "vm.h"
 
 #include <time.h>
 #include <stdio.h>
@@ -16,6 +17,9 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
+// Stores a native's result in the callee's slot and returns from it.
+#define NATIVE_RETURN(value) return (args[-1] = (value), true)
+
 typedef struct {
     GLFWwindow* window;
 } WindowEntry;
@@ -51,12 +55,12 @@ void removeWindow(int id) {
 }
 
 
-Value clockNative(int argCount, Value* args)
+bool clockNative(VM* vm, int argCount, Value* args)
 {
-	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+	NATIVE_RETURN(NUMBER_VAL((double)clock() / CLOCKS_PER_SEC));
 }
 
-Value inputNative(int argCount, Value* args)
+bool inputNative(VM* vm, int argCount, Value* args)
 {
     char buffer[256];
     
@@ -71,7 +75,7 @@ Value inputNative(int argCount, Value* args)
 
         char* heapBuffer = (char*)malloc(len + 1);
         if (heapBuffer == NULL) {
-            return NULL_VAL;
+            NATIVE_RETURN(NULL_VAL);
         }
 
         strcpy(heapBuffer, buffer);
@@ -79,28 +83,28 @@ Value inputNative(int argCount, Value* args)
         ObjString* string = takeString(heapBuffer, (int)len);
         if (string == NULL) {
             free(heapBuffer);
-            return NULL_VAL;
+            NATIVE_RETURN(NULL_VAL);
         }
 
-        return OBJ_VAL(string);
+        NATIVE_RETURN(OBJ_VAL(string));
     }
 
-    return NULL_VAL;
+    NATIVE_RETURN(NULL_VAL);
 }
 
 
 
-Value openNative(int argCount, Value* args)
+bool openNative(VM* vm, int argCount, Value* args)
 {
     if (!IS_STRING(args[0])) {
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     const char* path = AS_CSTRING(args[0]);
 
     FILE* file = fopen(path, "rb");
     if (file == NULL) {
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     fseek(file, 0, SEEK_END);
@@ -111,39 +115,39 @@ Value openNative(int argCount, Value* args)
 
     if (buffer == NULL) {
         fclose(file);
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     size_t bytesRead = fread(buffer, 1, fileSize, file);
     if (bytesRead != (size_t)fileSize) {
         free(buffer);
         fclose(file);
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     buffer[fileSize] = '\0';
 
     fclose(file);
 
+    // The string owns the buffer from here on.
     ObjString* string = takeString(buffer, fileSize);
-    free(buffer);
 
-    return OBJ_VAL(string);
+    NATIVE_RETURN(OBJ_VAL(string));
 }
 
-Value stringLengthNative(int argCount, Value* args) {
-    if (argCount != 1 || !IS_STRING(args[0])) {
-        return NULL_VAL;
+bool stringLengthNative(VM* vm, int argCount, Value* args) {
+    if (!IS_STRING(args[0])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     ObjString* string = AS_STRING(args[0]);
-    return NUMBER_VAL(string->length);
+    NATIVE_RETURN(NUMBER_VAL(string->length));
 }
 
-Value toNumberNative(int argCount, Value* args)
+bool toNumberNative(VM* vm, int argCount, Value* args)
 {
-    if (argCount != 1 || !IS_STRING(args[0])) {
-        return NULL_VAL;
+    if (!IS_STRING(args[0])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     ObjString* string = AS_STRING(args[0]);
@@ -156,59 +160,59 @@ Value toNumberNative(int argCount, Value* args)
 
     if (end == str) {
 
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
-    return NUMBER_VAL(number);
+    NATIVE_RETURN(NUMBER_VAL(number));
 }
 
-Value cosNative(int argCount, Value* args)
+bool cosNative(VM* vm, int argCount, Value* args)
 {
-    if(!IS_NUMBER(args[0])) return NULL_VAL;
+    if(!IS_NUMBER(args[0])) NATIVE_RETURN(NULL_VAL);
     
-    return NUMBER_VAL(cos(AS_NUMBER(args[0])));
+    NATIVE_RETURN(NUMBER_VAL(cos(AS_NUMBER(args[0]))));
 }
-Value sinNative(int argCount, Value* args)
+bool sinNative(VM* vm, int argCount, Value* args)
 {
-    if(!IS_NUMBER(args[0])) return NULL_VAL;
+    if(!IS_NUMBER(args[0])) NATIVE_RETURN(NULL_VAL);
 
-    return NUMBER_VAL(sin(AS_NUMBER(args[0])));
+    NATIVE_RETURN(NUMBER_VAL(sin(AS_NUMBER(args[0]))));
 }
-Value tanNative(int argCount, Value* args)
+bool tanNative(VM* vm, int argCount, Value* args)
 {
-    if(!IS_NUMBER(args[0])) return NULL_VAL;
+    if(!IS_NUMBER(args[0])) NATIVE_RETURN(NULL_VAL);
 
-    return NUMBER_VAL(tan(AS_NUMBER(args[0])));
+    NATIVE_RETURN(NUMBER_VAL(tan(AS_NUMBER(args[0]))));
 }
-Value powNative(int argCount, Value* args)
+bool powNative(VM* vm, int argCount, Value* args)
 {
-    if(!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) return NULL_VAL;
+    if(!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) NATIVE_RETURN(NULL_VAL);
 
-    return NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+    NATIVE_RETURN(NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1]))));
 }
-Value sqrtNative(int argCount, Value* args)
+bool sqrtNative(VM* vm, int argCount, Value* args)
 {
-    if(!IS_NUMBER(args[0])) return NULL_VAL;
+    if(!IS_NUMBER(args[0])) NATIVE_RETURN(NULL_VAL);
 
-    return NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+    NATIVE_RETURN(NUMBER_VAL(sqrt(AS_NUMBER(args[0]))));
 }
 
-Value charAtNative(int argCount, Value* args)
+bool charAtNative(VM* vm, int argCount, Value* args)
 {
     if (!IS_STRING(args[0]) || !IS_NUMBER(args[1])) {
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     ObjString* str = AS_STRING(args[0]);
     int index = (int)AS_NUMBER(args[1]);
 
     if (index < 0 || index >= str->length) {
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     char* charBuffer = (char*)malloc(2);
     if (charBuffer == NULL) {
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     charBuffer[0] = str->characters[index];
@@ -217,16 +221,16 @@ Value charAtNative(int argCount, Value* args)
     ObjString* resultString = takeString(charBuffer, 1);
     if (resultString == NULL) {
         free(charBuffer);
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
-    return OBJ_VAL(resultString);
+    NATIVE_RETURN(OBJ_VAL(resultString));
 }
 
-Value substrNative(int argCount, Value* args)
+bool substrNative(VM* vm, int argCount, Value* args)
 {
     if (!IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2])) {
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     ObjString* str = AS_STRING(args[0]);
@@ -234,31 +238,18 @@ Value substrNative(int argCount, Value* args)
     int end = (int)AS_NUMBER(args[2]);
 
     if (start < 0 || start >= (int)str->length || end < start || end > (int)str->length) {
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     int length = end - start;
-    char* substrBuffer = (char*)malloc(length + 1);
-    if (substrBuffer == NULL) {
-        return NULL_VAL;
-    }
-
-    memcpy(substrBuffer, str->characters + start, length);
-    substrBuffer[length] = '\0';
-
-    ObjString* resultString = takeString(substrBuffer, length);
-    free(substrBuffer);
-
-    if (resultString == NULL) {
-        return NULL_VAL;
-    }
+    ObjString* resultString = copyString(str->characters + start, length);
 
-    return OBJ_VAL(resultString);
+    NATIVE_RETURN(OBJ_VAL(resultString));
 }
 
-Value writeNative(int argCount, Value* args) {
-    if (argCount != 2 || !IS_STRING(args[0]) || !IS_STRING(args[1])) {
-        return NULL_VAL;
+bool writeNative(VM* vm, int argCount, Value* args) {
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     const char* path = AS_CSTRING(args[0]);
@@ -266,7 +257,7 @@ Value writeNative(int argCount, Value* args) {
 
     FILE* file = fopen(path, "wb");
     if (file == NULL) {
-        return BOOL_VAL(false);
+        NATIVE_RETURN(BOOL_VAL(false));
     }
 
     size_t contentLength = strlen(content);
@@ -275,19 +266,138 @@ Value writeNative(int argCount, Value* args) {
     fclose(file);
 
     if (bytesWritten != contentLength) {
-        return BOOL_VAL(false);
+        NATIVE_RETURN(BOOL_VAL(false));
+    }
+
+    NATIVE_RETURN(BOOL_VAL(true));
+}
+
+bool gcStatsNative(VM* vm, int argCount, Value* args) {
+    char* json = gcStatsToJson(&vm->gcStats, vm->bytesAllocated, vm->nextGC);
+    ObjString* string = copyString(json, (int)strlen(json));
+    free(json);
+
+    NATIVE_RETURN(OBJ_VAL(string));
+}
+
+bool gcStatNative(VM* vm, int argCount, Value* args) {
+    if (!IS_STRING(args[0])) {
+        NATIVE_RETURN(NULL_VAL);
+    }
+
+    const char* name = AS_CSTRING(args[0]);
+    if (strcmp(name, "bytesAllocated") == 0) NATIVE_RETURN(NUMBER_VAL((double)vm->bytesAllocated));
+    if (strcmp(name, "nextGC") == 0) NATIVE_RETURN(NUMBER_VAL((double)vm->nextGC));
+
+    double value;
+    if (!gcStatValue(&vm->gcStats, name, &value)) {
+        NATIVE_RETURN(NULL_VAL);
+    }
+
+    NATIVE_RETURN(NUMBER_VAL(value));
+}
+
+// Reads value as a position in a list, from 0 up to and including limit.
+static bool listPosition(VM* vm, Value value, uint32_t limit, uint32_t* position)
+{
+    if (!IS_NUMBER(value)) {
+        return nativeError(vm, "List index must be a number.");
+    }
+
+    double number = AS_NUMBER(value);
+
+    if (!(number >= 0 && number <= UINT32_MAX)) {
+        return nativeError(vm, "List index out of range.");
+    }
+
+    if (number != (uint32_t)number) {
+        return nativeError(vm, "List index must be an integer.");
+    }
+
+    if (number > limit) {
+        return nativeError(vm, "List index out of range.");
     }
 
-    return BOOL_VAL(true);
+    *position = (uint32_t)number;
+    return true;
 }
 
-Value __glfwInit(int argCount, Value* args) {
-    return BOOL_VAL(glfwInit());
+bool listLengthNative(VM* vm, int argCount, Value* args)
+{
+    if (!IS_LIST(args[0])) {
+        return nativeError(vm, "len() expects a list.");
+    }
+
+    NATIVE_RETURN(NUMBER_VAL(AS_LIST(args[0])->length));
+}
+
+// Appends the value, and returns the new length.
+bool listPushNative(VM* vm, int argCount, Value* args)
+{
+    if (!IS_LIST(args[0])) {
+        return nativeError(vm, "push() expects a list.");
+    }
+
+    ObjList* list = AS_LIST(args[0]);
+    appendToList(list, args[1]);
+    NATIVE_RETURN(NUMBER_VAL(list->length));
+}
+
+bool listPopNative(VM* vm, int argCount, Value* args)
+{
+    if (!IS_LIST(args[0])) {
+        return nativeError(vm, "pop() expects a list.");
+    }
+
+    ObjList* list = AS_LIST(args[0]);
+
+    if (list->length == 0) {
+        return nativeError(vm, "Can't pop from an empty list.");
+    }
+
+    NATIVE_RETURN(list->elements[--list->length]);
 }
 
-Value __glfwCreateWindow(int argCount, Value* args) {
-    if (argCount != 3 || !IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) || !IS_STRING(args[2])) {
-        return NULL_VAL;
+// insert(list, index, value) moves the elements from index on up by one;
+// an index of len(list) appends.
+bool listInsertNative(VM* vm, int argCount, Value* args)
+{
+    if (!IS_LIST(args[0])) {
+        return nativeError(vm, "insert() expects a list.");
+    }
+
+    ObjList* list = AS_LIST(args[0]);
+    uint32_t index = 0;
+    if (!listPosition(vm, args[1], list->length, &index)) return false;
+
+    insertIntoList(list, index, args[2]);
+    NATIVE_RETURN(NUMBER_VAL(list->length));
+}
+
+// slice(list, start, end) is a new list of the elements from start up to,
+// not including, end.
+bool listSliceNative(VM* vm, int argCount, Value* args)
+{
+    if (!IS_LIST(args[0])) {
+        return nativeError(vm, "slice() expects a list.");
+    }
+
+    ObjList* list = AS_LIST(args[0]);
+    uint32_t start = 0;
+    uint32_t end = 0;
+    if (!listPosition(vm, args[2], list->length, &end)) return false;
+    if (!listPosition(vm, args[1], end, &start)) return false;
+
+    NATIVE_RETURN(OBJ_VAL(copyList(list->elements + start, end - start)));
+}
+
+bool __glfwInit(VM* vm, int argCount, Value* args) {
+    NATIVE_RETURN(BOOL_VAL(glfwInit()));
+}
+
+bool __glfwCreateWindow(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) || !IS_STRING(args[2])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     int width = (int)AS_NUMBER(args[0]);
@@ -299,16 +409,16 @@ Value __glfwCreateWindow(int argCount, Value* args) {
 
     if (!window) {
         printf("Window not created");
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
     double windowPtr = (double)(intptr_t)window;
-    return NUMBER_VAL(windowPtr);
+    NATIVE_RETURN(NUMBER_VAL(windowPtr));
 }
 
-Value __glfwMakeContextCurrent(int argCount, Value* args) {
-    if (argCount != 1 || !IS_NUMBER(args[0])) {
-        return NULL_VAL;
+bool __glfwMakeContextCurrent(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     GLFWwindow* window = (GLFWwindow*)(intptr_t)AS_NUMBER(args[0]);
@@ -318,47 +428,43 @@ Value __glfwMakeContextCurrent(int argCount, Value* args) {
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
     {
         printf("Glad not initialized");
-        return NULL_VAL;
+        NATIVE_RETURN(NULL_VAL);
     }
 
-    return NULL_VAL;
+    NATIVE_RETURN(NULL_VAL);
 }
 
-Value __glfwWindowShouldClose(int argCount, Value* args) {
-    if (argCount != 1 || !IS_NUMBER(args[0])) {
-        return NULL_VAL;
+bool __glfwWindowShouldClose(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     GLFWwindow* window = (GLFWwindow*)(intptr_t)AS_NUMBER(args[0]);
 
     int shouldClose = glfwWindowShouldClose(window);
 
-    return BOOL_VAL(shouldClose);
+    NATIVE_RETURN(BOOL_VAL(shouldClose));
 }
 
-Value __glfwPollEvents(int argCount, Value* args) {
-    if (argCount != 0) {
-        return NULL_VAL;
-    }
-
+bool __glfwPollEvents(VM* vm, int argCount, Value* args) {
     glfwPollEvents();
 
-    return NULL_VAL;
+    NATIVE_RETURN(NULL_VAL);
 }
 
-Value __glfwSwapBuffers(int argCount, Value* args) {
-    if (argCount != 1 || !IS_NUMBER(args[0])) {
-        return NULL_VAL;
+bool __glfwSwapBuffers(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     GLFWwindow* window = (GLFWwindow*)(intptr_t)AS_NUMBER(args[0]);
     glfwSwapBuffers(window);
-    return NULL_VAL;
+    NATIVE_RETURN(NULL_VAL);
 }
 
-Value __glClearColor(int argCount, Value* args) {
-    if (argCount != 4 || !IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2]) || !IS_NUMBER(args[3])) {
-        return NULL_VAL;
+bool __glClearColor(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2]) || !IS_NUMBER(args[3])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     float r = (float)AS_NUMBER(args[0]);
@@ -367,27 +473,27 @@ Value __glClearColor(int argCount, Value* args) {
     float a = (float)AS_NUMBER(args[3]);
 
     glClearColor(r, g, b, a);
-    return NULL_VAL;
+    NATIVE_RETURN(NULL_VAL);
 }
 
-Value __glClear(int argCount, Value* args) {
-    if (argCount != 1 || !IS_NUMBER(args[0])) {
-        return NULL_VAL;
+bool __glClear(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     GLenum mask = (GLenum)(int)AS_NUMBER(args[0]);
     glClear(mask);
-    return NULL_VAL;
+    NATIVE_RETURN(NULL_VAL);
 }
 
-Value __gladLoadProc(int argCount, Value* args) {
-    if (argCount != 1 || !IS_NUMBER(args[0])) {
-        return NULL_VAL;
+bool __gladLoadProc(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0])) {
+        NATIVE_RETURN(NULL_VAL);
     }
 
     // Converte o valor double para um ponteiro de função
     GLADloadproc proc = (GLADloadproc)(intptr_t)AS_NUMBER(args[0]);
-    return BOOL_VAL(gladLoadGLLoader(proc));
+    NATIVE_RETURN(BOOL_VAL(gladLoadGLLoader(proc)));
 }
 
 #endif
@@ -1,26 +1,33 @@
 #pragma once
 
-#include "value.h"
+#include "vm.h"
 
-Value clockNative(int argCount, Value* args);
-Value inputNative(int argCount, Value* args);
-Value openNative(int argCount, Value* args);
-Value stringLengthNative(int argCount, Value* args);
-Value toNumberNative(int argCount, Value* args);
-Value cosNative(int argCount, Value* args);
-Value sinNative(int argCount, Value* args);
-Value tanNative(int argCount, Value* args);
-Value powNative(int argCount, Value* args);
-Value sqrtNative(int argCount, Value* args);
-Value charAtNative(int argCount, Value* args);
-Value substrNative(int argCount, Value* args);
-Value writeNative(int argCount, Value* args);
-Value __glfwInit(int argCount, Value* args);
-Value __glfwCreateWindow(int argCount, Value* args);
-Value __glfwMakeContextCurrent(int argCount, Value* args);
-Value __glfwWindowShouldClose(int argCount, Value* args);
-Value __glfwPollEvents(int argCount, Value* args);
-Value __glfwSwapBuffers(int argCount, Value* args);
-Value __glClearColor(int argCount, Value* args);
-Value __glClear(int argCount, Value* args);
-Value __gladLoadProc(int argCount, Value* args);
\ No newline at end of file
+bool clockNative(VM* vm, int argCount, Value* args);
+bool inputNative(VM* vm, int argCount, Value* args);
+bool openNative(VM* vm, int argCount, Value* args);
+bool stringLengthNative(VM* vm, int argCount, Value* args);
+bool toNumberNative(VM* vm, int argCount, Value* args);
+bool cosNative(VM* vm, int argCount, Value* args);
+bool sinNative(VM* vm, int argCount, Value* args);
+bool tanNative(VM* vm, int argCount, Value* args);
+bool powNative(VM* vm, int argCount, Value* args);
+bool sqrtNative(VM* vm, int argCount, Value* args);
+bool charAtNative(VM* vm, int argCount, Value* args);
+bool substrNative(VM* vm, int argCount, Value* args);
+bool writeNative(VM* vm, int argCount, Value* args);
+bool gcStatsNative(VM* vm, int argCount, Value* args);
+bool gcStatNative(VM* vm, int argCount, Value* args);
+bool listLengthNative(VM* vm, int argCount, Value* args);
+bool listPushNative(VM* vm, int argCount, Value* args);
+bool listPopNative(VM* vm, int argCount, Value* args);
+bool listInsertNative(VM* vm, int argCount, Value* args);
+bool listSliceNative(VM* vm, int argCount, Value* args);
+bool __glfwInit(VM* vm, int argCount, Value* args);
+bool __glfwCreateWindow(VM* vm, int argCount, Value* args);
+bool __glfwMakeContextCurrent(VM* vm, int argCount, Value* args);
+bool __glfwWindowShouldClose(VM* vm, int argCount, Value* args);
+bool __glfwPollEvents(VM* vm, int argCount, Value* args);
+bool __glfwSwapBuffers(VM* vm, int argCount, Value* args);
+bool __glClearColor(VM* vm, int argCount, Value* args);
+bool __glClear(VM* vm, int argCount, Value* args);
+bool __gladLoadProc(VM* vm, int argCount, Value* args);
\ No newline at end of file
@@ -13,14 +13,41 @@
 #define ALLOCATE_OBJ(type, objectType) \
 	(type*)allocateObject(sizeof(type), objectType)
 
+// Strings, instances, bound methods and lists are the objects running code
+// churns through, so they are bump-allocated in the nursery. Objects made
+// while no script is running (compiler constants, functions, natives) live
+// as long as the program and go straight to the old heap.
+static bool isNurseryType(ObjType type)
+{
+	return type == OBJ_STRING || type == OBJ_INSTANCE || type == OBJ_BOUND_METHOD || type == OBJ_LIST;
+}
+
 static Obj* allocateObject(size_t size, ObjType type)
 {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
+	Obj* object = NULL;
+
+	if (vm.frameCount > 0 && isNurseryType(type))
+	{
+		object = allocateYoung(size);
+	}
+
+	if (object != NULL)
+	{
+		object->isYoung = true;
+		object->next = NULL;
+	}
+	else
+	{
+		object = allocateOld(size);
+		object->isYoung = false;
+		object->next = NULL;
+	}
+
 	object->type = type;
-	object->isMarked = false;
-	object->isOnCurrentGC = false;
-	object->next = vm.objects;
-	vm.objects = object;
+	// Objects born while the collector is marking start out black, so the
+	// running cycle can never reclaim them.
+	object->isMarked = vm.gcPhase == GC_MARK_PHASE;
+	object->isRemembered = false;
 
 #ifdef DEBUG_LOG_GC
 	printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -32,15 +59,62 @@ static Obj* allocateObject(size_t size, ObjType type)
 ObjList* newList()
 {
 	ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
-	list->elements = NULL;
 	list->length = 0;
+	list->capacity = 0;
+	list->elements = NULL;
+	return list;
+}
+
+// A new list holding count values copied from elements, which must stay
+// reachable from somewhere else while this allocates.
+ObjList* copyList(Value* elements, uint32_t count)
+{
+	Value* copy = count == 0 ? NULL : ALLOCATE(Value, count);
+	if (count > 0) memcpy(copy, elements, sizeof(Value) * count);
+
+	ObjList* list = newList();
+	list->length = count;
+	list->capacity = count;
+	list->elements = copy;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		writeBarrier((Obj*)list, copy[i]);
+	}
+
 	return list;
 }
 
-void appendToList(ObjList* list, Value value) {
+static void growList(ObjList* list)
+{
+	if (list->capacity > UINT32_MAX / 2)
+	{
+		fprintf(stderr, "List too large.\n");
+		exit(1);
+	}
+
+	uint32_t capacity = GROW_CAPACITY(list->capacity);
+	list->elements = GROW_ARRAY(Value, list->elements, list->capacity, capacity);
+	list->capacity = capacity;
+}
+
+void appendToList(ObjList* list, Value value)
+{
+	if (list->length == list->capacity) growList(list);
+
+	list->elements[list->length++] = value;
+	writeBarrier((Obj*)list, value);
+}
+
+// Shifts the elements from index on up by one to make room for value.
+void insertIntoList(ObjList* list, uint32_t index, Value value)
+{
+	if (list->length == list->capacity) growList(list);
+
+	memmove(&list->elements[index + 1], &list->elements[index], sizeof(Value) * (list->length - index));
+	list->elements[index] = value;
 	list->length++;
-	list->elements = (Value*)realloc(list->elements, sizeof(Value) * list->length);
-	list->elements[list->length - 1] = value;
+	writeBarrier((Obj*)list, value);
 }
 
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
@@ -49,14 +123,20 @@ ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method)
 	
 	bound->receiver = receiver;
 	bound->method = method;
+	writeBarrier((Obj*)bound, receiver);
+	writeBarrier((Obj*)bound, OBJ_VAL(method));
 	return bound;
 }
 
 ObjStruct* newStruct(ObjString* name)
 {
+	Shape* shapes = newShapeTree();
 	ObjStruct* klass = ALLOCATE_OBJ(ObjStruct, OBJ_STRUCT);
 	klass->name = name;
 	initTable(&klass->methods);
+	klass->shapes = shapes;
+	klass->instanceSlots = 0;
+	writeBarrier((Obj*)klass, OBJ_VAL(name));
 	return klass;
 }
 
@@ -82,6 +162,7 @@ ObjClosure* newClosure(ObjFunction* function)
 	closure->function = function;
 	closure->upvalues = upvalues;
 	closure->upvalueCount = function->upvalueCount;
+	writeBarrier((Obj*)closure, OBJ_VAL(function));
 
 	return closure;
 }
@@ -91,24 +172,124 @@ ObjFunction* newFunction()
 	ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	function->arity = 0;
 	function->upvalueCount = 0;
+	function->maxSlots = 1;
 	function->name = NULL;
+#ifdef JIT
+	function->hotness = 0;
+	function->jitCode = NULL;
+	function->traces = NULL;
+#endif
 	initChunk(&function->chunk);
 	return function;
 }
 
 ObjInstance* newInstance(ObjStruct* klass)
 {
-	ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+	int inlineCapacity = klass->instanceSlots == 0 ? INSTANCE_INLINE_GUESS : klass->instanceSlots;
+	if (inlineCapacity > INSTANCE_INLINE_MAX) inlineCapacity = INSTANCE_INLINE_MAX;
+	ObjInstance* instance = (ObjInstance*)allocateObject(
+		sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
+
 	instance->klass = klass;
-	initTable(&instance->fields);
+	instance->shape = klass->shapes;
+	instance->dictionary = NULL;
+	instance->inlineCapacity = inlineCapacity;
+	instance->overflowCapacity = 0;
+	instance->overflow = NULL;
+	writeBarrier((Obj*)instance, OBJ_VAL(klass));
 	return instance;
 }
 
-ObjNative* newNative(NativeFn function, uint8_t expectedArgCount)
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value)
+{
+	if (instance->shape == NULL) return tableGet(instance->dictionary, name, value);
+
+	int slot = shapeFindSlot(instance->shape, name);
+	if (slot < 0) return false;
+
+	*value = *instanceSlot(instance, slot);
+	return true;
+}
+
+// Moves the fields of instance out of its slots into a table of their own.
+static void makeDictionary(ObjInstance* instance)
+{
+	Table* dictionary = ALLOCATE(Table, 1);
+	initTable(dictionary);
+
+	for (Shape* shape = instance->shape; shape->key != NULL; shape = shape->parent)
+	{
+		tableSet(dictionary, shape->key, *instanceSlot(instance, shape->slotCount - 1));
+	}
+
+	FREE_ARRAY(Value, instance->overflow, instance->overflowCapacity);
+	instance->overflow = NULL;
+	instance->overflowCapacity = 0;
+	instance->dictionary = dictionary;
+	instance->shape = NULL;
+	tableWriteBarrier((Obj*)instance, dictionary);
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value)
+{
+	if (instance->shape != NULL)
+	{
+		int slot = shapeFindSlot(instance->shape, name);
+
+		if (slot >= 0)
+		{
+			*instanceSlot(instance, slot) = value;
+			writeBarrier((Obj*)instance, value);
+			return;
+		}
+
+		if (instance->shape->slotCount < SHAPE_MAX_FIELDS)
+		{
+			Shape* shape = shapeAddField(instance->shape, name);
+			writeBarrier((Obj*)instance->klass, OBJ_VAL(name));
+			instanceAddField(instance, shape, value);
+			return;
+		}
+
+		makeDictionary(instance);
+	}
+
+	tableSet(instance->dictionary, name, value);
+	writeBarrier((Obj*)instance, OBJ_VAL(name));
+	writeBarrier((Obj*)instance, value);
+}
+
+// Stores value in the one field shape adds to the instance's current shape,
+// and moves the instance to shape.
+void instanceAddField(ObjInstance* instance, Shape* shape, Value value)
+{
+	int slot = shape->slotCount - 1;
+
+	if (slot >= instance->inlineCapacity + instance->overflowCapacity)
+	{
+		int oldCapacity = instance->overflowCapacity;
+		int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+		instance->overflow = GROW_ARRAY(Value, instance->overflow, oldCapacity, capacity);
+		instance->overflowCapacity = capacity;
+	}
+
+	*instanceSlot(instance, slot) = value;
+	instance->shape = shape;
+
+	if (shape->slotCount > instance->klass->instanceSlots)
+	{
+		instance->klass->instanceSlots = shape->slotCount;
+	}
+
+	writeBarrier((Obj*)instance, value);
+}
+
+ObjNative* newNative(NativeFn function, uint8_t expectedArgCount, uint8_t flags)
 {
 	ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
 	native->function = function;
 	native->arity = expectedArgCount;
+	native->flags = flags;
 	return native;
 }
 
@@ -118,9 +299,9 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash)
 	string->length = length;
 	string->characters = chars;
 	string->hash = hash;
-	push(OBJ_VAL(string));
+	pushRoot(OBJ_VAL(string));
 	tableSet(&vm.strings, string, NULL_VAL);
-	pop();
+	popRoot();
 	return string;
 }
 
@@ -177,6 +358,33 @@ static void printFunction(ObjFunction* function)
 	printf("<fn %s>", function->name->characters);
 }
 
+// Lists nested deeper than this, as a list that contains itself is, print
+// as [...].
+#define PRINT_DEPTH_MAX 16
+
+static void printList(ObjList* list)
+{
+	static int depth = 0;
+
+	if (depth == PRINT_DEPTH_MAX)
+	{
+		printf("[...]");
+		return;
+	}
+
+	depth++;
+	printf("[");
+
+	for (uint32_t i = 0; i < list->length; i++)
+	{
+		if (i > 0) printf(", ");
+		printValue(list->elements[i]);
+	}
+
+	printf("]");
+	depth--;
+}
+
 void printObject(Value value)
 {
 	switch (OBJ_TYPE(value))
@@ -214,7 +422,7 @@ void printObject(Value value)
 		break;
 
 	case OBJ_LIST:
-		printf("<list>");
+		printList(AS_LIST(value));
 		break;
 	}
 }
@@ -5,6 +5,7 @@
 #include "value.h"
 #include "chunk.h"
 #include "table.h"
+#include "shape.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
@@ -44,26 +45,61 @@ struct Obj
 {
 	ObjType type;
 	bool isMarked;
-	bool isOnCurrentGC;
+	// Young objects live in the nursery until a minor collection promotes
+	// them. Old objects sit in heap pages, where next threads free slots.
+	// For live objects next is NULL until the collector copies the object,
+	// either promoting it or evacuating its page, and next becomes its
+	// forwarding address.
+	bool isYoung;
+	// Old objects that may point into the nursery sit in vm.rememberedSet.
+	bool isRemembered;
 	struct Obj* next;
 };
 
+typedef struct JitCode JitCode;
+typedef struct Trace Trace;
+
 typedef struct
 {
 	Obj obj;
 	int arity;
 	int upvalueCount;
+	// Registers a call to the function uses, counting the callee slot; in
+	// the stack VM, the slots of its locals.
+	int maxSlots;
 	Chunk chunk;
 	ObjString* name;
+#ifdef JIT
+	// Calls and loop iterations counted towards compiling the function,
+	// its machine code once it is compiled, and that of its traced loops;
+	// see jit.h.
+	int hotness;
+	JitCode* jitCode;
+	Trace* traces;
+#endif
 } ObjFunction;
 
-typedef Value(*NativeFn)(int argCount, Value* args);
+// A native reads its arguments from args[0] to args[argCount - 1] and
+// stores its result in args[-1], the callee's slot, which the call leaves
+// on the stack. The VM has already checked argCount against the arity.
+// Returning false raises the runtime error reported with nativeError().
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
+
+typedef enum
+{
+	// Never allocates, so cannot collect: run() calls it in place, without
+	// reloading its frame or checking for a minor collection afterwards.
+	NATIVE_NO_GC = 1 << 0,
+	// Also has no side effects; the result depends only on the arguments.
+	NATIVE_PURE = NATIVE_NO_GC | 1 << 1,
+} NativeFlags;
 
 typedef struct
 {
 	Obj obj;
 	NativeFn function;
 	uint8_t arity;
+	uint8_t flags;
 } ObjNative;
 
 struct ObjString
@@ -95,13 +131,31 @@ typedef struct
 	Obj obj;
 	ObjString* name;
 	Table methods;
+	// Root of the layouts its instances have taken.
+	Shape* shapes;
+	// Most fields an instance has had, which is how many slots new
+	// instances get inline.
+	int instanceSlots;
 } ObjStruct;
 
+// Most fields kept inside an instance; any further ones go to overflow.
+#define INSTANCE_INLINE_MAX 8
+// Inline slots for instances of a struct none of whose instances has had
+// a field yet.
+#define INSTANCE_INLINE_GUESS 4
+
 typedef struct
 {
 	Obj obj;
 	ObjStruct* klass;
-	Table fields;
+	// The layout of the fields, or NULL once the instance has gathered too
+	// many of them and keeps them in dictionary instead.
+	Shape* shape;
+	Table* dictionary;
+	int inlineCapacity;
+	int overflowCapacity;
+	Value* overflow;
+	Value fields[];
 } ObjInstance;
 
 typedef struct
@@ -111,15 +165,22 @@ typedef struct
 	ObjClosure* method;
 } ObjBoundMethod;
 
+// A growable array. Its capacity doubles as it fills, so a run of appends
+// costs amortized constant time each.
 typedef struct
 {
 	Obj obj;
+	uint32_t length;
+	uint32_t capacity;
 	Value* elements;
-	uint8_t length;
 } ObjList;
 
+// These allocate, so the list and any value being stored must be reachable
+// from the roots while they run.
 ObjList* newList();
+ObjList* copyList(Value* elements, uint32_t count);
 void appendToList(ObjList* list, Value value);
+void insertIntoList(ObjList* list, uint32_t index, Value value);
 
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
 ObjStruct* newStruct(ObjString* name);
@@ -127,12 +188,22 @@ ObjUpvalue* newUpvalue(Value* slot);
 ObjClosure* newClosure(ObjFunction* function);
 ObjFunction* newFunction();
 ObjInstance* newInstance(ObjStruct* klass);
-ObjNative* newNative(NativeFn function, uint8_t expectedArgCount);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+void instanceAddField(ObjInstance* instance, Shape* shape, Value value);
+ObjNative* newNative(NativeFn function, uint8_t expectedArgCount, uint8_t flags);
 
 ObjString* takeString(char* characters, int length);
 ObjString* copyString(const char* characters, int length);
 void printObject(Value value);
 
+// Field storage of a shaped instance: the inline slots, then the overflow.
+static inline Value* instanceSlot(ObjInstance* instance, int slot)
+{
+	if (slot < instance->inlineCapacity) return &instance->fields[slot];
+	return &instance->overflow[slot - instance->inlineCapacity];
+}
+
 static inline bool isObjType(Value value, ObjType type)
 {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
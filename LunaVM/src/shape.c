@@ -0,0 +1,67 @@
+#include <stdlib.h>
+
+#include "lmemory.h"
+#include "shape.h"
+
+static Shape* newShape(Shape* parent, ObjString* key)
+{
+	Shape* shape = ALLOCATE(Shape, 1);
+	shape->parent = parent;
+	shape->key = key;
+	shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+	shape->transitionCount = 0;
+	shape->transitionCapacity = 0;
+	shape->transitions = NULL;
+	return shape;
+}
+
+Shape* newShapeTree()
+{
+	return newShape(NULL, NULL);
+}
+
+void freeShapeTree(Shape* root)
+{
+	for (int i = 0; i < root->transitionCount; i++)
+	{
+		freeShapeTree(root->transitions[i]);
+	}
+
+	FREE_ARRAY(Shape*, root->transitions, root->transitionCapacity);
+	FREE(Shape, root);
+}
+
+// Returns the slot of key in the layout, or -1 if it has no such field.
+int shapeFindSlot(Shape* shape, ObjString* key)
+{
+	for (; shape->key != NULL; shape = shape->parent)
+	{
+		if (shape->key == key) return shape->slotCount - 1;
+	}
+
+	return -1;
+}
+
+// Returns the layout with key added after the fields of shape, creating it
+// the first time an instance makes that transition.
+Shape* shapeAddField(Shape* shape, ObjString* key)
+{
+	for (int i = 0; i < shape->transitionCount; i++)
+	{
+		if (shape->transitions[i]->key == key) return shape->transitions[i];
+	}
+
+	// Both allocations may collect; the tree stays consistent in between.
+	Shape* next = newShape(shape, key);
+
+	if (shape->transitionCapacity < shape->transitionCount + 1)
+	{
+		int oldCapacity = shape->transitionCapacity;
+		int capacity = oldCapacity < 2 ? 2 : oldCapacity * 2;
+		shape->transitions = GROW_ARRAY(Shape*, shape->transitions, oldCapacity, capacity);
+		shape->transitionCapacity = capacity;
+	}
+
+	shape->transitions[shape->transitionCount++] = next;
+	return next;
+}
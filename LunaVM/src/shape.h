@@ -0,0 +1,31 @@
+#ifndef luna_shape_h
+#define luna_shape_h
+
+#include "common.h"
+#include "value.h"
+
+// Past this many fields an instance leaves its shape and keeps its fields
+// in a Table instead.
+#define SHAPE_MAX_FIELDS 32
+
+// A field layout. Every struct owns a tree of shapes whose root is the
+// layout with no fields; each other node adds one field to its parent's
+// layout, in the next slot. Instances that gained the same fields in the
+// same order share a shape. Shapes are not collected objects: the tree
+// lives as long as its struct, which marks the keys.
+struct Shape
+{
+	struct Shape* parent;
+	ObjString* key; // The field this node adds; NULL at the root.
+	int slotCount;
+	int transitionCount;
+	int transitionCapacity;
+	struct Shape** transitions;
+};
+
+Shape* newShapeTree();
+void freeShapeTree(Shape* root);
+int shapeFindSlot(Shape* shape, ObjString* key);
+Shape* shapeAddField(Shape* shape, ObjString* key);
+
+#endif
@@ -0,0 +1,884 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// A copy-and-patch compiler: instead of assembling templates by hand, every
+// instruction's machine code is a stencil, a C function built along with
+// the rest of the VM. Compiling a function copies the stencils of its
+// instructions one after the other and patches each one's holes with that
+// instruction's operands, its jump targets and the address of the stencil
+// that follows it.
+//
+// A stencil takes the interpreter's state in its arguments and ends by
+// tail calling the next one with them, so the whole function runs as one
+// chain of jumps that leave the registers where the previous stencil put
+// them. A hole is a 64-bit immediate the stencil materializes with inline
+// assembly, which the compiler can neither fold nor fetch relative to where
+// the code is; nothing else in a stencil may depend on its address. Each
+// stencil is placed in a section of its own, whose start and stop symbols
+// the linker provides, so that its code can be found and copied.
+
+typedef JitStatus (*Stencil)(Value* sp, Value* slots, CallFrame* frame);
+
+typedef enum
+{
+	HOLE_NEXT, // The next instruction's code.
+	HOLE_TARGET, // The code a jump leads to.
+	HOLE_INSTRUCTION, // The instruction in the chunk, for exits.
+	HOLE_IP, // Where frame->ip points while a helper runs.
+	HOLE_VM,
+	HOLE_HELPER,
+	HOLE_A, // Decoded operands.
+	HOLE_B,
+	HOLE_C,
+	HOLE_VALUE, // A Value known when compiling.
+	HOLE_CONSTANT, // Address of a slot in the constants.
+	HOLE_COUNT,
+} Hole;
+
+// Holes read "STENCIL" above their kind, which no stencil is likely to
+// contain otherwise.
+#define HOLE_MAGIC ((uint64_t)0x5354454E43494C00)
+
+#define HOLE(kind) __extension__ ({ \
+	uint64_t hole; \
+	__asm__("movabsq %1, %0" : "=r"(hole) : "i"(HOLE_MAGIC | (kind))); \
+	hole; \
+})
+
+#define HOLE_POINTER(type, kind) ((type)(uintptr_t)HOLE(kind))
+
+typedef JitStatus (*Helper0)(CallFrame* frame);
+typedef JitStatus (*Helper1)(CallFrame* frame, int a);
+typedef JitStatus (*Helper2)(CallFrame* frame, int a, int b);
+typedef JitStatus (*Helper3)(CallFrame* frame, int a, int b, int c);
+
+#define STENCILS(X) \
+	X(push_value) X(push_constant) X(pop) \
+	X(get_local) X(set_local) X(get_local_get_local) X(set_local_pop) X(get_upvalue) \
+	X(equal) X(not_equal) X(greater) X(greater_equal) X(less) X(less_equal) \
+	X(add) X(add_constant) X(subtract) X(multiply) X(divide) X(mod) X(negate) X(not) \
+	X(jump) X(jump_if_false) X(pop_jump_if_false) X(less_jump_if_false) \
+	X(greater_jump_if_false) X(loop) \
+	X(helper0) X(helper1) X(helper2) X(helper3) X(return) X(exit)
+
+// Stencils are compiled like the rest of the VM except for what would make
+// their code depend on where it runs: instrumentation calls, and cold blocks
+// moved to another section.
+#define STENCIL(name) \
+	__attribute__((section("luna_stencil_" #name), used, noinline, no_instrument_function, \
+		no_sanitize_address, optimize("no-reorder-blocks-and-partition"))) \
+	JitStatus stencil_##name(Value* sp, Value* slots, CallFrame* frame)
+
+#define CONTINUE(kind) return ((Stencil)HOLE(kind))(sp, slots, frame)
+#define NEXT() CONTINUE(HOLE_NEXT)
+
+// Hands the instruction back to run().
+#define EXIT() \
+	do \
+	{ \
+		frame->ip = HOLE_POINTER(uint8_t*, HOLE_INSTRUCTION); \
+		HOLE_POINTER(VM*, HOLE_VM)->stackTop = sp; \
+		return JIT_INTERPRET; \
+	} \
+	while (false)
+
+// Calls the helper in HOLE_HELPER the way the template compiler's
+// emitCallHelper() does.
+#define CALL_HELPER(type, ...) \
+	do \
+	{ \
+		VM* machine = HOLE_POINTER(VM*, HOLE_VM); \
+		frame->ip = HOLE_POINTER(uint8_t*, HOLE_IP); \
+		machine->stackTop = sp; \
+		JitStatus status = HOLE_POINTER(type, HOLE_HELPER)(__VA_ARGS__); \
+		if (status != JIT_OK) return status; \
+		sp = machine->stackTop; \
+		slots = frame->slots; \
+	} \
+	while (false)
+
+// value.h converts in inline functions, which sanitized builds would not
+// inline into a stencil but call relative to it.
+#define TO_NUMBER(value) (((union { Value bits; double number; }){ .bits = (value) }).number)
+#define FROM_NUMBER(num) (((union { double number; Value bits; }){ .number = (num) }).bits)
+
+#define IS_FALSEY(value) ((value) == NULL_VAL || (value) == FALSE_VAL)
+
+// Doubles are only ever added, compared and converted: a floating constant
+// would be loaded relative to the stencil.
+#define BINARY_NUMBERS() \
+	Value b = sp[-1]; \
+	Value a = sp[-2]; \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) EXIT()
+
+#define BINARY_RESULT(value) \
+	sp[-2] = (value); \
+	sp--; \
+	NEXT()
+
+STENCIL(push_value)
+{
+	*sp++ = HOLE(HOLE_VALUE);
+	NEXT();
+}
+
+// Objects can move, so only their slot in the constants is fixed.
+STENCIL(push_constant)
+{
+	*sp++ = *HOLE_POINTER(Value*, HOLE_CONSTANT);
+	NEXT();
+}
+
+STENCIL(pop)
+{
+	sp--;
+	NEXT();
+}
+
+STENCIL(get_local)
+{
+	*sp++ = slots[HOLE(HOLE_A)];
+	NEXT();
+}
+
+STENCIL(set_local)
+{
+	slots[HOLE(HOLE_A)] = sp[-1];
+	NEXT();
+}
+
+STENCIL(get_local_get_local)
+{
+	sp[0] = slots[HOLE(HOLE_A)];
+	sp[1] = slots[HOLE(HOLE_B)];
+	sp += 2;
+	NEXT();
+}
+
+STENCIL(set_local_pop)
+{
+	slots[HOLE(HOLE_A)] = *--sp;
+	NEXT();
+}
+
+STENCIL(get_upvalue)
+{
+	*sp++ = *frame->closure->upvalues[HOLE(HOLE_A)]->location;
+	NEXT();
+}
+
+// Numbers compare by value and everything else by its bits, as in
+// valueEquals().
+STENCIL(equal)
+{
+	Value b = sp[-1];
+	Value a = sp[-2];
+	BINARY_RESULT(BOOL_VAL(IS_NUMBER(a) && IS_NUMBER(b) ? TO_NUMBER(a) == TO_NUMBER(b) : a == b));
+}
+
+STENCIL(not_equal)
+{
+	Value b = sp[-1];
+	Value a = sp[-2];
+	BINARY_RESULT(BOOL_VAL(IS_NUMBER(a) && IS_NUMBER(b) ? TO_NUMBER(a) != TO_NUMBER(b) : a != b));
+}
+
+STENCIL(greater)
+{
+	BINARY_NUMBERS();
+	BINARY_RESULT(BOOL_VAL(TO_NUMBER(a) > TO_NUMBER(b)));
+}
+
+STENCIL(greater_equal)
+{
+	BINARY_NUMBERS();
+	BINARY_RESULT(BOOL_VAL(TO_NUMBER(a) >= TO_NUMBER(b)));
+}
+
+STENCIL(less)
+{
+	BINARY_NUMBERS();
+	BINARY_RESULT(BOOL_VAL(TO_NUMBER(a) < TO_NUMBER(b)));
+}
+
+STENCIL(less_equal)
+{
+	BINARY_NUMBERS();
+	BINARY_RESULT(BOOL_VAL(TO_NUMBER(a) <= TO_NUMBER(b)));
+}
+
+STENCIL(add)
+{
+	Value b = sp[-1];
+	Value a = sp[-2];
+
+	if (IS_NUMBER(a) && IS_NUMBER(b))
+	{
+		BINARY_RESULT(FROM_NUMBER(TO_NUMBER(a) + TO_NUMBER(b)));
+	}
+
+	// Concatenation.
+	CALL_HELPER(Helper0, frame);
+	NEXT();
+}
+
+STENCIL(add_constant)
+{
+	Value a = sp[-1];
+
+	if (IS_NUMBER(a))
+	{
+		sp[-1] = FROM_NUMBER(TO_NUMBER(a) + TO_NUMBER(HOLE(HOLE_VALUE)));
+		NEXT();
+	}
+
+	CALL_HELPER(Helper1, frame, (int)HOLE(HOLE_A));
+	NEXT();
+}
+
+STENCIL(subtract)
+{
+	BINARY_NUMBERS();
+	BINARY_RESULT(FROM_NUMBER(TO_NUMBER(a) - TO_NUMBER(b)));
+}
+
+STENCIL(multiply)
+{
+	BINARY_NUMBERS();
+	BINARY_RESULT(FROM_NUMBER(TO_NUMBER(a) * TO_NUMBER(b)));
+}
+
+STENCIL(divide)
+{
+	BINARY_NUMBERS();
+	BINARY_RESULT(FROM_NUMBER(TO_NUMBER(a) / TO_NUMBER(b)));
+}
+
+// On the operands truncated to int, as run() does.
+STENCIL(mod)
+{
+	BINARY_NUMBERS();
+	BINARY_RESULT(FROM_NUMBER((double)((int)TO_NUMBER(a) % (int)TO_NUMBER(b))));
+}
+
+// Flips the sign bit rather than negating the double, which would need a
+// mask loaded from memory.
+STENCIL(negate)
+{
+	Value a = sp[-1];
+	if (!IS_NUMBER(a)) EXIT();
+	sp[-1] = a ^ SIGN_BIT;
+	NEXT();
+}
+
+STENCIL(not)
+{
+	sp[-1] = BOOL_VAL(IS_FALSEY(sp[-1]));
+	NEXT();
+}
+
+STENCIL(jump)
+{
+	CONTINUE(HOLE_TARGET);
+}
+
+STENCIL(jump_if_false)
+{
+	if (IS_FALSEY(sp[-1])) CONTINUE(HOLE_TARGET);
+	NEXT();
+}
+
+STENCIL(pop_jump_if_false)
+{
+	Value a = *--sp;
+	if (IS_FALSEY(a)) CONTINUE(HOLE_TARGET);
+	NEXT();
+}
+
+// Unordered operands jump, as every comparison with NaN is false.
+STENCIL(less_jump_if_false)
+{
+	BINARY_NUMBERS();
+	sp -= 2;
+	if (!(TO_NUMBER(a) < TO_NUMBER(b))) CONTINUE(HOLE_TARGET);
+	NEXT();
+}
+
+STENCIL(greater_jump_if_false)
+{
+	BINARY_NUMBERS();
+	sp -= 2;
+	if (!(TO_NUMBER(a) > TO_NUMBER(b))) CONTINUE(HOLE_TARGET);
+	NEXT();
+}
+
+// A backward jump checks for a minor collection, as SAFEPOINT() does.
+STENCIL(loop)
+{
+#ifndef DEBUG_STRESS_GC
+	VM* machine = HOLE_POINTER(VM*, HOLE_VM);
+	if (machine->nurseryTop <= machine->nurseryLimit && !machine->compactionPending)
+	{
+		CONTINUE(HOLE_TARGET);
+	}
+#endif
+
+	CALL_HELPER(Helper0, frame);
+	CONTINUE(HOLE_TARGET);
+}
+
+STENCIL(helper0)
+{
+	CALL_HELPER(Helper0, frame);
+	NEXT();
+}
+
+STENCIL(helper1)
+{
+	CALL_HELPER(Helper1, frame, (int)HOLE(HOLE_A));
+	NEXT();
+}
+
+STENCIL(helper2)
+{
+	CALL_HELPER(Helper2, frame, (int)HOLE(HOLE_A), (int)HOLE(HOLE_B));
+	NEXT();
+}
+
+STENCIL(helper3)
+{
+	CALL_HELPER(Helper3, frame, (int)HOLE(HOLE_A), (int)HOLE(HOLE_B), (int)HOLE(HOLE_C));
+	NEXT();
+}
+
+// run() finishes the script itself.
+STENCIL(return)
+{
+	if (HOLE_POINTER(VM*, HOLE_VM)->frameCount == 1) EXIT();
+	frame->ip = HOLE_POINTER(uint8_t*, HOLE_IP);
+	HOLE_POINTER(VM*, HOLE_VM)->stackTop = sp;
+	return HOLE_POINTER(Helper0, HOLE_HELPER)(frame);
+}
+
+// Skipped by run() as well, one byte at a time.
+STENCIL(exit)
+{
+	EXIT();
+}
+
+typedef enum
+{
+#define STENCIL_ID(name) STENCIL_##name,
+	STENCILS(STENCIL_ID)
+#undef STENCIL_ID
+	STENCIL_COUNT,
+} StencilId;
+
+#define STENCIL_BOUNDS(name) \
+	extern uint8_t __start_luna_stencil_##name[]; \
+	extern uint8_t __stop_luna_stencil_##name[];
+STENCILS(STENCIL_BOUNDS)
+#undef STENCIL_BOUNDS
+
+#define MAX_HOLES 16
+
+typedef struct
+{
+	uint8_t* start;
+	int size;
+	// The size without a tail call to the next stencil at its end, which
+	// the copy can drop as that stencil follows it.
+	int fallthroughSize;
+	int holeCount;
+	struct
+	{
+		int at;
+		Hole kind;
+		// Loads the next stencil right before jumping to it, so that the
+		// copy can jump there directly instead.
+		bool direct;
+	} holes[MAX_HOLES];
+} StencilCode;
+
+static StencilCode stencils[STENCIL_COUNT];
+
+// Finds the jump to the stencil loaded by the movabs ending at end, and
+// returns how far past end it is, or -1 unless it is a tail call: a jmp
+// through the same register before any call through it. Only the epilogue
+// comes in between.
+static int findTailJump(uint8_t* end, uint8_t* limit, uint8_t rex, uint8_t opcode)
+{
+	int reg = (opcode & 7) | (rex & 1) << 3;
+
+	for (uint8_t* at = end; at + 1 < limit && at < end + 64; at++)
+	{
+		bool extended = reg >= 8;
+		if (extended && at[0] != 0x41) continue;
+
+		uint8_t* instruction = at + extended;
+		if (instruction + 1 >= limit || instruction[0] != 0xFF) continue;
+		if (instruction[1] == (0xE0 | (reg & 7))) return (int)(at - end);
+		if (instruction[1] == (0xD0 | (reg & 7))) return -1;
+	}
+
+	return -1;
+}
+
+// Finds the holes of a stencil and checks that it can be copied, which
+// depends on how it was compiled: without optimization the next stencil is
+// called rather than jumped to, and the C stack would grow with every
+// instruction.
+static bool loadStencil(StencilCode* stencil, uint8_t* start, uint8_t* stop)
+{
+	stencil->start = start;
+	stencil->size = (int)(stop - start);
+	stencil->fallthroughSize = stencil->size;
+	stencil->holeCount = 0;
+
+	int nextCount = 0;
+	int lastNext = -1;
+
+	for (int at = 2; at + 8 <= stencil->size; at++)
+	{
+		uint64_t value;
+		memcpy(&value, start + at, sizeof(value));
+		if ((value & ~(uint64_t)0xFF) != HOLE_MAGIC || (value & 0xFF) >= HOLE_COUNT) continue;
+
+		// movabs with REX.W.
+		uint8_t rex = start[at - 2];
+		uint8_t opcode = start[at - 1];
+		if ((rex & 0xFE) != 0x48 || (opcode & 0xF8) != 0xB8) return false;
+		if (stencil->holeCount == MAX_HOLES) return false;
+
+		Hole kind = (Hole)(value & 0xFF);
+		stencil->holes[stencil->holeCount].at = at;
+		stencil->holes[stencil->holeCount].kind = kind;
+		stencil->holes[stencil->holeCount].direct = false;
+
+		if (kind == HOLE_NEXT || kind == HOLE_TARGET)
+		{
+			int distance = findTailJump(start + at + 8, stop, rex, opcode);
+			if (distance < 0) return false;
+			stencil->holes[stencil->holeCount].direct = distance == 0;
+		}
+
+		stencil->holeCount++;
+
+		if (kind == HOLE_NEXT)
+		{
+			nextCount++;
+			lastNext = at;
+		}
+
+		at += 7;
+	}
+
+	if (nextCount == 1)
+	{
+		// movabs reg, next; jmp reg as the very last instructions.
+		int jumpSize = start[lastNext - 2] & 1 ? 3 : 2;
+		if (lastNext + 8 + jumpSize == stencil->size) stencil->fallthroughSize = lastNext - 2;
+	}
+
+	return true;
+}
+
+// Loaded once, on the first compile. Stencils that cannot be copied leave
+// the template compiler to do the work.
+static bool loadStencils()
+{
+	static bool loaded = false;
+	static bool usable = false;
+	if (loaded) return usable;
+	loaded = true;
+
+	uint8_t* bounds[STENCIL_COUNT][2] = {
+#define STENCIL_BOUNDS(name) { __start_luna_stencil_##name, __stop_luna_stencil_##name },
+		STENCILS(STENCIL_BOUNDS)
+#undef STENCIL_BOUNDS
+	};
+
+	for (int i = 0; i < STENCIL_COUNT; i++)
+	{
+		if (!loadStencil(&stencils[i], bounds[i][0], bounds[i][1])) return false;
+	}
+
+	usable = true;
+	return true;
+}
+
+// What to copy for one instruction and what to fill its holes with. NEXT,
+// TARGET, INSTRUCTION and IP hold bytecode offsets until the code is laid
+// out.
+typedef struct
+{
+	StencilId stencil;
+	uint64_t holes[HOLE_COUNT];
+} Patch;
+
+static uint16_t readShort(Chunk* chunk, int offset)
+{
+	return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+static void setHelper(Patch* patch, StencilId stencil, void* helper)
+{
+	patch->stencil = stencil;
+	patch->holes[HOLE_HELPER] = (uint64_t)(uintptr_t)helper;
+}
+
+// Picks the stencil for the instruction at offset and its patches, and
+// returns the offset of the next instruction.
+static int selectStencil(Chunk* chunk, int offset, Patch* patch)
+{
+	uint8_t* code = chunk->code;
+	int next = offset + 1;
+
+	memset(patch, 0, sizeof(Patch));
+	patch->stencil = STENCIL_exit;
+	patch->holes[HOLE_INSTRUCTION] = (uint64_t)offset;
+	patch->holes[HOLE_VM] = (uint64_t)(uintptr_t)&vm;
+
+	switch (code[offset])
+	{
+	case OP_CONSTANT:
+	case OP_CONSTANT_LONG:
+	{
+		bool wide = code[offset] == OP_CONSTANT_LONG;
+		int constant = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		Value value = chunk->constants.values[constant];
+		next = offset + (wide ? 3 : 2);
+
+		if (IS_OBJ(value))
+		{
+			patch->stencil = STENCIL_push_constant;
+			patch->holes[HOLE_CONSTANT] = (uint64_t)(uintptr_t)&chunk->constants.values[constant];
+		}
+		else
+		{
+			patch->stencil = STENCIL_push_value;
+			patch->holes[HOLE_VALUE] = value;
+		}
+		break;
+	}
+
+	case OP_NULL:
+	case OP_TRUE:
+	case OP_FALSE:
+		patch->stencil = STENCIL_push_value;
+		patch->holes[HOLE_VALUE] = code[offset] == OP_NULL ? NULL_VAL : BOOL_VAL(code[offset] == OP_TRUE);
+		break;
+
+	case OP_POP: patch->stencil = STENCIL_pop; break;
+
+	case OP_GET_LOCAL:
+	case OP_SET_LOCAL:
+		patch->stencil = code[offset] == OP_GET_LOCAL ? STENCIL_get_local : STENCIL_set_local;
+		patch->holes[HOLE_A] = code[offset + 1];
+		next = offset + 2;
+		break;
+
+	case OP_GET_LOCAL_LONG:
+	case OP_SET_LOCAL_LONG:
+		patch->stencil = code[offset] == OP_GET_LOCAL_LONG ? STENCIL_get_local : STENCIL_set_local;
+		patch->holes[HOLE_A] = readShort(chunk, offset + 1);
+		next = offset + 3;
+		break;
+
+	case OP_GET_LOCAL_GET_LOCAL:
+		patch->stencil = STENCIL_get_local_get_local;
+		patch->holes[HOLE_A] = code[offset + 1];
+		patch->holes[HOLE_B] = code[offset + 2];
+		next = offset + 3;
+		break;
+
+	case OP_SET_LOCAL_POP:
+		patch->stencil = STENCIL_set_local_pop;
+		patch->holes[HOLE_A] = code[offset + 1];
+		next = offset + 2;
+		break;
+
+	case OP_GET_UPVALUE:
+		patch->stencil = STENCIL_get_upvalue;
+		patch->holes[HOLE_A] = code[offset + 1];
+		next = offset + 2;
+		break;
+
+	case OP_SET_UPVALUE:
+		setHelper(patch, STENCIL_helper1, (void*)jitSetUpvalue);
+		patch->holes[HOLE_A] = code[offset + 1];
+		next = offset + 2;
+		break;
+
+	case OP_CLOSE_UPVALUE: setHelper(patch, STENCIL_helper0, (void*)jitCloseUpvalue); break;
+
+	case OP_DEFINE_GLOBAL:
+	case OP_GET_GLOBAL:
+	case OP_SET_GLOBAL:
+	case OP_DEFINE_GLOBAL_LONG:
+	case OP_GET_GLOBAL_LONG:
+	case OP_SET_GLOBAL_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_DEFINE_GLOBAL_LONG || op == OP_GET_GLOBAL_LONG || op == OP_SET_GLOBAL_LONG;
+		setHelper(patch, STENCIL_helper1, op == OP_DEFINE_GLOBAL || op == OP_DEFINE_GLOBAL_LONG ? (void*)jitDefineGlobal :
+			op == OP_GET_GLOBAL || op == OP_GET_GLOBAL_LONG ? (void*)jitGetGlobal : (void*)jitSetGlobal);
+		patch->holes[HOLE_A] = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		next = offset + (wide ? 3 : 2);
+		break;
+	}
+
+	case OP_EQUAL:
+	case OP_EQUAL_NUM: patch->stencil = STENCIL_equal; break;
+	case OP_NOT_EQUAL:
+	case OP_NOT_EQUAL_NUM: patch->stencil = STENCIL_not_equal; break;
+	case OP_GREATER: patch->stencil = STENCIL_greater; break;
+	case OP_GREATER_EQUAL: patch->stencil = STENCIL_greater_equal; break;
+	case OP_LESS: patch->stencil = STENCIL_less; break;
+	case OP_LESS_EQUAL: patch->stencil = STENCIL_less_equal; break;
+
+	case OP_ADD:
+	case OP_ADD_NUM_NUM:
+	case OP_ADD_STR_STR:
+		setHelper(patch, STENCIL_add, (void*)jitAdd);
+		break;
+
+	case OP_ADD_CONSTANT:
+		setHelper(patch, STENCIL_add_constant, (void*)jitAddConstant);
+		patch->holes[HOLE_A] = code[offset + 1];
+		patch->holes[HOLE_VALUE] = chunk->constants.values[code[offset + 1]];
+		next = offset + 2;
+		break;
+
+	case OP_SUBTRACT: patch->stencil = STENCIL_subtract; break;
+	case OP_MULTIPLY: patch->stencil = STENCIL_multiply; break;
+	case OP_DIVIDE: patch->stencil = STENCIL_divide; break;
+	case OP_MOD: patch->stencil = STENCIL_mod; break;
+	case OP_NEGATE: patch->stencil = STENCIL_negate; break;
+	case OP_NOT: patch->stencil = STENCIL_not; break;
+
+	case OP_PRINT:
+	case OP_PRINTLN:
+		setHelper(patch, STENCIL_helper1, (void*)jitPrint);
+		patch->holes[HOLE_A] = code[offset] == OP_PRINTLN;
+		break;
+
+	case OP_JUMP:
+	case OP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_FALSE:
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE:
+		patch->stencil = code[offset] == OP_JUMP ? STENCIL_jump :
+			code[offset] == OP_JUMP_IF_FALSE ? STENCIL_jump_if_false :
+			code[offset] == OP_POP_JUMP_IF_FALSE ? STENCIL_pop_jump_if_false :
+			code[offset] == OP_LESS_JUMP_IF_FALSE ? STENCIL_less_jump_if_false : STENCIL_greater_jump_if_false;
+		next = offset + 3;
+		patch->holes[HOLE_TARGET] = (uint64_t)(next + readShort(chunk, offset + 1));
+		break;
+
+	case OP_LOOP:
+		setHelper(patch, STENCIL_loop, (void*)jitSafepoint);
+		next = offset + 3;
+		patch->holes[HOLE_TARGET] = (uint64_t)(next - readShort(chunk, offset + 1));
+		break;
+
+	case OP_CALL:
+	case OP_TAIL_CALL:
+		setHelper(patch, STENCIL_helper1, code[offset] == OP_CALL ? (void*)jitCall : (void*)jitTailCall);
+		patch->holes[HOLE_A] = code[offset + 1];
+		next = offset + 2;
+		break;
+
+	case OP_INVOKE:
+	case OP_TAIL_INVOKE:
+	case OP_INVOKE_LONG:
+	case OP_TAIL_INVOKE_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_INVOKE_LONG || op == OP_TAIL_INVOKE_LONG;
+		int operands = offset + (wide ? 3 : 2);
+		setHelper(patch, STENCIL_helper3,
+			op == OP_INVOKE || op == OP_INVOKE_LONG ? (void*)jitInvoke : (void*)jitTailInvoke);
+		patch->holes[HOLE_A] = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		patch->holes[HOLE_B] = code[operands];
+		patch->holes[HOLE_C] = readShort(chunk, operands + 1);
+		next = operands + 3;
+		break;
+	}
+
+	case OP_SUPER_INVOKE:
+	case OP_TAIL_SUPER_INVOKE:
+	case OP_SUPER_INVOKE_LONG:
+	case OP_TAIL_SUPER_INVOKE_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_SUPER_INVOKE_LONG || op == OP_TAIL_SUPER_INVOKE_LONG;
+		int operands = offset + (wide ? 3 : 2);
+		setHelper(patch, STENCIL_helper2,
+			op == OP_SUPER_INVOKE || op == OP_SUPER_INVOKE_LONG ? (void*)jitSuperInvoke : (void*)jitTailSuperInvoke);
+		patch->holes[HOLE_A] = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		patch->holes[HOLE_B] = code[operands];
+		next = operands + 1;
+		break;
+	}
+
+	case OP_CLOSURE:
+	case OP_CLOSURE_LONG:
+	{
+		bool wide = code[offset] == OP_CLOSURE_LONG;
+		int constant = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+		setHelper(patch, STENCIL_helper1, (void*)jitClosure);
+		patch->holes[HOLE_A] = (uint64_t)offset;
+		next = offset + (wide ? 3 + 3 * function->upvalueCount : 2 + 2 * function->upvalueCount);
+		break;
+	}
+
+	case OP_GET_PROPERTY:
+	case OP_SET_PROPERTY:
+	case OP_GET_PROPERTY_LONG:
+	case OP_SET_PROPERTY_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_GET_PROPERTY_LONG || op == OP_SET_PROPERTY_LONG;
+		setHelper(patch, STENCIL_helper2,
+			op == OP_GET_PROPERTY || op == OP_GET_PROPERTY_LONG ? (void*)jitGetProperty : (void*)jitSetProperty);
+		patch->holes[HOLE_A] = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		patch->holes[HOLE_B] = readShort(chunk, offset + (wide ? 3 : 2));
+		next = offset + (wide ? 5 : 4);
+		break;
+	}
+
+	case OP_STRUCT:
+	case OP_METHOD:
+	case OP_GET_SUPER:
+	case OP_STRUCT_LONG:
+	case OP_METHOD_LONG:
+	case OP_GET_SUPER_LONG:
+	{
+		OpCode op = code[offset];
+		bool wide = op == OP_STRUCT_LONG || op == OP_METHOD_LONG || op == OP_GET_SUPER_LONG;
+		setHelper(patch, STENCIL_helper1, op == OP_STRUCT || op == OP_STRUCT_LONG ? (void*)jitStruct :
+			op == OP_METHOD || op == OP_METHOD_LONG ? (void*)jitMethod : (void*)jitGetSuper);
+		patch->holes[HOLE_A] = wide ? readShort(chunk, offset + 1) : code[offset + 1];
+		next = offset + (wide ? 3 : 2);
+		break;
+	}
+
+	case OP_INHERIT: setHelper(patch, STENCIL_helper0, (void*)jitInherit); break;
+	case OP_LIST: setHelper(patch, STENCIL_helper0, (void*)jitList); break;
+	case OP_ADD_LIST: setHelper(patch, STENCIL_helper0, (void*)jitAddList); break;
+	case OP_INDEX_GET: setHelper(patch, STENCIL_helper0, (void*)jitIndexGet); break;
+	case OP_INDEX_SET: setHelper(patch, STENCIL_helper0, (void*)jitIndexSet); break;
+	case OP_RETURN: setHelper(patch, STENCIL_return, (void*)jitReturn); break;
+
+	default:
+		break;
+	}
+
+	// A safepoint in a loop resumes at its target.
+	patch->holes[HOLE_NEXT] = (uint64_t)next;
+	patch->holes[HOLE_IP] = patch->stencil == STENCIL_loop ? patch->holes[HOLE_TARGET] : (uint64_t)next;
+
+	return next;
+}
+
+static JitStatus enterStencils(CallFrame* frame, uint8_t* target)
+{
+	return ((Stencil)(uintptr_t)target)(vm.stackTop, frame->slots, frame);
+}
+
+bool jitCompileStencils(ObjFunction* function)
+{
+	if (!loadStencils()) return false;
+
+	Chunk* chunk = &function->chunk;
+	uint32_t* entries = (uint32_t*)calloc(chunk->count, sizeof(uint32_t));
+	if (entries == NULL) exit(1);
+
+	// Lay the stencils out first, as their holes need each other's
+	// addresses. A trap at offset 0 keeps every entry nonzero.
+	size_t count = 1;
+	Patch patch;
+
+	for (int offset = 0; offset < chunk->count;)
+	{
+		entries[offset] = (uint32_t)count;
+		offset = selectStencil(chunk, offset, &patch);
+		count += (size_t)stencils[patch.stencil].fallthroughSize;
+	}
+
+	// Nothing falls off the end of a chunk; ud2 in case it did.
+	size_t end = count;
+	count += 2;
+
+	// Written, then made executable, never both at once.
+	size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t size = (count + pageSize - 1) / pageSize * pageSize;
+	uint8_t* code = (uint8_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (code == MAP_FAILED)
+	{
+		free(entries);
+		return false;
+	}
+
+	code[0] = 0xCC;
+	code[end] = 0x0F;
+	code[end + 1] = 0x0B;
+
+	for (int offset = 0; offset < chunk->count;)
+	{
+		int next = selectStencil(chunk, offset, &patch);
+		StencilCode* stencil = &stencils[patch.stencil];
+		uint8_t* copy = code + entries[offset];
+
+		patch.holes[HOLE_NEXT] = (uint64_t)(uintptr_t)(code + (next < chunk->count ? entries[next] : end));
+		patch.holes[HOLE_TARGET] = (uint64_t)(uintptr_t)(code + entries[patch.holes[HOLE_TARGET]]);
+		patch.holes[HOLE_INSTRUCTION] = (uint64_t)(uintptr_t)(chunk->code + patch.holes[HOLE_INSTRUCTION]);
+		patch.holes[HOLE_IP] = (uint64_t)(uintptr_t)(chunk->code + patch.holes[HOLE_IP]);
+
+		memcpy(copy, stencil->start, stencil->fallthroughSize);
+		for (int i = 0; i < stencil->holeCount; i++)
+		{
+			int at = stencil->holes[i].at;
+			uint64_t value = patch.holes[stencil->holes[i].kind];
+			if (at >= stencil->fallthroughSize) continue;
+
+			if (stencil->holes[i].direct)
+			{
+				// jmp rel32 over the movabs. The jmp through the register
+				// after it stays for any other path that leads there.
+				int32_t displacement = (int32_t)((uint8_t*)(uintptr_t)value - (copy + at + 3));
+				copy[at - 2] = 0xE9;
+				memcpy(copy + at - 1, &displacement, sizeof(displacement));
+			}
+			else
+			{
+				memcpy(copy + at, &value, sizeof(value));
+			}
+		}
+
+		offset = next;
+	}
+
+	mprotect(code, size, PROT_READ | PROT_EXEC);
+
+	JitCode* jitCode = (JitCode*)malloc(sizeof(JitCode));
+	if (jitCode == NULL) exit(1);
+	jitCode->code = code;
+	jitCode->size = size;
+	jitCode->entries = entries;
+	jitCode->enter = enterStencils;
+	function->jitCode = jitCode;
+	return true;
+}
+
+#endif
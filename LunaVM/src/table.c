@@ -57,6 +57,15 @@ bool tableGet(Table* table, ObjString* key, Value* value)
 	return true;
 }
 
+// The entry holding key, which stays where it is until the table grows.
+Entry* tableGetEntry(Table* table, ObjString* key)
+{
+	if (table->count == 0) return NULL;
+
+	Entry* entry = findEntry(table->entries, table->capacity, key);
+	return entry->key == NULL ? NULL : entry;
+}
+
 static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
 {
 	uint32_t index = key->hash & (capacity - 1);
@@ -148,6 +157,16 @@ bool tableDelete(Table* table, ObjString* key)
 	return true;
 }
 
+// Re-points the entry for key at newKey, an identical copy of the same string
+// made by the collector, without disturbing the probe sequence.
+void tableMoveKey(Table* table, ObjString* key, ObjString* newKey)
+{
+	if (table->count == 0) return;
+
+	Entry* entry = findEntry(table->entries, table->capacity, key);
+	if (entry->key == key) entry->key = newKey;
+}
+
 void tableAddAll(Table* from, Table* to)
 {
 	for (int i = 0; i < from->capacity; i++)
@@ -156,11 +175,24 @@ void tableAddAll(Table* from, Table* to)
 
 		if (entry->key != NULL) 
 		{
-			tableSet(from, entry->key, entry->value);
+			tableSet(to, entry->key, entry->value);
 		}
 	}
 }
 
+// Barrier for bulk stores such as tableAddAll(), which write many entries
+// into the table owned by owner at once.
+void tableWriteBarrier(Obj* owner, Table* table)
+{
+	if (owner != NULL && !owner->isYoung && !owner->isRemembered)
+	{
+		rememberObject(owner);
+	}
+
+	if (vm.gcPhase != GC_MARK_PHASE) return;
+	if (owner == NULL || owner->isMarked) markTable(table);
+}
+
 ObjString* tableFindString(Table* table, const char* characters, int length, uint32_t hash)
 {
 	if (table->count == 0) return NULL;
@@ -181,6 +213,6 @@ ObjString* tableFindString(Table* table, const char* characters, int length, uin
 			return entry->key;
 		}
 
-		index = (index + 1) % (table->capacity - 1);
+		index = (index + 1) & (table->capacity - 1);
 	}
 }
@@ -23,9 +23,12 @@ void freeTable(Table* table);
 void markTable(Table* table);
 void tableRemoveWhite(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+Entry* tableGetEntry(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
+void tableWriteBarrier(Obj* owner, Table* table);
+void tableMoveKey(Table* table, ObjString* key, ObjString* newKey);
 ObjString* tableFindString(Table* table, const char* characters, int length, uint32_t hash);
 
 #endif
\ No newline at end of file
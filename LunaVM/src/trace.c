@@ -0,0 +1,480 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "nativelib.h"
+
+#ifdef JIT
+
+// A tracing compiler for loops. Every backward jump counts towards its loop
+// head; once one is hot, the recorder runs the next iteration itself,
+// instruction by instruction on the interpreter's stack and frames, and
+// writes down the path it took and the types it met. jitCompileTrace()
+// turns that into machine code that runs the same path over and over,
+// checking on the way that the values and branches are still those it was
+// recorded with, and hands the loop back to run() where they are not.
+//
+// The recorder only knows numbers, booleans and null, locals and globals,
+// and the math natives. It stops before anything else, which run() then
+// executes, and the loop is never recorded again.
+
+// Counters for loop heads, hashed by address: loops that share one only
+// get hot sooner.
+#define HOT_LOOPS 64
+
+// Longest iteration recorded; longer ones are likely nested loops.
+#define TRACE_MAX_STEPS 512
+
+static int hotLoops[HOT_LOOPS];
+
+typedef struct
+{
+	TraceRecording recording;
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* sp;
+	Value* slots;
+	Value* constants;
+	int backJumps; // Taken to other places than the loop head.
+	bool closed; // The iteration got back to the loop head.
+} Recorder;
+
+static bool isFalsey(Value value)
+{
+	return IS_NULL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static Trace* findTrace(ObjFunction* function, uint8_t* start)
+{
+	for (Trace* trace = function->traces; trace != NULL; trace = trace->next)
+	{
+		if (trace->start == start) return trace;
+	}
+
+	return NULL;
+}
+
+static TraceStep* addStep(Recorder* recorder, TraceOp op)
+{
+	TraceRecording* recording = &recorder->recording;
+
+	if (recording->count == recording->capacity)
+	{
+		recording->capacity = recording->capacity < 64 ? 64 : recording->capacity * 2;
+		recording->steps = (TraceStep*)realloc(recording->steps, sizeof(TraceStep) * recording->capacity);
+		if (recording->steps == NULL) exit(1);
+	}
+
+	TraceStep* step = &recording->steps[recording->count++];
+	memset(step, 0, sizeof(TraceStep));
+	step->op = op;
+	return step;
+}
+
+// The type a trace knows value by, if it can hold it at all.
+static bool traceType(Value value, TraceType* type, NativeFn* native)
+{
+	*native = NULL;
+
+	if (IS_NUMBER(value)) *type = TRACE_NUMBER;
+	else if (IS_BOOL(value)) *type = TRACE_BOOL;
+	else if (IS_NULL(value)) *type = TRACE_NULL;
+	else if (IS_NATIVE(value))
+	{
+		*type = TRACE_NATIVE;
+		*native = AS_NATIVE(value);
+	}
+	else return false;
+
+	return true;
+}
+
+// Records pushing value, got by op from slot or global.
+static bool recordPush(Recorder* recorder, TraceOp op, Value value, int slot, Value* global)
+{
+	TraceType type;
+	NativeFn native;
+	if (!traceType(value, &type, &native)) return false;
+
+	TraceStep* step = addStep(recorder, op);
+	step->type = type;
+	step->native = native;
+	step->value = value;
+	step->slot = slot;
+	step->global = global;
+	*recorder->sp++ = value;
+	return true;
+}
+
+// The C function behind a math native, which a trace calls directly.
+static double (*mathFunction(Value callee))(double)
+{
+	if (!IS_NATIVE(callee)) return NULL;
+
+	NativeFn native = AS_NATIVE(callee);
+	if (native == sinNative) return sin;
+	if (native == cosNative) return cos;
+	if (native == tanNative) return tan;
+	if (native == sqrtNative) return sqrt;
+	return NULL;
+}
+
+static uint16_t readShort(uint8_t* ip)
+{
+	return (uint16_t)((ip[0] << 8) | ip[1]);
+}
+
+// Records a branch that went to taken, and would have gone to notTaken.
+static void recordGuard(Recorder* recorder, bool truthy, bool pop, uint8_t* taken, uint8_t* notTaken)
+{
+	TraceStep* step = addStep(recorder, TRACE_GUARD);
+	step->truthy = truthy;
+	step->pop = pop;
+	step->exit = notTaken;
+	recorder->ip = taken;
+}
+
+// Records and executes the instruction at recorder->ip as run() would.
+// Returns false, having done nothing, for one a trace cannot run.
+static bool recordInstruction(Recorder* recorder)
+{
+	uint8_t* ip = recorder->ip;
+	Value* sp = recorder->sp;
+	Value* slots = recorder->slots;
+
+	switch (*ip)
+	{
+	case OP_CONSTANT:
+		if (!recordPush(recorder, TRACE_CONSTANT, recorder->constants[ip[1]], 0, NULL)) return false;
+		recorder->ip += 2;
+		return true;
+
+	case OP_CONSTANT_LONG:
+		if (!recordPush(recorder, TRACE_CONSTANT, recorder->constants[readShort(ip + 1)], 0, NULL)) return false;
+		recorder->ip += 3;
+		return true;
+
+	case OP_NULL:
+	case OP_TRUE:
+	case OP_FALSE:
+		recordPush(recorder, TRACE_CONSTANT, *ip == OP_NULL ? NULL_VAL : BOOL_VAL(*ip == OP_TRUE), 0, NULL);
+		recorder->ip++;
+		return true;
+
+	case OP_POP:
+		addStep(recorder, TRACE_POP);
+		recorder->sp--;
+		recorder->ip++;
+		return true;
+
+	case OP_GET_LOCAL:
+		if (!recordPush(recorder, TRACE_GET_LOCAL, slots[ip[1]], ip[1], NULL)) return false;
+		recorder->ip += 2;
+		return true;
+
+	case OP_GET_LOCAL_LONG:
+	{
+		int slot = readShort(ip + 1);
+		if (!recordPush(recorder, TRACE_GET_LOCAL, slots[slot], slot, NULL)) return false;
+		recorder->ip += 3;
+		return true;
+	}
+
+	case OP_GET_LOCAL_GET_LOCAL:
+	{
+		TraceType type;
+		NativeFn native;
+		if (!traceType(slots[ip[1]], &type, &native) || !traceType(slots[ip[2]], &type, &native)) return false;
+
+		recordPush(recorder, TRACE_GET_LOCAL, slots[ip[1]], ip[1], NULL);
+		recordPush(recorder, TRACE_GET_LOCAL, slots[ip[2]], ip[2], NULL);
+		recorder->ip += 3;
+		return true;
+	}
+
+	case OP_SET_LOCAL:
+	case OP_SET_LOCAL_LONG:
+	case OP_SET_LOCAL_POP:
+	{
+		bool wide = *ip == OP_SET_LOCAL_LONG;
+		int slot = wide ? readShort(ip + 1) : ip[1];
+		addStep(recorder, TRACE_SET_LOCAL)->slot = slot;
+		slots[slot] = sp[-1];
+
+		if (*ip == OP_SET_LOCAL_POP)
+		{
+			addStep(recorder, TRACE_POP);
+			recorder->sp--;
+		}
+
+		recorder->ip += wide ? 3 : 2;
+		return true;
+	}
+
+	case OP_GET_GLOBAL:
+	case OP_GET_GLOBAL_LONG:
+	{
+		bool wide = *ip == OP_GET_GLOBAL_LONG;
+		int name = wide ? readShort(ip + 1) : ip[1];
+		Entry* entry = tableGetEntry(&vm.globals, AS_STRING(recorder->constants[name]));
+		if (entry == NULL || !recordPush(recorder, TRACE_GET_GLOBAL, entry->value, 0, &entry->value)) return false;
+		recorder->ip += wide ? 3 : 2;
+		return true;
+	}
+
+	case OP_SET_GLOBAL:
+	case OP_SET_GLOBAL_LONG:
+	{
+		// Natives would need the write barrier.
+		bool wide = *ip == OP_SET_GLOBAL_LONG;
+		int name = wide ? readShort(ip + 1) : ip[1];
+		Entry* entry = tableGetEntry(&vm.globals, AS_STRING(recorder->constants[name]));
+		if (entry == NULL || IS_OBJ(sp[-1])) return false;
+
+		addStep(recorder, TRACE_SET_GLOBAL)->global = &entry->value;
+		entry->value = sp[-1];
+		recorder->ip += wide ? 3 : 2;
+		return true;
+	}
+
+	case OP_ADD:
+	case OP_ADD_NUM_NUM:
+	case OP_ADD_STR_STR:
+	case OP_SUBTRACT:
+	case OP_MULTIPLY:
+	case OP_DIVIDE:
+	case OP_MOD:
+	{
+		if (!IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1])) return false;
+
+		double a = AS_NUMBER(sp[-2]);
+		double b = AS_NUMBER(sp[-1]);
+		double result;
+		TraceOp op;
+
+		switch (*ip)
+		{
+		case OP_SUBTRACT: op = TRACE_SUBTRACT; result = a - b; break;
+		case OP_MULTIPLY: op = TRACE_MULTIPLY; result = a * b; break;
+		case OP_DIVIDE: op = TRACE_DIVIDE; result = a / b; break;
+		case OP_MOD: op = TRACE_MOD; result = (double)((int)a % (int)b); break;
+		default: op = TRACE_ADD; result = a + b; break;
+		}
+
+		addStep(recorder, op);
+		sp[-2] = NUMBER_VAL(result);
+		recorder->sp--;
+		recorder->ip++;
+		return true;
+	}
+
+	case OP_ADD_CONSTANT:
+	{
+		// As the constant pushed and added.
+		Value constant = recorder->constants[ip[1]];
+		if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(constant)) return false;
+
+		recordPush(recorder, TRACE_CONSTANT, constant, 0, NULL);
+		addStep(recorder, TRACE_ADD);
+		recorder->sp--;
+		sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1]) + AS_NUMBER(constant));
+		recorder->ip += 2;
+		return true;
+	}
+
+	case OP_NEGATE:
+		if (!IS_NUMBER(sp[-1])) return false;
+		addStep(recorder, TRACE_NEGATE);
+		sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+		recorder->ip++;
+		return true;
+
+	case OP_NOT:
+		addStep(recorder, TRACE_NOT);
+		sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+		recorder->ip++;
+		return true;
+
+	case OP_EQUAL:
+	case OP_EQUAL_NUM:
+	case OP_NOT_EQUAL:
+	case OP_NOT_EQUAL_NUM:
+	{
+		bool equal = valueEquals(sp[-2], sp[-1]);
+		bool negate = *ip == OP_NOT_EQUAL || *ip == OP_NOT_EQUAL_NUM;
+		addStep(recorder, negate ? TRACE_NOT_EQUAL : TRACE_EQUAL);
+		sp[-2] = BOOL_VAL(equal != negate);
+		recorder->sp--;
+		recorder->ip++;
+		return true;
+	}
+
+	case OP_GREATER:
+	case OP_GREATER_EQUAL:
+	case OP_LESS:
+	case OP_LESS_EQUAL:
+	{
+		if (!IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1])) return false;
+
+		double a = AS_NUMBER(sp[-2]);
+		double b = AS_NUMBER(sp[-1]);
+		bool result;
+		TraceOp op;
+
+		switch (*ip)
+		{
+		case OP_GREATER: op = TRACE_GREATER; result = a > b; break;
+		case OP_GREATER_EQUAL: op = TRACE_GREATER_EQUAL; result = a >= b; break;
+		case OP_LESS: op = TRACE_LESS; result = a < b; break;
+		default: op = TRACE_LESS_EQUAL; result = a <= b; break;
+		}
+
+		addStep(recorder, op);
+		sp[-2] = BOOL_VAL(result);
+		recorder->sp--;
+		recorder->ip++;
+		return true;
+	}
+
+	case OP_JUMP:
+		recorder->ip = ip + 3 + readShort(ip + 1);
+		return true;
+
+	case OP_JUMP_IF_FALSE:
+	case OP_POP_JUMP_IF_FALSE:
+	{
+		bool falsey = isFalsey(sp[-1]);
+		bool pop = *ip == OP_POP_JUMP_IF_FALSE;
+		uint8_t* target = ip + 3 + readShort(ip + 1);
+		if (pop) recorder->sp--;
+
+		if (falsey) recordGuard(recorder, false, pop, target, ip + 3);
+		else recordGuard(recorder, true, pop, ip + 3, target);
+		return true;
+	}
+
+	case OP_LESS_JUMP_IF_FALSE:
+	case OP_GREATER_JUMP_IF_FALSE:
+	{
+		// As the comparison and a branch that pops it.
+		if (!IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1])) return false;
+
+		bool less = *ip == OP_LESS_JUMP_IF_FALSE;
+		bool holds = less ? AS_NUMBER(sp[-2]) < AS_NUMBER(sp[-1]) : AS_NUMBER(sp[-2]) > AS_NUMBER(sp[-1]);
+		uint8_t* target = ip + 3 + readShort(ip + 1);
+		addStep(recorder, less ? TRACE_LESS : TRACE_GREATER);
+		recorder->sp -= 2;
+
+		if (holds) recordGuard(recorder, true, true, ip + 3, target);
+		else recordGuard(recorder, false, true, target, ip + 3);
+		return true;
+	}
+
+	case OP_LOOP:
+	{
+		// A for loop's increment jumps back to its condition once; more
+		// backward jumps belong to an inner loop, which gets a trace of its
+		// own.
+		uint8_t* target = ip + 3 - readShort(ip + 1);
+
+		if (target != recorder->recording.start)
+		{
+			if (recorder->backJumps++ > 0) return false;
+			recorder->ip = target;
+			return true;
+		}
+
+		addStep(recorder, TRACE_LOOP);
+		recorder->closed = true;
+		recorder->ip = target;
+		return true;
+	}
+
+	case OP_CALL:
+	{
+		double (*math)(double) = mathFunction(sp[-2]);
+		if (ip[1] != 1 || math == NULL || !IS_NUMBER(sp[-1])) return false;
+
+		addStep(recorder, TRACE_CALL)->math = math;
+		sp[-2] = NUMBER_VAL(math(AS_NUMBER(sp[-1])));
+		recorder->sp--;
+		recorder->ip += 2;
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+// Runs the iteration from the loop head at frame->ip while recording it,
+// and compiles the recording if it got back there. The interpreter carries
+// on wherever the recorder stopped.
+static Trace* recordTrace(CallFrame* frame)
+{
+	Recorder recorder;
+	memset(&recorder, 0, sizeof(recorder));
+	recorder.frame = frame;
+	recorder.ip = frame->ip;
+	recorder.sp = vm.stackTop;
+	recorder.slots = frame->slots;
+	recorder.constants = frame->closure->function->chunk.constants.values;
+	recorder.recording.start = frame->ip;
+	recorder.recording.base = (int)(vm.stackTop - frame->slots);
+	recorder.recording.globals = vm.globals.entries;
+
+	while (!recorder.closed && recorder.recording.count < TRACE_MAX_STEPS &&
+		recordInstruction(&recorder))
+	{
+	}
+
+	frame->ip = recorder.ip;
+	vm.stackTop = recorder.sp;
+
+	ObjFunction* function = frame->closure->function;
+	Trace* trace = (Trace*)malloc(sizeof(Trace));
+	if (trace == NULL) exit(1);
+	trace->start = recorder.recording.start;
+	trace->code = NULL;
+	trace->size = 0;
+	trace->globals = NULL;
+	trace->next = function->traces;
+	function->traces = trace;
+
+	if (recorder.closed) jitCompileTrace(&recorder.recording, trace);
+	free(recorder.recording.steps);
+	return trace;
+}
+
+void jitTraceLoop(CallFrame* frame)
+{
+	ObjFunction* function = frame->closure->function;
+	Trace* trace = findTrace(function, frame->ip);
+
+	if (trace != NULL && trace->globals != NULL && trace->globals != vm.globals.entries)
+	{
+		// The globals table grew and the trace points into the old one; it
+		// is recorded again once the loop is hot again.
+		Trace** link = &function->traces;
+		while (*link != trace) link = &(*link)->next;
+		*link = trace->next;
+		trace->next = NULL;
+		jitFreeTraces(trace);
+		trace = NULL;
+	}
+
+	if (trace == NULL)
+	{
+		int* count = &hotLoops[((uintptr_t)frame->ip >> 2) % HOT_LOOPS];
+		if (jitThreshold == 0 || ++*count < jitThreshold) return;
+
+		*count = 0;
+		trace = recordTrace(frame);
+		if (frame->ip != trace->start) return;
+	}
+
+	if (trace->code != NULL) ((TraceEntry)(uintptr_t)trace->code)(frame);
+}
+
+#endif
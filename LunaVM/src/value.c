@@ -8,11 +8,13 @@
 bool valueEquals(Value a, Value b)
 {
 #ifdef NAN_BOXING
-	if(IS_NUMBER(a) && IS_NUMBER(b))
+	// Numbers compare by value, so that NaN != NaN and 0 == -0 as in the
+	// tagged representation; everything else is identical iff its bits are.
+	if (IS_NUMBER(a) && IS_NUMBER(b))
 	{
 		return AS_NUMBER(a) == AS_NUMBER(b);
 	}
-    return a == b;
+	return a == b;
 #else
 	if (a.type != b.type) return false;
 
@@ -55,37 +57,20 @@ void freeValueArray(ValueArray* array)
 
 void printValue(Value value)
 {
-#ifdef NAN_BOXING
-    if (IS_BOOL(value))
-    {
-        printf(AS_BOOL(value) ? "true" : "false");
-    }
-    else if (IS_NULL(value))
-    {
-        printf("null");
-    }
-    else if (IS_NUMBER(value))
-    {
-        printf("%g", AS_NUMBER(value));
-    }
-    else if (IS_OBJ(value))
-    {
-        printObject(value);
-    }
-#else
-	switch (value.type)
+	if (IS_BOOL(value))
 	{
-	case VAL_BOOL:
-		printf(AS_BOOL(value) ? "true" : "false"); break;
-
-	case VAL_NULL: 
-		printf("null"); break;
-
-	case VAL_NUMBER: 
-		printf("%g", AS_NUMBER(value)); break;
-
-	case VAL_OBJ:
-		printObject(value); break;
+		printf(AS_BOOL(value) ? "true" : "false");
+	}
+	else if (IS_NULL(value))
+	{
+		printf("null");
+	}
+	else if (IS_NUMBER(value))
+	{
+		printf("%g", AS_NUMBER(value));
+	}
+	else if (IS_OBJ(value))
+	{
+		printObject(value);
 	}
-#endif
 }
@@ -6,6 +6,8 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct Shape Shape;
+typedef struct VM VM;
 
 #ifdef NAN_BOXING
 
@@ -11,23 +11,32 @@
 #include "vm.h"
 #include "compiler.h"
 #include "nativelib.h"
+#include "jit.h"
 
 VM vm;
 
-Value peek(int distance);
+static inline Value peek(int distance);
 static bool isFalsey(Value value);
-static void concatenate(); 
+static ObjString* concatenate(ObjString* a, ObjString* b);
 static bool callValue(Value callee, int argCount);
+static bool isTailCallable(Value callee);
+static void replaceFrame(int argCount);
+static bool tailCall(int argCount);
 static bool call(ObjClosure* closure, int argCount);
 static ObjUpvalue* captureUpvalue(Value* local);
 
 static void resetStack()
 {
 	vm.stackTop = vm.stack;
+#ifdef REGISTER_VM
+	vm.registerTop = vm.stack;
+#endif
 	vm.openUpvalues = NULL;
 	vm.frameCount = 0;
 }
 
+#define TRACE_FRAMES_MAX 16
+
 static void runtimeError(const char* format, ...)
 {
 	fprintf(stderr, "Runtime error: ");
@@ -39,6 +48,13 @@ static void runtimeError(const char* format, ...)
 
 	for (int i = vm.frameCount - 1; i >= 0; i--)
 	{
+		// Past a few dozen frames a deep recursion only repeats itself.
+		if (i == vm.frameCount - 1 - TRACE_FRAMES_MAX && i > TRACE_FRAMES_MAX)
+		{
+			fprintf(stderr, "    ... %d more calls\n", i - TRACE_FRAMES_MAX + 1);
+			i = TRACE_FRAMES_MAX - 1;
+		}
+
 		CallFrame* frame = &vm.frames[i];
 		ObjFunction* function = frame->closure->function;
 		size_t instruction = frame->ip - function->chunk.code - 1;
@@ -57,49 +73,129 @@ static void runtimeError(const char* format, ...)
 	resetStack();
 }
 
-static void defineNative(const char* name, NativeFn function, uint8_t expectedArgCount)
+bool nativeError(VM* vm, const char* format, ...)
+{
+	char message[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	runtimeError("%s", message);
+	return false;
+}
+
+// Moves the stack to an allocation of at least `needed` slots, and points
+// everything that pointed into the old one at the same slot in the new one.
+static void growStack(int needed)
+{
+	int capacity = vm.stackCapacity;
+	while (capacity < needed) capacity *= 2;
+
+	Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+	if (stack == NULL) exit(1);
+	memcpy(stack, vm.stack, sizeof(Value) * (stackRootsEnd() - vm.stack));
+
+	for (int i = 0; i < vm.frameCount; i++)
+	{
+		vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+	}
+
+	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+	{
+		upvalue->location = stack + (upvalue->location - vm.stack);
+	}
+
+	vm.stackTop = stack + (vm.stackTop - vm.stack);
+#ifdef REGISTER_VM
+	vm.registerTop = stack + (vm.registerTop - vm.stack);
+#endif
+
+	free(vm.stack);
+	vm.stack = stack;
+	vm.stackCapacity = capacity;
+}
+
+// Makes sure the stack has `needed` slots, reporting an overflow if it
+// cannot grow that far.
+static bool ensureStack(int needed)
+{
+	if (needed <= vm.stackCapacity) return true;
+
+	if (needed > STACK_MAX)
+	{
+		runtimeError("Stack overflow.");
+		return false;
+	}
+
+	growStack(needed);
+	return true;
+}
+
+static void defineNative(const char* name, NativeFn function, uint8_t expectedArgCount, uint8_t flags)
 {
 	push(OBJ_VAL(copyString(name, (int)strlen(name))));
-	push(OBJ_VAL(newNative(function, expectedArgCount)));
+	push(OBJ_VAL(newNative(function, expectedArgCount, flags)));
 	tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+	writeBarrier(NULL, vm.stack[0]);
+	writeBarrier(NULL, vm.stack[1]);
 	pop();
 	pop();
 }
 
 void initVM()
 {
+	vm.frameCapacity = FRAMES_INITIAL;
+	vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * vm.frameCapacity);
+	vm.stackCapacity = STACK_INITIAL;
+	vm.stack = (Value*)malloc(sizeof(Value) * vm.stackCapacity);
+	if (vm.frames == NULL || vm.stack == NULL) exit(1);
+
 	resetStack();
-	vm.objects = NULL;
+	initGCStats(&vm.gcStats);
 	vm.bytesAllocated = 0;
-	vm.nextGC = 1024;
+	initHeapPolicy();
+	vm.gcPhase = GC_IDLE_PHASE;
 	vm.grayCapacity = 0;
 	vm.grayCount = 0;
 	vm.grayStack = NULL;
+	vm.rememberedCount = 0;
+	vm.rememberedCapacity = 0;
+	vm.rememberedSet = NULL;
+	vm.compactionPending = false;
+	initNursery();
 	initTable(&vm.globals);
 	initTable(&vm.strings);
 	vm.initString = NULL;
 	vm.initString = copyString("init", 4);
 	
-	defineNative("clock", clockNative, 0);
-	defineNative("input", inputNative, 0);
-	defineNative("readf", openNative, 1);
-	defineNative("writef", writeNative, 2);
-	defineNative("strlen", stringLengthNative, 1);
-	defineNative("substr", substrNative, 3);
-	defineNative("double", toNumberNative, 1);
-	defineNative("cos", cosNative, 1);
-	defineNative("sin", sinNative, 1);
-	defineNative("tan", tanNative, 1);
-	defineNative("sqrt", sqrtNative, 1);
-
-	defineNative("__glfwInit", __glfwInit, 0);
-	defineNative("__glfwCreateWindow", __glfwCreateWindow, 3);
-	defineNative("__glfwMakeContextCurrent", __glfwMakeContextCurrent, 1);
-	defineNative("__glfwWindowShouldClose", __glfwWindowShouldClose, 1);
-	defineNative("__glfwSwapBuffers", __glfwSwapBuffers, 1);
-	defineNative("__glfwPollEvents", __glfwPollEvents, 0);
-	defineNative("__glClearColor", __glClearColor, 4);
-	defineNative("__glClear", __glClear, 1);
+	defineNative("clock", clockNative, 0, NATIVE_NO_GC);
+	defineNative("input", inputNative, 0, 0);
+	defineNative("readf", openNative, 1, 0);
+	defineNative("writef", writeNative, 2, NATIVE_NO_GC);
+	defineNative("strlen", stringLengthNative, 1, NATIVE_PURE);
+	defineNative("substr", substrNative, 3, 0);
+	defineNative("double", toNumberNative, 1, NATIVE_PURE);
+	defineNative("cos", cosNative, 1, NATIVE_PURE);
+	defineNative("sin", sinNative, 1, NATIVE_PURE);
+	defineNative("tan", tanNative, 1, NATIVE_PURE);
+	defineNative("sqrt", sqrtNative, 1, NATIVE_PURE);
+	defineNative("gcStats", gcStatsNative, 0, 0);
+	defineNative("gcStat", gcStatNative, 1, NATIVE_NO_GC);
+	defineNative("len", listLengthNative, 1, NATIVE_NO_GC);
+	defineNative("push", listPushNative, 2, 0);
+	defineNative("pop", listPopNative, 1, NATIVE_NO_GC);
+	defineNative("insert", listInsertNative, 3, 0);
+	defineNative("slice", listSliceNative, 3, 0);
+
+	defineNative("__glfwInit", __glfwInit, 0, 0);
+	defineNative("__glfwCreateWindow", __glfwCreateWindow, 3, 0);
+	defineNative("__glfwMakeContextCurrent", __glfwMakeContextCurrent, 1, 0);
+	defineNative("__glfwWindowShouldClose", __glfwWindowShouldClose, 1, 0);
+	defineNative("__glfwSwapBuffers", __glfwSwapBuffers, 1, 0);
+	defineNative("__glfwPollEvents", __glfwPollEvents, 0, 0);
+	defineNative("__glClearColor", __glClearColor, 4, 0);
+	defineNative("__glClear", __glClear, 1, 0);
 }
 
 void freeVM()
@@ -108,6 +204,8 @@ void freeVM()
 	freeTable(&vm.strings);
 	vm.initString = NULL;
 	freeObjects();
+	free(vm.frames);
+	free(vm.stack);
 }
 
 static void closeUpvalues(Value* last)
@@ -117,15 +215,21 @@ static void closeUpvalues(Value* last)
 		ObjUpvalue* upvalue = vm.openUpvalues;
 		upvalue->closed = *upvalue->location;
 		upvalue->location = &upvalue->closed;
+		writeBarrier((Obj*)upvalue, upvalue->closed);
 		vm.openUpvalues = upvalue->next;
 	}
 }
 
+#ifndef REGISTER_VM
+
 static void defineMethod(ObjString* name)
 {
 	Value method = peek(0);
 	ObjStruct* klass = AS_STRUCT(peek(1));
 	tableSet(&klass->methods, name, method); 
+	writeBarrier((Obj*)klass, OBJ_VAL(name));
+	writeBarrier((Obj*)klass, method);
+	invalidateInlineCaches();
 	pop();
 }
 
@@ -145,7 +249,10 @@ static bool bindMethod(ObjStruct* klass, ObjString* name)
 	return true;
 }
 
-static bool invokeFromStruct(ObjStruct* target, ObjString* name, int argCount)
+#endif
+
+// A tail invoke calls the method in place of the frame on top.
+static bool invokeFromStruct(ObjStruct* target, ObjString* name, int argCount, bool tail)
 {
 	Value method;
 
@@ -155,10 +262,155 @@ static bool invokeFromStruct(ObjStruct* target, ObjString* name, int argCount)
 		return false;
 	}
 
+	if (tail) replaceFrame(argCount);
 	return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount)
+typedef enum
+{
+	PROPERTY_FIELD,
+	PROPERTY_METHOD,
+	PROPERTY_UNDEFINED,
+} PropertyKind;
+
+// Returns the cache's entry for shape, if it has one.
+static inline InlineCacheEntry* findCacheEntry(InlineCache* cache, Shape* shape)
+{
+	if (cache->epoch != vm.cacheEpoch)
+	{
+		cache->epoch = vm.cacheEpoch;
+		cache->count = 0;
+	}
+
+	for (int i = 0; i < cache->count; i++)
+	{
+		if (cache->entries[i].shape == shape) return &cache->entries[i];
+	}
+
+	return NULL;
+}
+
+static void updateCache(InlineCache* cache, Shape* shape, int field, Shape* transition, Value method)
+{
+	// Past INLINE_CACHE_ENTRIES shapes the site is megamorphic; the rest
+	// take the slow path.
+	if (cache->count == INLINE_CACHE_ENTRIES) return;
+
+	InlineCacheEntry* entry = &cache->entries[cache->count++];
+	entry->shape = shape;
+	entry->field = field;
+	entry->transition = transition;
+	entry->method = method;
+}
+
+// Looks name up on instance without help from the cache, then fills the
+// cache in.
+static NOINLINE PropertyKind lookupProperty(InlineCache* cache, ObjInstance* instance, ObjString* name, Value* value)
+{
+	Shape* shape = instance->shape;
+
+	if (shape == NULL)
+	{
+		if (tableGet(instance->dictionary, name, value)) return PROPERTY_FIELD;
+		return tableGet(&instance->klass->methods, name, value) ? PROPERTY_METHOD : PROPERTY_UNDEFINED;
+	}
+
+	int slot = shapeFindSlot(shape, name);
+
+	if (slot >= 0)
+	{
+		*value = *instanceSlot(instance, slot);
+		updateCache(cache, shape, slot, NULL, NULL_VAL);
+		return PROPERTY_FIELD;
+	}
+
+	if (!tableGet(&instance->klass->methods, name, value)) return PROPERTY_UNDEFINED;
+
+	updateCache(cache, shape, -1, NULL, *value);
+	return PROPERTY_METHOD;
+}
+
+// Looks name up on instance: a field, or else a method of its struct.
+static inline PropertyKind getProperty(InlineCache* cache, ObjInstance* instance, ObjString* name, Value* value)
+{
+	InlineCacheEntry* cached = instance->shape == NULL ? NULL : findCacheEntry(cache, instance->shape);
+
+	if (cached == NULL) return lookupProperty(cache, instance, name, value);
+
+	// A shape has one layout, so a cached method also means the instance
+	// has no field to shadow it.
+	if (cached->field < 0)
+	{
+		*value = cached->method;
+		return PROPERTY_METHOD;
+	}
+
+	*value = *instanceSlot(instance, cached->field);
+	return PROPERTY_FIELD;
+}
+
+static void setProperty(InlineCache* cache, ObjInstance* instance, ObjString* name, Value value)
+{
+	Shape* shape = instance->shape;
+
+	if (shape == NULL)
+	{
+		instanceSetField(instance, name, value);
+		return;
+	}
+
+	InlineCacheEntry* cached = findCacheEntry(cache, shape);
+
+	if (cached != NULL)
+	{
+		if (cached->transition != NULL)
+		{
+			instanceAddField(instance, cached->transition, value);
+			return;
+		}
+
+		*instanceSlot(instance, cached->field) = value;
+		writeBarrier((Obj*)instance, value);
+		return;
+	}
+
+	instanceSetField(instance, name, value);
+
+	// Remember either the slot the field was in or the shape adding it
+	// led to.
+	if (instance->shape == NULL) return;
+
+	if (instance->shape == shape)
+	{
+		updateCache(cache, shape, shapeFindSlot(shape, name), NULL, NULL_VAL);
+	}
+	else
+	{
+		updateCache(cache, shape, instance->shape->slotCount - 1, instance->shape, NULL_VAL);
+	}
+}
+
+// Returns NULL if index names an element of list, or else the runtime error
+// OP_INDEX_GET and OP_INDEX_SET report.
+static inline const char* checkListIndex(Value list, Value index)
+{
+	if (!IS_LIST(list)) return "Only lists can be indexed.";
+	if (!IS_NUMBER(index)) return "List index must be a number.";
+
+	double number = AS_NUMBER(index);
+
+	if (!(number >= 0 && number <= UINT32_MAX)) return "List index out of range.";
+	if (number != (uint32_t)number) return "List index must be an integer.";
+	if (number >= AS_LIST(list)->length) return "List index out of range.";
+
+	return NULL;
+}
+
+#define LIST_ELEMENT(list, index) (AS_LIST(list)->elements[(uint32_t)AS_NUMBER(index)])
+
+// A tail invoke calls a method, or a closure held in a field, in place of
+// the frame on top; anything else it calls as invoke does.
+static bool invoke(ObjString* name, int argCount, InlineCache* cache, bool tail)
 {
 	Value receiver = peek(argCount);
 
@@ -168,16 +420,21 @@ static bool invoke(ObjString* name, int argCount)
 		return false;
 	}
 
-	ObjInstance* instance = AS_INSTANCE(receiver);
-
 	Value value;
-	if (tableGet(&instance->fields, name, &value))
+
+	switch (getProperty(cache, AS_INSTANCE(receiver), name, &value))
 	{
+	case PROPERTY_FIELD:
 		vm.stackTop[-argCount - 1] = value;
+		if (tail && isTailCallable(value)) return tailCall(argCount);
 		return callValue(value, argCount);
+	case PROPERTY_METHOD:
+		if (tail) replaceFrame(argCount);
+		return call(AS_CLOSURE(value), argCount);
+	default:
+		runtimeError("Undefined property '%s'.", name->characters);
+		return false;
 	}
-
-	return invokeFromStruct(instance->klass, name, argCount);
 }
 
 ObjString* concatStringAndNumber(const ObjString* str, double num) {
@@ -213,420 +470,2280 @@ ObjString* concatNumberAndString(double num, const ObjString* str) {
 		return NULL;
 	}
 
-	strcpy(result, numBuffer);
-	strcat(result, str->characters);
+	strcpy(result, numBuffer);
+	strcat(result, str->characters);
+
+	ObjString* resultString = takeString(result, totalLen - 1);
+	return resultString;
+}
+
+#ifdef REGISTER_VM
+
+// Brings the registers of the frame on top under the collector's scan,
+// clearing the ones it has not scanned before.
+static void reserveRegisters()
+{
+	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	Value* end = frame->slots + frame->closure->function->maxSlots;
+
+	if (vm.registerTop < vm.stackTop) vm.registerTop = vm.stackTop;
+
+	while (vm.registerTop < end)
+	{
+		*vm.registerTop++ = NULL_VAL;
+	}
+}
+
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-crossjumping")))
+#endif
+static InterpretResult run()
+{
+	// Instructions name their operands as registers, slots of the current
+	// frame. Calls lay the callee and the arguments out in consecutive
+	// registers and point vm.stackTop past them, the way the stack VM's
+	// call helpers expect; the callee's frame starts at the callee register.
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* slots;
+	Value* constants;
+
+#define STORE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME() \
+	do { \
+		frame = &vm.frames[vm.frameCount - 1]; \
+		ip = frame->ip; \
+		slots = frame->slots; \
+		constants = frame->closure->function->chunk.constants.values; \
+	} while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
+// The _LONG forms name their constant with 16 bits.
+#define READ_NAME(wide) AS_STRING(constants[(wide) ? READ_SHORT() : READ_BYTE()])
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_REGISTER() (slots[READ_BYTE()])
+
+// Rewrite the instruction being executed, whose length bytes have been read,
+// to opcode. DEOPTIMIZE also rewinds so that opcode runs next.
+#define QUICKEN(length, opcode) (ip[-(length)] = (opcode))
+#define DEOPTIMIZE(length, opcode) (ip -= (length), *ip = (opcode))
+
+#define RUNTIME_ERROR(...) \
+	do { \
+		STORE_FRAME(); \
+		runtimeError(__VA_ARGS__); \
+		return INTERPRET_RUNTIME_ERROR; \
+	} while (false)
+
+#ifdef DEBUG_STRESS_GC
+#define SAFEPOINT() \
+	do { \
+		STORE_FRAME(); \
+		collectNursery(); \
+	} while (false)
+#else
+#define SAFEPOINT() \
+	do { \
+		if (vm.nurseryTop > vm.nurseryLimit || vm.compactionPending) \
+		{ \
+			STORE_FRAME(); \
+			collectNursery(); \
+		} \
+	} while (false)
+#endif
+
+// Picks up after a call helper has returned: either a new frame is on top,
+// or a native or an initializer-less struct has already left its result in
+// the callee register.
+#define FINISH_CALL() \
+	do { \
+		reserveRegisters(); \
+		LOAD_FRAME(); \
+		SAFEPOINT(); \
+	} while (false)
+
+#define BINARY_OP(valueType, op) \
+	do { \
+		uint8_t dest = READ_BYTE(); \
+		Value a = READ_REGISTER(); \
+		Value b = READ_REGISTER(); \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		{ \
+			RUNTIME_ERROR("Operands must be numbers."); \
+		} \
+		slots[dest] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+	} while (false)
+
+#define BINARY_OP_INT(valueType, op) \
+	do { \
+		uint8_t dest = READ_BYTE(); \
+		Value a = READ_REGISTER(); \
+		Value b = READ_REGISTER(); \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		{ \
+			RUNTIME_ERROR("Operands must be numbers."); \
+		} \
+		slots[dest] = valueType((int)AS_NUMBER(a) op (int)AS_NUMBER(b)); \
+	} while (false)
+
+#define COMPARE_JUMP(op) \
+	do { \
+		Value a = READ_REGISTER(); \
+		Value b = READ_REGISTER(); \
+		uint16_t offset = READ_SHORT(); \
+		if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		{ \
+			RUNTIME_ERROR("Operands must be numbers."); \
+		} \
+		if (!(AS_NUMBER(a) op AS_NUMBER(b))) ip += offset; \
+	} while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#ifdef DEBUG_STACK
+#define TRACE_STACK() \
+	do { \
+		for (int i = 0; i < frame->closure->function->maxSlots; i++) \
+		{ \
+			printf("["); \
+			printValue(slots[i]); \
+			printf("]"); \
+		} \
+		printf("\n"); \
+	} while (false)
+#else
+#define TRACE_STACK() do { } while (false)
+#endif
+#define TRACE_INSTRUCTION() \
+	do { \
+		TRACE_STACK(); \
+		disassembleInstruction(&frame->closure->function->chunk, \
+			(int)(ip - frame->closure->function->chunk.code)); \
+	} while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+	uint8_t instruction;
+
+	LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+	static void* dispatchTable[256] = {
+		[0 ... 255] = &&op_UNKNOWN,
+		[OP_MOVE] = &&op_OP_MOVE,
+		[OP_CONSTANT] = &&op_OP_CONSTANT,
+		[OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+		[OP_NULL] = &&op_OP_NULL,
+		[OP_TRUE] = &&op_OP_TRUE,
+		[OP_FALSE] = &&op_OP_FALSE,
+		[OP_EQUAL] = &&op_OP_EQUAL,
+		[OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+		[OP_GREATER] = &&op_OP_GREATER,
+		[OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+		[OP_LESS] = &&op_OP_LESS,
+		[OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+		[OP_ADD] = &&op_OP_ADD,
+		[OP_ADD_CONSTANT] = &&op_OP_ADD_CONSTANT,
+		[OP_SUBTRACT] = &&op_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&op_OP_MULTIPLY,
+		[OP_MOD] = &&op_OP_MOD,
+		[OP_DIVIDE] = &&op_OP_DIVIDE,
+		[OP_NOT] = &&op_OP_NOT,
+		[OP_NEGATE] = &&op_OP_NEGATE,
+		[OP_PRINT] = &&op_OP_PRINT,
+		[OP_PRINTLN] = &&op_OP_PRINTLN,
+		[OP_JUMP] = &&op_OP_JUMP,
+		[OP_LOOP] = &&op_OP_LOOP,
+		[OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+		[OP_LESS_JUMP_IF_FALSE] = &&op_OP_LESS_JUMP_IF_FALSE,
+		[OP_GREATER_JUMP_IF_FALSE] = &&op_OP_GREATER_JUMP_IF_FALSE,
+		[OP_ADD_NUM_NUM] = &&op_OP_ADD_NUM_NUM,
+		[OP_ADD_STR_STR] = &&op_OP_ADD_STR_STR,
+		[OP_EQUAL_NUM] = &&op_OP_EQUAL_NUM,
+		[OP_NOT_EQUAL_NUM] = &&op_OP_NOT_EQUAL_NUM,
+		[OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+		[OP_DEFINE_GLOBAL_LONG] = &&op_OP_DEFINE_GLOBAL_LONG,
+		[OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+		[OP_GET_GLOBAL_LONG] = &&op_OP_GET_GLOBAL_LONG,
+		[OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+		[OP_SET_GLOBAL_LONG] = &&op_OP_SET_GLOBAL_LONG,
+		[OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+		[OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+		[OP_GET_PROPERTY_LONG] = &&op_OP_GET_PROPERTY_LONG,
+		[OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+		[OP_SET_PROPERTY_LONG] = &&op_OP_SET_PROPERTY_LONG,
+		[OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+		[OP_CALL] = &&op_OP_CALL,
+		[OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+		[OP_INVOKE] = &&op_OP_INVOKE,
+		[OP_INVOKE_LONG] = &&op_OP_INVOKE_LONG,
+		[OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+		[OP_SUPER_INVOKE_LONG] = &&op_OP_SUPER_INVOKE_LONG,
+		[OP_TAIL_INVOKE] = &&op_OP_TAIL_INVOKE,
+		[OP_TAIL_INVOKE_LONG] = &&op_OP_TAIL_INVOKE_LONG,
+		[OP_TAIL_SUPER_INVOKE] = &&op_OP_TAIL_SUPER_INVOKE,
+		[OP_TAIL_SUPER_INVOKE_LONG] = &&op_OP_TAIL_SUPER_INVOKE_LONG,
+		[OP_GET_SUPER] = &&op_OP_GET_SUPER,
+		[OP_GET_SUPER_LONG] = &&op_OP_GET_SUPER_LONG,
+		[OP_CLOSURE] = &&op_OP_CLOSURE,
+		[OP_CLOSURE_LONG] = &&op_OP_CLOSURE_LONG,
+		[OP_STRUCT] = &&op_OP_STRUCT,
+		[OP_STRUCT_LONG] = &&op_OP_STRUCT_LONG,
+		[OP_INHERIT] = &&op_OP_INHERIT,
+		[OP_METHOD] = &&op_OP_METHOD,
+		[OP_METHOD_LONG] = &&op_OP_METHOD_LONG,
+		[OP_LIST] = &&op_OP_LIST,
+		[OP_ADD_LIST] = &&op_OP_ADD_LIST,
+		[OP_INDEX_GET] = &&op_OP_INDEX_GET,
+		[OP_INDEX_SET] = &&op_OP_INDEX_SET,
+		[OP_RETURN] = &&op_OP_RETURN,
+	};
+
+#define DISPATCH() \
+	do { \
+		TRACE_INSTRUCTION(); \
+		goto *dispatchTable[instruction = READ_BYTE()]; \
+	} while (false)
+#define CASE(opcode) op_##opcode
+
+	DISPATCH();
+
+op_UNKNOWN:
+	DISPATCH();
+
+	{
+#else
+#define DISPATCH() break
+#define CASE(opcode) case opcode
+
+	for (;;)
+	{
+		TRACE_INSTRUCTION();
+
+		switch (instruction = READ_BYTE())
+		{
+#endif
+		CASE(OP_MOVE):
+		{
+			uint8_t dest = READ_BYTE();
+			slots[dest] = READ_REGISTER();
+			DISPATCH();
+		}
+
+		CASE(OP_CONSTANT):
+		{
+			uint8_t dest = READ_BYTE();
+			slots[dest] = READ_CONSTANT();
+			DISPATCH();
+		}
+
+		CASE(OP_CONSTANT_LONG):
+		{
+			uint8_t dest = READ_BYTE();
+			slots[dest] = constants[READ_SHORT()];
+			DISPATCH();
+		}
+
+		CASE(OP_NULL): slots[READ_BYTE()] = NULL_VAL; DISPATCH();
+		CASE(OP_TRUE): slots[READ_BYTE()] = BOOL_VAL(true); DISPATCH();
+		CASE(OP_FALSE): slots[READ_BYTE()] = BOOL_VAL(false); DISPATCH();
+
+		CASE(OP_DEFINE_GLOBAL):
+		CASE(OP_DEFINE_GLOBAL_LONG):
+		{
+			Value value = READ_REGISTER();
+			ObjString* name = READ_NAME(instruction == OP_DEFINE_GLOBAL_LONG);
+			STORE_FRAME();
+			tableSet(&vm.globals, name, value);
+			writeBarrier(NULL, OBJ_VAL(name));
+			writeBarrier(NULL, value);
+			DISPATCH();
+		}
+
+		CASE(OP_GET_GLOBAL):
+		CASE(OP_GET_GLOBAL_LONG):
+		{
+			uint8_t dest = READ_BYTE();
+			ObjString* name = READ_NAME(instruction == OP_GET_GLOBAL_LONG);
+			Value value;
+
+			if (!tableGet(&vm.globals, name, &value))
+			{
+				RUNTIME_ERROR("Undefined variable '%s'.", name->characters);
+			}
+
+			slots[dest] = value;
+			DISPATCH();
+		}
+
+		CASE(OP_SET_GLOBAL):
+		CASE(OP_SET_GLOBAL_LONG):
+		{
+			Value value = READ_REGISTER();
+			ObjString* name = READ_NAME(instruction == OP_SET_GLOBAL_LONG);
+			STORE_FRAME();
+			if (tableSet(&vm.globals, name, value))
+			{
+				tableDelete(&vm.globals, name);
+				RUNTIME_ERROR("Undefined variable '%s'.", name->characters);
+			}
+
+			writeBarrier(NULL, value);
+			DISPATCH();
+		}
+
+		CASE(OP_EQUAL):
+		{
+			uint8_t dest = READ_BYTE();
+			Value a = READ_REGISTER();
+			Value b = READ_REGISTER();
+			if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(4, OP_EQUAL_NUM);
+			slots[dest] = BOOL_VAL(valueEquals(a, b));
+			DISPATCH();
+		}
+
+		CASE(OP_NOT_EQUAL):
+		{
+			uint8_t dest = READ_BYTE();
+			Value a = READ_REGISTER();
+			Value b = READ_REGISTER();
+			if (IS_NUMBER(a) && IS_NUMBER(b)) QUICKEN(4, OP_NOT_EQUAL_NUM);
+			slots[dest] = BOOL_VAL(!valueEquals(a, b));
+			DISPATCH();
+		}
+
+		CASE(OP_EQUAL_NUM):
+		{
+			uint8_t dest = READ_BYTE();
+			Value a = READ_REGISTER();
+			Value b = READ_REGISTER();
+
+			if (!IS_NUMBER(a) || !IS_NUMBER(b))
+			{
+				DEOPTIMIZE(4, OP_EQUAL);
+				DISPATCH();
+			}
+
+			slots[dest] = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+			DISPATCH();
+		}
+
+		CASE(OP_NOT_EQUAL_NUM):
+		{
+			uint8_t dest = READ_BYTE();
+			Value a = READ_REGISTER();
+			Value b = READ_REGISTER();
+
+			if (!IS_NUMBER(a) || !IS_NUMBER(b))
+			{
+				DEOPTIMIZE(4, OP_NOT_EQUAL);
+				DISPATCH();
+			}
+
+			slots[dest] = BOOL_VAL(AS_NUMBER(a) != AS_NUMBER(b));
+			DISPATCH();
+		}
+
+		CASE(OP_GREATER): BINARY_OP(BOOL_VAL, > ); DISPATCH();
+		CASE(OP_LESS): BINARY_OP(BOOL_VAL, < ); DISPATCH();
+		CASE(OP_GREATER_EQUAL): BINARY_OP(BOOL_VAL, >= ); DISPATCH();
+		CASE(OP_LESS_EQUAL): BINARY_OP(BOOL_VAL, <= ); DISPATCH();
+
+		CASE(OP_ADD):
+		{
+			uint8_t dest = READ_BYTE();
+			Value a = READ_REGISTER();
+			Value b = READ_REGISTER();
+
+			if (IS_NUMBER(a) && IS_NUMBER(b))
+			{
+				QUICKEN(4, OP_ADD_NUM_NUM);
+				slots[dest] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+				DISPATCH();
+			}
+
+			// The operands stay in their registers, reachable, while the
+			// result is allocated.
+			STORE_FRAME();
+			ObjString* result;
+
+			if (IS_STRING(a) && IS_STRING(b))
+			{
+				QUICKEN(4, OP_ADD_STR_STR);
+				result = concatenate(AS_STRING(a), AS_STRING(b));
+			}
+			else if (IS_STRING(a) && IS_NUMBER(b))
+			{
+				result = concatStringAndNumber(AS_STRING(a), AS_NUMBER(b));
+			}
+			else if (IS_NUMBER(a) && IS_STRING(b))
+			{
+				result = concatNumberAndString(AS_NUMBER(a), AS_STRING(b));
+			}
+			else
+			{
+				RUNTIME_ERROR("Operands must be two numbers or two strings, or one number and one string.");
+			}
+
+			slots[dest] = OBJ_VAL(result);
+			DISPATCH();
+		}
+
+		CASE(OP_ADD_NUM_NUM):
+		{
+			uint8_t dest = READ_BYTE();
+			Value a = READ_REGISTER();
+			Value b = READ_REGISTER();
+
+			if (!IS_NUMBER(a) || !IS_NUMBER(b))
+			{
+				DEOPTIMIZE(4, OP_ADD);
+				DISPATCH();
+			}
+
+			slots[dest] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+			DISPATCH();
+		}
+
+		CASE(OP_ADD_STR_STR):
+		{
+			uint8_t dest = READ_BYTE();
+			Value a = READ_REGISTER();
+			Value b = READ_REGISTER();
+
+			if (!IS_STRING(a) || !IS_STRING(b))
+			{
+				DEOPTIMIZE(4, OP_ADD);
+				DISPATCH();
+			}
+
+			STORE_FRAME();
+			ObjString* result = concatenate(AS_STRING(a), AS_STRING(b));
+			slots[dest] = OBJ_VAL(result);
+			DISPATCH();
+		}
+
+		CASE(OP_ADD_CONSTANT):
+		{
+			uint8_t dest = READ_BYTE();
+			Value a = READ_REGISTER();
+			double b = AS_NUMBER(READ_CONSTANT());
+
+			if (IS_NUMBER(a))
+			{
+				slots[dest] = NUMBER_VAL(AS_NUMBER(a) + b);
+			}
+			else if (IS_STRING(a))
+			{
+				STORE_FRAME();
+				slots[dest] = OBJ_VAL(concatStringAndNumber(AS_STRING(a), b));
+			}
+			else
+			{
+				RUNTIME_ERROR("Operands must be two numbers or two strings, or one number and one string.");
+			}
+			DISPATCH();
+		}
+
+		CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, - ); DISPATCH();
+		CASE(OP_MOD): BINARY_OP_INT(NUMBER_VAL, % ); DISPATCH();
+		CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, * ); DISPATCH();
+		CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, / ); DISPATCH();
+
+		CASE(OP_NOT):
+		{
+			uint8_t dest = READ_BYTE();
+			slots[dest] = BOOL_VAL(isFalsey(READ_REGISTER()));
+			DISPATCH();
+		}
+
+		CASE(OP_NEGATE):
+		{
+			uint8_t dest = READ_BYTE();
+			Value value = READ_REGISTER();
+
+			if (!IS_NUMBER(value))
+			{
+				RUNTIME_ERROR("Operand must be a number.");
+			}
+
+			slots[dest] = NUMBER_VAL(-AS_NUMBER(value));
+			DISPATCH();
+		}
+
+		CASE(OP_PRINT):
+		{
+			printValue(READ_REGISTER());
+			DISPATCH();
+		}
+
+		CASE(OP_PRINTLN):
+		{
+			printValue(READ_REGISTER());
+			printf("\n");
+			DISPATCH();
+		}
+
+		CASE(OP_JUMP):
+		{
+			uint16_t offset = READ_SHORT();
+			ip += offset;
+			DISPATCH();
+		}
+
+		CASE(OP_JUMP_IF_FALSE):
+		{
+			Value condition = READ_REGISTER();
+			uint16_t offset = READ_SHORT();
+			if (isFalsey(condition)) ip += offset;
+			DISPATCH();
+		}
+
+		CASE(OP_LESS_JUMP_IF_FALSE): COMPARE_JUMP(< ); DISPATCH();
+		CASE(OP_GREATER_JUMP_IF_FALSE): COMPARE_JUMP(> ); DISPATCH();
+
+		CASE(OP_LOOP):
+		{
+			uint16_t offset = READ_SHORT();
+			ip -= offset;
+			SAFEPOINT();
+			DISPATCH();
+		}
+
+		CASE(OP_TAIL_CALL):
+		{
+			uint8_t base = ip[0];
+			int argCount = ip[1];
+
+			if (isTailCallable(slots[base]))
+			{
+				ip += 2;
+				STORE_FRAME();
+				vm.stackTop = slots + base + argCount + 1;
+				if (!tailCall(argCount)) return INTERPRET_RUNTIME_ERROR;
+
+				FINISH_CALL();
+				DISPATCH();
+			}
+
+			// Anything else is called as OP_CALL calls it, and returns
+			// through the OP_RETURN that follows.
+		}
+
+		CASE(OP_CALL):
+		{
+			uint8_t base = READ_BYTE();
+			int argCount = READ_BYTE();
+			Value callee = slots[base];
+
+			STORE_FRAME();
+			vm.stackTop = slots + base + argCount + 1;
+
+			if (IS_NATIVE(callee) && (AS_NATIVE_FN(callee)->flags & NATIVE_NO_GC) &&
+				AS_NATIVE_FN(callee)->arity == argCount)
+			{
+				Value* args = slots + base + 1;
+				if (!AS_NATIVE_FN(callee)->function(&vm, argCount, args)) return INTERPRET_RUNTIME_ERROR;
+				vm.stackTop = args;
+				DISPATCH();
+			}
+
+			if (!callValue(callee, argCount))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			FINISH_CALL();
+			DISPATCH();
+		}
+
+		CASE(OP_INVOKE):
+		CASE(OP_INVOKE_LONG):
+		{
+			uint8_t base = READ_BYTE();
+			ObjString* method = READ_NAME(instruction == OP_INVOKE_LONG);
+			int argCount = READ_BYTE();
+			InlineCache* cache = READ_CACHE();
+
+			STORE_FRAME();
+			vm.stackTop = slots + base + argCount + 1;
+			if (!invoke(method, argCount, cache, false))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			FINISH_CALL();
+			DISPATCH();
+		}
+
+		CASE(OP_TAIL_INVOKE):
+		CASE(OP_TAIL_INVOKE_LONG):
+		{
+			uint8_t base = READ_BYTE();
+			ObjString* method = READ_NAME(instruction == OP_TAIL_INVOKE_LONG);
+			int argCount = READ_BYTE();
+			InlineCache* cache = READ_CACHE();
+
+			STORE_FRAME();
+			vm.stackTop = slots + base + argCount + 1;
+			if (!invoke(method, argCount, cache, true))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			FINISH_CALL();
+			DISPATCH();
+		}
+
+		CASE(OP_SUPER_INVOKE):
+		CASE(OP_SUPER_INVOKE_LONG):
+		{
+			uint8_t base = READ_BYTE();
+			ObjString* method = READ_NAME(instruction == OP_SUPER_INVOKE_LONG);
+			int argCount = READ_BYTE();
+			ObjStruct* superstruct = AS_STRUCT(slots[base + argCount + 1]);
+
+			STORE_FRAME();
+			vm.stackTop = slots + base + argCount + 1;
+			if (!invokeFromStruct(superstruct, method, argCount, false))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			FINISH_CALL();
+			DISPATCH();
+		}
+
+		CASE(OP_TAIL_SUPER_INVOKE):
+		CASE(OP_TAIL_SUPER_INVOKE_LONG):
+		{
+			uint8_t base = READ_BYTE();
+			ObjString* method = READ_NAME(instruction == OP_TAIL_SUPER_INVOKE_LONG);
+			int argCount = READ_BYTE();
+			ObjStruct* superstruct = AS_STRUCT(slots[base + argCount + 1]);
+
+			STORE_FRAME();
+			vm.stackTop = slots + base + argCount + 1;
+			if (!invokeFromStruct(superstruct, method, argCount, true))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			FINISH_CALL();
+			DISPATCH();
+		}
+
+		CASE(OP_GET_SUPER):
+		CASE(OP_GET_SUPER_LONG):
+		{
+			uint8_t dest = READ_BYTE();
+			ObjString* name = READ_NAME(instruction == OP_GET_SUPER_LONG);
+			ObjStruct* superstruct = AS_STRUCT(slots[dest + 1]);
+			Value method;
+
+			if (!tableGet(&superstruct->methods, name, &method))
+			{
+				RUNTIME_ERROR("Undefined property '%s'.", name->characters);
+			}
+
+			STORE_FRAME();
+			slots[dest] = OBJ_VAL(newBoundMethod(slots[dest], AS_CLOSURE(method)));
+			DISPATCH();
+		}
+
+		CASE(OP_CLOSURE):
+		CASE(OP_CLOSURE_LONG):
+		{
+			bool wide = instruction == OP_CLOSURE_LONG;
+			uint8_t dest = READ_BYTE();
+			ObjFunction* function = AS_FUNCTION(constants[wide ? READ_SHORT() : READ_BYTE()]);
+			STORE_FRAME();
+			ObjClosure* closure = newClosure(function);
+			slots[dest] = OBJ_VAL(closure);
+
+			for (int i = 0; i < closure->upvalueCount; i++)
+			{
+				uint8_t isLocal = READ_BYTE();
+				uint16_t index = wide ? READ_SHORT() : READ_BYTE();
+				if (isLocal)
+				{
+					closure->upvalues[i] = captureUpvalue(slots + index);
+				}
+				else
+				{
+					closure->upvalues[i] = frame->closure->upvalues[index];
+				}
+
+				writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+			}
+
+			DISPATCH();
+		}
+
+		CASE(OP_GET_UPVALUE):
+		{
+			uint8_t dest = READ_BYTE();
+			uint8_t slot = READ_BYTE();
+			slots[dest] = *frame->closure->upvalues[slot]->location;
+			DISPATCH();
+		}
+
+		CASE(OP_SET_UPVALUE):
+		{
+			Value value = READ_REGISTER();
+			ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+			*upvalue->location = value;
+			writeBarrier((Obj*)upvalue, value);
+			DISPATCH();
+		}
+
+		CASE(OP_CLOSE_UPVALUE):
+		{
+			closeUpvalues(slots + READ_BYTE());
+			DISPATCH();
+		}
+
+		CASE(OP_GET_PROPERTY):
+		CASE(OP_GET_PROPERTY_LONG):
+		{
+			uint8_t dest = READ_BYTE();
+			Value receiver = READ_REGISTER();
+			ObjString* name = READ_NAME(instruction == OP_GET_PROPERTY_LONG);
+			InlineCache* cache = READ_CACHE();
+
+			if (!IS_INSTANCE(receiver))
+			{
+				RUNTIME_ERROR("Only instances have properties.");
+			}
+
+			Value value;
+
+			switch (getProperty(cache, AS_INSTANCE(receiver), name, &value))
+			{
+			case PROPERTY_FIELD:
+				slots[dest] = value;
+				DISPATCH();
+			case PROPERTY_METHOD:
+				// The receiver is still in its register while this allocates.
+				STORE_FRAME();
+				slots[dest] = OBJ_VAL(newBoundMethod(receiver, AS_CLOSURE(value)));
+				DISPATCH();
+			default:
+				RUNTIME_ERROR("Undefined property '%s'.", name->characters);
+			}
+		}
+
+		CASE(OP_SET_PROPERTY):
+		CASE(OP_SET_PROPERTY_LONG):
+		{
+			Value receiver = READ_REGISTER();
+			ObjString* name = READ_NAME(instruction == OP_SET_PROPERTY_LONG);
+			Value value = READ_REGISTER();
+			InlineCache* cache = READ_CACHE();
+
+			if (!IS_INSTANCE(receiver))
+			{
+				RUNTIME_ERROR("Only instances have fields.");
+			}
+
+			STORE_FRAME();
+			setProperty(cache, AS_INSTANCE(receiver), name, value);
+			DISPATCH();
+		}
+
+		CASE(OP_STRUCT):
+		CASE(OP_STRUCT_LONG):
+		{
+			uint8_t dest = READ_BYTE();
+			ObjString* name = READ_NAME(instruction == OP_STRUCT_LONG);
+			STORE_FRAME();
+			slots[dest] = OBJ_VAL(newStruct(name));
+			DISPATCH();
+		}
+
+		CASE(OP_INHERIT):
+		{
+			Value superstruct = READ_REGISTER();
+			ObjStruct* substruct = AS_STRUCT(READ_REGISTER());
+
+			if (!IS_STRUCT(superstruct))
+			{
+				RUNTIME_ERROR("The superstruct must be a struct.");
+			}
+
+			STORE_FRAME();
+			tableAddAll(&AS_STRUCT(superstruct)->methods, &substruct->methods);
+			tableWriteBarrier((Obj*)substruct, &substruct->methods);
+			invalidateInlineCaches();
+			DISPATCH();
+		}
+
+		CASE(OP_METHOD):
+		CASE(OP_METHOD_LONG):
+		{
+			ObjStruct* klass = AS_STRUCT(READ_REGISTER());
+			Value method = READ_REGISTER();
+			ObjString* name = READ_NAME(instruction == OP_METHOD_LONG);
+			STORE_FRAME();
+			tableSet(&klass->methods, name, method);
+			writeBarrier((Obj*)klass, OBJ_VAL(name));
+			writeBarrier((Obj*)klass, method);
+			invalidateInlineCaches();
+			DISPATCH();
+		}
+
+		CASE(OP_LIST):
+		{
+			uint8_t dest = READ_BYTE();
+			STORE_FRAME();
+			slots[dest] = OBJ_VAL(newList());
+			DISPATCH();
+		}
+
+		CASE(OP_ADD_LIST):
+		{
+			ObjList* list = AS_LIST(READ_REGISTER());
+			Value value = READ_REGISTER();
+			STORE_FRAME();
+			appendToList(list, value);
+			DISPATCH();
+		}
+
+		CASE(OP_INDEX_GET):
+		{
+			uint8_t dest = READ_BYTE();
+			Value list = READ_REGISTER();
+			Value index = READ_REGISTER();
+			const char* error = checkListIndex(list, index);
+			if (error != NULL) RUNTIME_ERROR("%s", error);
+
+			slots[dest] = LIST_ELEMENT(list, index);
+			DISPATCH();
+		}
+
+		CASE(OP_INDEX_SET):
+		{
+			Value list = READ_REGISTER();
+			Value index = READ_REGISTER();
+			Value value = READ_REGISTER();
+			const char* error = checkListIndex(list, index);
+			if (error != NULL) RUNTIME_ERROR("%s", error);
+
+			LIST_ELEMENT(list, index) = value;
+			writeBarrier(AS_OBJ(list), value);
+			DISPATCH();
+		}
+
+		CASE(OP_RETURN):
+		{
+			Value result = READ_REGISTER();
+			closeUpvalues(slots);
+			vm.frameCount--;
+
+			if (vm.frameCount == 0)
+			{
+				vm.stackTop = vm.stack;
+				vm.registerTop = vm.stack;
+				return INTERPRET_OK;
+			}
+
+			// The callee's first register is the caller's callee register.
+			slots[0] = result;
+			LOAD_FRAME();
+			SAFEPOINT();
+			DISPATCH();
+		}
+#ifndef COMPUTED_GOTO
+		}
+#endif
+	}
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef READ_BYTE
+#undef READ_CONSTANT
+#undef READ_SHORT
+#undef READ_NAME
+#undef READ_CACHE
+#undef READ_REGISTER
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef RUNTIME_ERROR
+#undef SAFEPOINT
+#undef FINISH_CALL
+#undef BINARY_OP
+#undef BINARY_OP_INT
+#undef COMPARE_JUMP
+#undef TRACE_STACK
+#undef TRACE_INSTRUCTION
+#undef DISPATCH
+#undef CASE
+}
+
+#else
+
+#ifdef JIT
+
+// Runs a minor collection if one is due, as SAFEPOINT() in run() does.
+static void safepoint()
+{
+#ifndef DEBUG_STRESS_GC
+	if (vm.nurseryTop <= vm.nurseryLimit && !vm.compactionPending) return;
+#endif
+	collectNursery();
+}
+
+// Runs the frame on top in compiled code, following calls and returns into
+// other compiled code, until the interpreter has to take over. Returns false
+// on a runtime error.
+static bool runCompiled()
+{
+	for (;;)
+	{
+		CallFrame* frame = &vm.frames[vm.frameCount - 1];
+		if (!jitHasEntry(frame->closure->function, frame->ip)) return true;
+
+		switch (jitExecute(frame))
+		{
+		case JIT_FRAME:
+		case JIT_RETURN:
+			safepoint();
+			break;
+		case JIT_ERROR:
+			return false;
+		default:
+			return true;
+		}
+	}
+}
+
+// Deepest that compiled code runs nested in the compiled code calling it.
+#define JIT_NESTING_MAX 1024
+
+static int jitNesting = 0;
+
+// After a call from compiled code: runs the callee's compiled code on the C
+// stack, nested in the caller's, which carries on from the call once it has
+// returned. Callees that cannot finish there unwind to runCompiled() instead,
+// as do calls that moved the frame the caller's code points to.
+static JitStatus runCallee(int frameCount, CallFrame* frames)
+{
+	if (vm.frameCount == frameCount) return JIT_OK;
+	if (vm.frames != frames || jitNesting == JIT_NESTING_MAX) return JIT_FRAME;
+
+	safepoint();
+	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	if (!jitHasEntry(frame->closure->function, frame->ip)) return JIT_FRAME;
+
+	jitNesting++;
+	JitStatus status = jitExecute(frame);
+	jitNesting--;
+
+	if (status != JIT_RETURN) return status;
+	safepoint();
+	return JIT_OK;
+}
+
+// The helpers compiled code calls do what the handler of their instruction
+// in run() does, on vm.stackTop.
+
+#define JIT_CONSTANT(frame, index) ((frame)->closure->function->chunk.constants.values[index])
+#define JIT_STRING(frame, index) AS_STRING(JIT_CONSTANT(frame, index))
+
+// Whatever OP_ADD does not do inline: the concatenations.
+JitStatus jitAdd(CallFrame* frame)
+{
+	Value b = peek(0);
+	Value a = peek(1);
+	ObjString* result;
+
+	if (IS_STRING(a) && IS_STRING(b))
+	{
+		result = concatenate(AS_STRING(a), AS_STRING(b));
+	}
+	else if (IS_STRING(a) && IS_NUMBER(b))
+	{
+		result = concatStringAndNumber(AS_STRING(a), AS_NUMBER(b));
+	}
+	else if (IS_NUMBER(a) && IS_STRING(b))
+	{
+		result = concatNumberAndString(AS_NUMBER(a), AS_STRING(b));
+	}
+	else
+	{
+		runtimeError("Operands must be two numbers or two strings, or one number and one string.");
+		return JIT_ERROR;
+	}
+
+	vm.stackTop--;
+	vm.stackTop[-1] = OBJ_VAL(result);
+	return JIT_OK;
+}
+
+JitStatus jitAddConstant(CallFrame* frame, int constant)
+{
+	if (!IS_STRING(peek(0)))
+	{
+		runtimeError("Operands must be two numbers or two strings, or one number and one string.");
+		return JIT_ERROR;
+	}
+
+	double b = AS_NUMBER(JIT_CONSTANT(frame, constant));
+	vm.stackTop[-1] = OBJ_VAL(concatStringAndNumber(AS_STRING(peek(0)), b));
+	return JIT_OK;
+}
+
+JitStatus jitDefineGlobal(CallFrame* frame, int constant)
+{
+	ObjString* name = JIT_STRING(frame, constant);
+	tableSet(&vm.globals, name, peek(0));
+	writeBarrier(NULL, OBJ_VAL(name));
+	writeBarrier(NULL, peek(0));
+	vm.stackTop--;
+	return JIT_OK;
+}
+
+JitStatus jitGetGlobal(CallFrame* frame, int constant)
+{
+	ObjString* name = JIT_STRING(frame, constant);
+	Value value;
+
+	if (!tableGet(&vm.globals, name, &value))
+	{
+		runtimeError("Undefined variable '%s'.", name->characters);
+		return JIT_ERROR;
+	}
+
+	push(value);
+	return JIT_OK;
+}
+
+JitStatus jitSetGlobal(CallFrame* frame, int constant)
+{
+	ObjString* name = JIT_STRING(frame, constant);
+
+	if (tableSet(&vm.globals, name, peek(0)))
+	{
+		tableDelete(&vm.globals, name);
+		runtimeError("Undefined variable '%s'.", name->characters);
+		return JIT_ERROR;
+	}
+
+	writeBarrier(NULL, peek(0));
+	return JIT_OK;
+}
+
+JitStatus jitSetUpvalue(CallFrame* frame, int slot)
+{
+	ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+	*upvalue->location = peek(0);
+	writeBarrier((Obj*)upvalue, peek(0));
+	return JIT_OK;
+}
+
+JitStatus jitCloseUpvalue(CallFrame* frame)
+{
+	closeUpvalues(vm.stackTop - 1);
+	vm.stackTop--;
+	return JIT_OK;
+}
+
+// upvalues is the offset in the chunk of the (isLocal, index) pairs.
+// Decodes the OP_CLOSURE or OP_CLOSURE_LONG at `offset` itself, as the
+// width of its upvalue pairs depends on which it is.
+JitStatus jitClosure(CallFrame* frame, int offset)
+{
+	uint8_t* code = frame->closure->function->chunk.code + offset;
+	bool wide = code[0] == OP_CLOSURE_LONG;
+	int constant = wide ? (code[1] << 8) | code[2] : code[1];
+	uint8_t* pairs = code + (wide ? 3 : 2);
+	ObjFunction* function = AS_FUNCTION(JIT_CONSTANT(frame, constant));
+	ObjClosure* closure = newClosure(function);
+	push(OBJ_VAL(closure));
+
+	for (int i = 0; i < closure->upvalueCount; i++)
+	{
+		uint8_t isLocal = pairs[0];
+		uint16_t index = wide ? (pairs[1] << 8) | pairs[2] : pairs[1];
+		pairs += wide ? 3 : 2;
+		if (isLocal)
+		{
+			closure->upvalues[i] = captureUpvalue(frame->slots + index);
+		}
+		else
+		{
+			closure->upvalues[i] = frame->closure->upvalues[index];
+		}
+
+		writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
+	}
+
+	return JIT_OK;
+}
+
+JitStatus jitGetProperty(CallFrame* frame, int constant, int cache)
+{
+	if (!IS_INSTANCE(peek(0)))
+	{
+		runtimeError("Only instances have properties.");
+		return JIT_ERROR;
+	}
+
+	ObjString* name = JIT_STRING(frame, constant);
+	Value value;
+
+	switch (getProperty(&frame->closure->function->chunk.caches[cache], AS_INSTANCE(peek(0)), name, &value))
+	{
+	case PROPERTY_FIELD:
+		vm.stackTop[-1] = value;
+		return JIT_OK;
+	case PROPERTY_METHOD:
+	{
+		ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(value));
+		vm.stackTop[-1] = OBJ_VAL(bound);
+		return JIT_OK;
+	}
+	default:
+		runtimeError("Undefined property '%s'.", name->characters);
+		return JIT_ERROR;
+	}
+}
+
+JitStatus jitSetProperty(CallFrame* frame, int constant, int cache)
+{
+	if (!IS_INSTANCE(peek(1)))
+	{
+		runtimeError("Only instances have fields.");
+		return JIT_ERROR;
+	}
+
+	setProperty(&frame->closure->function->chunk.caches[cache], AS_INSTANCE(peek(1)),
+		JIT_STRING(frame, constant), peek(0));
+	Value value = pop();
+	vm.stackTop[-1] = value;
+	return JIT_OK;
+}
+
+JitStatus jitPrint(CallFrame* frame, bool newline)
+{
+	printValue(pop());
+	if (newline) printf("\n");
+	return JIT_OK;
+}
+
+JitStatus jitStruct(CallFrame* frame, int constant)
+{
+	push(OBJ_VAL(newStruct(JIT_STRING(frame, constant))));
+	return JIT_OK;
+}
+
+JitStatus jitInherit(CallFrame* frame)
+{
+	Value superstruct = peek(1);
+
+	if (!IS_STRUCT(superstruct))
+	{
+		runtimeError("The superstruct must be a struct.");
+		return JIT_ERROR;
+	}
+
+	ObjStruct* substruct = AS_STRUCT(peek(0));
+	tableAddAll(&AS_STRUCT(superstruct)->methods, &substruct->methods);
+	tableWriteBarrier((Obj*)substruct, &substruct->methods);
+	invalidateInlineCaches();
+	vm.stackTop--;
+	return JIT_OK;
+}
+
+JitStatus jitMethod(CallFrame* frame, int constant)
+{
+	defineMethod(JIT_STRING(frame, constant));
+	return JIT_OK;
+}
+
+JitStatus jitGetSuper(CallFrame* frame, int constant)
+{
+	ObjStruct* superstruct = AS_STRUCT(pop());
+	return bindMethod(superstruct, JIT_STRING(frame, constant)) ? JIT_OK : JIT_ERROR;
+}
+
+JitStatus jitList(CallFrame* frame)
+{
+	push(OBJ_VAL(newList()));
+	return JIT_OK;
+}
+
+JitStatus jitAddList(CallFrame* frame)
+{
+	appendToList(AS_LIST(peek(1)), peek(0));
+	vm.stackTop--;
+	return JIT_OK;
+}
+
+JitStatus jitIndexGet(CallFrame* frame)
+{
+	const char* error = checkListIndex(peek(1), peek(0));
+
+	if (error != NULL)
+	{
+		runtimeError("%s", error);
+		return JIT_ERROR;
+	}
+
+	Value element = LIST_ELEMENT(peek(1), peek(0));
+	vm.stackTop--;
+	vm.stackTop[-1] = element;
+	return JIT_OK;
+}
+
+JitStatus jitIndexSet(CallFrame* frame)
+{
+	const char* error = checkListIndex(peek(2), peek(1));
+
+	if (error != NULL)
+	{
+		runtimeError("%s", error);
+		return JIT_ERROR;
+	}
+
+	Value value = peek(0);
+	LIST_ELEMENT(peek(2), peek(1)) = value;
+	writeBarrier(AS_OBJ(peek(2)), value);
+	vm.stackTop -= 2;
+	vm.stackTop[-1] = value;
+	return JIT_OK;
+}
+
+JitStatus jitCall(CallFrame* frame, int argCount)
+{
+	int frameCount = vm.frameCount;
+	CallFrame* frames = vm.frames;
+	if (!callValue(peek(argCount), argCount)) return JIT_ERROR;
+	return runCallee(frameCount, frames);
+}
+
+// The callee has replaced the frame on top, whose code cannot go on.
+JitStatus jitTailCall(CallFrame* frame, int argCount)
+{
+	if (!isTailCallable(peek(argCount))) return jitCall(frame, argCount);
+	return tailCall(argCount) ? JIT_FRAME : JIT_ERROR;
+}
+
+JitStatus jitInvoke(CallFrame* frame, int constant, int argCount, int cache)
+{
+	int frameCount = vm.frameCount;
+	CallFrame* frames = vm.frames;
+	if (!invoke(JIT_STRING(frame, constant), argCount, &frame->closure->function->chunk.caches[cache], false))
+	{
+		return JIT_ERROR;
+	}
+
+	return runCallee(frameCount, frames);
+}
+
+JitStatus jitSuperInvoke(CallFrame* frame, int constant, int argCount)
+{
+	ObjStruct* superstruct = AS_STRUCT(pop());
+	int frameCount = vm.frameCount;
+	CallFrame* frames = vm.frames;
+	if (!invokeFromStruct(superstruct, JIT_STRING(frame, constant), argCount, false)) return JIT_ERROR;
+	return runCallee(frameCount, frames);
+}
+
+// Like jitTailCall, though a native in a field leaves the frame where it
+// was; the interpreter picks it up at its OP_RETURN either way.
+JitStatus jitTailInvoke(CallFrame* frame, int constant, int argCount, int cache)
+{
+	if (!invoke(JIT_STRING(frame, constant), argCount, &frame->closure->function->chunk.caches[cache], true))
+	{
+		return JIT_ERROR;
+	}
+
+	return JIT_FRAME;
+}
 
-	ObjString* resultString = takeString(result, totalLen - 1);
-	return resultString;
+JitStatus jitTailSuperInvoke(CallFrame* frame, int constant, int argCount)
+{
+	ObjStruct* superstruct = AS_STRUCT(pop());
+	if (!invokeFromStruct(superstruct, JIT_STRING(frame, constant), argCount, true)) return JIT_ERROR;
+	return JIT_FRAME;
+}
+
+// Never for the last frame; compiled code leaves that to run().
+JitStatus jitReturn(CallFrame* frame)
+{
+	Value result = pop();
+	closeUpvalues(frame->slots);
+	vm.frameCount--;
+	vm.stackTop = frame->slots;
+	push(result);
+	return JIT_RETURN;
+}
+
+JitStatus jitSafepoint(CallFrame* frame)
+{
+	safepoint();
+	return JIT_OK;
 }
 
+#undef JIT_CONSTANT
+#undef JIT_STRING
+
+#endif
+
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+// GCC's cross-jumping merges the identical indirect jumps that end every
+// handler back into a single one, which would undo the threading.
+__attribute__((optimize("no-crossjumping")))
+#endif
 static InterpretResult run() 
 {
-	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	// The state every instruction touches lives in locals so the compiler
+	// can keep it in registers. STORE_FRAME() writes ip and the stack top
+	// back before anything outside run() may look at them: calls,
+	// allocations (the collector scans the stack), safepoints and runtime
+	// errors. LOAD_FRAME() picks them up again for the current frame.
+	CallFrame* frame;
+	uint8_t* ip;
+	Value* sp;
+	Value* slots;
+	Value* constants;
+
+#define STORE_FRAME() (frame->ip = ip, vm.stackTop = sp)
+#define LOAD_FRAME() \
+	do { \
+		frame = &vm.frames[vm.frameCount - 1]; \
+		ip = frame->ip; \
+		slots = frame->slots; \
+		constants = frame->closure->function->chunk.constants.values; \
+		sp = vm.stackTop; \
+	} while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
+// The _LONG forms name their constant with 16 bits.
+#define READ_NAME(wide) AS_STRING(constants[(wide) ? READ_SHORT() : READ_BYTE()])
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+// Rewrite the instruction being executed, whose length bytes have been read,
+// to opcode. DEOPTIMIZE also rewinds so that opcode runs next.
+#define QUICKEN(length, opcode) (ip[-(length)] = (opcode))
+#define DEOPTIMIZE(length, opcode) (ip -= (length), *ip = (opcode))
+
+#define PUSH(value) \
+	do { \
+		Value pushed = (value); \
+		*sp++ = pushed; \
+	} while (false)
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+#define RUNTIME_ERROR(...) \
+	do { \
+		STORE_FRAME(); \
+		runtimeError(__VA_ARGS__); \
+		return INTERPRET_RUNTIME_ERROR; \
+	} while (false)
 
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_SHORT() (frame->ip += 2, (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+// Minor collections move objects, so they only run here: on backward jumps,
+// calls and returns, where run() holds no pointer into the nursery.
+#ifdef DEBUG_STRESS_GC
+#define SAFEPOINT() \
+	do { \
+		STORE_FRAME(); \
+		collectNursery(); \
+	} while (false)
+#else
+#define SAFEPOINT() \
+	do { \
+		if (vm.nurseryTop > vm.nurseryLimit || vm.compactionPending) \
+		{ \
+			STORE_FRAME(); \
+			collectNursery(); \
+		} \
+	} while (false)
+#endif
 #define BINARY_OP(valueType, op) \
 	do { \
-		if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+		if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
 		{ \
-			runtimeError("Operands must be numbers."); \
-			return INTERPRET_RUNTIME_ERROR; \
+			RUNTIME_ERROR("Operands must be numbers."); \
 		} \
-		double b = AS_NUMBER(pop()); \
-		double a = AS_NUMBER(pop()); \
-		push(valueType(a op b)); \
+		double b = AS_NUMBER(sp[-1]); \
+		double a = AS_NUMBER(sp[-2]); \
+		sp--; \
+		sp[-1] = valueType(a op b); \
 	} while (false)
 
 #define BINARY_OP_INT(valueType, op) \
-do { \
-	if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
-	{ \
-		runtimeError("Operands must be numbers."); \
-		return INTERPRET_RUNTIME_ERROR; \
+	do { \
+		if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+		{ \
+			RUNTIME_ERROR("Operands must be numbers."); \
 		} \
-		int b = (int)AS_NUMBER(pop()); \
-		int a = (int)AS_NUMBER(pop()); \
-		push(valueType(a op b)); \
+		int b = (int)AS_NUMBER(sp[-1]); \
+		int a = (int)AS_NUMBER(sp[-2]); \
+		sp--; \
+		sp[-1] = valueType(a op b); \
+	} while (false)
+
+// Compares the two numbers on top of the stack, pops them, and jumps if the
+// comparison is false.
+#define COMPARE_JUMP(op) \
+	do { \
+		uint16_t offset = READ_SHORT(); \
+		if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+		{ \
+			RUNTIME_ERROR("Operands must be numbers."); \
+		} \
+		bool holds = AS_NUMBER(sp[-2]) op AS_NUMBER(sp[-1]); \
+		sp -= 2; \
+		if (!holds) ip += offset; \
 	} while (false)
 
-	for (;;)
-	{
 #ifdef DEBUG_TRACE_EXECUTION
 #ifdef DEBUG_STACK
-		printf("");
-		for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
-		{
-			printf("[");
-			printValue(*slot);
-			printf("]");
-		}
-		printf("\n");
+#define TRACE_STACK() \
+	do { \
+		for (Value* slot = vm.stack; slot < sp; slot++) \
+		{ \
+			printf("["); \
+			printValue(*slot); \
+			printf("]"); \
+		} \
+		printf("\n"); \
+	} while (false)
+#else
+#define TRACE_STACK() do { } while (false)
 #endif
-		disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+	do { \
+		TRACE_STACK(); \
+		disassembleInstruction(&frame->closure->function->chunk, \
+			(int)(ip - frame->closure->function->chunk.code)); \
+	} while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+// Calls, returns and backward jumps continue in compiled code when the frame
+// on top has some; OP_LOOP also counts towards compiling the function, or
+// with traces runs or records the loop's.
+#ifdef JIT
+#define ENTER_JIT() \
+	do { \
+		if (jitHasEntry(frame->closure->function, ip)) \
+		{ \
+			STORE_FRAME(); \
+			if (!runCompiled()) return INTERPRET_RUNTIME_ERROR; \
+			LOAD_FRAME(); \
+		} \
+	} while (false)
+#define WARM_UP() jitWarmUp(frame->closure->function)
+#define ENTER_TRACE() \
+	do { \
+		if (jitBackend == JIT_TRACES) \
+		{ \
+			STORE_FRAME(); \
+			jitTraceLoop(frame); \
+			LOAD_FRAME(); \
+		} \
+	} while (false)
+#else
+#define ENTER_JIT() do { } while (false)
+#define WARM_UP() do { } while (false)
+#define ENTER_TRACE() do { } while (false)
 #endif
-		uint8_t instruction;
+
+	uint8_t instruction;
+
+	LOAD_FRAME();
+	ENTER_JIT();
+
+// With computed goto every handler ends in its own indirect jump through
+// dispatchTable, so the branch predictor sees one branch per opcode instead
+// of the switch's single shared one.
+#ifdef COMPUTED_GOTO
+	static void* dispatchTable[256] = {
+		[0 ... 255] = &&op_UNKNOWN,
+		[OP_CONSTANT] = &&op_OP_CONSTANT,
+		[OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+		[OP_NULL] = &&op_OP_NULL,
+		[OP_CLOSURE] = &&op_OP_CLOSURE,
+		[OP_CLOSURE_LONG] = &&op_OP_CLOSURE_LONG,
+		[OP_TRUE] = &&op_OP_TRUE,
+		[OP_FALSE] = &&op_OP_FALSE,
+		[OP_EQUAL] = &&op_OP_EQUAL,
+		[OP_GREATER] = &&op_OP_GREATER,
+		[OP_LESS] = &&op_OP_LESS,
+		[OP_NOT] = &&op_OP_NOT,
+		[OP_NEGATE] = &&op_OP_NEGATE,
+		[OP_ADD] = &&op_OP_ADD,
+		[OP_SUBTRACT] = &&op_OP_SUBTRACT,
+		[OP_MULTIPLY] = &&op_OP_MULTIPLY,
+		[OP_MOD] = &&op_OP_MOD,
+		[OP_DIVIDE] = &&op_OP_DIVIDE,
+		[OP_RETURN] = &&op_OP_RETURN,
+		[OP_PRINT] = &&op_OP_PRINT,
+		[OP_PRINTLN] = &&op_OP_PRINTLN,
+		[OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+		[OP_JUMP] = &&op_OP_JUMP,
+		[OP_LOOP] = &&op_OP_LOOP,
+		[OP_POP] = &&op_OP_POP,
+		[OP_LIST] = &&op_OP_LIST,
+		[OP_ADD_LIST] = &&op_OP_ADD_LIST,
+		[OP_INDEX_GET] = &&op_OP_INDEX_GET,
+		[OP_INDEX_SET] = &&op_OP_INDEX_SET,
+		[OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+		[OP_DEFINE_GLOBAL_LONG] = &&op_OP_DEFINE_GLOBAL_LONG,
+		[OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+		[OP_GET_GLOBAL_LONG] = &&op_OP_GET_GLOBAL_LONG,
+		[OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+		[OP_SET_GLOBAL_LONG] = &&op_OP_SET_GLOBAL_LONG,
+		[OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+		[OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+		[OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+		[OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+		[OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+		[OP_GET_PROPERTY_LONG] = &&op_OP_GET_PROPERTY_LONG,
+		[OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+		[OP_SET_PROPERTY_LONG] = &&op_OP_SET_PROPERTY_LONG,
+		[OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+		[OP_CALL] = &&op_OP_CALL,
+		[OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+		[OP_STRUCT] = &&op_OP_STRUCT,
+		[OP_STRUCT_LONG] = &&op_OP_STRUCT_LONG,
+		[OP_INHERIT] = &&op_OP_INHERIT,
+		[OP_METHOD] = &&op_OP_METHOD,
+		[OP_METHOD_LONG] = &&op_OP_METHOD_LONG,
+		[OP_INVOKE] = &&op_OP_INVOKE,
+		[OP_INVOKE_LONG] = &&op_OP_INVOKE_LONG,
+		[OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+		[OP_SUPER_INVOKE_LONG] = &&op_OP_SUPER_INVOKE_LONG,
+		[OP_TAIL_INVOKE] = &&op_OP_TAIL_INVOKE,
+		[OP_TAIL_INVOKE_LONG] = &&op_OP_TAIL_INVOKE_LONG,
+		[OP_TAIL_SUPER_INVOKE] = &&op_OP_TAIL_SUPER_INVOKE,
+		[OP_TAIL_SUPER_INVOKE_LONG] = &&op_OP_TAIL_SUPER_INVOKE_LONG,
+		[OP_GET_SUPER] = &&op_OP_GET_SUPER,
+		[OP_GET_SUPER_LONG] = &&op_OP_GET_SUPER_LONG,
+		[OP_GET_LOCAL_LONG] = &&op_OP_GET_LOCAL_LONG,
+		[OP_SET_LOCAL_LONG] = &&op_OP_SET_LOCAL_LONG,
+		[OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+		[OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+		[OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+		[OP_GET_LOCAL_GET_LOCAL] = &&op_OP_GET_LOCAL_GET_LOCAL,
+		[OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+		[OP_ADD_CONSTANT] = &&op_OP_ADD_CONSTANT,
+		[OP_POP_JUMP_IF_FALSE] = &&op_OP_POP_JUMP_IF_FALSE,
+		[OP_LESS_JUMP_IF_FALSE] = &&op_OP_LESS_JUMP_IF_FALSE,
+		[OP_GREATER_JUMP_IF_FALSE] = &&op_OP_GREATER_JUMP_IF_FALSE,
+		[OP_ADD_NUM_NUM] = &&op_OP_ADD_NUM_NUM,
+		[OP_ADD_STR_STR] = &&op_OP_ADD_STR_STR,
+		[OP_EQUAL_NUM] = &&op_OP_EQUAL_NUM,
+		[OP_NOT_EQUAL_NUM] = &&op_OP_NOT_EQUAL_NUM,
+	};
+
+#define DISPATCH() \
+	do { \
+		TRACE_INSTRUCTION(); \
+		goto *dispatchTable[instruction = READ_BYTE()]; \
+	} while (false)
+#define CASE(opcode) op_##opcode
+
+	DISPATCH();
+
+	// Opcodes without a handler are skipped, as the switch does.
+op_UNKNOWN:
+	DISPATCH();
+
+	{
+#else
+#define DISPATCH() break
+#define CASE(opcode) case opcode
+
+	for (;;)
+	{
+		TRACE_INSTRUCTION();
 
 		switch (instruction = READ_BYTE())
 		{
-		case OP_CONSTANT: {
-			Value constant = READ_CONSTANT();
-			push(constant);
-			break;
-		}
-		case OP_NULL: push(NULL_VAL); break;
-		case OP_TRUE: push(BOOL_VAL(true)); break;
-		case OP_FALSE: push(BOOL_VAL(false)); break;
+#endif
+		CASE(OP_CONSTANT): PUSH(READ_CONSTANT()); DISPATCH();
+		CASE(OP_CONSTANT_LONG): PUSH(constants[READ_SHORT()]); DISPATCH();
+		CASE(OP_NULL): PUSH(NULL_VAL); DISPATCH();
+		CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+		CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
 
-		case OP_POP:
-			pop();
-			break;
+		CASE(OP_POP):
+			sp--;
+			DISPATCH();
 
-		case OP_GET_LOCAL:
+		CASE(OP_GET_LOCAL):
 		{
 			uint8_t slot = READ_BYTE();
-			push(frame->slots[slot]);
-			break;
+			PUSH(slots[slot]);
+			DISPATCH();
 		}
 
-		case OP_SET_LOCAL:
+		CASE(OP_SET_LOCAL):
 		{
 			uint8_t slot = READ_BYTE();
-			frame->slots[slot] = peek(0);
-			break;	
+			slots[slot] = PEEK(0);
+			DISPATCH();	
 		}
 
-		case OP_DEFINE_GLOBAL: 
+		CASE(OP_GET_LOCAL_LONG):
 		{
-			ObjString* name = READ_STRING();
-			tableSet(&vm.globals, name, peek(0));
-			pop();
-			break;
+			uint16_t slot = READ_SHORT();
+			PUSH(slots[slot]);
+			DISPATCH();
 		}
 
-		case OP_GET_GLOBAL: 
+		CASE(OP_SET_LOCAL_LONG):
 		{
-			ObjString* name = READ_STRING();
+			uint16_t slot = READ_SHORT();
+			slots[slot] = PEEK(0);
+			DISPATCH();
+		}
+
+		CASE(OP_GET_LOCAL_GET_LOCAL):
+		{
+			uint8_t first = READ_BYTE();
+			uint8_t second = READ_BYTE();
+			PUSH(slots[first]);
+			PUSH(slots[second]);
+			DISPATCH();
+		}
+
+		CASE(OP_SET_LOCAL_POP):
+		{
+			uint8_t slot = READ_BYTE();
+			slots[slot] = POP();
+			DISPATCH();
+		}
+
+		CASE(OP_DEFINE_GLOBAL): 
+		CASE(OP_DEFINE_GLOBAL_LONG):
+		{
+			ObjString* name = READ_NAME(instruction == OP_DEFINE_GLOBAL_LONG);
+			STORE_FRAME();
+			tableSet(&vm.globals, name, PEEK(0));
+			writeBarrier(NULL, OBJ_VAL(name));
+			writeBarrier(NULL, PEEK(0));
+			sp--;
+			DISPATCH();
+		}
+
+		CASE(OP_GET_GLOBAL): 
+		CASE(OP_GET_GLOBAL_LONG):
+		{
+			ObjString* name = READ_NAME(instruction == OP_GET_GLOBAL_LONG);
 			Value value;
 
 			if (!tableGet(&vm.globals, name, &value))
 			{
-				runtimeError("Undefined variable '%s'.", name->characters);
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Undefined variable '%s'.", name->characters);
 			}
 
-			push(value);
-			break;
+			PUSH(value);
+			DISPATCH();
 		}
 
-		case OP_SET_GLOBAL:
+		CASE(OP_SET_GLOBAL):
+		CASE(OP_SET_GLOBAL_LONG):
 		{
-			ObjString* name = READ_STRING();
-			if (tableSet(&vm.globals, name, peek(0)))
+			ObjString* name = READ_NAME(instruction == OP_SET_GLOBAL_LONG);
+			STORE_FRAME();
+			if (tableSet(&vm.globals, name, PEEK(0)))
 			{
 				tableDelete(&vm.globals, name);
-				runtimeError("Undefined variable '%s'.", name->characters);
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Undefined variable '%s'.", name->characters);
 			}
 
-			break;
+			writeBarrier(NULL, PEEK(0));
+			DISPATCH();
 		}
 
-		case OP_EQUAL: {
-			Value b = pop();
-			Value a = pop();
-			push(BOOL_VAL(valueEquals(a, b)));
-			break;
+		CASE(OP_EQUAL): {
+			if (IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1])) QUICKEN(1, OP_EQUAL_NUM);
+			sp[-2] = BOOL_VAL(valueEquals(sp[-2], sp[-1]));
+			sp--;
+			DISPATCH();
+		}
+
+		CASE(OP_NOT_EQUAL): {
+			if (IS_NUMBER(sp[-2]) && IS_NUMBER(sp[-1])) QUICKEN(1, OP_NOT_EQUAL_NUM);
+			sp[-2] = BOOL_VAL(!valueEquals(sp[-2], sp[-1]));
+			sp--;
+			DISPATCH();
+		}
+
+		CASE(OP_EQUAL_NUM):
+		{
+			if (!IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1]))
+			{
+				DEOPTIMIZE(1, OP_EQUAL);
+				DISPATCH();
+			}
+
+			sp[-2] = BOOL_VAL(AS_NUMBER(sp[-2]) == AS_NUMBER(sp[-1]));
+			sp--;
+			DISPATCH();
+		}
+
+		CASE(OP_NOT_EQUAL_NUM):
+		{
+			if (!IS_NUMBER(sp[-2]) || !IS_NUMBER(sp[-1]))
+			{
+				DEOPTIMIZE(1, OP_NOT_EQUAL);
+				DISPATCH();
+			}
+
+			sp[-2] = BOOL_VAL(AS_NUMBER(sp[-2]) != AS_NUMBER(sp[-1]));
+			sp--;
+			DISPATCH();
 		}
 
-		case OP_GREATER: BINARY_OP(BOOL_VAL, > ); break;
-		case OP_LESS: BINARY_OP(BOOL_VAL, < ); break;
+		CASE(OP_GREATER): BINARY_OP(BOOL_VAL, > ); DISPATCH();
+		CASE(OP_LESS): BINARY_OP(BOOL_VAL, < ); DISPATCH();
+		CASE(OP_GREATER_EQUAL): BINARY_OP(BOOL_VAL, >= ); DISPATCH();
+		CASE(OP_LESS_EQUAL): BINARY_OP(BOOL_VAL, <= ); DISPATCH();
 
-		case OP_ADD: 
+		CASE(OP_ADD): 
 		{
-			if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+			Value b = PEEK(0);
+			Value a = PEEK(1);
+
+			if (IS_NUMBER(a) && IS_NUMBER(b))
 			{
-				concatenate();
+				QUICKEN(1, OP_ADD_NUM_NUM);
+				sp--;
+				sp[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+				DISPATCH();
 			}
-			else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+
+			// The concatenations allocate, so the operands stay on the stack
+			// until the result replaces them.
+			STORE_FRAME();
+
+			if (IS_STRING(a) && IS_STRING(b))
 			{
-				double b = AS_NUMBER(pop());
-				double a = AS_NUMBER(pop());
-				push(NUMBER_VAL(a + b));
+				QUICKEN(1, OP_ADD_STR_STR);
+				ObjString* result = concatenate(AS_STRING(a), AS_STRING(b));
+				sp--;
+				sp[-1] = OBJ_VAL(result);
 			}
-			else if (IS_STRING(peek(1)) && IS_NUMBER(peek(0)))
+			else if (IS_STRING(a) && IS_NUMBER(b))
 			{
-				double b = AS_NUMBER(pop());
-				ObjString* a = AS_STRING(pop());
-				push(OBJ_VAL(concatStringAndNumber(a, b)));
+				ObjString* result = concatStringAndNumber(AS_STRING(a), AS_NUMBER(b));
+				sp--;
+				sp[-1] = OBJ_VAL(result);
 			}
-			else if (IS_STRING(peek(0)) && IS_NUMBER(peek(1)))
+			else if (IS_NUMBER(a) && IS_STRING(b))
 			{
-				ObjString* a = AS_STRING(pop());
-				double b = AS_NUMBER(pop());
-				push(OBJ_VAL(concatNumberAndString(b, a)));
+				ObjString* result = concatNumberAndString(AS_NUMBER(a), AS_STRING(b));
+				sp--;
+				sp[-1] = OBJ_VAL(result);
 			}
 			else
 			{
-				runtimeError("Operands must be two numbers or two strings, or one number and one string.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Operands must be two numbers or two strings, or one number and one string.");
 			}
-			break;
+			DISPATCH();
+		}
+
+		CASE(OP_ADD_NUM_NUM):
+		{
+			Value b = PEEK(0);
+			Value a = PEEK(1);
+
+			if (!IS_NUMBER(a) || !IS_NUMBER(b))
+			{
+				DEOPTIMIZE(1, OP_ADD);
+				DISPATCH();
+			}
+
+			sp--;
+			sp[-1] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+			DISPATCH();
 		}
 
-		case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, - ); break;
-		case OP_MOD: BINARY_OP_INT(NUMBER_VAL, % ); break;
-		case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, * ); break;
-		case OP_DIVIDE: BINARY_OP(NUMBER_VAL, / ); break;
+		CASE(OP_ADD_STR_STR):
+		{
+			Value b = PEEK(0);
+			Value a = PEEK(1);
 
-		case OP_NOT:
-			push(BOOL_VAL(isFalsey(pop()))); break;
+			if (!IS_STRING(a) || !IS_STRING(b))
+			{
+				DEOPTIMIZE(1, OP_ADD);
+				DISPATCH();
+			}
 
-		case OP_NEGATE:
-			if (!IS_NUMBER(peek(0))) {
-				runtimeError("Operand must be a number.");
-				return INTERPRET_RUNTIME_ERROR;
+			STORE_FRAME();
+			ObjString* result = concatenate(AS_STRING(a), AS_STRING(b));
+			sp--;
+			sp[-1] = OBJ_VAL(result);
+			DISPATCH();
+		}
+
+		CASE(OP_ADD_CONSTANT):
+		{
+			// The compiler only fuses number constants.
+			double b = AS_NUMBER(READ_CONSTANT());
+			Value a = PEEK(0);
+
+			if (IS_NUMBER(a))
+			{
+				sp[-1] = NUMBER_VAL(AS_NUMBER(a) + b);
+			}
+			else if (IS_STRING(a))
+			{
+				STORE_FRAME();
+				sp[-1] = OBJ_VAL(concatStringAndNumber(AS_STRING(a), b));
+			}
+			else
+			{
+				RUNTIME_ERROR("Operands must be two numbers or two strings, or one number and one string.");
 			}
+			DISPATCH();
+		}
 
-			// Optimized implementation
-			*(vm.stackTop - 1) = NUMBER_VAL(-AS_NUMBER((*(vm.stackTop - 1))));
+		CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, - ); DISPATCH();
+		CASE(OP_MOD): BINARY_OP_INT(NUMBER_VAL, % ); DISPATCH();
+		CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, * ); DISPATCH();
+		CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, / ); DISPATCH();
 
-			// Original creafting interpreters implementation
-			// 
-			// push(NUMBER_VAL(-AS_NUMBER(pop())));
+		CASE(OP_NOT):
+			sp[-1] = BOOL_VAL(isFalsey(sp[-1])); DISPATCH();
 
-			break;
+		CASE(OP_NEGATE):
+			if (!IS_NUMBER(PEEK(0))) {
+				RUNTIME_ERROR("Operand must be a number.");
+			}
 
-		case OP_PRINT: {
-			printValue(pop());
-			break;
+			// Negate in place rather than popping and pushing.
+			sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+			DISPATCH();
+
+		CASE(OP_PRINT): {
+			printValue(POP());
+			DISPATCH();
 		}
 
-		case OP_PRINTLN: {
-			printValue(pop());
+		CASE(OP_PRINTLN): {
+			printValue(POP());
 			printf("\n");
-			break;
+			DISPATCH();
 		}
 
-		case OP_JUMP_IF_FALSE:
+		CASE(OP_JUMP_IF_FALSE):
 		{
 			uint16_t offset = READ_SHORT();
-			if (isFalsey(peek(0))) frame->ip += offset;
-			break;
+			if (isFalsey(PEEK(0))) ip += offset;
+			DISPATCH();
 		}
 
-		case OP_JUMP:
+		CASE(OP_POP_JUMP_IF_FALSE):
 		{
 			uint16_t offset = READ_SHORT();
-			frame->ip += offset;
-			break;
+			if (isFalsey(POP())) ip += offset;
+			DISPATCH();
 		}
 
-		case OP_LOOP:
+		CASE(OP_LESS_JUMP_IF_FALSE): COMPARE_JUMP(< ); DISPATCH();
+		CASE(OP_GREATER_JUMP_IF_FALSE): COMPARE_JUMP(> ); DISPATCH();
+
+		CASE(OP_JUMP):
 		{
 			uint16_t offset = READ_SHORT();
-			frame->ip -= offset;
-			break;
+			ip += offset;
+			DISPATCH();
+		}
+
+		CASE(OP_LOOP):
+		{
+			uint16_t offset = READ_SHORT();
+			ip -= offset;
+			SAFEPOINT();
+			WARM_UP();
+			ENTER_JIT();
+			ENTER_TRACE();
+			DISPATCH();
 		}
 
-		case OP_CALL:
+		CASE(OP_TAIL_CALL):
+		{
+			int argCount = ip[0];
+
+			if (isTailCallable(PEEK(argCount)))
+			{
+				ip++;
+				STORE_FRAME();
+				if (!tailCall(argCount)) return INTERPRET_RUNTIME_ERROR;
+
+				LOAD_FRAME();
+				SAFEPOINT();
+				ENTER_JIT();
+				DISPATCH();
+			}
+
+			// Anything else is called as OP_CALL calls it, and returns
+			// through the OP_RETURN that follows.
+		}
+
+		CASE(OP_CALL):
 		{
 			int argCount = READ_BYTE();
+			Value callee = PEEK(argCount);
+
+			STORE_FRAME();
 
-			if (!callValue(peek(argCount), argCount))
+			// Natives that cannot collect run in place; the frame and the
+			// nursery stay as they were.
+			if (IS_NATIVE(callee) && (AS_NATIVE_FN(callee)->flags & NATIVE_NO_GC) &&
+				AS_NATIVE_FN(callee)->arity == argCount)
+			{
+				if (!AS_NATIVE_FN(callee)->function(&vm, argCount, sp - argCount)) return INTERPRET_RUNTIME_ERROR;
+				sp -= argCount;
+				DISPATCH();
+			}
+
+			if (!callValue(callee, argCount))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			LOAD_FRAME();
+			SAFEPOINT();
+			ENTER_JIT();
+			DISPATCH();
 		}
 
-		case OP_CLOSURE:
+		CASE(OP_CLOSURE):
+		CASE(OP_CLOSURE_LONG):
 		{
-			ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+			bool wide = instruction == OP_CLOSURE_LONG;
+			ObjFunction* function = AS_FUNCTION(constants[wide ? READ_SHORT() : READ_BYTE()]);
+			STORE_FRAME();
 			ObjClosure* closure = newClosure(function);
-			push(OBJ_VAL(closure));
+			PUSH(OBJ_VAL(closure));
+			vm.stackTop = sp;
 			
 			for (int i = 0; i < closure->upvalueCount; i++)
 			{
 				uint8_t isLocal = READ_BYTE();
-				uint8_t index = READ_BYTE();
+				uint16_t index = wide ? READ_SHORT() : READ_BYTE();
 				if (isLocal)
 				{
-					closure->upvalues[i] = captureUpvalue(frame->slots + index);
+					closure->upvalues[i] = captureUpvalue(slots + index);
 				}
 				else
 				{
 					closure->upvalues[i] = frame->closure->upvalues[index];
 				}
+
+				writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
 			}
 
-			break;
+			DISPATCH();
 		}
 
-		case OP_GET_UPVALUE:
+		CASE(OP_GET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
-			push(*frame->closure->upvalues[slot]->location);
-			break;
+			PUSH(*frame->closure->upvalues[slot]->location);
+			DISPATCH();
 		}
 
-		case OP_SET_UPVALUE:
+		CASE(OP_SET_UPVALUE):
 		{
 			uint8_t slot = READ_BYTE();
-			*frame->closure->upvalues[slot]->location = peek(0);
-			break;
+			ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+			*upvalue->location = PEEK(0);
+			writeBarrier((Obj*)upvalue, PEEK(0));
+			DISPATCH();
 		}
 
-		case OP_CLOSE_UPVALUE:
+		CASE(OP_CLOSE_UPVALUE):
 		{
-			closeUpvalues(vm.stackTop - 1);
-			pop();
-			break;
+			closeUpvalues(sp - 1);
+			sp--;
+			DISPATCH();
 		}
 
-		case OP_GET_PROPERTY:
+		CASE(OP_GET_PROPERTY):
+		CASE(OP_GET_PROPERTY_LONG):
 		{
-			if (!IS_INSTANCE(peek(0)))
+			if (!IS_INSTANCE(PEEK(0)))
 			{
-				runtimeError("Only instances have properties.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("Only instances have properties.");
 			}
 
-			ObjInstance* instance = AS_INSTANCE(peek(0));
-			ObjString* name = READ_STRING();
-
+			ObjString* name = READ_NAME(instruction == OP_GET_PROPERTY_LONG);
+			InlineCache* cache = READ_CACHE();
 			Value value;
 
-			if (tableGet(&instance->fields, name, &value))
+			switch (getProperty(cache, AS_INSTANCE(PEEK(0)), name, &value))
 			{
-				pop();
-				push(value);
-				break;
-			}
-
-			if (!bindMethod(instance->klass, name))
+			case PROPERTY_FIELD:
+				sp[-1] = value;
+				DISPATCH();
+			case PROPERTY_METHOD:
 			{
-				return INTERPRET_RUNTIME_ERROR;
+				// The receiver stays on the stack while this allocates.
+				STORE_FRAME();
+				ObjBoundMethod* bound = newBoundMethod(PEEK(0), AS_CLOSURE(value));
+				sp[-1] = OBJ_VAL(bound);
+				DISPATCH();
+			}
+			default:
+				RUNTIME_ERROR("Undefined property '%s'.", name->characters);
 			}
-			break;
 		}
 
-		case OP_SET_PROPERTY:
+		CASE(OP_SET_PROPERTY):
+		CASE(OP_SET_PROPERTY_LONG):
 		{
-			if (!IS_INSTANCE(peek(1))) {
-				runtimeError("Only instances have fields.");
-				return INTERPRET_RUNTIME_ERROR;
+			if (!IS_INSTANCE(PEEK(1))) {
+				RUNTIME_ERROR("Only instances have fields.");
 			}
 
-			ObjInstance* instance = AS_INSTANCE(peek(1));
-			tableSet(&instance->fields, READ_STRING(), peek(0));
-			Value value = pop();
-			pop();
-			push(value);
-			break;
+			ObjString* name = READ_NAME(instruction == OP_SET_PROPERTY_LONG);
+			InlineCache* cache = READ_CACHE();
+			STORE_FRAME();
+			setProperty(cache, AS_INSTANCE(PEEK(1)), name, PEEK(0));
+			Value value = POP();
+			sp[-1] = value;
+			DISPATCH();
 		}
 
-		case OP_STRUCT:
+		CASE(OP_LIST):
 		{
-			push(OBJ_VAL(newStruct(READ_STRING())));
-			break;
+			STORE_FRAME();
+			ObjList* list = newList();
+			PUSH(OBJ_VAL(list));
+			DISPATCH();
+		}
+
+		CASE(OP_ADD_LIST):
+		{
+			// The value stays on the stack while the list grows.
+			STORE_FRAME();
+			appendToList(AS_LIST(PEEK(1)), PEEK(0));
+			sp--;
+			DISPATCH();
+		}
+
+		CASE(OP_INDEX_GET):
+		{
+			const char* error = checkListIndex(PEEK(1), PEEK(0));
+			if (error != NULL) RUNTIME_ERROR("%s", error);
+
+			Value element = LIST_ELEMENT(PEEK(1), PEEK(0));
+			sp--;
+			sp[-1] = element;
+			DISPATCH();
+		}
+
+		CASE(OP_INDEX_SET):
+		{
+			const char* error = checkListIndex(PEEK(2), PEEK(1));
+			if (error != NULL) RUNTIME_ERROR("%s", error);
+
+			Value value = PEEK(0);
+			LIST_ELEMENT(PEEK(2), PEEK(1)) = value;
+			writeBarrier(AS_OBJ(PEEK(2)), value);
+			sp -= 2;
+			sp[-1] = value;
+			DISPATCH();
+		}
+
+		CASE(OP_STRUCT):
+		CASE(OP_STRUCT_LONG):
+		{
+			ObjString* name = READ_NAME(instruction == OP_STRUCT_LONG);
+			STORE_FRAME();
+			PUSH(OBJ_VAL(newStruct(name)));
+			DISPATCH();
 		}
 
-		case OP_INHERIT:
+		CASE(OP_INHERIT):
 		{
-			Value superstruct = peek(1);
+			Value superstruct = PEEK(1);
 
 			if (!IS_STRUCT(superstruct))
 			{
-				runtimeError("The superstruct must be a struct.");
-				return INTERPRET_RUNTIME_ERROR;
+				RUNTIME_ERROR("The superstruct must be a struct.");
 			}
 
-			ObjStruct* substruct = AS_STRUCT(peek(0));
+			ObjStruct* substruct = AS_STRUCT(PEEK(0));
+			STORE_FRAME();
 			tableAddAll(&AS_STRUCT(superstruct)->methods, &substruct->methods);
+			tableWriteBarrier((Obj*)substruct, &substruct->methods);
+			invalidateInlineCaches();
 
-			pop(); // Substruct
-			break;
+			sp--; // Substruct
+			DISPATCH();
 		}
 
-		case OP_METHOD:
+		CASE(OP_METHOD):
+		CASE(OP_METHOD_LONG):
 		{
-			defineMethod(READ_STRING());
-			break;
+			ObjString* name = READ_NAME(instruction == OP_METHOD_LONG);
+			STORE_FRAME();
+			defineMethod(name);
+			sp = vm.stackTop;
+			DISPATCH();
 		}
 
-		case OP_INVOKE:
+		CASE(OP_INVOKE):
+		CASE(OP_INVOKE_LONG):
 		{
-			ObjString* method = READ_STRING();
+			ObjString* method = READ_NAME(instruction == OP_INVOKE_LONG);
 			int argCount = READ_BYTE();
+			InlineCache* cache = READ_CACHE();
 
-			if (!invoke(method, argCount))
+			STORE_FRAME();
+			if (!invoke(method, argCount, cache, false))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			LOAD_FRAME();
+			SAFEPOINT();
+			ENTER_JIT();
+			DISPATCH();
 		}
 
-		case OP_SUPER_INVOKE:
+		CASE(OP_TAIL_INVOKE):
+		CASE(OP_TAIL_INVOKE_LONG):
 		{
-			ObjString* method = READ_STRING();
+			ObjString* method = READ_NAME(instruction == OP_TAIL_INVOKE_LONG);
 			int argCount = READ_BYTE();
-			ObjStruct* superstruct = AS_STRUCT(pop());
-			if (!invokeFromStruct(superstruct, method, argCount))
+			InlineCache* cache = READ_CACHE();
+
+			STORE_FRAME();
+			if (!invoke(method, argCount, cache, true))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			LOAD_FRAME();
+			SAFEPOINT();
+			ENTER_JIT();
+			DISPATCH();
+		}
+
+		CASE(OP_SUPER_INVOKE):
+		CASE(OP_SUPER_INVOKE_LONG):
+		{
+			ObjString* method = READ_NAME(instruction == OP_SUPER_INVOKE_LONG);
+			int argCount = READ_BYTE();
+			ObjStruct* superstruct = AS_STRUCT(POP());
+
+			STORE_FRAME();
+			if (!invokeFromStruct(superstruct, method, argCount, false))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			LOAD_FRAME();
+			SAFEPOINT();
+			ENTER_JIT();
+			DISPATCH();
+		}
+
+		CASE(OP_TAIL_SUPER_INVOKE):
+		CASE(OP_TAIL_SUPER_INVOKE_LONG):
+		{
+			ObjString* method = READ_NAME(instruction == OP_TAIL_SUPER_INVOKE_LONG);
+			int argCount = READ_BYTE();
+			ObjStruct* superstruct = AS_STRUCT(POP());
+
+			STORE_FRAME();
+			if (!invokeFromStruct(superstruct, method, argCount, true))
+			{
+				return INTERPRET_RUNTIME_ERROR;
+			}
+
+			LOAD_FRAME();
+			SAFEPOINT();
+			ENTER_JIT();
+			DISPATCH();
 		}
 
-		case OP_GET_SUPER:
+		CASE(OP_GET_SUPER):
+		CASE(OP_GET_SUPER_LONG):
 		{
-			ObjString* name = READ_STRING();
-			ObjStruct* superstruct = AS_STRUCT(pop());
+			ObjString* name = READ_NAME(instruction == OP_GET_SUPER_LONG);
+			ObjStruct* superstruct = AS_STRUCT(POP());
 
+			STORE_FRAME();
 			if (!bindMethod(superstruct, name))
 			{
 				return INTERPRET_RUNTIME_ERROR;
 			}
 
-			break;
+			sp = vm.stackTop;
+			DISPATCH();
 		}
 
-		case OP_RETURN:
+		CASE(OP_RETURN):
 		{
-			Value result = pop();
-			closeUpvalues(frame->slots);
+			Value result = POP();
+			closeUpvalues(slots);
 			vm.frameCount--;
 
 			if (vm.frameCount == 0)
 			{
-				pop();
+				vm.stackTop = sp - 1;
 				return INTERPRET_OK;
 			}
 
-			vm.stackTop = frame->slots;
+			vm.stackTop = slots;
 			push(result);
-			frame = &vm.frames[vm.frameCount - 1];
-			break;
+			LOAD_FRAME();
+			SAFEPOINT();
+			ENTER_JIT();
+			DISPATCH();
 		}
+#ifndef COMPUTED_GOTO
 		}
+#endif
 	}
 
+#undef STORE_FRAME
+#undef LOAD_FRAME
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
-#undef READ_STRING
+#undef READ_NAME
+#undef READ_CACHE
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef SAFEPOINT
 #undef BINARY_OP
+#undef BINARY_OP_INT
+#undef COMPARE_JUMP
+#undef TRACE_STACK
+#undef TRACE_INSTRUCTION
+#undef ENTER_JIT
+#undef WARM_UP
+#undef ENTER_TRACE
+#undef DISPATCH
+#undef CASE
 }
 
+#endif
+
 InterpretResult interpret(const char* filename, const char* source)
 {
 	ObjFunction* function = compile(filename, source);
@@ -637,43 +2754,57 @@ InterpretResult interpret(const char* filename, const char* source)
 	pop();
 	push(OBJ_VAL(closure));
 	call(closure, 0);
+#ifdef REGISTER_VM
+	reserveRegisters();
+#endif
 	return run();
 }
 
-void push(Value value)
-{
-	*vm.stackTop = value;
-	vm.stackTop++;
-}
-
-Value pop()
-{
-	vm.stackTop--;
-	return *vm.stackTop;
-}
-
-static Value peek(int distance)
+static inline Value peek(int distance)
 {
 	return vm.stackTop[-1 - distance];
 }
 
+#ifdef REGISTER_VM
+// Room above the registers for the values pushRoot() keeps alive.
+#define FRAME_SLOTS(function) ((function)->maxSlots + 2)
+#else
+// Temporaries sit above a frame's locals. Only absurdly nested expressions
+// keep more than UINT8_COUNT of them at once.
+#define FRAME_SLOTS(function) ((function)->maxSlots + UINT8_COUNT)
+#endif
+
 static bool call(ObjClosure* closure, int argCount)
 {
 	if (argCount != closure->function->arity)
 	{
 		runtimeError("Expected %d arguments, but got %d", closure->function->arity, argCount);
+		return false;
 	}
 
-	if (vm.frameCount == FRAMES_MAX)
+	if (vm.frameCount == vm.frameCapacity)
 	{
-		runtimeError("Stack overflow.");
-		return false;
+		if (vm.frameCapacity == FRAMES_MAX)
+		{
+			runtimeError("Stack overflow.");
+			return false;
+		}
+
+		vm.frameCapacity *= 2;
+		vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * vm.frameCapacity);
+		if (vm.frames == NULL) exit(1);
 	}
 
+	int base = (int)(vm.stackTop - argCount - 1 - vm.stack);
+	if (!ensureStack(base + FRAME_SLOTS(closure->function))) return false;
+
 	CallFrame* frame = &vm.frames[vm.frameCount++];
 	frame->closure = closure;
 	frame->ip = closure->function->chunk.code;
-	frame->slots = vm.stackTop - argCount - 1;
+	frame->slots = vm.stack + base;
+#ifdef JIT
+	jitWarmUp(closure->function);
+#endif
 	return true;
 }
 
@@ -720,12 +2851,13 @@ static bool callValue(Value callee, int argCount)
 			if (argCount != native->arity)
 			{
 				runtimeError("Expected %d arguments, but got %d.", native->arity, argCount);
+				return false;
 			}
 
-			NativeFn nativeFn = native->function;
-			Value result = nativeFn(argCount, vm.stackTop - argCount);
-			vm.stackTop -= argCount + 1;
-			push(result);
+			// The native may move the stack by reserving space on it.
+			int base = (int)(vm.stackTop - argCount - vm.stack);
+			if (!native->function(&vm, argCount, vm.stack + base)) return false;
+			vm.stackTop = vm.stack + base;
 			return true;
 		}
 
@@ -738,6 +2870,34 @@ static bool callValue(Value callee, int argCount)
 	return false;
 }
 
+// Closures and the methods bound to them run their body in a frame of their
+// own, which a tail call can hand them instead.
+static bool isTailCallable(Value callee)
+{
+	return IS_CLOSURE(callee) || IS_BOUND_METHOD(callee);
+}
+
+// Pops the frame on top for a call to take its place: once its upvalues are
+// closed, the callee or receiver below the argCount arguments on top of the
+// stack slides down over its slots along with them.
+static void replaceFrame(int argCount)
+{
+	Value* slots = vm.frames[vm.frameCount - 1].slots;
+
+	closeUpvalues(slots);
+	memmove(slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+	vm.stackTop = slots + argCount + 1;
+	vm.frameCount--;
+}
+
+// Calls the callee below the argCount arguments on top of the stack in
+// place of the frame on top.
+static bool tailCall(int argCount)
+{
+	replaceFrame(argCount);
+	return callValue(vm.stackTop[-argCount - 1], argCount);
+}
+
 static ObjUpvalue* captureUpvalue(Value* local)
 {
 	ObjUpvalue* prevUpvalue = NULL;
@@ -774,21 +2934,14 @@ static bool isFalsey(Value value)
 	return IS_NULL(value) || (IS_BOOL(value) && !(AS_BOOL(value)));
 }
 
-static void concatenate()
+// Both operands must be reachable by the collector while this allocates.
+static ObjString* concatenate(ObjString* a, ObjString* b)
 {
-	ObjString* b = AS_STRING(peek(0));
-	ObjString* a = AS_STRING(peek(1));
-
 	int length = a->length + b->length;
 	char* characters = ALLOCATE(char, length + 1);
 	memcpy(characters, a->characters, a->length);
 	memcpy(characters + a->length, b->characters, b->length);
 	characters[length] = '\0';
 
-	ObjString* result = takeString(characters, length);
-
-	pop();
-	pop();
-
-	push(OBJ_VAL(result));
+	return takeString(characters, length);
 }
\ No newline at end of file
@@ -5,8 +5,14 @@
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "gcstats.h"
 
-#define FRAMES_MAX 64
+// The frame array and the value stack start out this large and grow as
+// calls need them, moving when they do. Calls nest at most FRAMES_MAX deep,
+// and the stack holds at most STACK_MAX values.
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+#define FRAMES_MAX (FRAMES_INITIAL * 1024)
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
 typedef struct
@@ -16,25 +22,52 @@ typedef struct
 	Value* slots;
 } CallFrame;
 
-typedef struct 
+typedef enum {
+	GC_MARK_PHASE,
+	GC_SWEEP_PHASE,
+	GC_IDLE_PHASE
+} GCPhase;
+
+struct VM
 {
-	CallFrame frames[FRAMES_MAX];
+	CallFrame* frames;
 	int frameCount;
-	Value stack[STACK_MAX];
+	int frameCapacity;
+	Value* stack;
 	Value* stackTop;
+	int stackCapacity;
+#ifdef REGISTER_VM
+	// Registers live above stackTop, which only marks the arguments of a
+	// call in progress. Every slot below registerTop has been written, and
+	// the collector scans up to it.
+	Value* registerTop;
+#endif
 	Table globals;
 	Table strings;
 	ObjString* initString;
 	ObjUpvalue* openUpvalues;
+	// Bumped whenever a cached method or shape may have moved, died or
+	// been replaced; see InlineCache.
+	uint32_t cacheEpoch;
 
 	size_t bytesAllocated;
 	size_t nextGC;
+	GCPhase gcPhase;
+	GCStats gcStats;
 
-	Obj* objects;
 	int grayCount;
 	int grayCapacity;
 	Obj** grayStack;
-} VM;
+
+	uint8_t* nurseryStart;
+	uint8_t* nurseryTop;
+	uint8_t* nurseryLimit;
+	uint8_t* nurseryEnd;
+	bool compactionPending;
+	int rememberedCount;
+	int rememberedCapacity;
+	Obj** rememberedSet;
+};
 
 typedef enum 
 {
@@ -48,8 +81,62 @@ extern VM vm;
 void initVM();
 void freeVM();
 
+// For natives. nativeError() reports a runtime error and returns false, for
+// the native to return in turn.
+bool nativeError(VM* vm, const char* format, ...);
+
 InterpretResult interpret(const char* filename, const char* source);
-void push(Value value);
-Value pop();
+
+// End of the stack slots the collector treats as roots.
+static inline Value* stackRootsEnd()
+{
+#ifdef REGISTER_VM
+	return vm.registerTop > vm.stackTop ? vm.registerTop : vm.stackTop;
+#else
+	return vm.stackTop;
+#endif
+}
+
+// Empties every inline cache.
+static inline void invalidateInlineCaches()
+{
+	vm.cacheEpoch++;
+}
+
+static inline void push(Value value)
+{
+	*vm.stackTop = value;
+	vm.stackTop++;
+}
+
+static inline Value pop()
+{
+	vm.stackTop--;
+	return *vm.stackTop;
+}
+
+// Keep a value that only C code holds reachable while that code allocates.
+// Under REGISTER_VM the live registers sit above stackTop, where push()
+// would overwrite one, so the value goes past them instead and registerTop
+// covers it until popRoot().
+static inline void pushRoot(Value value)
+{
+#ifdef REGISTER_VM
+	Value* top = stackRootsEnd();
+	*top = value;
+	vm.registerTop = top + 1;
+#else
+	push(value);
+#endif
+}
+
+static inline void popRoot()
+{
+#ifdef REGISTER_VM
+	vm.registerTop--;
+#else
+	pop();
+#endif
+}
 
 #endif
\ No newline at end of file